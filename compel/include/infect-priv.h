@@ -29,7 +29,8 @@ struct parasite_ctl {
 	struct rt_sigframe	*sigframe;
 	struct rt_sigframe	*rsigframe;				/* address in a parasite */
 
-	void			*r_thread_stack;			/* stack for non-leader threads */
+	void			*r_thread_stacks;			/* stacks for non-leader threads */
+	unsigned long		nr_thread_stacks;
 
 	unsigned long		parasite_ip;				/* service routine start ip */
 
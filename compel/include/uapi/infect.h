@@ -37,6 +37,8 @@ struct parasite_thread_ctl;
 extern struct parasite_ctl *compel_prepare(int pid);
 extern struct parasite_ctl *compel_prepare_noctx(int pid);
 extern int compel_infect(struct parasite_ctl *ctl, unsigned long nr_threads, unsigned long args_size);
+extern int compel_infect_start(struct parasite_ctl *ctl, unsigned long nr_threads, unsigned long args_size);
+extern int compel_infect_finish(struct parasite_ctl *ctl);
 extern struct parasite_thread_ctl *compel_prepare_thread(struct parasite_ctl *ctl, int pid);
 extern void compel_release_thread(struct parasite_thread_ctl *);
 
@@ -66,6 +68,16 @@ extern int compel_syscall(struct parasite_ctl *ctl, int nr, long *ret,
 		unsigned long arg5,
 		unsigned long arg6);
 extern int compel_run_in_thread(struct parasite_thread_ctl *tctl, unsigned int cmd);
+
+/*
+ * Up to this many non-leader threads can run a command at once with
+ * compel_run_in_threads(), each on its own stack. The parasite can
+ * tell which of them it runs in by the stack, see compel_thread_stacks().
+ */
+#define PARASITE_THREADS_BATCH	64
+
+extern int compel_run_in_threads(struct parasite_thread_ctl **tctls, int nr, unsigned int cmd);
+extern unsigned long compel_thread_stacks(struct parasite_ctl *ctl, unsigned long *stack_size);
 extern int compel_run_at(struct parasite_ctl *ctl, unsigned long ip, user_regs_struct_t *ret_regs);
 
 /*
@@ -36,6 +36,7 @@ struct siginfo;
 struct msghdr;
 struct rusage;
 struct iocb;
+struct io_uring_params;
 
 typedef unsigned long aio_context_t;
 
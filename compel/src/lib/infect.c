@@ -388,7 +388,8 @@ static int prepare_tsock(struct parasite_ctl *ctl, pid_t pid,
 			goto err;
 		}
 
-		if (listen(ssock, 1)) {
+		/* Several parasites can connect at once, see accept_tsock() */
+		if (listen(ssock, SOMAXCONN)) {
 			pr_perror("Can't listen on transport socket");
 			goto err;
 		}
@@ -546,6 +547,7 @@ int compel_execute_syscall(struct parasite_ctl *ctl,
 		user_regs_struct_t *regs, const char *code_syscall)
 {
 	pid_t pid = ctl->rpid;
+	sigset_t blockmask, oldmask;
 	int err;
 	uint8_t code_orig[BUILTIN_SYSCALL_SIZE];
 
@@ -560,10 +562,21 @@ int compel_execute_syscall(struct parasite_ctl *ctl,
 		return -1;
 	}
 
+	/*
+	 * Parasites of other tasks may be running with the SIGCHLD
+	 * handler set (infection of several tasks at once), it must
+	 * not take this task's stop on the trap.
+	 */
+	sigemptyset(&blockmask);
+	sigaddset(&blockmask, SIGCHLD);
+	sigprocmask(SIG_BLOCK, &blockmask, &oldmask);
+
 	err = parasite_run(pid, PTRACE_CONT, ctl->ictx.syscall_ip, 0, regs, &ctl->orig);
 	if (!err)
 		err = parasite_trap(ctl, pid, regs, &ctl->orig);
 
+	sigprocmask(SIG_SETMASK, &oldmask, NULL);
+
 	if (ptrace_poke_area(pid, (void *)code_orig,
 			     (void *)ctl->ictx.syscall_ip, sizeof(code_orig))) {
 		pr_err("Can't restore syscall blob (pid: %d)\n", ctl->rpid);
@@ -584,16 +597,78 @@ int compel_run_at(struct parasite_ctl *ctl, unsigned long ip, user_regs_struct_t
 	return ret;
 }
 
+/*
+ * When several tasks are being infected at once (compel_infect_start()
+ * for each, then compel_infect_finish()) their parasites connect to
+ * the same socket in any order. The connections of the others are
+ * kept here till their compel_infect_finish() comes.
+ */
+struct early_tsock {
+	pid_t			pid;
+	int			sock;
+	struct early_tsock	*next;
+};
+
+static struct early_tsock *early_tsocks;
+
+static int take_early_tsock(pid_t pid)
+{
+	struct early_tsock **p, *e;
+	int sock;
+
+	for (p = &early_tsocks; *p; p = &(*p)->next) {
+		e = *p;
+		if (e->pid != pid)
+			continue;
+
+		*p = e->next;
+		sock = e->sock;
+		xfree(e);
+		return sock;
+	}
+
+	return -1;
+}
+
 static int accept_tsock(struct parasite_ctl *ctl)
 {
 	int sock;
 	int ask = -ctl->tsock; /* this '-' is explained above */
 
-	sock = accept(ask, NULL, 0);
-	if (sock < 0) {
-		pr_perror("Can't accept connection to the transport socket");
-		close(ask);
-		return -1;
+	sock = take_early_tsock(ctl->rpid);
+	while (sock < 0) {
+		struct ucred ucred;
+		socklen_t len = sizeof(ucred);
+		struct early_tsock *e;
+
+		sock = accept(ask, NULL, 0);
+		if (sock < 0) {
+			pr_perror("Can't accept connection to the transport socket");
+			close(ask);
+			return -1;
+		}
+
+		if (getsockopt(sock, SOL_SOCKET, SO_PEERCRED, &ucred, &len)) {
+			pr_perror("Can't get transport socket peer");
+			close(sock);
+			return -1;
+		}
+
+		if (ucred.pid == ctl->rpid)
+			break;
+
+		e = xmalloc(sizeof(*e));
+		if (!e) {
+			close(sock);
+			return -1;
+		}
+
+		pr_debug("Parasite of %d connected before its turn\n", ucred.pid);
+		e->pid = ucred.pid;
+		e->sock = sock;
+		e->next = early_tsocks;
+		early_tsocks = e;
+		sock = -1;
 	}
 
 	ctl->tsock = sock;
@@ -605,7 +680,6 @@ static int parasite_init_daemon(struct parasite_ctl *ctl)
 	struct parasite_init_args *args;
 	pid_t pid = ctl->rpid;
 	user_regs_struct_t regs;
-	struct ctl_msg m = { };
 
 	*ctl->addr_cmd = PARASITE_CMD_INIT_DAEMON;
 
@@ -627,6 +701,19 @@ static int parasite_init_daemon(struct parasite_ctl *ctl)
 	if (parasite_run(pid, PTRACE_CONT, ctl->parasite_ip, ctl->rstack, &regs, &ctl->orig))
 		goto err;
 
+	return 0;
+err:
+	return -1;
+}
+
+static int parasite_init_daemon_wait(struct parasite_ctl *ctl)
+{
+	struct parasite_init_args *args;
+	pid_t pid = ctl->rpid;
+	struct ctl_msg m = { };
+
+	args = compel_parasite_args(ctl, struct parasite_init_args);
+
 	futex_wait_while_eq(&args->daemon_connected, 0);
 	if (futex_get(&args->daemon_connected) != 1) {
 		errno = -(int)futex_get(&args->daemon_connected);
@@ -840,7 +927,7 @@ static inline unsigned long total_pie_size(size_t blob_size)
 	return round_up(blob_size, page_size());
 }
 
-int compel_infect(struct parasite_ctl *ctl, unsigned long nr_threads, unsigned long args_size)
+int compel_infect_start(struct parasite_ctl *ctl, unsigned long nr_threads, unsigned long args_size)
 {
 	int ret;
 	unsigned long p, map_exchange_size, parasite_size = 0;
@@ -866,10 +953,13 @@ int compel_infect(struct parasite_ctl *ctl, unsigned long nr_threads, unsigned l
 	ctl->args_size = round_up(args_size, PAGE_SIZE);
 	parasite_size += ctl->args_size;
 
+	if (nr_threads > 1)
+		ctl->nr_thread_stacks = min_t(unsigned long, nr_threads - 1,
+					      PARASITE_THREADS_BATCH);
+
 	map_exchange_size = parasite_size;
 	map_exchange_size += RESTORE_STACK_SIGFRAME + PARASITE_STACK_SIZE;
-	if (nr_threads > 1)
-		map_exchange_size += PARASITE_STACK_SIZE;
+	map_exchange_size += ctl->nr_thread_stacks * PARASITE_STACK_SIZE;
 
 	ret = compel_map_exchange(ctl, map_exchange_size);
 	if (ret)
@@ -895,10 +985,8 @@ int compel_infect(struct parasite_ctl *ctl, unsigned long nr_threads, unsigned l
 	p += PARASITE_STACK_SIZE;
 	ctl->rstack = ctl->remote_map + p;
 
-	if (nr_threads > 1) {
-		p += PARASITE_STACK_SIZE;
-		ctl->r_thread_stack = ctl->remote_map + p;
-	}
+	if (ctl->nr_thread_stacks)
+		ctl->r_thread_stacks = ctl->remote_map + p;
 
 	ret = arch_fetch_sas(ctl, ctl->rsigframe);
 	if (ret) {
@@ -916,6 +1004,24 @@ err:
 	return -1;
 }
 
+/*
+ * Waits for the parasite started by compel_infect_start() to become
+ * a daemon. Tasks can be infected in parallel by calling the former
+ * for several of them and then this one for each.
+ */
+int compel_infect_finish(struct parasite_ctl *ctl)
+{
+	return parasite_init_daemon_wait(ctl);
+}
+
+int compel_infect(struct parasite_ctl *ctl, unsigned long nr_threads, unsigned long args_size)
+{
+	if (compel_infect_start(ctl, nr_threads, args_size))
+		return -1;
+
+	return compel_infect_finish(ctl);
+}
+
 struct parasite_thread_ctl *compel_prepare_thread(struct parasite_ctl *ctl, int pid)
 {
 	struct parasite_thread_ctl *tctl;
@@ -1358,7 +1464,7 @@ int compel_run_in_thread(struct parasite_thread_ctl *tctl, unsigned int cmd)
 	int pid = tctl->tid;
 	struct parasite_ctl *ctl = tctl->ctl;
 	struct thread_ctx *octx = &tctl->th;
-	void *stack = ctl->r_thread_stack;
+	void *stack = ctl->r_thread_stacks + PARASITE_STACK_SIZE;
 	user_regs_struct_t regs = octx->regs;
 	int ret;
 
@@ -1376,6 +1482,56 @@ int compel_run_in_thread(struct parasite_thread_ctl *tctl, unsigned int cmd)
 	return ret;
 }
 
+/*
+ * Same as compel_run_in_thread(), but all the threads are let run
+ * the command and only then waited for, so that they do it at the
+ * same time, each on the stack of its index in the tctls.
+ */
+int compel_run_in_threads(struct parasite_thread_ctl **tctls, int nr, unsigned int cmd)
+{
+	struct parasite_ctl *ctl = tctls[0]->ctl;
+	user_regs_struct_t regs;
+	int i, started, ret = 0;
+
+	BUG_ON(nr > ctl->nr_thread_stacks);
+
+	*ctl->addr_cmd = cmd;
+
+	for (started = 0; started < nr; started++) {
+		struct parasite_thread_ctl *tctl = tctls[started];
+		void *stack = ctl->r_thread_stacks + (started + 1) * PARASITE_STACK_SIZE;
+
+		regs = tctl->th.regs;
+		if (parasite_run(tctl->tid, PTRACE_CONT, ctl->parasite_ip,
+					stack, &regs, &tctl->th)) {
+			ret = -1;
+			break;
+		}
+	}
+
+	/* The started ones are to be trapped even if others failed */
+	for (i = 0; i < started; i++) {
+		struct parasite_thread_ctl *tctl = tctls[i];
+		int tret;
+
+		tret = parasite_trap(ctl, tctl->tid, &regs, &tctl->th);
+		if (tret == 0)
+			tret = (int)REG_RES(regs);
+		if (tret) {
+			pr_err("Parasite exited with %d in %d\n", tret, tctl->tid);
+			ret = -1;
+		}
+	}
+
+	return ret;
+}
+
+unsigned long compel_thread_stacks(struct parasite_ctl *ctl, unsigned long *stack_size)
+{
+	*stack_size = PARASITE_STACK_SIZE;
+	return (unsigned long)ctl->r_thread_stacks;
+}
+
 /*
  * compel_unmap() is used for unmapping parasite and restorer blobs.
  * A blob can contain code for unmapping itself, so the porcess is
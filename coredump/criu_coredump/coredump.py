@@ -51,6 +51,7 @@ status = {
 	"VMA_AREA_SOCKET"	: 1 << 11,
 	"VMA_AREA_VVAR"		: 1 << 12,
 	"VMA_AREA_AIORING"	: 1 << 13,
+	"VMA_AREA_THP"		: 1 << 14,
 	"VMA_AREA_UNSUPP"	: 1 << 31
 }
 
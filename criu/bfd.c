@@ -109,6 +109,20 @@ int bfdopenw(struct bfd *f)
 	return bfdopen(f, true);
 }
 
+/*
+ * Read-only bfd over the data that is all in memory
+ * already, it's never refilled.
+ */
+void bfdopen_mem(struct bfd *f, void *mem, unsigned int size)
+{
+	f->fd = -1;
+	f->writable = false;
+	f->b.mem = mem;
+	f->b.data = mem;
+	f->b.sz = size;
+	f->b.buf = NULL;
+}
+
 static int bflush(struct bfd *bfd);
 static bool flush_failed = false;
 
@@ -132,7 +146,8 @@ void bclose(struct bfd *f)
 			pr_perror("Error flushing image");
 		}
 
-		buf_put(&f->b);
+		if (f->b.buf)
+			buf_put(&f->b);
 	}
 	close_safe(&f->fd);
 }
@@ -142,6 +157,9 @@ static int brefill(struct bfd *f)
 	int ret;
 	struct xbuf *b = &f->b;
 
+	if (!b->buf)
+		return 0;
+
 	memmove(b->mem, b->data, b->sz);
 	b->data = b->mem;
 
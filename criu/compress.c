@@ -0,0 +1,210 @@
+#include <pthread.h>
+#include <string.h>
+
+#ifdef CONFIG_HAS_LIBLZ4
+# include <lz4.h>
+#endif
+
+#ifdef CONFIG_HAS_LIBZSTD
+# include <zstd.h>
+#endif
+
+#include "types.h"
+#include "atomic.h"
+#include "cr_options.h"
+#include "compress.h"
+#include "log.h"
+#include "xmalloc.h"
+#include "images/pagemap.pb-c.h"
+
+#ifdef CONFIG_HAS_LIBLZ4
+static size_t lz4_bound(size_t len)
+{
+	return LZ4_compressBound(len);
+}
+
+static ssize_t lz4_compress(const void *src, size_t len, void *dst, size_t dst_len)
+{
+	int ret;
+
+	ret = LZ4_compress_default(src, dst, len, dst_len);
+	return ret > 0 ? ret : -1;
+}
+
+static ssize_t lz4_decompress(const void *src, size_t len, void *dst, size_t dst_len)
+{
+	int ret;
+
+	ret = LZ4_decompress_safe(src, dst, len, dst_len);
+	return ret >= 0 ? ret : -1;
+}
+#endif
+
+#ifdef CONFIG_HAS_LIBZSTD
+/*
+ * Memory dump is on the frozen time path, so prefer the speed
+ * over the ratio.
+ */
+#define ZSTD_PAGES_LEVEL	1
+
+static size_t zstd_bound(size_t len)
+{
+	return ZSTD_compressBound(len);
+}
+
+static ssize_t zstd_compress(const void *src, size_t len, void *dst, size_t dst_len)
+{
+	size_t ret;
+
+	ret = ZSTD_compress(dst, dst_len, src, len, ZSTD_PAGES_LEVEL);
+	return ZSTD_isError(ret) ? -1 : ret;
+}
+
+static ssize_t zstd_decompress(const void *src, size_t len, void *dst, size_t dst_len)
+{
+	size_t ret;
+
+	ret = ZSTD_decompress(dst, dst_len, src, len);
+	return ZSTD_isError(ret) ? -1 : ret;
+}
+#endif
+
+static struct page_codec page_codecs[] = {
+#ifdef CONFIG_HAS_LIBLZ4
+	{
+		.name		= "lz4",
+		.type		= COMPRESS_CODEC__CODEC_LZ4,
+		.bound		= lz4_bound,
+		.compress	= lz4_compress,
+		.decompress	= lz4_decompress,
+	},
+#endif
+#ifdef CONFIG_HAS_LIBZSTD
+	{
+		.name		= "zstd",
+		.type		= COMPRESS_CODEC__CODEC_ZSTD,
+		.bound		= zstd_bound,
+		.compress	= zstd_compress,
+		.decompress	= zstd_decompress,
+	},
+#endif
+	{ }, /* terminator */
+};
+
+struct page_codec *page_codec_lookup(const char *name)
+{
+	struct page_codec *c;
+
+	for (c = page_codecs; c->name; c++)
+		if (!strcmp(c->name, name))
+			return c;
+
+	return NULL;
+}
+
+struct page_codec *page_codec_get(int type)
+{
+	struct page_codec *c;
+
+	for (c = page_codecs; c->name; c++)
+		if (c->type == type)
+			return c;
+
+	pr_err("Pages compressed with unsupported codec %d\n", type);
+	return NULL;
+}
+
+void page_codecs_list(void)
+{
+	struct page_codec *c;
+
+	if (!page_codecs[0].name) {
+		pr_msg("No compression codecs are built in\n");
+		return;
+	}
+
+	pr_msg("Available compression codecs:");
+	for (c = page_codecs; c->name; c++)
+		pr_msg(" %s", c->name);
+	pr_msg("\n");
+}
+
+struct compress_job {
+	struct page_codec	*codec;
+	struct compress_block	*blocks;
+	int			nr;
+	atomic_t		next;
+};
+
+static void compress_one_block(struct page_codec *codec, struct compress_block *b)
+{
+	b->clen = codec->compress(b->src, b->len, b->dst, codec->bound(b->len));
+
+	/*
+	 * Blocks that don't shrink (or confuse the codec) are
+	 * just stored as is.
+	 */
+	if (b->clen < 0 || b->clen >= b->len)
+		b->clen = 0;
+}
+
+/*
+ * No logging here, this is called in threads and
+ * the log engine is not ready for that.
+ */
+static void *compress_worker(void *arg)
+{
+	struct compress_job *job = arg;
+	int i;
+
+	while ((i = atomic_add_return(1, &job->next) - 1) < job->nr)
+		compress_one_block(job->codec, &job->blocks[i]);
+
+	return NULL;
+}
+
+int compress_blocks(struct page_codec *codec, struct compress_block *blocks, int nr)
+{
+	struct compress_job job = {
+		.codec	= codec,
+		.blocks	= blocks,
+		.nr	= nr,
+	};
+	pthread_t *threads;
+	int nr_threads, i;
+
+	nr_threads = min_t(int, opts.compress_threads, nr);
+	if (nr_threads <= 1) {
+		for (i = 0; i < nr; i++)
+			compress_one_block(codec, &blocks[i]);
+		return 0;
+	}
+
+	/* The calling thread is a worker as well */
+	threads = xmalloc((nr_threads - 1) * sizeof(*threads));
+	if (!threads)
+		return -1;
+
+	atomic_set(&job.next, 0);
+	for (i = 0; i < nr_threads - 1; i++) {
+		int ret;
+
+		ret = pthread_create(&threads[i], NULL, compress_worker, &job);
+		if (ret) {
+			pr_warn("Can't start compression thread: %s\n", strerror(ret));
+			break;
+		}
+	}
+
+	/*
+	 * Even if not all the threads have started, the
+	 * running ones (and us) will finish the job.
+	 */
+	compress_worker(&job);
+
+	while (--i >= 0)
+		pthread_join(threads[i], NULL);
+
+	xfree(threads);
+	return 0;
+}
@@ -30,7 +30,8 @@
 #include "fdinfo.h"
 #include "sockets.h"
 #include "crtools.h"
-#include "log.h"
+#include "criu-log.h"
+#include "compress.h"
 #include "util-pie.h"
 #include "prctl.h"
 #include "files.h"
@@ -50,6 +51,7 @@
 #include "libnetlink.h"
 #include "net.h"
 #include "restorer.h"
+#include "uffd.h"
 
 static char *feature_name(int (*func)());
 
@@ -822,6 +824,7 @@ static int check_clone_parent_vs_pid()
 	struct clone_arg ca;
 	pid_t pid;
 
+	log_flush();
 	pid = clone(clone_cb, ca.stack_ptr, CLONE_NEWPID | CLONE_PARENT, &ca);
 	if (pid < 0) {
 		pr_err("CLONE_PARENT | CLONE_NEWPID don't work together\n");
@@ -1067,6 +1070,49 @@ static int check_compat_cr(void)
 	return -1;
 }
 
+static int check_uffd_noncoop(void)
+{
+	if (kerndat_uffd())
+		return -1;
+
+	if (!uffd_noncoop_supported()) {
+		pr_warn("Non-cooperative userfaultfd is not supported\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+static int check_io_uring(void)
+{
+	if (!kdat.has_io_uring) {
+		pr_warn("io_uring is not supported. Requires kernel >= v5.1\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+static int check_compress_codec(const char *name)
+{
+	if (!page_codec_lookup(name)) {
+		pr_warn("CRIU built without %s - can't compress pages with it\n", name);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int check_compress_lz4(void)
+{
+	return check_compress_codec("lz4");
+}
+
+static int check_compress_zstd(void)
+{
+	return check_compress_codec("zstd");
+}
+
 static int (*chk_feature)(void);
 
 /*
@@ -1178,6 +1224,8 @@ int cr_check(void)
 	if (opts.check_experimental_features) {
 		ret |= check_autofs();
 		ret |= check_compat_cr();
+		ret |= check_uffd_noncoop();
+		ret |= check_io_uring();
 	}
 
 	print_on_level(DEFAULT_LOGLEVEL, "%s\n", ret ? CHECK_MAYBE : CHECK_GOOD);
@@ -1219,6 +1267,10 @@ static struct feature_list feature_list[] = {
 	{ "autofs", check_autofs },
 	{ "tcp_half_closed", check_tcp_halt_closed },
 	{ "compat_cr", check_compat_cr },
+	{ "uffd_noncoop", check_uffd_noncoop },
+	{ "io_uring", check_io_uring },
+	{ "compress_lz4", check_compress_lz4 },
+	{ "compress_zstd", check_compress_zstd },
 	{ NULL, NULL },
 };
 
@@ -7,6 +7,7 @@
 #include "crtools.h"
 #include "pagemap.h"
 #include "restorer.h"
+#include "image.h"
 
 static int cr_dedup_one_pagemap(int id, int flags);
 
@@ -17,6 +18,14 @@ int cr_dedup(void)
 	DIR * dirp;
 	struct dirent *ent;
 
+	if (check_img_inventory() < 0)
+		return -1;
+
+	if (img_dedup_pages) {
+		pr_err("Pages were deduplicated on dump, can't punch them\n");
+		return -1;
+	}
+
 	dirp = opendir(CR_PARENT_LINK);
 	if (dirp == NULL) {
 		pr_perror("Can't enter previous snapshot folder, error=%d", errno);
@@ -46,6 +46,7 @@
 #include "util.h"
 #include "namespaces.h"
 #include "image.h"
+#include "image-archive.h"
 #include "proc_parse.h"
 #include "parasite.h"
 #include "parasite-syscall.h"
@@ -82,6 +83,7 @@
 #include "seize.h"
 #include "fault-injection.h"
 #include "dump.h"
+#include "page-index.h"
 
 static char loc_buf[PAGE_SIZE];
 
@@ -827,33 +829,37 @@ static int collect_file_locks(void)
 	return parse_file_locks();
 }
 
-static int dump_task_thread(struct parasite_ctl *parasite_ctl,
-				const struct pstree_item *item, int id)
+static int dump_task_threads_batch(struct parasite_ctl *parasite_ctl,
+				   const struct pstree_item *item, int *ids, int nr)
 {
-	struct pid *tid = &item->threads[id];
-	CoreEntry *core = item->core[id];
-	pid_t pid = tid->real;
-	int ret = -1;
-	struct cr_img *img;
+	int i, ret = -1;
 
 	pr_info("\n");
-	pr_info("Dumping core for thread (pid: %d)\n", pid);
+	pr_info("Dumping core for %d threads (pid: %d)\n", nr, item->pid->real);
 	pr_info("----------------------------------------\n");
 
-	ret = parasite_dump_thread_seized(parasite_ctl, id, tid, core);
-	if (ret) {
-		pr_err("Can't dump thread for pid %d\n", pid);
+	if (parasite_dump_threads_seized(parasite_ctl, item, ids, nr)) {
+		pr_err("Can't dump threads of %d\n", item->pid->real);
 		goto err;
 	}
-	pstree_insert_pid(tid);
 
-	img = open_image(CR_FD_CORE, O_DUMP, tid->ns[0].virt);
-	if (!img)
-		goto err;
+	for (i = 0; i < nr; i++) {
+		struct pid *tid = &item->threads[ids[i]];
+		struct cr_img *img;
 
-	ret = pb_write_one(img, core, PB_CORE);
+		pstree_insert_pid(tid);
 
-	close_image(img);
+		img = open_image(CR_FD_CORE, O_DUMP, tid->ns[0].virt);
+		if (!img)
+			goto err;
+
+		ret = pb_write_one(img, item->core[ids[i]], PB_CORE);
+		close_image(img);
+		if (ret)
+			goto err;
+	}
+
+	ret = 0;
 err:
 	pr_info("----------------------------------------\n");
 	return ret;
@@ -994,7 +1000,8 @@ static struct proc_pid_stat pps_buf;
 static int dump_task_threads(struct parasite_ctl *parasite_ctl,
 			     const struct pstree_item *item)
 {
-	int i;
+	int ids[PARASITE_THREADS_BATCH];
+	int i, nr = 0;
 
 	for (i = 0; i < item->nr_threads; i++) {
 		/* Leader is already dumped */
@@ -1002,10 +1009,19 @@ static int dump_task_threads(struct parasite_ctl *parasite_ctl,
 			item->threads[i].ns[0].virt = vpid(item);
 			continue;
 		}
-		if (dump_task_thread(parasite_ctl, item, i))
+
+		ids[nr++] = i;
+		if (nr < PARASITE_THREADS_BATCH)
+			continue;
+
+		if (dump_task_threads_batch(parasite_ctl, item, ids, nr))
 			return -1;
+		nr = 0;
 	}
 
+	if (nr && dump_task_threads_batch(parasite_ctl, item, ids, nr))
+		return -1;
+
 	return 0;
 }
 
@@ -1178,6 +1194,8 @@ static int pre_dump_one_task(struct pstree_item *item)
 	item->pid->ns[0].virt = misc.pid;
 
 	mdc.pre_dump = true;
+	mdc.parallel = false;
+	mdc.pages_id = 0;
 
 	ret = parasite_dump_pages_seized(item, &vmas, &mdc, parasite_ctl);
 	if (ret)
@@ -1191,68 +1209,234 @@ err:
 	return ret;
 
 err_cure:
-	if (compel_cure(parasite_ctl))
+	if (parasite_cure(parasite_ctl))
 		pr_err("Can't cure (pid: %d) from parasite\n", pid);
 	goto err_free;
 }
 
-static int dump_one_task(struct pstree_item *item)
+/*
+ * The part of dump_one_task() that runs after the task's pages
+ * are dumped.
+ */
+static int dump_task_finish(struct pstree_item *item,
+		struct parasite_ctl *parasite_ctl,
+		struct vm_area_list *vmas,
+		struct parasite_dump_misc *misc,
+		const struct proc_pid_stat *pps,
+		struct cr_imgset *cr_imgset)
 {
 	pid_t pid = item->pid->real;
-	struct vm_area_list vmas;
-	struct parasite_ctl *parasite_ctl;
-	int ret, exit_code = -1;
-	struct parasite_dump_misc misc;
-	struct cr_imgset *cr_imgset = NULL;
-	struct parasite_drain_fd *dfds = NULL;
-	struct proc_posix_timers_stat proc_args;
-	struct mem_dump_ctl mdc;
+	int ret;
 
-	INIT_LIST_HEAD(&vmas.h);
-	vmas.nr = 0;
+	ret = parasite_stop_daemon(parasite_ctl);
+	if (ret) {
+		pr_err("Can't cure (pid: %d) from parasite\n", pid);
+		return -1;
+	}
 
-	pr_info("========================================\n");
-	pr_info("Dumping task (pid: %d)\n", pid);
-	pr_info("========================================\n");
+	ret = dump_task_threads(parasite_ctl, item);
+	if (ret) {
+		pr_err("Can't dump threads\n");
+		return -1;
+	}
 
-	if (item->pid->state == TASK_DEAD)
-		/*
-		 * zombies are dumped separately in dump_zombies()
-		 */
-		return 0;
+	ret = parasite_cure(parasite_ctl);
+	if (ret) {
+		pr_err("Can't cure (pid: %d) from parasite\n", pid);
+		return -1;
+	}
+
+	ret = dump_task_mm(pid, pps, misc, vmas, cr_imgset);
+	if (ret) {
+		pr_err("Dump mappings (pid: %d) failed with %d\n", pid, ret);
+		return -1;
+	}
+
+	ret = dump_task_fs(pid, misc, cr_imgset);
+	if (ret) {
+		pr_err("Dump fs (pid: %d) failed with %d\n", pid, ret);
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * With --mem-dump-workers the pages of a task are dumped by a forked
+ * worker and the rest of the task dump is postponed till the worker
+ * finishes. Meanwhile we go ahead and infect and dump the next tasks,
+ * so that pages of up to opts.mem_dump_workers tasks are drained and
+ * written at the same time.
+ */
+struct pending_task {
+	struct pstree_item		*item;
+	struct parasite_ctl		*ctl;
+	struct vm_area_list		vmas;
+	struct parasite_dump_misc	misc;
+	struct proc_pid_stat		pps;
+	struct cr_imgset		*imgset;
+	struct mem_dump_worker		w;
+	struct list_head		l;
+};
+
+static LIST_HEAD(pending_tasks);
+static unsigned int nr_pending_tasks;
+
+static void drop_pending_task(struct pending_task *pt)
+{
+	list_del(&pt->l);
+	nr_pending_tasks--;
+
+	close_cr_imgset(&pt->imgset);
+	free_mappings(&pt->vmas);
+	xfree(pt);
+}
+
+static int finish_pending_task(void)
+{
+	struct pending_task *pt;
+	int ret;
+
+	pt = list_first_entry(&pending_tasks, struct pending_task, l);
+
+	ret = parasite_dump_pages_wait(&pt->w);
+	if (ret)
+		parasite_cure(pt->ctl);
+	else
+		ret = dump_task_finish(pt->item, pt->ctl, &pt->vmas,
+				&pt->misc, &pt->pps, pt->imgset);
+
+	close_pid_proc();
+	drop_pending_task(pt);
+	return ret;
+}
+
+static int finish_pending_tasks(void)
+{
+	while (!list_empty(&pending_tasks))
+		if (finish_pending_task())
+			return -1;
+
+	return 0;
+}
+
+static void abort_pending_tasks(void)
+{
+	struct pending_task *pt, *n;
+
+	list_for_each_entry_safe(pt, n, &pending_tasks, l) {
+		/* Workers stop on their own, the parasite is ours after that */
+		parasite_dump_pages_wait(&pt->w);
+		parasite_cure(pt->ctl);
+		drop_pending_task(pt);
+	}
+}
+
+static int postpone_task_dump(struct pstree_item *item,
+		struct parasite_ctl *parasite_ctl,
+		struct vm_area_list *vmas,
+		struct parasite_dump_misc *misc,
+		struct mem_dump_ctl *mdc,
+		struct cr_imgset *cr_imgset)
+{
+	struct pending_task *pt;
+
+	if (nr_pending_tasks >= opts.mem_dump_workers &&
+			finish_pending_task())
+		return -1;
+
+	pt = xzalloc(sizeof(*pt));
+	if (!pt)
+		return -1;
+
+	if (parasite_dump_pages_start(item, vmas, mdc, parasite_ctl, &pt->w)) {
+		xfree(pt);
+		return -1;
+	}
+
+	pt->item = item;
+	pt->ctl = parasite_ctl;
+	pt->misc = *misc;
+	pt->pps = pps_buf;
+	pt->imgset = cr_imgset;
+
+	/* The pending task owns vmas and images from now on */
+	pt->vmas = *vmas;
+	INIT_LIST_HEAD(&pt->vmas.h);
+	list_splice_init(&vmas->h, &pt->vmas.h);
+
+	list_add_tail(&pt->l, &pending_tasks);
+	nr_pending_tasks++;
+
+	return 0;
+}
+
+/*
+ * A task with the parasite started in it. With --parallel-infect the
+ * parasite is started in several tasks ahead of the one being dumped
+ * and the tasks get scheduled to run it and connect back at the same
+ * time, instead of one by one.
+ */
+struct infected_task {
+	struct pstree_item		*item;
+	struct parasite_ctl		*ctl;
+	struct vm_area_list		vmas;
+	struct parasite_drain_fd	*dfds;
+	struct proc_posix_timers_stat	proc_args;
+	struct proc_pid_stat		pps;
+	struct list_head		l;
+};
+
+static void release_infected_task(struct infected_task *it)
+{
+	close_pid_proc();
+	free_mappings(&it->vmas);
+	xfree(it->dfds);
+	it->dfds = NULL;
+}
+
+static int infect_one_task(struct infected_task *it)
+{
+	struct pstree_item *item = it->item;
+	pid_t pid = item->pid->real;
+	int ret;
+
+	INIT_LIST_HEAD(&it->vmas.h);
+	it->vmas.nr = 0;
+	it->dfds = NULL;
 
 	pr_info("Obtaining task stat ... \n");
-	ret = parse_pid_stat(pid, &pps_buf);
+	ret = parse_pid_stat(pid, &it->pps);
 	if (ret < 0)
 		goto err;
 
-	ret = collect_mappings(pid, &vmas, dump_filemap);
+	ret = collect_mappings(pid, &it->vmas, dump_filemap);
 	if (ret) {
 		pr_err("Collect mappings (pid: %d) failed with %d\n", pid, ret);
 		goto err;
 	}
 
 	if (!shared_fdtable(item)) {
-		dfds = xmalloc(sizeof(*dfds));
-		if (!dfds)
+		it->dfds = xmalloc(sizeof(*it->dfds));
+		if (!it->dfds)
 			goto err;
 
-		ret = collect_fds(pid, &dfds);
+		ret = collect_fds(pid, &it->dfds);
 		if (ret) {
 			pr_err("Collect fds (pid: %d) failed with %d\n", pid, ret);
 			goto err;
 		}
 
-		parasite_ensure_args_size(drain_fds_size(dfds));
+		parasite_ensure_args_size(drain_fds_size(it->dfds));
 	}
 
-	ret = parse_posix_timers(pid, &proc_args);
+	ret = parse_posix_timers(pid, &it->proc_args);
 	if (ret < 0) {
 		pr_err("Can't read posix timers file (pid: %d)\n", pid);
 		goto err;
 	}
 
-	parasite_ensure_args_size(posix_timers_dump_size(proc_args.timer_n));
+	parasite_ensure_args_size(posix_timers_dump_size(it->proc_args.timer_n));
 
 	ret = dump_task_signals(pid, item);
 	if (ret) {
@@ -1260,8 +1444,38 @@ static int dump_one_task(struct pstree_item *item)
 		goto err;
 	}
 
-	parasite_ctl = parasite_infect_seized(pid, item, &vmas);
-	if (!parasite_ctl) {
+	it->ctl = parasite_infect_start(pid, item, &it->vmas);
+	if (!it->ctl) {
+		pr_err("Can't infect (pid: %d) with parasite\n", pid);
+		goto err;
+	}
+
+	return 0;
+
+err:
+	release_infected_task(it);
+	return -1;
+}
+
+static int dump_infected_task(struct infected_task *it)
+{
+	struct pstree_item *item = it->item;
+	pid_t pid = item->pid->real;
+	struct vm_area_list *vmas = &it->vmas;
+	struct parasite_ctl *parasite_ctl = it->ctl;
+	int ret, exit_code = -1;
+	struct parasite_dump_misc misc;
+	struct cr_imgset *cr_imgset = NULL;
+	struct parasite_drain_fd *dfds = it->dfds;
+	struct mem_dump_ctl mdc;
+
+	pr_info("========================================\n");
+	pr_info("Dumping task (pid: %d)\n", pid);
+	pr_info("========================================\n");
+
+	pps_buf = it->pps;
+
+	if (parasite_infect_finish(item, parasite_ctl)) {
 		pr_err("Can't infect (pid: %d) with parasite\n", pid);
 		goto err;
 	}
@@ -1286,13 +1500,13 @@ static int dump_one_task(struct pstree_item *item)
 		close(pfd);
 	}
 
-	ret = parasite_fixup_vdso(parasite_ctl, pid, &vmas);
+	ret = parasite_fixup_vdso(parasite_ctl, pid, vmas);
 	if (ret) {
 		pr_err("Can't fixup vdso VMAs (pid: %d)\n", pid);
 		goto err_cure_imgset;
 	}
 
-	ret = parasite_collect_aios(parasite_ctl, &vmas); /* FIXME -- merge with above */
+	ret = parasite_collect_aios(parasite_ctl, vmas); /* FIXME -- merge with above */
 	if (ret) {
 		pr_err("Failed to check aio rings (pid: %d)\n", pid);
 		goto err_cure_imgset;
@@ -1336,12 +1550,6 @@ static int dump_one_task(struct pstree_item *item)
 		}
 	}
 
-	mdc.pre_dump = false;
-
-	ret = parasite_dump_pages_seized(item, &vmas, &mdc, parasite_ctl);
-	if (ret)
-		goto err_cure;
-
 	ret = parasite_dump_sigacts_seized(parasite_ctl, item);
 	if (ret) {
 		pr_err("Can't dump sigactions (pid: %d) with parasite\n", pid);
@@ -1354,7 +1562,7 @@ static int dump_one_task(struct pstree_item *item)
 		goto err_cure;
 	}
 
-	ret = parasite_dump_posix_timers_seized(&proc_args, parasite_ctl, item);
+	ret = parasite_dump_posix_timers_seized(&it->proc_args, parasite_ctl, item);
 	if (ret) {
 		pr_err("Can't dump posix timers (pid: %d)\n", pid);
 		goto err_cure;
@@ -1366,51 +1574,138 @@ static int dump_one_task(struct pstree_item *item)
 		goto err_cure;
 	}
 
-	ret = compel_stop_daemon(parasite_ctl);
-	if (ret) {
-		pr_err("Can't cure (pid: %d) from parasite\n", pid);
-		goto err;
-	}
+	mdc.pre_dump = false;
+	mdc.parallel = false;
+	mdc.pages_id = 0;
 
-	ret = dump_task_threads(parasite_ctl, item);
-	if (ret) {
-		pr_err("Can't dump threads\n");
-		goto err;
-	}
+	if (opts.mem_dump_workers > 1) {
+		ret = postpone_task_dump(item, parasite_ctl, vmas,
+				&misc, &mdc, cr_imgset);
+		if (ret)
+			goto err_cure;
 
-	ret = compel_cure(parasite_ctl);
-	if (ret) {
-		pr_err("Can't cure (pid: %d) from parasite\n", pid);
+		exit_code = 0;
 		goto err;
 	}
 
-	ret = dump_task_mm(pid, &pps_buf, &misc, &vmas, cr_imgset);
-	if (ret) {
-		pr_err("Dump mappings (pid: %d) failed with %d\n", pid, ret);
-		goto err;
-	}
+	ret = parasite_dump_pages_seized(item, vmas, &mdc, parasite_ctl);
+	if (ret)
+		goto err_cure;
 
-	ret = dump_task_fs(pid, &misc, cr_imgset);
-	if (ret) {
-		pr_err("Dump fs (pid: %d) failed with %d\n", pid, ret);
+	ret = dump_task_finish(item, parasite_ctl, vmas, &misc,
+			&pps_buf, cr_imgset);
+	if (ret)
 		goto err;
-	}
 
 	close_cr_imgset(&cr_imgset);
 	exit_code = 0;
 err:
-	close_pid_proc();
-	free_mappings(&vmas);
-	xfree(dfds);
+	release_infected_task(it);
 	return exit_code;
 
 err_cure:
 	close_cr_imgset(&cr_imgset);
 err_cure_imgset:
-	compel_cure(parasite_ctl);
+	parasite_cure(parasite_ctl);
 	goto err;
 }
 
+static int dump_one_task(struct pstree_item *item)
+{
+	struct infected_task it = { .item = item };
+
+	if (item->pid->state == TASK_DEAD)
+		/*
+		 * zombies are dumped separately in dump_zombies()
+		 */
+		return 0;
+
+	if (infect_one_task(&it))
+		return -1;
+
+	return dump_infected_task(&it);
+}
+
+static LIST_HEAD(infected_tasks);
+static unsigned int nr_infected_tasks;
+
+static int dump_first_infected_task(void)
+{
+	struct infected_task *it;
+	int ret;
+
+	it = list_first_entry(&infected_tasks, struct infected_task, l);
+	list_del(&it->l);
+	nr_infected_tasks--;
+
+	ret = dump_infected_task(it);
+	xfree(it);
+	return ret;
+}
+
+static void abort_infected_tasks(void)
+{
+	struct infected_task *it, *n;
+
+	list_for_each_entry_safe(it, n, &infected_tasks, l) {
+		/* Don't leave the parasite running in the task */
+		if (!parasite_infect_finish(it->item, it->ctl)) {
+			parasite_cure(it->ctl);
+			dmpi(it->item)->parasite_ctl = NULL;
+		}
+		release_infected_task(it);
+		list_del(&it->l);
+		xfree(it);
+	}
+	nr_infected_tasks = 0;
+}
+
+/*
+ * The root task is dumped first on its own, as with pid namespace
+ * its parasite provides the proc for the rest of the tasks.
+ */
+static int dump_tasks_parallel_infect(void)
+{
+	struct pstree_item *item;
+
+	for_each_pstree_item(item) {
+		struct infected_task *it;
+
+		if (item == root_item || item->pid->state == TASK_DEAD) {
+			if (dump_one_task(item))
+				goto err;
+			continue;
+		}
+
+		if (nr_infected_tasks >= opts.parallel_infect &&
+				dump_first_infected_task())
+			goto err;
+
+		it = xzalloc(sizeof(*it));
+		if (!it)
+			goto err;
+
+		it->item = item;
+		if (infect_one_task(it)) {
+			xfree(it);
+			goto err;
+		}
+
+		list_add_tail(&it->l, &infected_tasks);
+		nr_infected_tasks++;
+	}
+
+	while (!list_empty(&infected_tasks))
+		if (dump_first_infected_task())
+			goto err;
+
+	return 0;
+
+err:
+	abort_infected_tasks();
+	return -1;
+}
+
 static int alarm_attempts = 0;
 
 bool alarm_timeouted() {
@@ -1498,9 +1793,14 @@ err:
 	if (disconnect_from_page_server())
 		ret = -1;
 
+	page_index_fini();
+
 	if (bfd_flush_images())
 		ret = -1;
 
+	if (img_archive_fini())
+		ret = -1;
+
 	if (ret)
 		pr_err("Pre-dumping FAILED.\n");
 	else {
@@ -1586,11 +1886,15 @@ static int cr_dump_finish(int ret)
 	if (disconnect_from_page_server())
 		ret = -1;
 
+	page_index_fini();
 	close_cr_imgset(&glob_imgset);
 
 	if (bfd_flush_images())
 		ret = -1;
 
+	if (img_archive_fini())
+		ret = -1;
+
 	cr_plugin_fini(CR_PLUGIN_STAGE__DUMP, ret);
 	cgp_fini();
 
@@ -1749,11 +2053,19 @@ int cr_dump_tasks(pid_t pid)
 	if (collect_seccomp_filters() < 0)
 		goto err;
 
-	for_each_pstree_item(item) {
-		if (dump_one_task(item))
+	if (opts.parallel_infect > 1) {
+		if (dump_tasks_parallel_infect())
 			goto err;
+	} else {
+		for_each_pstree_item(item) {
+			if (dump_one_task(item))
+				goto err;
+		}
 	}
 
+	if (finish_pending_tasks())
+		goto err;
+
 	/*
 	 * It may happen that a process has completed but its files in
 	 * /proc/PID/ are still open by another process. If the PID has been
@@ -1803,5 +2115,6 @@ int cr_dump_tasks(pid_t pid)
 	if (ret)
 		goto err;
 err:
+	abort_pending_tasks();
 	return cr_dump_finish(ret);
 }
@@ -0,0 +1,196 @@
+#include <fcntl.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+
+#include "types.h"
+#include "crtools.h"
+#include "cr_options.h"
+#include "image.h"
+#include "page-xfer.h"
+#include "protobuf.h"
+#include "util.h"
+#include "log.h"
+#include "images/stats.pb-c.h"
+
+#undef	LOG_PREFIX
+#define LOG_PREFIX "iter: "
+
+/*
+ * Iterative dump (dump --iterative) pre-dumps memory in passes, each
+ * writing only the pages dirtied since the previous one (tracked with
+ * soft-dirty bits), until the final dump is expected to keep the
+ * tasks frozen for less than the target, then makes the final dump
+ * on top of the last pass.
+ *
+ * Every pass is done in a child process with the images in its own
+ * subdir (see open_iter_image_dir) and reports what it did via the
+ * stats image.
+ */
+
+struct iter_pass {
+	unsigned long	start;		/* us */
+	unsigned long	written;	/* pages */
+	unsigned long	frozen;		/* us */
+	unsigned long	memwrite;	/* us */
+};
+
+static unsigned long now_us(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec * USEC_PER_SEC + tv.tv_usec;
+}
+
+static int read_pass_stats(struct iter_pass *ip)
+{
+	struct cr_img *img;
+	StatsEntry *se;
+	int ret = -1;
+
+	img = open_image_at(AT_FDCWD, CR_FD_STATS, O_RSTR, "dump");
+	if (!img)
+		return -1;
+
+	if (pb_read_one(img, &se, PB_STATS) < 0)
+		goto out;
+
+	if (se->dump) {
+		ip->written = se->dump->pages_written;
+		ip->frozen = se->dump->frozen_time;
+		ip->memwrite = se->dump->memwrite_time;
+		ret = 0;
+	} else
+		pr_err("No dump stats in the pass images\n");
+
+	stats_entry__free_unpacked(se, NULL);
+out:
+	close_image(img);
+	return ret;
+}
+
+static int pre_dump_pass(pid_t pid, int pass, struct iter_pass *ip)
+{
+	int child, status;
+
+	pr_info("Starting pre-dump pass %d\n", pass);
+
+	ip->start = now_us();
+
+	child = fork();
+	if (child < 0) {
+		pr_perror("Can't fork pre-dump pass");
+		return -1;
+	}
+
+	if (child == 0) {
+		int ret = 1;
+
+		if (page_server_start_pass(pass, pass - 1))
+			goto cout;
+
+		if (open_iter_image_dir(pass, pass - 1))
+			goto cout;
+
+		if (cr_pre_dump_tasks(pid))
+			goto cout;
+
+		ret = 0;
+cout:
+		exit(ret);
+	}
+
+	if (waitpid(child, &status, 0) != child) {
+		pr_perror("Can't wait pre-dump pass %d", pass);
+		return -1;
+	}
+
+	if (!WIFEXITED(status) || WEXITSTATUS(status)) {
+		pr_err("Pre-dump pass %d failed (status %#x)\n", pass, status);
+		return -1;
+	}
+
+	if (read_pass_stats(ip))
+		return -1;
+
+	pr_info("Pass %d: %lu pages written in %lu us, frozen for %lu us\n",
+			pass, ip->written, ip->memwrite, ip->frozen);
+	return 0;
+}
+
+/*
+ * The final dump writes the pages dirtied since the last pass reset
+ * the tracker, and does it with the tasks frozen. Their number is
+ * estimated with the dirty rate seen between the last two passes,
+ * after the first pass the rate is unknown and the whole memory is
+ * the upper bound. The write rate is the one of the last pass.
+ */
+static unsigned long predict_freeze(struct iter_pass *prev, struct iter_pass *cur)
+{
+	double dirty;
+
+	if (prev && cur->start > prev->start)
+		dirty = (double)cur->written * (now_us() - cur->start) /
+				(cur->start - prev->start);
+	else
+		dirty = cur->written;
+
+	if (!cur->written)
+		return cur->frozen;
+
+	return cur->frozen + dirty * cur->memwrite / cur->written;
+}
+
+int cr_iterative_dump_tasks(pid_t pid)
+{
+	struct iter_pass passes[2], *cur = &passes[0], *prev = NULL;
+	unsigned long target = opts.iter_freeze_target * 1000UL;
+	int pass;
+
+	/* All the passes share one connection to the page server */
+	if (connect_to_page_server())
+		return -1;
+
+	for (pass = 1; ; pass++) {
+		unsigned long freeze;
+
+		if (pre_dump_pass(pid, pass, cur))
+			goto err;
+
+		if (prev && cur->written >= prev->written) {
+			pr_info("Dirty memory doesn't shrink (%lu -> %lu pages)\n",
+					prev->written, cur->written);
+			break;
+		}
+
+		freeze = predict_freeze(prev, cur);
+		pr_info("Predicted frozen time %lu us (target %lu us)\n", freeze, target);
+		if (freeze <= target)
+			break;
+
+		if (pass == opts.iter_max_passes) {
+			pr_info("Pre-dump passes limit reached\n");
+			break;
+		}
+
+		prev = cur;
+		cur = (cur == &passes[0] ? &passes[1] : &passes[0]);
+	}
+
+	pr_info("Dumping tasks on top of pre-dump pass %d\n", pass);
+
+	if (page_server_start_pass(0, pass))
+		goto err;
+
+	if (open_iter_image_dir(0, pass))
+		goto err;
+
+	opts.track_mem = true;
+	return cr_dump_tasks(pid);
+
+err:
+	disconnect_from_page_server();
+	return -1;
+}
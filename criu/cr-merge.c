@@ -0,0 +1,439 @@
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "int.h"
+#include "crtools.h"
+#include "pagemap.h"
+#include "image.h"
+#include "image-archive.h"
+#include "imgset.h"
+#include "servicefd.h"
+#include "protobuf.h"
+#include "xmalloc.h"
+#include "util.h"
+#include "log.h"
+#include "images/pagemap.pb-c.h"
+
+#undef	LOG_PREFIX
+#define LOG_PREFIX "merge: "
+
+/*
+ * Merge (criu merge) collapses the parents chain of a memory dump
+ * into self-contained pagemap and pages images, i.e. makes it
+ * possible to restore from the images dir with no parents around.
+ *
+ * Each pagemap is read with the page_read engine (so in_parent,
+ * same-as, zero and compressed entries are all resolved by it) and
+ * is written into a tmp subdir with all the pages in one raw pages
+ * image. Pagemaps are merged in parallel by worker processes.
+ *
+ * When all the pagemaps are merged, the new images are renamed over
+ * the old ones and the parent link is removed, all under the images
+ * dir lock (see lock_image_dir), so dumps that are making a child of
+ * this dir and restores don't see a half-merged one.
+ */
+
+#define MERGE_TMP_DIR	"merge-tmp"
+#define MERGE_BUF_PAGES	256
+
+struct merge_pagemap {
+	unsigned long	id;
+	int		pr_flags;
+	u32		pages_id;	/* new pages image */
+	u32		old_pages_id;
+};
+
+struct merge_ctx {
+	struct merge_pagemap	*pms;
+	int			nr_pms;
+	u32			max_pages_id;
+};
+
+static int merge_add_pagemap(struct merge_ctx *mc, unsigned long id, int pr_flags)
+{
+	struct merge_pagemap *pm;
+
+	pm = xrealloc(mc->pms, (mc->nr_pms + 1) * sizeof(*mc->pms));
+	if (!pm)
+		return -1;
+
+	mc->pms = pm;
+	pm = &mc->pms[mc->nr_pms++];
+	pm->id = id;
+	pm->pr_flags = pr_flags;
+	pm->old_pages_id = 0;
+	return 0;
+}
+
+static int collect_pagemaps(int dfd, struct merge_ctx *mc)
+{
+	DIR *dirp;
+	struct dirent *ent;
+	unsigned long id;
+	u32 pages_id;
+	int ret = 0, fd;
+
+	fd = dup(dfd);
+	if (fd < 0) {
+		pr_perror("Can't dup images dir");
+		return -1;
+	}
+
+	dirp = fdopendir(fd);
+	if (!dirp) {
+		pr_perror("Can't open images dir");
+		close(fd);
+		return -1;
+	}
+
+	while (1) {
+		errno = 0;
+		ent = readdir(dirp);
+		if (ent == NULL) {
+			if (errno) {
+				pr_perror("Failed readdir");
+				ret = -1;
+			}
+			break;
+		}
+
+		if (sscanf(ent->d_name, "pagemap-shmem-%lu.img", &id) == 1)
+			ret = merge_add_pagemap(mc, id, PR_SHMEM);
+		else if (sscanf(ent->d_name, "pagemap-%lu.img", &id) == 1)
+			ret = merge_add_pagemap(mc, id, PR_TASK);
+		else if (sscanf(ent->d_name, "pages-%u.img", &pages_id) == 1)
+			mc->max_pages_id = max(mc->max_pages_id, pages_id);
+
+		if (ret)
+			break;
+	}
+
+	closedir(dirp);
+	return ret;
+}
+
+static int merge_flush_pe(struct cr_img *pmi, PagemapEntry *pe)
+{
+	if (!pe->nr_pages)
+		return 0;
+
+	if (pb_write_one(pmi, pe, PB_PAGEMAP) < 0)
+		return -1;
+
+	pe->nr_pages = 0;
+	return 0;
+}
+
+static int merge_one_pagemap(int tdfd, struct merge_pagemap *pm, void *buf)
+{
+	PagemapHead h = PAGEMAP_HEAD__INIT;
+	PagemapEntry pe = PAGEMAP_ENTRY__INIT;
+	struct cr_img *pmi = NULL, *pi = NULL;
+	struct page_read pr;
+	int ret;
+
+	ret = open_page_read(pm->id, &pr, pm->pr_flags);
+	if (ret <= 0)
+		return ret;
+
+	ret = -1;
+	pmi = open_image_at(tdfd, pm->pr_flags == PR_TASK ?
+			CR_FD_PAGEMAP : CR_FD_SHMEM_PAGEMAP, O_DUMP, pm->id);
+	if (!pmi)
+		goto out;
+
+	h.pages_id = pm->pages_id;
+	if (pb_write_one(pmi, &h, PB_PAGEMAP_HEAD) < 0)
+		goto out;
+
+	pi = open_image_at(tdfd, CR_FD_PAGES, O_DUMP, pm->pages_id);
+	if (!pi)
+		goto out;
+
+	while (pr.advance(&pr)) {
+		unsigned long vaddr = pr.pe->vaddr;
+		unsigned long nr = pr.pe->nr_pages;
+		bool zero = !pr.pe->in_parent && pagemap_zero(pr.pe);
+
+		if (pe.nr_pages && (pe.vaddr + pagemap_len(&pe) != vaddr ||
+					pagemap_zero(&pe) != zero))
+			if (merge_flush_pe(pmi, &pe))
+				goto out;
+
+		if (!pe.nr_pages) {
+			pe.vaddr = vaddr;
+			pe.has_zero = zero;
+			pe.zero = zero;
+		}
+		pe.nr_pages += nr;
+
+		if (zero)
+			continue;
+
+		while (nr) {
+			unsigned long n = min_t(unsigned long, nr, MERGE_BUF_PAGES);
+
+			if (pr.read_pages(&pr, vaddr, n, buf, 0) < 0)
+				goto out;
+			if (write_img_buf(pi, buf, n * PAGE_SIZE))
+				goto out;
+
+			vaddr += n * PAGE_SIZE;
+			nr -= n;
+		}
+	}
+
+	if (merge_flush_pe(pmi, &pe))
+		goto out;
+
+	pm->old_pages_id = pr.pages_img_id;
+	pr_info("Merged %s %lu into pages-%u\n",
+			pm->pr_flags == PR_TASK ? "pid" : "shmid",
+			pm->id, pm->pages_id);
+	ret = 1;
+out:
+	if (pi)
+		close_image(pi);
+	if (pmi)
+		close_image(pmi);
+	pr.close(&pr);
+	return ret;
+}
+
+/*
+ * Worker @idx of @nr merges every nr-th pagemap and reports the
+ * old pages image ids via @old_ids (shared with the others),
+ * 0 for empty pagemaps.
+ */
+static int merge_worker(int tdfd, struct merge_ctx *mc, int idx, int nr,
+			u32 *old_ids)
+{
+	void *buf;
+	int i, ret;
+
+	buf = xmalloc(MERGE_BUF_PAGES * PAGE_SIZE);
+	if (!buf)
+		return -1;
+
+	for (i = idx; i < mc->nr_pms; i += nr) {
+		ret = merge_one_pagemap(tdfd, &mc->pms[i], buf);
+		if (ret < 0)
+			break;
+		old_ids[i] = ret ? mc->pms[i].old_pages_id : 0;
+		ret = 0;
+	}
+
+	xfree(buf);
+	return ret;
+}
+
+static int merge_pagemaps(int tdfd, struct merge_ctx *mc)
+{
+	int i, nr_workers, status, ret = 0;
+	u32 *old_ids;
+	pid_t pid;
+
+	old_ids = mmap(NULL, mc->nr_pms * sizeof(*old_ids), PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (old_ids == MAP_FAILED) {
+		pr_perror("Can't map merge results");
+		return -1;
+	}
+
+	nr_workers = sysconf(_SC_NPROCESSORS_ONLN);
+	if (nr_workers < 1)
+		nr_workers = 1;
+	if (nr_workers > mc->nr_pms)
+		nr_workers = mc->nr_pms;
+
+	for (i = 0; i < mc->nr_pms; i++)
+		mc->pms[i].pages_id = mc->max_pages_id + 1 + i;
+
+	pr_info("Merging %d pagemaps with %d workers\n", mc->nr_pms, nr_workers);
+
+	for (i = 0; i < nr_workers; i++) {
+		pid = fork();
+		if (pid < 0) {
+			pr_perror("Can't fork merge worker");
+			ret = -1;
+			break;
+		}
+
+		if (pid == 0)
+			exit(merge_worker(tdfd, mc, i, nr_workers, old_ids) ? 1 : 0);
+	}
+
+	while ((pid = wait(&status)) > 0)
+		if (!WIFEXITED(status) || WEXITSTATUS(status)) {
+			pr_err("Merge worker %d failed (%#x)\n", pid, status);
+			ret = -1;
+		}
+
+	for (i = 0; i < mc->nr_pms; i++) {
+		mc->pms[i].old_pages_id = old_ids[i];
+		/* Empty pagemap, nothing to swap */
+		if (!old_ids[i])
+			mc->pms[i].pages_id = 0;
+	}
+
+	munmap(old_ids, mc->nr_pms * sizeof(*old_ids));
+	return ret;
+}
+
+static int swap_merged_images(int dfd, int tdfd, struct merge_ctx *mc)
+{
+	char pm_name[PATH_MAX], pg_name[PATH_MAX];
+	int i, lfd, ret = -1;
+
+	lfd = lock_image_dir(dfd, LOCK_EX);
+	if (lfd < 0)
+		return -1;
+
+	/*
+	 * New pages go first, so that the pagemap that refers to
+	 * them only appears when they are there. Old pages images
+	 * stay till all the pagemaps are swapped.
+	 */
+	for (i = 0; i < mc->nr_pms; i++) {
+		struct merge_pagemap *pm = &mc->pms[i];
+
+		if (!pm->pages_id)
+			continue;
+
+		snprintf(pg_name, sizeof(pg_name),
+				imgset_template[CR_FD_PAGES].fmt, pm->pages_id);
+		snprintf(pm_name, sizeof(pm_name),
+				imgset_template[pm->pr_flags == PR_TASK ?
+				CR_FD_PAGEMAP : CR_FD_SHMEM_PAGEMAP].fmt, pm->id);
+
+		if (renameat(tdfd, pg_name, dfd, pg_name) ||
+				renameat(tdfd, pm_name, dfd, pm_name)) {
+			pr_perror("Can't move merged %s in place", pm_name);
+			goto out;
+		}
+	}
+
+	if (unlinkat(dfd, CR_PARENT_LINK, 0) && errno != ENOENT) {
+		pr_perror("Can't remove parent link");
+		goto out;
+	}
+
+	for (i = 0; i < mc->nr_pms; i++) {
+		struct merge_pagemap *pm = &mc->pms[i];
+
+		if (!pm->pages_id)
+			continue;
+
+		snprintf(pg_name, sizeof(pg_name),
+				imgset_template[CR_FD_PAGES].fmt, pm->old_pages_id);
+		if (unlinkat(dfd, pg_name, 0) && errno != ENOENT)
+			pr_warn("Can't remove %s: %m\n", pg_name);
+	}
+
+	ret = 0;
+out:
+	unlock_image_dir(lfd);
+	return ret;
+}
+
+static int remove_tmp_dir(int dfd)
+{
+	DIR *dirp;
+	struct dirent *ent;
+	int fd;
+
+	fd = openat(dfd, MERGE_TMP_DIR, O_RDONLY | O_DIRECTORY);
+	if (fd < 0) {
+		if (errno == ENOENT)
+			return 0;
+		pr_perror("Can't open " MERGE_TMP_DIR);
+		return -1;
+	}
+
+	dirp = fdopendir(fd);
+	if (!dirp) {
+		pr_perror("Can't open " MERGE_TMP_DIR);
+		close(fd);
+		return -1;
+	}
+
+	while ((ent = readdir(dirp)) != NULL) {
+		if (dir_dots(ent))
+			continue;
+		if (unlinkat(fd, ent->d_name, 0))
+			pr_perror("Can't remove " MERGE_TMP_DIR "/%s", ent->d_name);
+	}
+
+	closedir(dirp);
+
+	if (unlinkat(dfd, MERGE_TMP_DIR, AT_REMOVEDIR)) {
+		pr_perror("Can't remove " MERGE_TMP_DIR);
+		return -1;
+	}
+
+	return 0;
+}
+
+int cr_merge(void)
+{
+	struct merge_ctx mc = {};
+	int dfd, tdfd, ret = -1;
+
+	if (check_img_inventory() < 0)
+		return -1;
+
+	dfd = get_service_fd(IMG_FD_OFF);
+
+	if (img_archive_present(dfd)) {
+		pr_err("Can't merge archived images\n");
+		return -1;
+	}
+
+	if (faccessat(dfd, CR_PARENT_LINK, F_OK, AT_SYMLINK_NOFOLLOW)) {
+		if (errno != ENOENT) {
+			pr_perror("Can't access parent link");
+			return -1;
+		}
+		pr_info("No parent images, nothing to merge\n");
+		return 0;
+	}
+
+	/* Leftovers from a failed merge */
+	if (remove_tmp_dir(dfd))
+		return -1;
+
+	if (mkdirat(dfd, MERGE_TMP_DIR, 0700)) {
+		pr_perror("Can't create " MERGE_TMP_DIR);
+		return -1;
+	}
+
+	tdfd = openat(dfd, MERGE_TMP_DIR, O_RDONLY | O_DIRECTORY);
+	if (tdfd < 0) {
+		pr_perror("Can't open " MERGE_TMP_DIR);
+		goto out;
+	}
+
+	if (collect_pagemaps(dfd, &mc))
+		goto out_close;
+
+	if (mc.nr_pms && merge_pagemaps(tdfd, &mc))
+		goto out_close;
+
+	if (swap_merged_images(dfd, tdfd, &mc))
+		goto out_close;
+
+	pr_info("Merged\n");
+	ret = 0;
+out_close:
+	close(tdfd);
+out:
+	remove_tmp_dir(dfd);
+	xfree(mc.pms);
+	return ret;
+}
@@ -51,6 +51,7 @@
 #include "crtools.h"
 #include "namespaces.h"
 #include "mem.h"
+#include "pages-prefetch.h"
 #include "mount.h"
 #include "fsnotify.h"
 #include "pstree.h"
@@ -78,6 +79,7 @@
 #include "sk-queue.h"
 #include "sigframe.h"
 #include "fdstore.h"
+#include "uffd.h"
 
 #include "parasite-syscall.h"
 #include "files-reg.h"
@@ -1172,6 +1174,8 @@ static inline int fork_with_pid(struct pstree_item *item)
 	 * The cgroup namespace is also unshared explicitly in the
 	 * move_in_cgroup(), so drop this flag here as well.
 	 */
+	/* clone() doesn't run the atfork handlers */
+	log_flush();
 	ret = clone_noasan(restore_task_with_children,
 			(ca.clone_flags & ~(CLONE_NEWNET | CLONE_NEWCGROUP)) | SIGCHLD, &ca);
 	if (ret < 0) {
@@ -2035,6 +2039,9 @@ skip_ns_bouncing:
 	pr_info("Restore finished successfully. Resuming tasks.\n");
 	__restore_switch_stage(CR_STATE_COMPLETE);
 
+	/* Let the daemon copy the rest of lazy memory */
+	lazy_pages_restore_finished();
+
 	if (ret == 0)
 		ret = compel_stop_on_syscall(task_entries->nr_threads,
 			__NR(rt_sigreturn, 0), __NR(rt_sigreturn, 1), flag);
@@ -2092,6 +2099,7 @@ out_kill:
 	}
 
 out:
+	lazy_pages_restore_finished();
 	fini_cgroup();
 	depopulate_roots_yard(mnt_ns_fd, true);
 	stop_usernsd();
@@ -2134,6 +2142,9 @@ int cr_restore_tasks(void)
 	if (kerndat_init())
 		goto err;
 
+	if (prepare_lazy_pages_socket())
+		goto err;
+
 	timing_start(TIME_RESTORE);
 
 	if (cpu_init() < 0)
@@ -2159,7 +2170,11 @@ int cr_restore_tasks(void)
 	if (criu_signals_setup() < 0)
 		goto err;
 
+	if (start_pages_prefetch())
+		goto err;
+
 	ret = restore_root_task(root_item);
+	stop_pages_prefetch();
 err:
 	cr_plugin_fini(CR_PLUGIN_STAGE__RESTORE, ret);
 	return ret;
@@ -3267,6 +3282,7 @@ static int sigreturn_restore(pid_t pid, struct task_restore_args *task_args, uns
 	close_service_fd(USERNSD_SK);
 	close_service_fd(FDSTORE_SK_OFF);
 	close_service_fd(RPC_SK_OFF);
+	close_service_fd(LAZY_PAGES_SK_OFF);
 
 	__gcov_flush();
 
@@ -3285,6 +3301,7 @@ static int sigreturn_restore(pid_t pid, struct task_restore_args *task_args, uns
 	 * and restoring core is extremely destructive.
 	 */
 
+	log_flush();
 	JUMP_TO_RESTORER_BLOB(new_sp, restore_task_exec_start, task_args);
 
 err:
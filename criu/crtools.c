@@ -50,6 +50,9 @@
 
 #include "setproctitle.h"
 #include "sysctl.h"
+#include "compress.h"
+#include "image-archive.h"
+#include "uffd.h"
 
 #include "../soccr/soccr.h"
 
@@ -71,10 +74,15 @@ void init_opts(void)
 	opts.cpu_cap = CPU_CAP_DEFAULT;
 	opts.manage_cgroups = CG_MODE_DEFAULT;
 	opts.ps_socket = -1;
+	opts.ps_connections = 1;
 	opts.ghost_limit = DEFAULT_GHOST_LIMIT;
 	opts.timeout = DEFAULT_TIMEOUT;
 	opts.empty_ns = 0;
 	opts.status_fd = -1;
+	opts.stream_fd = -1;
+	opts.compress_threads = 1;
+	opts.iter_freeze_target = DEFAULT_ITER_FREEZE_TARGET;
+	opts.iter_max_passes = DEFAULT_ITER_MAX_PASSES;
 }
 
 static int parse_join_ns(const char *ptr)
@@ -196,6 +204,23 @@ static size_t parse_size(char *optarg)
 	return (size_t)atol(optarg);
 }
 
+/* Parses a count, which must be a positive number and nothing more */
+static int parse_positive(const char *opt, const char *optarg, unsigned int *val)
+{
+	char *end;
+	long n;
+
+	errno = 0;
+	n = strtol(optarg, &end, 10);
+	if (errno || end == optarg || *end != '\0' || n < 1 || n > INT_MAX) {
+		pr_msg("Error: --%s should be a positive number, not %s\n", opt, optarg);
+		return -1;
+	}
+
+	*val = n;
+	return 0;
+}
+
 bool deprecated_ok(char *what)
 {
 	if (opts.deprecated_ok)
@@ -244,6 +269,7 @@ int main(int argc, char *argv[], char *envp[])
 		BOOL_OPT(SK_EST_PARAM, &opts.tcp_established_ok),
 		{ "close",			required_argument,	0, 1043	},
 		BOOL_OPT("log-pid", &opts.log_file_per_pid),
+		BOOL_OPT("log-buffered", &opts.log_buffered),
 		{ "version",			no_argument,		0, 'V'	},
 		BOOL_OPT("evasive-devices", &opts.evasive_devices),
 		{ "pidfile",			required_argument,	0, 1046	},
@@ -259,6 +285,14 @@ int main(int argc, char *argv[], char *envp[])
 		{ "ms",				no_argument,		0, 1054	},
 		BOOL_OPT("track-mem", &opts.track_mem),
 		BOOL_OPT("auto-dedup", &opts.auto_dedup),
+		BOOL_OPT("dedup-pages", &opts.dedup_pages),
+		BOOL_OPT("direct-io", &opts.direct_io),
+		BOOL_OPT("compact-pagemaps", &opts.compact_pagemaps),
+		BOOL_OPT("skip-smaps", &opts.skip_smaps),
+		BOOL_OPT("archive", &opts.img_archive),
+		BOOL_OPT("lazy-pages", &opts.lazy_pages),
+		BOOL_OPT("io-uring", &opts.io_uring),
+		BOOL_OPT("iterative", &opts.iterative),
 		{ "libdir",			required_argument,	0, 'L'	},
 		{ "cpu-cap",			optional_argument,	0, 1057	},
 		BOOL_OPT("force-irmap", &opts.force_irmap),
@@ -290,6 +324,15 @@ int main(int argc, char *argv[], char *envp[])
 		BOOL_OPT("display-stats", &opts.display_stats),
 		BOOL_OPT("weak-sysctls", &opts.weak_sysctls),
 		{ "status-fd",			required_argument,	0, 1088 },
+		{ "mem-dump-workers",		required_argument,	0, 1089 },
+		{ "compress",			required_argument,	0, 1090 },
+		{ "compress-threads",		required_argument,	0, 1091 },
+		{ "iter-freeze-target",		required_argument,	0, 1092 },
+		{ "iter-max-passes",		required_argument,	0, 1093 },
+		{ "ps-connections",		required_argument,	0, 1094 },
+		{ "stream-fd",			required_argument,	0, 1095 },
+		{ "prefetch-threads",		required_argument,	0, 1096 },
+		{ "parallel-infect",		required_argument,	0, 1097 },
 		{ },
 	};
 
@@ -568,6 +611,51 @@ int main(int argc, char *argv[], char *envp[])
 				return 1;
 			}
 			break;
+		case 1089:
+			if (parse_positive("mem-dump-workers", optarg,
+						&opts.mem_dump_workers))
+				return 1;
+			break;
+		case 1090:
+			opts.compress = optarg;
+			break;
+		case 1091:
+			opts.compress_threads = atoi(optarg);
+			break;
+		case 1092:
+			if (parse_positive("iter-freeze-target", optarg,
+						&opts.iter_freeze_target))
+				return 1;
+			break;
+		case 1093:
+			if (parse_positive("iter-max-passes", optarg,
+						&opts.iter_max_passes))
+				return 1;
+			break;
+		case 1094:
+			opts.ps_connections = atoi(optarg);
+			if (opts.ps_connections < 1 ||
+			    opts.ps_connections > PS_MAX_CONNECTIONS) {
+				pr_msg("Error: --ps-connections should be within 1..%d\n",
+						PS_MAX_CONNECTIONS);
+				return 1;
+			}
+			break;
+		case 1095:
+			if (sscanf(optarg, "%d", &opts.stream_fd) != 1 ||
+			    opts.stream_fd < 0) {
+				pr_msg("Error: bad --stream-fd %s\n", optarg);
+				return 1;
+			}
+			break;
+		case 1096:
+			if (parse_positive("prefetch-threads", optarg,
+						&opts.prefetch_threads))
+				return 1;
+			break;
+		case 1097:
+			opts.parallel_infect = atoi(optarg);
+			break;
 		case 'V':
 			pr_msg("Version: %s\n", CRIU_VERSION);
 			if (strcmp(CRIU_GITID, "0"))
@@ -602,6 +690,69 @@ int main(int argc, char *argv[], char *envp[])
 		return 1;
 	}
 
+	if (opts.mem_dump_workers > 1 && opts.use_page_server) {
+		pr_msg("Warn: --mem-dump-workers doesn't work with --page-server, "
+				"pages will be dumped sequentially\n");
+		opts.mem_dump_workers = 0;
+	}
+
+	/*
+	 * The index of written pages lives in criu memory, each worker
+	 * would only see the pages it has written itself.
+	 */
+	if (opts.mem_dump_workers > 1 && opts.dedup_pages) {
+		pr_msg("Error: --mem-dump-workers can't be used with --dedup-pages\n");
+		return 1;
+	}
+
+	if (opts.compress && !page_codec_lookup(opts.compress)) {
+		pr_msg("Error: unknown compression codec %s\n", opts.compress);
+		page_codecs_list();
+		return 1;
+	}
+
+	if (opts.dedup_pages && opts.auto_dedup) {
+		pr_msg("Error: --dedup-pages can't be used with --auto-dedup\n");
+		return 1;
+	}
+
+	if (opts.compact_pagemaps && (opts.compress || opts.dedup_pages)) {
+		pr_msg("Error: --compact-pagemaps can't be used with --compress or --dedup-pages\n");
+		return 1;
+	}
+
+	if (opts.img_archive && (opts.use_page_server || opts.auto_dedup ||
+				opts.dedup_pages || opts.direct_io)) {
+		pr_msg("Error: --archive can't be used with --page-server, "
+				"--auto-dedup, --dedup-pages or --direct-io\n");
+		return 1;
+	}
+
+	if (opts.stream_fd >= 0 && (opts.iterative || opts.img_parent ||
+				opts.use_page_server || opts.img_archive ||
+				opts.dedup_pages || opts.direct_io || opts.lazy_pages)) {
+		pr_msg("Error: --stream-fd can't be used with --iterative, "
+				"--prev-images-dir, --page-server, --archive, "
+				"--dedup-pages, --direct-io or --lazy-pages\n");
+		return 1;
+	}
+
+	/* Buffered reads can't be done without io_uring workers */
+	if (opts.io_uring && !opts.direct_io) {
+		pr_msg("Error: --io-uring needs --direct-io\n");
+		return 1;
+	}
+
+	if (opts.direct_io && opts.prefetch_threads) {
+		pr_msg("Error: --prefetch-threads can't be used with --direct-io\n");
+		return 1;
+	}
+
+	if (opts.iterative && opts.img_parent) {
+		pr_msg("Error: --iterative can't be used with --prev-images-dir\n");
+		return 1;
+	}
+
 	if (!opts.restore_detach && opts.restore_sibling) {
 		pr_msg("--restore-sibling only makes sense with --restore-detach\n");
 		return 1;
@@ -694,12 +845,28 @@ int main(int argc, char *argv[], char *envp[])
 		inherit_fd_log();
 	}
 
+	if (opts.stream_fd >= 0) {
+		if (!strcmp(argv[optind], "dump")) {
+			if (opts.auto_dedup) {
+				pr_err("--auto-dedup can't be used on dump with --stream-fd\n");
+				return 1;
+			}
+		} else if (strcmp(argv[optind], "restore")) {
+			pr_err("--stream-fd is dump and restore only option\n");
+			return 1;
+		}
+	}
+
 	if (opts.img_parent)
 		pr_info("Will do snapshot from %s\n", opts.img_parent);
 
 	if (!strcmp(argv[optind], "dump")) {
 		if (!tree_id)
 			goto opt_pid_missing;
+		if (opts.iterative)
+			return cr_iterative_dump_tasks(tree_id) != 0;
+		if (opts.stream_fd >= 0 && img_stream_dump(opts.stream_fd))
+			return 1;
 		return cr_dump_tasks(tree_id);
 	}
 
@@ -714,9 +881,17 @@ int main(int argc, char *argv[], char *envp[])
 		if (tree_id)
 			pr_warn("Using -t with criu restore is obsoleted\n");
 
+		if (opts.stream_fd >= 0) {
+			if (img_stream_restore(opts.stream_fd))
+				return 1;
+			/* Free the streamed pages as they are restored */
+			opts.auto_dedup = true;
+		}
+
 		ret = cr_restore_tasks();
 		if (ret == 0 && opts.exec_cmd) {
 			close_pid_proc();
+			log_flush();
 			execvp(opts.exec_cmd[0], opts.exec_cmd);
 			pr_perror("Failed to exec command %s", opts.exec_cmd[0]);
 			ret = 1;
@@ -743,6 +918,12 @@ int main(int argc, char *argv[], char *envp[])
 	if (!strcmp(argv[optind], "dedup"))
 		return cr_dedup() != 0;
 
+	if (!strcmp(argv[optind], "merge"))
+		return cr_merge() != 0;
+
+	if (!strcmp(argv[optind], "lazy-pages"))
+		return cr_lazy_pages(opts.daemon_mode) != 0;
+
 	if (!strcmp(argv[optind], "cpuinfo")) {
 		if (!argv[optind + 1]) {
 			pr_msg("Error: cpuinfo requires an action: dump or check\n");
@@ -764,6 +945,8 @@ usage:
 "  criu page-server\n"
 "  criu service [<options>]\n"
 "  criu dedup\n"
+"  criu merge\n"
+"  criu lazy-pages\n"
 "\n"
 "Commands:\n"
 "  dump           checkpoint a process/tree identified by pid\n"
@@ -773,6 +956,8 @@ usage:
 "  page-server    launch page server\n"
 "  service        launch service\n"
 "  dedup          remove duplicates in memory dump\n"
+"  merge          make memory dump self-contained by merging in its parents\n"
+"  lazy-pages     launch daemon populating memory of lazily restored tasks\n"
 "  cpuinfo dump   writes cpu information into image file\n"
 "  cpuinfo check  validates cpu information read from image file\n"
 	);
@@ -891,6 +1076,7 @@ usage:
 "* Logging:\n"
 "  -o|--log-file FILE    log file name\n"
 "     --log-pid          enable per-process logging to separate FILE.pid files\n"
+"     --log-buffered     write log messages in big chunks, not line by line\n"
 "  -v[v...]            increase verbosity (can use multiple v)\n"
 "  -vNUM               set verbosity to NUM (higher level means more output):\n"
 "                          -v1 - only errors and messages\n"
@@ -903,14 +1089,46 @@ usage:
 "  --track-mem           turn on memory changes tracker in kernel\n"
 "  --prev-images-dir DIR path to images from previous dump (relative to -D)\n"
 "  --page-server         send pages to page server (see options below as well)\n"
+"  --mem-dump-workers NUM\n"
+"                        dump pages of up to NUM tasks at once\n"
+"  --parallel-infect NUM\n"
+"                        start parasites in up to NUM tasks ahead of the one\n"
+"                        being dumped\n"
+"  --compress CODEC      compress pages images with CODEC (lz4 or zstd)\n"
+"  --compress-threads NUM\n"
+"                        compress pages using NUM threads\n"
+"  --dedup-pages         don't write zero pages and pages with the same contents\n"
+"                        as already written ones\n"
+"  --direct-io           write and read pages images bypassing the page cache\n"
+"  --compact-pagemaps    write pagemaps as fixed size records, not protobuf\n"
+"  --skip-smaps          read tasks' mappings from maps, not from smaps, losing\n"
+"                        their madvise hints\n"
+"  --archive             put all images into one archive file\n"
+"  --stream-fd FD        write images to (on dump) or read them from (on\n"
+"                        restore) the pipe or socket FD\n"
 "  --auto-dedup          when used on dump it will deduplicate \"old\" data in\n"
 "                        pages images of previous dump\n"
 "                        when used on restore, as soon as page is restored, it\n"
 "                        will be punched from the image\n"
+"  --lazy-pages          restore anonymous memory on demand, the pages are\n"
+"                        served by the \"criu lazy-pages\" daemon\n"
+"  --io-uring            read pages on restore with io_uring, needs --direct-io\n"
+"  --prefetch-threads NUM\n"
+"                        prefetch pages images of all tasks on restore with\n"
+"                        NUM threads\n"
+"  --iterative           pre-dump memory in several passes before the dump\n"
+"                        until tasks are expected to be frozen for less than\n"
+"                        --iter-freeze-target or the memory stops converging\n"
+"  --iter-freeze-target MS\n"
+"                        target frozen time for --iterative (default 100 ms)\n"
+"  --iter-max-passes NUM\n"
+"                        do at most NUM pre-dump passes (default 8)\n"
 "\n"
 "Page/Service server options:\n"
 "  --address ADDR        address of server or service\n"
 "  --port PORT           port of page server\n"
+"  --ps-connections NUM  stripe pages across NUM connections to page server,\n"
+"                        should be the same for dump and page-server\n"
 "  -d|--daemon           run in the background after creating socket\n"
 "  --status-fd FD        write \\0 to the FD and close it once process is ready\n"
 "                        to handle requests\n"
@@ -1801,7 +1801,7 @@ static struct collect_image_info reg_file_cinfo = {
 	.pb_type = PB_REG_FILE,
 	.priv_size = sizeof(struct reg_file_info),
 	.collect = collect_one_regfile,
-	.flags = COLLECT_SHARED,
+	.flags = COLLECT_SHARED | COLLECT_ARENA,
 };
 
 int collect_remaps_and_regfiles(void)
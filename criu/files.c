@@ -11,6 +11,7 @@
 #include <sys/stat.h>
 #include <sys/socket.h>
 #include <sys/un.h>
+#include <sys/time.h>
 #include <stdlib.h>
 
 #include "types.h"
@@ -43,6 +44,7 @@
 #include "autofs.h"
 #include "parasite.h"
 #include "parasite-syscall.h"
+#include "stats.h"
 
 #include "protobuf.h"
 #include "util.h"
@@ -782,6 +784,7 @@ int prepare_fd_pid(struct pstree_item *item)
 	struct cr_img *img;
 	pid_t pid = vpid(item);
 	struct rst_info *rst_info = rsti(item);
+	struct pb_arena *arena;
 
 	INIT_LIST_HEAD(&rst_info->fds);
 
@@ -791,6 +794,10 @@ int prepare_fd_pid(struct pstree_item *item)
 	if (rsti(item)->fdt && rsti(item)->fdt->pid != vpid(item))
 		return 0;
 
+	arena = pb_collect_arena();
+	if (!arena)
+		return -1;
+
 	img = open_image(CR_FD_FDINFO, O_RSTR, item->ids->files_id);
 	if (!img)
 		return -1;
@@ -798,7 +805,7 @@ int prepare_fd_pid(struct pstree_item *item)
 	while (1) {
 		FdinfoEntry *e;
 
-		ret = pb_read_one_eof(img, &e, PB_FDINFO);
+		ret = pb_read_one_eof_arena(img, &e, PB_FDINFO, arena);
 		if (ret <= 0)
 			break;
 
@@ -809,10 +816,8 @@ int prepare_fd_pid(struct pstree_item *item)
 		}
 
 		ret = collect_fd(pid, e, rst_info);
-		if (ret < 0) {
-			fdinfo_entry__free_unpacked(e, NULL);
+		if (ret < 0)
 			break;
-		}
 	}
 
 	close_image(img);
@@ -883,30 +888,63 @@ static int plant_fd(struct fdinfo_list_entry *fle, int fd)
 	return reopen_fd_as(fle->fe->fd, fd);
 }
 
+/*
+ * A message can bring several fds, some of them can already sit
+ * on the numbers the others are to be planted to, so move those
+ * out of the way first.
+ */
+static int plant_fds(struct fdinfo_list_entry **fles, int *fds, int nr)
+{
+	int i, j;
+
+	for (i = 0; i < nr; i++) {
+		pr_info("Further fle=%p, pid=%d\n", fles[i], fles[i]->pid);
+		if (!task_fle(current, fles[i])) {
+			pr_err("Unexpected fle %p, pid=%d\n", fles[i], vpid(current));
+			goto err;
+		}
+
+		for (j = i + 1; j < nr; j++)
+			if (move_fd_from(&fds[j], fles[i]->fe->fd))
+				goto err;
+
+		if (plant_fd(fles[i], fds[i]))
+			goto err;
+	}
+
+	return 0;
+err:
+	for (i++; i < nr; i++)
+		close(fds[i]);
+	return -1;
+}
+
 static int recv_fd_from_peer(struct fdinfo_list_entry *fle)
 {
-	struct fdinfo_list_entry *tmp;
-	int fd, ret, tsock;
+	struct fdinfo_list_entry *fles[CR_SCM_MAX_FD];
+	int fds[CR_SCM_MAX_FD];
+	int i, nr, tsock;
+	bool found = false;
 
 	if (fle->received)
 		return 0;
 
 	tsock = get_service_fd(TRANSPORT_FD_OFF);
 	do {
-		ret = __recv_fds(tsock, &fd, 1, (void *)&tmp, sizeof(struct fdinfo_list_entry *), MSG_DONTWAIT);
-		if (ret == -EAGAIN || ret == -EWOULDBLOCK)
+		nr = __recv_fds_msg(tsock, fds, CR_SCM_MAX_FD, (void *)fles,
+				sizeof(struct fdinfo_list_entry *), MSG_DONTWAIT);
+		if (nr == -EAGAIN || nr == -EWOULDBLOCK)
 			return 1;
-		else if (ret)
+		else if (nr < 0)
 			return -1;
 
-		pr_info("Further fle=%p, pid=%d\n", tmp, fle->pid);
-		if (!task_fle(current, tmp)) {
-			pr_err("Unexpected fle %p, pid=%d\n", tmp, vpid(current));
-			return -1;
-		}
-		if (plant_fd(tmp, fd))
+		for (i = 0; i < nr; i++)
+			if (fles[i] == fle)
+				found = true;
+
+		if (plant_fds(fles, fds, nr))
 			return -1;
-	} while (tmp != fle);
+	} while (!found);
 
 	return 0;
 }
@@ -926,6 +964,93 @@ static int send_fd_to_peer(int fd, struct fdinfo_list_entry *fle)
 	return set_fds_event(fle->pid);
 }
 
+/*
+ * Fds served out to peers are sent in batches, one message per
+ * peer with up to CR_SCM_MAX_FD fds in it, rather than one message
+ * (and one wakeup) per fd. The fds served out are the ones already
+ * put on their places in the fd table and stay there, so they can
+ * be sent later. The batches are flushed before the task goes to
+ * sleep waiting for fds from others and when it's done with fds.
+ */
+struct fds_batch {
+	struct list_head		l;
+	pid_t				pid;
+	int				nr;
+	int				fds[CR_SCM_MAX_FD];
+	struct fdinfo_list_entry	*fles[CR_SCM_MAX_FD];
+};
+
+static LIST_HEAD(fds_batches);
+
+static int flush_fds_batch(struct fds_batch *b)
+{
+	struct sockaddr_un saddr;
+	int len, sock, ret;
+
+	if (!b->nr)
+		return 0;
+
+	sock = get_service_fd(TRANSPORT_FD_OFF);
+
+	transport_name_gen(&saddr, &len, b->pid);
+	pr_info("\t\tSend %d fds to %s\n", b->nr, saddr.sun_path + 1);
+	ret = send_fds(sock, &saddr, len, b->fds, b->nr, (void *)b->fles,
+			sizeof(struct fdinfo_list_entry *));
+	if (ret < 0)
+		return -1;
+
+	b->nr = 0;
+	return set_fds_event(b->pid);
+}
+
+static int flush_fds_batches(void)
+{
+	struct fds_batch *b;
+
+	list_for_each_entry(b, &fds_batches, l)
+		if (flush_fds_batch(b))
+			return -1;
+
+	return 0;
+}
+
+static void free_fds_batches(void)
+{
+	struct fds_batch *b, *tmp;
+
+	list_for_each_entry_safe(b, tmp, &fds_batches, l) {
+		list_del(&b->l);
+		xfree(b);
+	}
+}
+
+static int queue_fd_to_peer(int fd, struct fdinfo_list_entry *fle)
+{
+	struct fds_batch *b;
+
+	list_for_each_entry(b, &fds_batches, l)
+		if (b->pid == fle->pid)
+			goto found;
+
+	b = xmalloc(sizeof(*b));
+	if (!b)
+		return -1;
+	INIT_LIST_HEAD(&b->l);
+	b->pid = fle->pid;
+	b->nr = 0;
+found:
+	/* Peers get fds in bunches, keep the last one at hand */
+	list_move(&b->l, &fds_batches);
+
+	pr_info("\t\tQueue fd %d to %d\n", fd, fle->pid);
+	b->fds[b->nr] = fd;
+	b->fles[b->nr] = fle;
+	if (++b->nr == CR_SCM_MAX_FD)
+		return flush_fds_batch(b);
+
+	return 0;
+}
+
 /*
  * Helpers to scatter file_desc across users for those files, that
  * create two descriptors from a single system call at once (e.g.
@@ -985,7 +1110,7 @@ static int serve_out_fd(int pid, int fd, struct file_desc *d)
 		if (pid == fle->pid)
 			ret = send_fd_to_self(fd, fle);
 		else
-			ret = send_fd_to_peer(fd, fle);
+			ret = queue_fd_to_peer(fd, fle);
 
 		if (ret) {
 			pr_err("Can't sent fd %d to %d\n", fd, fle->pid);
@@ -1099,9 +1224,13 @@ static int open_fdinfos(struct pstree_item *me)
 		clear_fds_event();
 
 		list_for_each_entry_safe(fle, tmp, list, ps_list) {
+			struct timeval start;
+
 			st = fle->stage;
 			BUG_ON(st == FLE_RESTORED);
+			gettimeofday(&start, NULL);
 			ret = open_fd(fle);
+			fd_timing_add(fle->desc->ops->type, &start, ret == 0);
 			if (ret == -1)
 				goto splice;
 			if (st != fle->stage || ret == 0)
@@ -1118,12 +1247,18 @@ static int open_fdinfos(struct pstree_item *me)
 			if (ret == 1)
 			       again = true;
 		}
-		if (!progress && again)
+		if (!progress && again) {
+			ret = flush_fds_batches();
+			if (ret)
+				goto splice;
 			wait_fds_event();
+		}
 	} while (again || progress);
 
 	BUG_ON(!list_empty(list));
+	ret = flush_fds_batches();
 splice:
+	free_fds_batches();
 	list_splice(&completed, list);
 
 	return ret;
@@ -0,0 +1,1162 @@
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/falloc.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#include "common/list.h"
+#include "common/err.h"
+#include "crtools.h"
+#include "cr_options.h"
+#include "image.h"
+#include "image-archive.h"
+#include "magic.h"
+#include "page.h"
+#include "servicefd.h"
+#include "string.h"
+#include "util.h"
+#include "xmalloc.h"
+#include "log.h"
+
+#undef	LOG_PREFIX
+#define LOG_PREFIX "archive: "
+
+/*
+ * With --archive the dump puts all the images into one IMG_ARCHIVE
+ * file instead of a file per image, so that dumping and restoring
+ * a lot of small images costs no fs metadata ops.
+ *
+ * The archive is the head, then images data, then the index of
+ * img_archive_entry-s, each naming an image by its file name. The
+ * head points to the index and is written last, when the dump is
+ * over (img_archive_fini), so a half-written archive is detected.
+ *
+ * On dump each image is written into a memfd and is appended to the
+ * archive when closed, raw images (tar-s, etc.) at page aligned
+ * offsets. Pages images are too big to be staged in memory, so
+ * they are written right into the archive, into the page aligned
+ * room reserved at its end when the image is opened. The room is
+ * grown as pages are written (archive_reserve), in place if it's
+ * still at the end, otherwise the image is moved to the new end
+ * and its old room is punched. Mem dump workers write into the
+ * same archive, so appending and reserving are serialized with a
+ * POSIX lock on it.
+ *
+ * On read the archive is mmap-ed and the buffered images are read
+ * right from the mapping, pages images are read from the archive
+ * file at their offset (see img_raw_off), so splice and preadv work
+ * on them as on regular pages images. Other raw images are given to
+ * their readers (tar, ip tool, etc.) in a memfd copy. No fds are
+ * kept open, restore closes all but service fds in the tasks.
+ *
+ * Images that are not in the archive are looked for as files.
+ *
+ * With --stream-fd the dump sends the same images into the given
+ * fd (pipe or socket) as img_stream_rec-s instead, so that the dump
+ * can be piped to compression, transfer and restore. Images are
+ * staged in memfds as for the archive, but raw ones are sent in
+ * STREAM_CHUNK_SIZE chunks as they are written, so the dump keeps
+ * at most a chunk per pages image in memory while the tasks are
+ * frozen.
+ *
+ * The restore reads the records one by one as they come and puts
+ * the chunks into the spool file laid out as the archive, each
+ * image into its own room grown as with the archive dump. Restore
+ * can't start before the dump ends, the pstree and the inventory
+ * are the last images sent, and the tasks read their pages in
+ * pstree order, not in the order the dump sent them. So every
+ * record arrives before it's needed and is spooled, the spool is
+ * an unlinked file in the images dir (a memfd if the fs can't do
+ * that). It is kept in the IMG_STREAM_OFF service fd and images
+ * are opened from there. Pages are punched from it once restored
+ * (as with --auto-dedup).
+ */
+
+struct img_archive {
+	dev_t				dev;
+	ino_t				ino;
+	void				*map;	/* NULL if there's no archive */
+	size_t				size;
+	struct img_archive_entry	*ents;
+	u32				nr_ents;
+	struct list_head		l;
+};
+
+static LIST_HEAD(archives);
+static struct img_archive *streamed;
+
+static struct {
+	int	fd;
+	int	ifd;		/* index entries */
+	pid_t	owner;
+	bool	stream;
+	bool	finished;
+	dev_t	dev;
+	ino_t	ino;
+} aw = { .fd = -1, .ifd = -1, };
+
+static int dir_stat(int dfd, struct stat *st)
+{
+	if (fstat(dfd, st)) {
+		pr_perror("Can't stat images dir");
+		return -1;
+	}
+
+	return 0;
+}
+
+static int img_archive_memfd(const char *name)
+{
+	int fd;
+
+	fd = syscall(SYS_memfd_create, name, 0);
+	if (fd < 0)
+		pr_perror("Can't create memfd for %s", name);
+
+	return fd;
+}
+
+static int entry_cmp(const void *a, const void *b)
+{
+	const struct img_archive_entry *ea = a, *eb = b;
+
+	return strncmp(ea->name, eb->name, IMG_ARCHIVE_NAME_LEN);
+}
+
+static int load_archive(struct img_archive *a, int fd)
+{
+	struct img_archive_head *h;
+	struct stat st;
+	u32 i;
+
+	if (fstat(fd, &st)) {
+		pr_perror("Can't stat images archive");
+		return -1;
+	}
+
+	if (st.st_size < sizeof(*h)) {
+		pr_err("Images archive is truncated\n");
+		return -1;
+	}
+
+	/* Writable to sort the index and parse images in place */
+	a->size = st.st_size;
+	a->map = mmap(NULL, a->size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	if (a->map == MAP_FAILED) {
+		pr_perror("Can't map images archive");
+		a->map = NULL;
+		return -1;
+	}
+
+	h = a->map;
+	if (h->magic != IMG_ARCHIVE_MAGIC) {
+		pr_err("Images archive magic doesn't match\n");
+		goto err;
+	}
+
+	if (!h->index_off) {
+		pr_err("Images archive is not finished\n");
+		goto err;
+	}
+
+	if (h->index_off + (u64)h->nr_entries * sizeof(*a->ents) > a->size) {
+		pr_err("Images archive index is truncated\n");
+		goto err;
+	}
+
+	a->ents = a->map + h->index_off;
+	a->nr_ents = h->nr_entries;
+
+	for (i = 0; i < a->nr_ents; i++) {
+		struct img_archive_entry *e = &a->ents[i];
+
+		if (e->off + e->size > h->index_off ||
+				e->name[IMG_ARCHIVE_NAME_LEN - 1] != '\0') {
+			pr_err("Images archive entry %u is corrupted\n", i);
+			goto err;
+		}
+	}
+
+	qsort(a->ents, a->nr_ents, sizeof(*a->ents), entry_cmp);
+	pr_info("Loaded images archive with %u images\n", a->nr_ents);
+	return 0;
+
+err:
+	munmap(a->map, a->size);
+	a->map = NULL;
+	return -1;
+}
+
+static struct img_archive *get_archive(int dfd)
+{
+	struct img_archive *a;
+	struct stat st;
+	int fd, ret;
+
+	if (dir_stat(dfd, &st))
+		return NULL;
+
+	list_for_each_entry(a, &archives, l)
+		if (a->dev == st.st_dev && a->ino == st.st_ino)
+			return a;
+
+	a = xzalloc(sizeof(*a));
+	if (!a)
+		return NULL;
+
+	a->dev = st.st_dev;
+	a->ino = st.st_ino;
+	fd = openat(dfd, IMG_ARCHIVE, O_RDONLY);
+	if (fd < 0) {
+		if (errno != ENOENT) {
+			pr_perror("Can't open images archive");
+			xfree(a);
+			return NULL;
+		}
+	} else {
+		ret = load_archive(a, fd);
+		close(fd);
+		if (ret) {
+			xfree(a);
+			return NULL;
+		}
+	}
+
+	list_add(&a->l, &archives);
+	return a;
+}
+
+bool img_archive_present(int dfd)
+{
+	struct img_archive *a;
+
+	a = get_archive(dfd);
+	return a && a->map;
+}
+
+static struct img_archive_entry *find_entry(struct img_archive *a, const char *name)
+{
+	struct img_archive_entry key;
+
+	strlcpy(key.name, name, sizeof(key.name));
+	return bsearch(&key, a->ents, a->nr_ents, sizeof(*a->ents), entry_cmp);
+}
+
+static int copy_to_memfd(struct img_archive *a, struct img_archive_entry *e)
+{
+	u64 done = 0;
+	int fd;
+
+	fd = img_archive_memfd(e->name);
+	if (fd < 0)
+		return -1;
+
+	while (done < e->size) {
+		ssize_t ret;
+
+		ret = write(fd, a->map + e->off + done, e->size - done);
+		if (ret <= 0) {
+			pr_perror("Can't copy archived %s", e->name);
+			close(fd);
+			return -1;
+		}
+		done += ret;
+	}
+
+	if (lseek(fd, 0, SEEK_SET)) {
+		pr_perror("Can't rewind archived %s", e->name);
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+static int open_archive_file(struct img_archive *a, int dfd, unsigned long oflags)
+{
+	int fd;
+
+	/* Own file position for each open, not a dup */
+	if (a == streamed)
+		return __open_proc(PROC_SELF, 0, oflags & O_ACCMODE, "fd/%d",
+				get_service_fd(IMG_STREAM_OFF));
+
+	fd = openat(dfd, IMG_ARCHIVE, O_RDONLY);
+	if (fd < 0)
+		pr_perror("Can't open images archive");
+	return fd;
+}
+
+static int open_archived_image(struct cr_img *img, struct img_archive *a,
+		int dfd, int type, unsigned long oflags, const char *path)
+{
+	struct img_archive_entry *e;
+	int fd;
+
+	e = find_entry(a, path);
+	if (!e)
+		return 0;
+
+	/* Only streamed pages can be punched, the spool is ours */
+	if ((oflags & O_ACCMODE) != O_RDONLY &&
+			!(a == streamed && type == CR_FD_PAGES)) {
+		pr_err("Can't modify archived image %s\n", path);
+		return -1;
+	}
+
+	img->raw_size = e->size;
+
+	if (!(oflags & O_NOBUF)) {
+		bfdopen_mem(&img->_x, a->map + e->off, e->size);
+		return 1;
+	}
+
+	if (type == CR_FD_PAGES) {
+		fd = open_archive_file(a, dfd, oflags);
+		if (fd < 0)
+			return -1;
+		img->raw_off = e->off;
+	} else {
+		fd = copy_to_memfd(a, e);
+		if (fd < 0)
+			return -1;
+	}
+
+	img->_x.fd = fd;
+	bfd_setraw(&img->_x);
+	return 1;
+}
+
+static void drop_writer(void)
+{
+	close_safe(&aw.ifd);
+	close_safe(&aw.fd);
+}
+
+static int open_writer(int dfd)
+{
+	struct img_archive_head h = { .magic = IMG_ARCHIVE_MAGIC, };
+	struct stat st;
+
+	if (aw.stream)
+		return aw.finished ? 0 : 1;
+
+	if (dir_stat(dfd, &st))
+		return -1;
+
+	if (aw.dev == st.st_dev && aw.ino == st.st_ino) {
+		if (aw.finished)
+			return 0;
+		if (aw.fd >= 0)
+			return 1;
+	}
+
+	/* Images dir has changed (iterative dump), start a new archive */
+	drop_writer();
+	aw.finished = false;
+	aw.dev = st.st_dev;
+	aw.ino = st.st_ino;
+	aw.owner = getpid();
+
+	aw.fd = openat(dfd, IMG_ARCHIVE, O_RDWR | O_CREAT | O_TRUNC, CR_FD_PERM);
+	if (aw.fd < 0) {
+		pr_perror("Can't create images archive");
+		return -1;
+	}
+
+	if (write(aw.fd, &h, sizeof(h)) != sizeof(h)) {
+		pr_perror("Can't write images archive head");
+		goto err;
+	}
+
+	aw.ifd = img_archive_memfd("criu-archive-index");
+	if (aw.ifd < 0)
+		goto err;
+
+	return 1;
+
+err:
+	drop_writer();
+	return -1;
+}
+
+static int send_all(int to, int from, off_t off, u64 size)
+{
+	off_t end = off + size;
+
+	while (off < end) {
+		ssize_t ret;
+
+		ret = sendfile(to, from, &off, end - off);
+		if (ret <= 0) {
+			pr_perror("Can't put data into images archive");
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+static int lock_writer(int type)
+{
+	struct flock fl = {
+		.l_type		= type,
+		.l_whence	= SEEK_SET,
+	};
+
+	/*
+	 * Not flock, mem dump workers share the archive file (and
+	 * the index) with us. Stream can be a pipe, so the lock is
+	 * on the index.
+	 */
+	if (fcntl(aw.ifd, F_SETLKW, &fl)) {
+		pr_perror("Can't lock images archive");
+		return -1;
+	}
+
+	return 0;
+}
+
+#define ARCHIVE_ROOM_SIZE	(64 << 20)
+
+/* Called with the writer locked, returns where the room starts */
+static off_t reserve_room(u64 size)
+{
+	struct stat st;
+	off_t off;
+
+	if (fstat(aw.fd, &st)) {
+		pr_perror("Can't stat images archive");
+		return -1;
+	}
+
+	off = round_up(st.st_size, PAGE_SIZE);
+	if (ftruncate(aw.fd, off + size)) {
+		pr_perror("Can't reserve %"PRIu64" bytes in images archive", size);
+		return -1;
+	}
+
+	return off;
+}
+
+static int open_room(struct cr_img *img, int dfd)
+{
+	off_t off;
+	int fd;
+
+	/* Own file position, aw.fd is shared with mem dump workers */
+	fd = openat(dfd, IMG_ARCHIVE, O_WRONLY);
+	if (fd < 0) {
+		pr_perror("Can't open images archive");
+		return -1;
+	}
+
+	if (lock_writer(F_WRLCK))
+		goto err;
+	off = reserve_room(ARCHIVE_ROOM_SIZE);
+	lock_writer(F_UNLCK);
+	if (off < 0)
+		goto err;
+
+	if (lseek(fd, off, SEEK_SET) != off) {
+		pr_perror("Can't seek images archive");
+		goto err;
+	}
+
+	img->raw_off = off;
+	img->stage_end = off + ARCHIVE_ROOM_SIZE;
+	return fd;
+
+err:
+	close(fd);
+	return -1;
+}
+
+static int grow_room(struct cr_img *img, off_t pos, size_t len)
+{
+	off_t size = pos - img->raw_off, room, off;
+	struct stat st;
+	int ret = -1;
+
+	room = max_t(off_t, 2 * (img->stage_end - img->raw_off), size + len);
+	room = round_up(room, PAGE_SIZE);
+
+	if (lock_writer(F_WRLCK))
+		return -1;
+
+	if (fstat(aw.fd, &st)) {
+		pr_perror("Can't stat images archive");
+		goto unlock;
+	}
+
+	if (st.st_size == img->stage_end) {
+		if (ftruncate(aw.fd, img->raw_off + room)) {
+			pr_perror("Can't grow %s in images archive", img->stage_name);
+			goto unlock;
+		}
+		img->stage_end = img->raw_off + room;
+		ret = 0;
+		goto unlock;
+	}
+
+	/* Something is put after the image, move it to the end */
+	off = reserve_room(room);
+	if (off < 0)
+		goto unlock;
+
+	if (lseek(img->stage_fd, off, SEEK_SET) != off) {
+		pr_perror("Can't seek images archive");
+		goto unlock;
+	}
+
+	if (send_all(img->stage_fd, aw.fd, img->raw_off, size))
+		goto unlock;
+
+	/* Not fatal, the archive just takes more space */
+	if (fallocate(aw.fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+				img->raw_off, size))
+		pr_warn("Can't punch moved %s: %m\n", img->stage_name);
+
+	pr_debug("Moved %s %"PRIu64" bytes from %"PRIx64" to %"PRIx64"\n",
+			img->stage_name, (u64)size, (u64)img->raw_off, (u64)off);
+	img->raw_off = off;
+	img->stage_end = off + room;
+	ret = 0;
+unlock:
+	lock_writer(F_UNLCK);
+	return ret;
+}
+
+static int stream_image(struct img_archive_entry *e, int fd, u32 flags)
+{
+	struct img_stream_rec r = { .size = e->size, .flags = flags, };
+
+	strlcpy(r.name, e->name, sizeof(r.name));
+	if (write(aw.fd, &r, sizeof(r)) != sizeof(r)) {
+		pr_perror("Can't write %s into images stream", r.name);
+		return -1;
+	}
+
+	if (send_all(aw.fd, fd, 0, e->size))
+		return -1;
+
+	pr_debug("Streamed %s %"PRIu64" bytes\n", e->name, e->size);
+	return 0;
+}
+
+#define STREAM_CHUNK_SIZE	(4 << 20)
+
+/*
+ * Raw images are streamed in chunks as they are written, so that
+ * the dump keeps at most a chunk of each one in memory.
+ */
+static int stream_chunk(struct cr_img *img, size_t len)
+{
+	struct img_archive_entry e = {};
+	off_t size;
+	int ret;
+
+	if (bfd_buffered(&img->_x))
+		return 0;
+
+	size = lseek(img->stage_fd, 0, SEEK_CUR);
+	if (size < 0) {
+		pr_perror("Can't get %s position", img->stage_name);
+		return -1;
+	}
+
+	if (!size || size + len <= STREAM_CHUNK_SIZE)
+		return 0;
+
+	e.size = size;
+	strlcpy(e.name, img->stage_name, sizeof(e.name));
+
+	if (lock_writer(F_WRLCK))
+		return -1;
+	ret = stream_image(&e, img->stage_fd, IMG_STREAM_MORE);
+	lock_writer(F_UNLCK);
+	if (ret)
+		return -1;
+
+	/* The memfd is shared with the image fd, so it's rewound too */
+	if (ftruncate(img->stage_fd, 0) || lseek(img->stage_fd, 0, SEEK_SET)) {
+		pr_perror("Can't reset %s memfd", e.name);
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Makes sure @len more bytes written into the image at its file
+ * position fit the room reserved for it in the archive, or sends
+ * what's written so far into the stream.
+ */
+int archive_reserve(struct cr_img *img, size_t len)
+{
+	off_t pos;
+
+	if (aw.stream)
+		return stream_chunk(img, len);
+
+	if (img->stage_end < 0)
+		return 0;
+
+	pos = lseek(img->stage_fd, 0, SEEK_CUR);
+	if (pos < 0) {
+		pr_perror("Can't get %s position", img->stage_name);
+		return -1;
+	}
+
+	if (pos + len <= img->stage_end)
+		return 0;
+
+	return grow_room(img, pos, len);
+}
+
+static int stage_image(struct cr_img *img, int dfd, int type,
+		unsigned long oflags, const char *path)
+{
+	int ret, fd;
+
+	ret = open_writer(dfd);
+	if (ret <= 0)
+		return ret;
+
+	if (strlen(path) >= IMG_ARCHIVE_NAME_LEN) {
+		pr_err("Image name %s is too long to archive\n", path);
+		return -1;
+	}
+
+	if (type == CR_FD_PAGES && !aw.stream)
+		fd = open_room(img, dfd);
+	else
+		fd = img_archive_memfd(path);
+	if (fd < 0)
+		return -1;
+
+	img->stage_fd = dup(fd);
+	if (img->stage_fd < 0) {
+		pr_perror("Can't dup %s memfd", path);
+		close(fd);
+		return -1;
+	}
+
+	img->stage_name = xstrdup(path);
+	if (!img->stage_name) {
+		close(fd);
+		goto err;
+	}
+
+	img->_x.fd = fd;
+	if (oflags & O_NOBUF)
+		bfd_setraw(&img->_x);
+	else if (bfdopenw(&img->_x))
+		goto err;
+
+	return 1;
+
+err:
+	close_safe(&img->stage_fd);
+	xfree(img->stage_name);
+	img->stage_name = NULL;
+	img->stage_end = -1;
+	return -1;
+}
+
+int archive_open_image(struct cr_img *img, int dfd, int type,
+		unsigned long oflags, const char *path)
+{
+	struct img_archive *a;
+	struct stat st;
+
+	if (oflags & O_CREAT) {
+		if (!(opts.img_archive || aw.stream) ||
+				dfd != get_service_fd(IMG_FD_OFF))
+			return 0;
+		return stage_image(img, dfd, type, oflags, path);
+	}
+
+	if (streamed && dfd == get_service_fd(IMG_FD_OFF))
+		return open_archived_image(img, streamed, dfd, type, oflags, path);
+
+	/* Dump doesn't read back what it has archived */
+	if (aw.fd >= 0) {
+		if (dir_stat(dfd, &st))
+			return -1;
+		if (aw.dev == st.st_dev && aw.ino == st.st_ino)
+			return 0;
+	}
+
+	a = get_archive(dfd);
+	if (!a)
+		return -1;
+	if (!a->map)
+		return 0;
+
+	return open_archived_image(img, a, dfd, type, oflags, path);
+}
+
+/* The image written in place only needs the index entry */
+static int close_room(struct cr_img *img, struct img_archive_entry *e)
+{
+	struct stat st;
+	int ret = -1;
+
+	e->off = img->raw_off;
+	e->size = lseek(img->stage_fd, 0, SEEK_CUR) - img->raw_off;
+
+	if (lock_writer(F_WRLCK))
+		return -1;
+
+	if (fstat(aw.fd, &st)) {
+		pr_perror("Can't stat images archive");
+		goto unlock;
+	}
+
+	/* Give the unused room back if it's still at the end */
+	if (st.st_size == img->stage_end &&
+			ftruncate(aw.fd, e->off + e->size)) {
+		pr_perror("Can't trim images archive");
+		goto unlock;
+	}
+
+	if (write(aw.ifd, e, sizeof(*e)) != sizeof(*e)) {
+		pr_perror("Can't write images archive index");
+		goto unlock;
+	}
+
+	pr_debug("Wrote %s %"PRIu64" bytes at %"PRIx64"\n", e->name, e->size, e->off);
+	ret = 0;
+unlock:
+	lock_writer(F_UNLCK);
+	return ret;
+}
+
+int archive_close_image(struct cr_img *img)
+{
+	struct img_archive_entry e = {};
+	bool raw = !bfd_buffered(&img->_x);
+	off_t end;
+	int ret = -1;
+
+	bclose(&img->_x);
+
+	if (aw.fd < 0) {
+		pr_err("Images archive is closed, %s is lost\n", img->stage_name);
+		goto out;
+	}
+
+	strlcpy(e.name, img->stage_name, sizeof(e.name));
+	if (img->stage_end >= 0) {
+		ret = close_room(img, &e);
+		goto out;
+	}
+
+	e.size = lseek(img->stage_fd, 0, SEEK_END);
+
+	if (lock_writer(F_WRLCK))
+		goto out;
+
+	if (aw.stream) {
+		ret = stream_image(&e, img->stage_fd, 0);
+		goto unlock;
+	}
+
+	end = lseek(aw.fd, 0, SEEK_END);
+	e.off = raw ? round_up(end, PAGE_SIZE) : round_up(end, sizeof(u64));
+
+	if (lseek(aw.fd, e.off, SEEK_SET) != e.off) {
+		pr_perror("Can't seek images archive");
+		goto unlock;
+	}
+
+	if (send_all(aw.fd, img->stage_fd, 0, e.size))
+		goto unlock;
+
+	if (write(aw.ifd, &e, sizeof(e)) != sizeof(e)) {
+		pr_perror("Can't write images archive index");
+		goto unlock;
+	}
+
+	pr_debug("Put %s %"PRIu64" bytes at %"PRIx64"\n", e.name, e.size, e.off);
+	ret = 0;
+unlock:
+	lock_writer(F_UNLCK);
+out:
+	close_safe(&img->stage_fd);
+	xfree(img->stage_name);
+	return ret;
+}
+
+static int img_stream_fini(void)
+{
+	struct img_stream_rec r = { };
+	int ret = 0;
+
+	if (write(aw.fd, &r, sizeof(r)) != sizeof(r)) {
+		pr_perror("Can't end images stream");
+		ret = -1;
+	}
+
+	drop_writer();
+	aw.finished = true;
+	return ret;
+}
+
+/*
+ * Writes the index and the head. Images written after that go
+ * to files.
+ */
+int img_archive_fini(void)
+{
+	struct img_archive_head h = { .magic = IMG_ARCHIVE_MAGIC, };
+	off_t isize;
+	int ret = -1;
+
+	if (aw.fd < 0 || aw.owner != getpid())
+		return 0;
+
+	if (aw.stream)
+		return img_stream_fini();
+
+	isize = lseek(aw.ifd, 0, SEEK_END);
+	h.nr_entries = isize / sizeof(struct img_archive_entry);
+	h.index_off = round_up(lseek(aw.fd, 0, SEEK_END), sizeof(u64));
+
+	if (lseek(aw.fd, h.index_off, SEEK_SET) != h.index_off) {
+		pr_perror("Can't seek images archive");
+		goto out;
+	}
+
+	if (send_all(aw.fd, aw.ifd, 0, isize))
+		goto out;
+
+	if (pwrite(aw.fd, &h, sizeof(h), 0) != sizeof(h)) {
+		pr_perror("Can't write images archive head");
+		goto out;
+	}
+
+	pr_info("Archived %u images\n", h.nr_entries);
+	ret = 0;
+out:
+	drop_writer();
+	aw.finished = true;
+	return ret;
+}
+
+int img_stream_dump(int fd)
+{
+	u32 magic = IMG_STREAM_MAGIC;
+
+	aw.fd = dup(fd);
+	if (aw.fd < 0) {
+		pr_perror("Can't dup stream fd");
+		return -1;
+	}
+
+	aw.ifd = img_archive_memfd("criu-stream-lock");
+	if (aw.ifd < 0)
+		goto err;
+
+	if (write(aw.fd, &magic, sizeof(magic)) != sizeof(magic)) {
+		pr_perror("Can't write images stream magic");
+		goto err;
+	}
+
+	aw.stream = true;
+	aw.owner = getpid();
+	return 0;
+
+err:
+	drop_writer();
+	return -1;
+}
+
+static int read_stream(int fd, void *buf, size_t size)
+{
+	size_t done = 0;
+
+	while (done < size) {
+		ssize_t ret;
+
+		ret = read(fd, buf + done, size - done);
+		if (ret <= 0) {
+			if (ret == 0)
+				pr_err("Images stream is truncated\n");
+			else
+				pr_perror("Can't read images stream");
+			return -1;
+		}
+		done += ret;
+	}
+
+	return 0;
+}
+
+#define STREAM_BUF_SIZE		(256 * PAGE_SIZE)
+#define STREAM_ROOM_SIZE	(64 << 20)
+
+/* Image which chunks are still coming */
+struct stream_img {
+	u32			ent;	/* in the spool archive ents */
+	off_t			end;	/* of the room reserved for it */
+	struct list_head	l;
+};
+
+struct stream_spool {
+	int			fd;
+	off_t			end;	/* rooms included */
+	void			*buf;
+	struct img_archive	*a;
+	struct list_head	open;
+};
+
+static int open_spool(void)
+{
+	int fd;
+
+	fd = openat(get_service_fd(IMG_FD_OFF), ".", O_TMPFILE | O_RDWR, CR_FD_PERM);
+	if (fd >= 0)
+		return fd;
+
+	pr_warn("Can't spool images stream in images dir (%m), "
+			"keeping it in memory\n");
+	return img_archive_memfd("criu-stream");
+}
+
+static struct stream_img *find_streamed_image(struct stream_spool *sp,
+		const char *name)
+{
+	struct stream_img *si;
+
+	list_for_each_entry(si, &sp->open, l)
+		if (!strcmp(sp->a->ents[si->ent].name, name))
+			return si;
+
+	return NULL;
+}
+
+static struct stream_img *new_streamed_image(struct stream_spool *sp,
+		struct img_stream_rec *r)
+{
+	struct img_archive *a = sp->a;
+	struct img_archive_entry *e;
+	struct stream_img *si;
+	bool more = r->flags & IMG_STREAM_MORE;
+
+	si = xmalloc(sizeof(*si));
+	if (!si)
+		return NULL;
+
+	e = xrealloc(a->ents, (a->nr_ents + 1) * sizeof(*e));
+	if (!e) {
+		xfree(si);
+		return NULL;
+	}
+	a->ents = e;
+
+	e = &a->ents[a->nr_ents];
+	memcpy(e->name, r->name, sizeof(e->name));
+	e->size = 0;
+	/* Aligned, so that the punched pages are freed */
+	e->off = more || r->size >= PAGE_SIZE ? round_up(sp->end, PAGE_SIZE) :
+			round_up(sp->end, sizeof(u64));
+
+	si->ent = a->nr_ents++;
+	si->end = e->off + (more ? max_t(u64, r->size, STREAM_ROOM_SIZE) : r->size);
+	sp->end = si->end;
+	list_add_tail(&si->l, &sp->open);
+	return si;
+}
+
+static int grow_streamed_image(struct stream_spool *sp, struct stream_img *si,
+		u64 size)
+{
+	struct img_archive_entry *e = &sp->a->ents[si->ent];
+	off_t room, off;
+	u64 done;
+
+	room = max_t(u64, 2 * (si->end - e->off), e->size + size);
+	room = round_up(room, PAGE_SIZE);
+
+	if (si->end == sp->end) {
+		si->end = e->off + room;
+		sp->end = si->end;
+		return 0;
+	}
+
+	/* Other images came after it, move it to the end */
+	off = round_up(sp->end, PAGE_SIZE);
+	for (done = 0; done < e->size; ) {
+		size_t len = min_t(u64, e->size - done, STREAM_BUF_SIZE);
+
+		if (pread(sp->fd, sp->buf, len, e->off + done) != len ||
+				pwrite(sp->fd, sp->buf, len, off + done) != len) {
+			pr_perror("Can't move streamed %s", e->name);
+			return -1;
+		}
+		done += len;
+	}
+
+	/* Not fatal, the spool just takes more space */
+	if (e->size && fallocate(sp->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+				e->off, e->size))
+		pr_warn("Can't punch moved %s: %m\n", e->name);
+
+	e->off = off;
+	si->end = off + room;
+	sp->end = si->end;
+	return 0;
+}
+
+static int read_stream_rec(int fd, struct stream_spool *sp)
+{
+	struct img_archive_entry *e;
+	struct img_stream_rec r;
+	struct stream_img *si;
+	off_t off;
+	u64 left;
+
+	if (read_stream(fd, &r, sizeof(r)))
+		return -1;
+	if (!r.name[0])
+		return 0;
+	if (r.name[IMG_ARCHIVE_NAME_LEN - 1] != '\0' ||
+			(r.flags & ~IMG_STREAM_MORE)) {
+		pr_err("Images stream is corrupted\n");
+		return -1;
+	}
+
+	si = find_streamed_image(sp, r.name);
+	if (!si) {
+		si = new_streamed_image(sp, &r);
+		if (!si)
+			return -1;
+	}
+
+	e = &sp->a->ents[si->ent];
+	if (e->off + e->size + r.size > si->end &&
+			grow_streamed_image(sp, si, r.size))
+		return -1;
+
+	off = e->off + e->size;
+	for (left = r.size; left; ) {
+		size_t chunk = min_t(u64, left, STREAM_BUF_SIZE);
+
+		if (read_stream(fd, sp->buf, chunk))
+			return -1;
+		if (pwrite(sp->fd, sp->buf, chunk, off) != chunk) {
+			pr_perror("Can't spool streamed %s", r.name);
+			return -1;
+		}
+		off += chunk;
+		left -= chunk;
+	}
+	e->size += r.size;
+
+	if (!(r.flags & IMG_STREAM_MORE)) {
+		/* Give the rest of the room back if it's the last one */
+		if (si->end == sp->end)
+			sp->end = e->off + e->size;
+		pr_debug("Got %s %"PRIu64" bytes from stream\n", e->name, e->size);
+		list_del(&si->l);
+		xfree(si);
+	}
+
+	return 1;
+}
+
+/*
+ * Reads the images from the stream for restore, they are then
+ * opened from the service images dir only. See the comment at
+ * the top on why it's all read before restore starts.
+ */
+int img_stream_restore(int fd)
+{
+	struct stream_spool sp = { .fd = -1, };
+	struct stream_img *si, *tmp;
+	struct img_archive *a;
+	u32 magic, i;
+	int ret;
+
+	INIT_LIST_HEAD(&sp.open);
+
+	if (read_stream(fd, &magic, sizeof(magic)))
+		return -1;
+	if (magic != IMG_STREAM_MAGIC) {
+		pr_err("Images stream magic doesn't match\n");
+		return -1;
+	}
+
+	sp.fd = open_spool();
+	if (sp.fd < 0)
+		return -1;
+
+	a = sp.a = xzalloc(sizeof(*a));
+	sp.buf = xmalloc(STREAM_BUF_SIZE);
+	if (!a || !sp.buf)
+		goto err;
+
+	while ((ret = read_stream_rec(fd, &sp)) > 0)
+		;
+	if (ret < 0)
+		goto err;
+
+	if (!list_empty(&sp.open)) {
+		si = list_first_entry(&sp.open, struct stream_img, l);
+		pr_err("Image %s is truncated in stream\n", a->ents[si->ent].name);
+		goto err;
+	}
+
+	if (!a->nr_ents) {
+		pr_err("No images in stream\n");
+		goto err;
+	}
+
+	qsort(a->ents, a->nr_ents, sizeof(*a->ents), entry_cmp);
+	for (i = 1; i < a->nr_ents; i++)
+		if (!entry_cmp(&a->ents[i - 1], &a->ents[i])) {
+			pr_err("Image %s is streamed twice\n", a->ents[i].name);
+			goto err;
+		}
+
+	a->size = sp.end;
+	if (ftruncate(sp.fd, a->size)) {
+		pr_perror("Can't trim images stream spool");
+		goto err;
+	}
+
+	a->map = mmap(NULL, a->size, PROT_READ | PROT_WRITE, MAP_PRIVATE, sp.fd, 0);
+	if (a->map == MAP_FAILED) {
+		pr_perror("Can't map streamed images");
+		goto err;
+	}
+
+	if (install_service_fd(IMG_STREAM_OFF, sp.fd) < 0) {
+		munmap(a->map, a->size);
+		goto err;
+	}
+	close(sp.fd);
+
+	pr_info("Read %u images (%lu bytes) from stream\n", a->nr_ents,
+			(unsigned long)a->size);
+	xfree(sp.buf);
+	streamed = a;
+	return 0;
+
+err:
+	list_for_each_entry_safe(si, tmp, &sp.open, l)
+		xfree(si);
+	if (a)
+		xfree(a->ents);
+	xfree(a);
+	xfree(sp.buf);
+	close(sp.fd);
+	return -1;
+}
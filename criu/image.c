@@ -4,10 +4,12 @@
 #include <fcntl.h>
 #include <limits.h>
 #include <sys/stat.h>
+#include <sys/file.h>
 #include "crtools.h"
 #include "cr_options.h"
 #include "imgset.h"
 #include "image.h"
+#include "image-archive.h"
 #include "pstree.h"
 #include "stats.h"
 #include "cgroup.h"
@@ -19,6 +21,7 @@
 
 bool ns_per_id = false;
 bool img_common_magic = true;
+bool img_dedup_pages = false;
 TaskKobjIdsEntry *root_ids;
 u32 root_cg_set;
 Lsmtype image_lsm;
@@ -65,6 +68,16 @@ int check_img_inventory(void)
 	else
 		image_lsm = LSMTYPE__NO_LSM;
 
+	img_dedup_pages = he->has_dedup_pages && he->dedup_pages;
+	if (img_dedup_pages && opts.auto_dedup) {
+		/*
+		 * Pages of one task may be referred to by "same-as"
+		 * entries of another, so they can't be punched.
+		 */
+		pr_warn("Pages were deduplicated on dump, auto-dedup is off\n");
+		opts.auto_dedup = false;
+	}
+
 	switch (he->img_version) {
 	case CRTOOLS_IMAGES_V1:
 		/* good old images. OK */
@@ -122,6 +135,10 @@ int prepare_inventory(InventoryEntry *he)
 	he->has_ns_per_id = true;
 	he->has_lsmtype = true;
 	he->lsmtype = host_lsm_type();
+	if (opts.dedup_pages) {
+		he->has_dedup_pages = true;
+		he->dedup_pages = true;
+	}
 
 	crt.i.pid->state = TASK_ALIVE;
 	crt.i.pid->real = getpid();
@@ -247,6 +264,12 @@ struct cr_img *open_image_at(int dfd, int type, unsigned long flags, ...)
 	if (!img)
 		return NULL;
 
+	img->raw_off = 0;
+	img->raw_size = -1;
+	img->stage_fd = -1;
+	img->stage_end = -1;
+	img->stage_name = NULL;
+
 	oflags = flags | imgset_template[type].oflags;
 
 	va_start(args, flags);
@@ -319,6 +342,12 @@ static int do_open_image(struct cr_img *img, int dfd, int type, unsigned long of
 
 	flags = oflags & ~(O_NOBUF | O_SERVICE);
 
+	ret = archive_open_image(img, dfd, type, oflags, path);
+	if (ret < 0)
+		goto err;
+	if (ret > 0)
+		goto opened;
+
 	ret = openat(dfd, path, flags, CR_FD_PERM);
 	if (ret < 0) {
 		if (!(flags & O_CREAT) && (errno == ENOENT)) {
@@ -344,6 +373,7 @@ static int do_open_image(struct cr_img *img, int dfd, int type, unsigned long of
 			goto err;
 	}
 
+opened:
 	if (imgset_template[type].magic == RAW_IMAGE_MAGIC)
 		goto skip_magic;
 
@@ -388,7 +418,9 @@ void close_image(struct cr_img *img)
 		 */
 		unlinkat(get_service_fd(IMG_FD_OFF), img->path, 0);
 		xfree(img->path);
-	} else if (!empty_image(img))
+	} else if (img->stage_fd >= 0)
+		archive_close_image(img);
+	else if (!empty_image(img))
 		bclose(&img->_x);
 
 	xfree(img);
@@ -402,11 +434,36 @@ struct cr_img *img_from_fd(int fd)
 	if (img) {
 		img->_x.fd = fd;
 		bfd_setraw(&img->_x);
+		img->raw_off = 0;
+		img->raw_size = -1;
+		img->stage_fd = -1;
+		img->stage_end = -1;
+		img->stage_name = NULL;
 	}
 
 	return img;
 }
 
+static int link_parent_images(int dfd)
+{
+	int ret;
+
+	if (!opts.img_parent)
+		return 0;
+
+	ret = symlinkat(opts.img_parent, dfd, CR_PARENT_LINK);
+	if (ret < 0 && errno != EEXIST) {
+		pr_perror("Can't link parent snapshot");
+		return -1;
+	}
+
+	if (opts.img_parent[0] == '/')
+		pr_warn("Absolute paths for parent links "
+				"may not work on restore!\n");
+
+	return 0;
+}
+
 int open_image_dir(char *dir)
 {
 	int fd, ret;
@@ -421,17 +478,8 @@ int open_image_dir(char *dir)
 	close(fd);
 	fd = ret;
 
-	if (opts.img_parent) {
-		ret = symlinkat(opts.img_parent, fd, CR_PARENT_LINK);
-		if (ret < 0 && errno != EEXIST) {
-			pr_perror("Can't link parent snapshot");
-			goto err;
-		}
-
-		if (opts.img_parent[0] == '/')
-			pr_warn("Absolute paths for parent links "
-					"may not work on restore!\n");
-	}
+	if (link_parent_images(fd))
+		goto err;
 
 	return 0;
 
@@ -440,12 +488,101 @@ err:
 	return -1;
 }
 
+/* The pass which images dir is now in IMG_FD_OFF */
+static int iter_image_pass;
+
+/*
+ * The iterative dump puts images of pre-dump passes into the
+ * ITER_IMAGE_DIR subdirs of the images dir, each pass linked to
+ * the previous one, and the final dump into the images dir itself,
+ * linked to the last pass. Both, the dump and the page server,
+ * move between these dirs with this call, the @pass is 0 for
+ * the final dump and @parent is 0 for the first pass.
+ */
+int open_iter_image_dir(int pass, int parent)
+{
+	static char parent_path[32];
+	char path[32];
+	int dfd, fd, ret;
+
+	dfd = get_service_fd(IMG_FD_OFF);
+
+	/* Paths are relative to the current images dir */
+	if (pass)
+		snprintf(path, sizeof(path), "%s" ITER_IMAGE_DIR,
+				iter_image_pass ? "../" : "", pass);
+	else
+		snprintf(path, sizeof(path), "%s", iter_image_pass ? ".." : ".");
+
+	if (pass && mkdirat(dfd, path, 0700) && errno != EEXIST) {
+		pr_perror("Can't create %s images dir", path);
+		return -1;
+	}
+
+	fd = openat(dfd, path, O_RDONLY | O_DIRECTORY);
+	if (fd < 0) {
+		pr_perror("Can't open %s images dir", path);
+		return -1;
+	}
+
+	ret = install_service_fd(IMG_FD_OFF, fd);
+	close(fd);
+	if (ret < 0)
+		return -1;
+
+	iter_image_pass = pass;
+
+	/* The parent link is relative to the new images dir */
+	if (parent) {
+		snprintf(parent_path, sizeof(parent_path), "%s" ITER_IMAGE_DIR,
+				pass ? "../" : "", parent);
+		opts.img_parent = parent_path;
+	} else
+		opts.img_parent = NULL;
+
+	return link_parent_images(ret);
+}
+
 void close_image_dir(void)
 {
 	close_service_fd(IMG_FD_OFF);
 }
 
+/*
+ * Images dir lock. Readers of the memory images take it shared
+ * while opening them, criu merge takes it exclusive while swapping
+ * the merged images in, so that nobody sees the pagemap and pages
+ * images or the parent link of different generations.
+ *
+ * The lock is on a fresh open of the dir, as flock() locks are
+ * per open file and the images dir fd is shared with children.
+ */
+int lock_image_dir(int dfd, int how)
+{
+	int fd;
+
+	fd = openat(dfd, ".", O_RDONLY | O_DIRECTORY);
+	if (fd < 0) {
+		pr_perror("Can't open images dir to lock");
+		return -1;
+	}
+
+	if (flock(fd, how)) {
+		pr_perror("Can't lock images dir");
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+void unlock_image_dir(int fd)
+{
+	close(fd);
+}
+
 static unsigned long page_ids = 1;
+static unsigned long page_ids_step = 1;
 
 void up_page_ids_base(void)
 {
@@ -461,17 +598,53 @@ void up_page_ids_base(void)
 	page_ids += 0x10000;
 }
 
-struct cr_img *open_pages_image_at(int dfd, unsigned long flags, struct cr_img *pmi, u32 *id)
+void split_page_ids(int nr, int idx)
+{
+	/*
+	 * Page server processes serving different connections
+	 * write into the same dir, so each one takes every
+	 * nr-th ID starting from its own.
+	 */
+	page_ids += idx;
+	page_ids_step = nr;
+}
+
+/*
+ * Mem dump workers are forked with a copy of page_ids, so the parent
+ * allocates the ids of the pages images they write.
+ */
+u32 alloc_page_id(void)
+{
+	u32 id = page_ids;
+
+	page_ids += page_ids_step;
+	return id;
+}
+
+/*
+ * On dump @compact tells whether the pagemap entries will be written
+ * as pagemap_rec-s and a non-zero @id is the one allocated in advance,
+ * on read both are taken from the head.
+ */
+struct cr_img *open_pages_image_at(int dfd, unsigned long flags, struct cr_img *pmi,
+		u32 *id, bool *compact)
 {
 	if (flags == O_RDONLY || flags == O_RDWR) {
 		PagemapHead *h;
 		if (pb_read_one(pmi, &h, PB_PAGEMAP_HEAD) < 0)
 			return NULL;
 		*id = h->pages_id;
+		*compact = h->has_compact && h->compact;
 		pagemap_head__free_unpacked(h, NULL);
 	} else {
 		PagemapHead h = PAGEMAP_HEAD__INIT;
-		*id = h.pages_id = page_ids++;
+		if (!*id)
+			*id = alloc_page_id();
+		h.pages_id = *id;
+		if (*compact) {
+			h.has_compact = true;
+			h.compact = true;
+		}
 		if (pb_write_one(pmi, &h, PB_PAGEMAP_HEAD) < 0)
 			return NULL;
 	}
@@ -479,9 +652,24 @@ struct cr_img *open_pages_image_at(int dfd, unsigned long flags, struct cr_img *
 	return open_image_at(dfd, CR_FD_PAGES, flags, *id);
 }
 
-struct cr_img *open_pages_image(unsigned long flags, struct cr_img *pmi, u32 *id)
+struct cr_img *open_pages_image(unsigned long flags, struct cr_img *pmi, u32 *id, bool *compact)
 {
-	return open_pages_image_at(get_service_fd(IMG_FD_OFF), flags, pmi, id);
+	return open_pages_image_at(get_service_fd(IMG_FD_OFF), flags, pmi, id, compact);
+}
+
+/*
+ * Raw images written right into the archive need the room for
+ * @size more bytes at the file position, see archive_reserve.
+ */
+int img_reserve(struct cr_img *img, size_t size)
+{
+	if (lazy_image(img) && open_image_lazy(img))
+		return -1;
+
+	if (img->stage_fd < 0)
+		return 0;
+
+	return archive_reserve(img, size);
 }
 
 /*
@@ -494,6 +682,9 @@ int write_img_buf(struct cr_img *img, const void *ptr, int size)
 {
 	int ret;
 
+	if (img_reserve(img, size))
+		return -1;
+
 	ret = bwrite(&img->_x, ptr, size);
 	if (ret == size)
 		return 0;
@@ -577,6 +768,9 @@ off_t img_raw_size(struct cr_img *img)
 {
 	struct stat stat;
 
+	if (img->raw_size >= 0)
+		return img->raw_size;
+
 	if (fstat(img->_x.fd, &stat)) {
 		pr_perror("Failed to get image stats");
 		return -1;
@@ -29,6 +29,7 @@ static inline void bfd_setraw(struct bfd *b)
 
 int bfdopenr(struct bfd *f);
 int bfdopenw(struct bfd *f);
+void bfdopen_mem(struct bfd *f, void *mem, unsigned int size);
 void bclose(struct bfd *f);
 char *breadline(struct bfd *f);
 char *breadchr(struct bfd *f, char c);
@@ -0,0 +1,43 @@
+#ifndef __CR_COMPRESS_H__
+#define __CR_COMPRESS_H__
+
+#include <sys/types.h>
+
+#include "page.h"
+
+/*
+ * Pages are compressed in blocks of that many pages. Each block
+ * gets its own pagemap entry, so that restore can decompress only
+ * the piece it needs.
+ */
+#define COMPRESS_BLOCK_PAGES	16
+#define COMPRESS_BLOCK_SIZE	(COMPRESS_BLOCK_PAGES * PAGE_SIZE)
+
+struct page_codec {
+	const char	*name;
+	int		type;		/* CompressCodec from pagemap.proto */
+
+	/* worst case size of compressed @len bytes */
+	size_t		(*bound)(size_t len);
+	/* both return the resulting size or negative value on error */
+	ssize_t		(*compress)(const void *src, size_t len,
+				    void *dst, size_t dst_len);
+	ssize_t		(*decompress)(const void *src, size_t len,
+				      void *dst, size_t dst_len);
+};
+
+extern struct page_codec *page_codec_lookup(const char *name);
+extern struct page_codec *page_codec_get(int type);
+extern void page_codecs_list(void);
+
+struct compress_block {
+	void		*src;
+	size_t		len;
+	void		*dst;		/* at least codec->bound(len) bytes */
+	ssize_t		clen;		/* compressed size, 0 -- store raw */
+};
+
+extern int compress_blocks(struct page_codec *codec,
+			   struct compress_block *blocks, int nr);
+
+#endif /* __CR_COMPRESS_H__ */
@@ -0,0 +1,10 @@
+#ifndef __CR_CONFIG_H__
+#define __CR_CONFIG_H__
+
+#define CONFIG_HAS_TCP_REPAIR
+
+#define CONFIG_HAS_TCP_REPAIR_WINDOW
+
+#define CONFIG_VDSO
+
+#endif /* __CR_CONFIG_H__ */
@@ -40,6 +40,13 @@ struct cg_root_opt {
 
 #define DEFAULT_TIMEOUT		10
 
+/*
+ * Iterative dump stops pre-dumping when the tasks are expected
+ * to be frozen for less than the target, or after that many passes.
+ */
+#define DEFAULT_ITER_FREEZE_TARGET	100	/* ms */
+#define DEFAULT_ITER_MAX_PASSES		8
+
 struct irmap;
 
 struct irmap_path_opt {
@@ -66,6 +73,7 @@ struct cr_options {
 	int			evasive_devices;
 	int			link_remap_ok;
 	int			log_file_per_pid;
+	int			log_buffered;
 	bool			swrk_restore;
 	char			*output;
 	char			*root;
@@ -80,9 +88,26 @@ struct cr_options {
 	unsigned short		port;
 	char			*addr;
 	int			ps_socket;
+	unsigned int		ps_connections;
 	int			track_mem;
+	unsigned int		mem_dump_workers;
+	unsigned int		parallel_infect;
+	char			*compress;
+	unsigned int		compress_threads;
+	int			dedup_pages;
+	int			direct_io;
+	int			compact_pagemaps;
+	int			skip_smaps;
+	unsigned int		prefetch_threads;
+	int			img_archive;
+	int			stream_fd;
 	char			*img_parent;
 	int			auto_dedup;
+	int			lazy_pages;
+	int			io_uring;
+	int			iterative;
+	unsigned int		iter_freeze_target;	/* ms */
+	unsigned int		iter_max_passes;
 	unsigned int		cpu_cap;
 	int			force_irmap;
 	char			**exec_cmd;
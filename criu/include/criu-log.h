@@ -24,6 +24,7 @@
 
 extern int log_init(const char *output);
 extern void log_fini(void);
+extern void log_flush(void);
 extern int log_init_by_pid(void);
 extern void log_closedir(void);
 extern int log_keep_err(void);
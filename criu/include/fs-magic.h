@@ -53,4 +53,16 @@
 #define AUTOFS_SUPER_MAGIC	0x0187
 #endif
 
+#ifndef SYSFS_MAGIC
+#define SYSFS_MAGIC		0x62656572
+#endif
+
+#ifndef DEBUGFS_MAGIC
+#define DEBUGFS_MAGIC		0x64626720
+#endif
+
+#ifndef HUGETLBFS_MAGIC
+#define HUGETLBFS_MAGIC		0x958458f6
+#endif
+
 #endif /* __CR_FS_MAGIC_H__ */
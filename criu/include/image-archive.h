@@ -0,0 +1,59 @@
+#ifndef __CR_IMAGE_ARCHIVE_H__
+#define __CR_IMAGE_ARCHIVE_H__
+
+#include <stdbool.h>
+
+#include "int.h"
+
+/*
+ * Images archive (dump --archive) is one file in the images dir
+ * that has all the images in it, see image-archive.c
+ */
+#define IMG_ARCHIVE		"images.cra"
+#define IMG_ARCHIVE_NAME_LEN	64
+
+struct img_archive_head {
+	u32	magic;
+	u32	nr_entries;
+	u64	index_off;	/* 0 if the archive is not finished */
+};
+
+struct img_archive_entry {
+	u64	off;
+	u64	size;
+	char	name[IMG_ARCHIVE_NAME_LEN];
+};
+
+/*
+ * Images stream (dump --stream-fd) is the magic followed by the
+ * records each followed by @size bytes of the image data. Big
+ * images are sent in several chunks, all but the last one have
+ * IMG_STREAM_MORE set, chunks of different images can interleave.
+ * The record with empty name ends the stream.
+ */
+#define IMG_STREAM_MORE		(1 << 0)
+
+struct img_stream_rec {
+	u64	size;
+	u32	flags;
+	u32	pad;
+	char	name[IMG_ARCHIVE_NAME_LEN];
+};
+
+struct cr_img;
+
+/*
+ * -1 -- error
+ *  0 -- image is not (to be) archived, go open the file
+ *  1 -- opened from (or staged for) the archive
+ */
+extern int archive_open_image(struct cr_img *img, int dfd, int type,
+		unsigned long oflags, const char *path);
+extern int archive_reserve(struct cr_img *img, size_t len);
+extern int archive_close_image(struct cr_img *img);
+extern bool img_archive_present(int dfd);
+extern int img_archive_fini(void);
+extern int img_stream_dump(int fd);
+extern int img_stream_restore(int fd);
+
+#endif /* __CR_IMAGE_ARCHIVE_H__ */
@@ -65,6 +65,9 @@
  *  	memory map for socket
  *  - AIO ring
  *  	memory area serves AIO buffers
+ *  - THP
+ *  	anon private area (partly) backed with transparent
+ *  	huge pages, restored at a huge page aligned address
  *  - unsupported
  *  	stands for any unknown memory areas, usually means
  *  	we don't know how to work with it and should stop
@@ -88,7 +91,9 @@
 #define VMA_AREA_SOCKET		(1 <<  11)
 #define VMA_AREA_VVAR		(1 <<  12)
 #define VMA_AREA_AIORING	(1 <<  13)
+#define VMA_AREA_THP		(1 <<  14)
 
+#define VMA_LAZY		(1 <<  27)
 #define VMA_CLOSE		(1 <<  28)
 #define VMA_NO_PROT_WRITE	(1 <<  29)
 #define VMA_PREMMAPED		(1 <<  30)
@@ -102,6 +107,7 @@
 
 extern bool ns_per_id;
 extern bool img_common_magic;
+extern bool img_dedup_pages;
 
 #define O_NOBUF		(O_DIRECT)
 #define O_SERVICE	(O_DIRECTORY)
@@ -119,6 +125,14 @@ struct cr_img {
 			char *path;
 		};
 	};
+
+	/* Archived images, see image-archive.c */
+	off_t raw_off;		/* where the raw image starts in fd */
+	off_t raw_size;		/* its size, -1 if up to the fd end */
+	int stage_fd;		/* written image to put into archive */
+	off_t stage_end;	/* end of the room reserved in the archive
+				   for the image written in place, or -1 */
+	char *stage_name;
 };
 
 #define EMPTY_IMG_FD	(-404)
@@ -145,20 +159,33 @@ static inline int img_raw_fd(struct cr_img *img)
 	return img->_x.fd;
 }
 
+static inline off_t img_raw_off(struct cr_img *img)
+{
+	return img->raw_off;
+}
+
 extern off_t img_raw_size(struct cr_img *img);
 
 extern int open_image_dir(char *dir);
 extern void close_image_dir(void);
+extern int lock_image_dir(int dfd, int how);
+extern void unlock_image_dir(int fd);
+
+#define ITER_IMAGE_DIR		"pre-%d"
+extern int open_iter_image_dir(int pass, int parent);
 
 extern struct cr_img *open_image_at(int dfd, int type, unsigned long flags, ...);
 #define open_image(typ, flags, ...) open_image_at(-1, typ, flags, ##__VA_ARGS__)
 extern int open_image_lazy(struct cr_img *img);
-extern struct cr_img *open_pages_image(unsigned long flags, struct cr_img *pmi, u32 *pages_id);
-extern struct cr_img *open_pages_image_at(int dfd, unsigned long flags, struct cr_img *pmi, u32 *pages_id);
+extern struct cr_img *open_pages_image(unsigned long flags, struct cr_img *pmi, u32 *pages_id, bool *compact);
+extern struct cr_img *open_pages_image_at(int dfd, unsigned long flags, struct cr_img *pmi, u32 *pages_id, bool *compact);
 extern void up_page_ids_base(void);
+extern void split_page_ids(int nr, int idx);
+extern u32 alloc_page_id(void);
 
 extern struct cr_img *img_from_fd(int fd); /* for cr-show mostly */
 
+extern int img_reserve(struct cr_img *img, size_t size);
 extern int write_img_buf(struct cr_img *, const void *ptr, int size);
 #define write_img(img, ptr)	write_img_buf((img), (ptr), sizeof(*(ptr)))
 extern int read_img_buf_eof(struct cr_img *, void *ptr, int size);
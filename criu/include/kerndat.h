@@ -44,6 +44,11 @@ struct kerndat_s {
 	unsigned int has_xtlocks;
 	unsigned long mmap_min_addr;
 	bool has_tcp_half_closed;
+	bool has_uffd;
+	unsigned long uffd_features;
+	bool has_io_uring;
+	bool has_pagemap_scan;
+	unsigned long thp_size;
 };
 
 extern struct kerndat_s kdat;
@@ -114,6 +114,8 @@
  */
 #define STATS_MAGIC		0x57093306 /* Ostashkov */
 #define IRMAP_CACHE_MAGIC	0x57004059 /* Ivanovo */
+#define IMG_ARCHIVE_MAGIC	0x57253419 /* Rybinsk */
+#define IMG_STREAM_MAGIC	0x57243311 /* Cherepovets */
 
 /*
  * Main magic for kerndat_s structure.
@@ -2,6 +2,7 @@
 #define __CR_MEM_H__
 
 #include <stdbool.h>
+#include <sys/types.h>
 #include "int.h"
 #include "vma.pb-c.h"
 
@@ -12,6 +13,13 @@ struct pstree_item;
 
 struct mem_dump_ctl {
 	bool	pre_dump;
+	bool	parallel;	/* pages are dumped by a worker */
+	u32	pages_id;	/* allocated for the worker, 0 if none */
+};
+
+struct mem_dump_worker {
+	pid_t	pid;
+	int	stats_fd;
 };
 
 extern bool page_in_parent(bool dirty);
@@ -23,6 +31,12 @@ extern int parasite_dump_pages_seized(struct pstree_item *item,
 				      struct vm_area_list *vma_area_list,
 				      struct mem_dump_ctl *mdc,
 				      struct parasite_ctl *ctl);
+extern int parasite_dump_pages_start(struct pstree_item *item,
+				     struct vm_area_list *vma_area_list,
+				     struct mem_dump_ctl *mdc,
+				     struct parasite_ctl *ctl,
+				     struct mem_dump_worker *w);
+extern int parasite_dump_pages_wait(struct mem_dump_worker *w);
 
 #define PME_PRESENT		(1ULL << 63)
 #define PME_SWAP		(1ULL << 62)
@@ -0,0 +1,25 @@
+#ifndef __CR_PAGE_INDEX_H__
+#define __CR_PAGE_INDEX_H__
+
+#include <stdbool.h>
+
+#include "int.h"
+
+/*
+ * Index of pages written into pages images during dump. It's
+ * used to find pages with the same contents and write them
+ * as "same-as" pagemap entries instead of the data.
+ */
+
+extern bool page_is_zero(void *page);
+extern u64 page_hash(void *page);
+
+/*
+ * Returns 1 and the location of the page with the same contents
+ * if it's found, 0 if it's not and -1 on error.
+ */
+extern int page_index_lookup(void *page, u64 hash, u32 *pages_id, u64 *off);
+extern int page_index_add(u64 hash, u32 pages_id, u64 off);
+extern void page_index_fini(void);
+
+#endif /* __CR_PAGE_INDEX_H__ */
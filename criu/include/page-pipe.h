@@ -121,7 +121,10 @@ struct page_pipe {
 struct page_pipe *create_page_pipe(unsigned int nr_segs, struct iovec *iovs, unsigned flags);
 extern void destroy_page_pipe(struct page_pipe *p);
 extern int page_pipe_add_page(struct page_pipe *p, unsigned long addr);
-extern int page_pipe_add_hole(struct page_pipe *p, unsigned long addr);
+extern int page_pipe_add_pages(struct page_pipe *p, unsigned long addr,
+		unsigned int nr);
+extern int page_pipe_add_hole(struct page_pipe *p, unsigned long addr,
+		unsigned long len);
 
 extern void debug_show_page_pipe(struct page_pipe *pp);
 void page_pipe_reinit(struct page_pipe *pp);
@@ -4,12 +4,20 @@
 
 extern int cr_page_server(bool daemon_mode, int cfd);
 
+#define PS_MAX_CONNECTIONS	64
+
 /*
  * page_xfer -- transfer pages into image file.
  * Two images backends are implemented -- local image file
- * and page-server image file.
+ * and page-server image file. The former can compress and
+ * deduplicate pages on the fly (--compress, --dedup-pages)
+ * and bypass the page cache (--direct-io).
  */
 
+struct page_xfer_buf;
+struct page_xfer_direct;
+struct page_server_batch;
+
 struct page_xfer {
 	/* transfers one vaddr:len entry */
 	int (*write_pagemap)(struct page_xfer *self, struct iovec *iov);
@@ -18,17 +26,23 @@ struct page_xfer {
 	/* transfers one hole -- vaddr:len entry w/o pages */
 	int (*write_hole)(struct page_xfer *self, struct iovec *iov);
 	void (*close)(struct page_xfer *self);
+	/* sends what's queued, the pipes are about to be reused */
+	int (*flush)(struct page_xfer *self);
 
 	/* private data for every page-xfer engine */
 	union {
 		struct /* local */ {
 			struct cr_img *pmi; /* pagemaps */
 			struct cr_img *pi;  /* pages */
+			struct page_xfer_buf *pbuf; /* see write_pages_buf */
+			struct page_xfer_direct *direct; /* --direct-io */
+			bool compact; /* --compact-pagemaps */
 		};
 
 		struct /* page-server */ {
 			int sk;
 			u64 dst_id;
+			struct page_server_batch *batch;
 		};
 	};
 
@@ -36,11 +50,13 @@ struct page_xfer {
 };
 
 extern int open_page_xfer(struct page_xfer *xfer, int fd_type, long id);
+extern int open_page_xfer_id(struct page_xfer *xfer, int fd_type, long id, u32 pages_id);
 struct page_pipe;
 extern int page_xfer_dump_pages(struct page_xfer *, struct page_pipe *,
 				unsigned long off);
 extern int connect_to_page_server(void);
 extern int disconnect_from_page_server(void);
+extern int page_server_start_pass(int pass, int parent);
 
 extern int check_parent_page_xfer(int fd_type, long id);
 
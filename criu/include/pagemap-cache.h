@@ -10,6 +10,16 @@ struct vma_area;
 
 #define PAGEMAP_PFN_OFF(addr)	(PAGE_PFN(addr) * sizeof(u64))
 
+/*
+ * Range of pages with the same PME_ flags as reported by pmc_scan().
+ * It's laid out as the kernel's struct page_region.
+ */
+struct pmc_region {
+	u64			start;
+	u64			end;
+	u64			pme;
+};
+
 typedef struct {
 	pid_t			pid;		/* which process it belongs */
 	unsigned long		start;		/* start of area */
@@ -18,6 +28,7 @@ typedef struct {
 	u64			*map;		/* local buffer */
 	size_t			map_len;	/* length of a buffer */
 	int			fd;		/* file to read PMs from */
+	struct pmc_region	*regs;		/* pmc_scan() results */
 } pmc_t;
 
 #define PMC_INIT (pmc_t){ }
@@ -26,4 +37,14 @@ extern int pmc_init(pmc_t *pmc, pid_t pid, const struct list_head *vma_head, siz
 extern u64 *pmc_get_map(pmc_t *pmc, const struct vma_area *vma);
 extern void pmc_fini(pmc_t *pmc);
 
+/*
+ * Reports the ranges of present and swapped pages (except the zero
+ * page) in [start, end) into pmc->regs, returns their number. The
+ * walk may stop before the end, the next one should start from the
+ * walk_end. Requires kdat.has_pagemap_scan.
+ */
+extern int pmc_scan(pmc_t *pmc, unsigned long start, unsigned long end,
+		unsigned long *walk_end);
+extern int kerndat_pagemap_scan(void);
+
 #endif /* __CR_PAGEMAP_H__ */
@@ -5,6 +5,8 @@
 #include "images/pagemap.pb-c.h"
 #include "page.h"
 
+struct pagemap_extent;
+
 /*
  * page_read -- engine, that reads pages from image file(s)
  *
@@ -75,10 +77,24 @@ struct page_read {
 	unsigned id; /* for logging */
 
 	PagemapEntry **pmes;
+	struct pb_arena *pmes_arena;	/* pmes are unpacked here */
+	bool compact;			/* pagemap of pagemap_rec-s */
 	int nr_pmes;
 	int curr_pme;
 
 	struct list_head	async;
+
+	void			*cbuf;		/* last decompressed block */
+	unsigned long		cbuf_size;
+	off_t			cbuf_off;	/* its offset in pages file */
+
+	struct list_head	same_pis;	/* images "same-as" pages are in */
+
+	struct pagemap_extent	*exts;		/* where the pages are over the
+						   parents chain, see
+						   build_pagemap_extents */
+	int			nr_exts;
+	int			curr_ext;
 };
 
 /* flags for ->read_pages */
@@ -90,6 +106,7 @@ struct page_read {
 
 #define PR_TYPE_MASK	0x3
 #define PR_MOD		0x4	/* Will need to modify */
+#define PR_DIRECT	0x8	/* Read pages bypassing the page cache */
 
 /*
  * -1 -- error
@@ -97,6 +114,7 @@ struct page_read {
  *  1 -- opened
  */
 extern int open_page_read(int pid, struct page_read *, int pr_flags);
+extern void pages_image_direct(struct cr_img *pi);
 extern int open_page_read_at(int dfd, int pid, struct page_read *pr,
 		int pr_flags);
 
@@ -109,8 +127,46 @@ int pagemap_render_iovec(struct list_head *from, struct task_restore_args *ta);
 extern int dedup_one_iovec(struct page_read *pr, unsigned long base,
 			   unsigned long len);
 
+/*
+ * Entry of compact pagemap image (--compact-pagemaps). These go
+ * right after the head one by one, without the size, and can only
+ * describe plain pages and in_parent holes.
+ */
+struct pagemap_rec {
+	u64	vaddr;
+	u32	nr_pages;
+	u32	flags;
+};
+
+#define PAGEMAP_REC_IN_PARENT	0x1
+
 static inline unsigned long pagemap_len(PagemapEntry *pe)
 {
 	return pe->nr_pages * PAGE_SIZE;
 }
+
+static inline bool pagemap_compressed(PagemapEntry *pe)
+{
+	return pe->has_codec && pe->codec != COMPRESS_CODEC__CODEC_NONE;
+}
+
+static inline bool pagemap_zero(PagemapEntry *pe)
+{
+	return pe->has_zero && pe->zero;
+}
+
+static inline bool pagemap_same_as(PagemapEntry *pe)
+{
+	return pe->has_same_as_pages_id;
+}
+
+/* Whether the pages are laid in the pages image one by one */
+static inline bool pagemap_raw_pages(PagemapEntry *pe)
+{
+	return !pe->in_parent && !pagemap_compressed(pe) &&
+		!pagemap_zero(pe) && !pagemap_same_as(pe);
+}
+
+extern bool pagemap_range_pieok(struct page_read *pr, unsigned long start,
+				unsigned long end, bool zero_ok);
 #endif /* __CR_PAGE_READ_H__ */
@@ -0,0 +1,10 @@
+#ifndef __CR_PAGES_PREFETCH_H__
+#define __CR_PAGES_PREFETCH_H__
+
+struct pstree_item;
+
+extern int start_pages_prefetch(void);
+extern void pages_prefetch_progress(struct pstree_item *t);
+extern void stop_pages_prefetch(void);
+
+#endif /* __CR_PAGES_PREFETCH_H__ */
@@ -32,8 +32,8 @@ extern int parasite_dump_posix_timers_seized(struct proc_posix_timers_stat *proc
 extern int parasite_dump_misc_seized(struct parasite_ctl *ctl, struct parasite_dump_misc *misc);
 extern int parasite_dump_creds(struct parasite_ctl *ctl, struct _CredsEntry *ce);
 extern int parasite_dump_thread_leader_seized(struct parasite_ctl *ctl, int pid, struct _CoreEntry *core);
-extern int parasite_dump_thread_seized(struct parasite_ctl *ctl, int id,
-					struct pid *tid, struct _CoreEntry *core);
+extern int parasite_dump_threads_seized(struct parasite_ctl *ctl,
+					const struct pstree_item *item, int *ids, int nr);
 extern int dump_thread_core(int pid, CoreEntry *core,
 					const struct parasite_dump_thread *dt);
 
@@ -45,6 +45,12 @@ extern int parasite_get_proc_fd_seized(struct parasite_ctl *ctl);
 extern struct parasite_ctl *parasite_infect_seized(pid_t pid,
 						   struct pstree_item *item,
 						   struct vm_area_list *vma_area_list);
+extern struct parasite_ctl *parasite_infect_start(pid_t pid,
+						  struct pstree_item *item,
+						  struct vm_area_list *vma_area_list);
+extern int parasite_infect_finish(struct pstree_item *item, struct parasite_ctl *ctl);
+extern int parasite_stop_daemon(struct parasite_ctl *ctl);
+extern int parasite_cure(struct parasite_ctl *ctl);
 extern void parasite_ensure_args_size(unsigned long sz);
 extern unsigned long get_exec_start(struct vm_area_list *);
 
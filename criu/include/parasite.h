@@ -35,6 +35,7 @@ enum {
 	PARASITE_CMD_CHECK_VDSO_MARK,
 	PARASITE_CMD_CHECK_AIOS,
 	PARASITE_CMD_DUMP_CGROUP,
+	PARASITE_CMD_DUMP_THREADS,
 
 	PARASITE_CMD_MAX,
 };
@@ -171,6 +172,23 @@ struct parasite_dump_thread {
 	struct parasite_dump_creds	creds[0];
 };
 
+/*
+ * Threads dumped at once with PARASITE_CMD_DUMP_THREADS. Each one
+ * finds its index by the stack it runs on and puts its info into
+ * the respective page after this header.
+ */
+struct parasite_dump_threads {
+	unsigned long			stacks;
+	unsigned long			stack_size;
+	unsigned int			nr;
+};
+
+static inline struct parasite_dump_thread *
+dump_threads_slot(struct parasite_dump_threads *dts, int i)
+{
+	return (void *)dts + (i + 1) * PAGE_SIZE;
+}
+
 static inline void copy_sas(ThreadSasEntry *dst, const stack_t *src)
 {
 	dst->ss_sp = encode_pointer(src->ss_sp);
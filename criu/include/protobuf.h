@@ -8,11 +8,21 @@
 #include "util.h"
 
 struct cr_img;
+struct pb_arena;
 
-extern int do_pb_read_one(struct cr_img *, void **objp, int type, bool eof);
+extern struct pb_arena *pb_arena_create(void);
+extern void pb_arena_destroy(struct pb_arena *);
+extern void *pb_arena_alloc(struct pb_arena *, size_t size);
+extern struct pb_arena *pb_collect_arena(void);
+extern void pb_free(int type, void *obj, struct pb_arena *);
 
-#define pb_read_one(fd, objp, type) do_pb_read_one(fd, (void **)objp, type, false)
-#define pb_read_one_eof(fd, objp, type) do_pb_read_one(fd, (void **)objp, type, true)
+extern int do_pb_read_one(struct cr_img *, void **objp, int type, bool eof,
+		struct pb_arena *);
+
+#define pb_read_one(fd, objp, type) do_pb_read_one(fd, (void **)objp, type, false, NULL)
+#define pb_read_one_eof(fd, objp, type) do_pb_read_one(fd, (void **)objp, type, true, NULL)
+#define pb_read_one_eof_arena(fd, objp, type, arena) \
+	do_pb_read_one(fd, (void **)objp, type, true, arena)
 
 extern int pb_write_one(struct cr_img *, void *obj, int type);
 
@@ -38,6 +48,7 @@ struct collect_image_info {
 #define COLLECT_SHARED		0x1	/* use shared memory for obj-s */
 #define COLLECT_NOFREE		0x2	/* don't free entry after callback */
 #define COLLECT_HAPPENED	0x4	/* image was opened and collected */
+#define COLLECT_ARENA		0x8	/* unpack entries into pb_collect_arena() */
 
 extern int collect_image(struct collect_image_info *);
 
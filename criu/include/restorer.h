@@ -132,6 +132,9 @@ struct task_restore_args {
 	int				vma_ios_fd;
 	struct restore_vma_io		*vma_ios;
 	unsigned int			vma_ios_n;
+	bool				vma_ios_uring;		/* read vma_ios with io_uring */
+
+	int				uffd;			/* to register VMA_LAZY vmas with */
 
 	struct restore_posix_timer	*posix_timers;
 	unsigned int			posix_timers_n;
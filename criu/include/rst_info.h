@@ -40,7 +40,9 @@ struct rst_info {
 	struct vm_area_list	vmas;
 	struct _MmEntry		*mm;
 	struct list_head	vma_io;
+	struct list_head	lazy_iovs;
 	unsigned int		pages_img_id;
+	u32			prefetch_chunk;	/* its 1st one + 1, 0 if none */
 
 	u32			cg_set;
 
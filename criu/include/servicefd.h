@@ -22,6 +22,8 @@ enum sfd_type {
 	TRANSPORT_FD_OFF, /* to transfer file descriptors */
 	RPC_SK_OFF,
 	FDSTORE_SK_OFF,
+	LAZY_PAGES_SK_OFF,	/* Connection to the lazy-pages daemon */
+	IMG_STREAM_OFF,		/* Images read from --stream-fd */
 
 	SERVICE_FD_MAX
 };
@@ -1,12 +1,17 @@
 #ifndef __CR_STATS_H__
 #define __CR_STATS_H__
 
+#include <stdbool.h>
+
 enum {
 	TIME_FREEZING,
 	TIME_FROZEN,
 	TIME_MEMDUMP,
 	TIME_MEMWRITE,
 	TIME_IRMAP_RESOLVE,
+	TIME_COMPRESS,
+	TIME_FREEZER_WAIT,
+	TIME_SEIZE,
 
 	DUMP_TIME_NR_STATS,
 };
@@ -21,10 +26,17 @@ enum {
 extern void timing_start(int t);
 extern void timing_stop(int t);
 
+struct timeval;
+extern void fd_timing_add(int type, struct timeval *start, bool restored);
+
 enum {
 	CNT_PAGES_SCANNED,
 	CNT_PAGES_SKIPPED_PARENT,
 	CNT_PAGES_WRITTEN,
+	CNT_COMPRESS_IN,	/* bytes */
+	CNT_COMPRESS_OUT,
+	CNT_PAGES_ZERO,
+	CNT_PAGES_SAME,
 
 	DUMP_CNT_NR_STATS,
 };
@@ -33,11 +45,13 @@ enum {
 	CNT_PAGES_COMPARED,
 	CNT_PAGES_SKIPPED_COW,
 	CNT_PAGES_RESTORED,
+	CNT_PAGES_LAZY,
 
 	RESTORE_CNT_NR_STATS,
 };
 
 extern void cnt_add(int c, unsigned long val);
+extern bool dump_stats_enabled(void);
 
 #define DUMP_STATS	1
 #define RESTORE_STATS	2
@@ -45,4 +59,8 @@ extern void cnt_add(int c, unsigned long val);
 extern int init_stats(int what);
 extern void write_stats(int what);
 
+extern void reset_dump_stats(void);
+extern int send_dump_stats(int fd);
+extern int recv_dump_stats(int fd);
+
 #endif /* __CR_STATS_H__ */
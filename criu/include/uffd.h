@@ -0,0 +1,33 @@
+#ifndef __CR_UFFD_H__
+#define __CR_UFFD_H__
+
+#include <stdbool.h>
+
+#include "int.h"
+
+/*
+ * Lazy (post-copy) restore of memory. Restored tasks register their
+ * anonymous private VMAs with userfaultfd and send the descriptor to
+ * the lazy-pages daemon, which populates the memory on page faults
+ * and copies the rest in the background.
+ */
+
+#define LAZY_PAGES_SOCK_NAME	"lazy-pages.socket"
+
+struct pstree_item;
+struct vma_area;
+struct task_restore_args;
+
+extern int kerndat_uffd(void);
+extern bool uffd_noncoop_supported(void);
+
+extern bool vma_can_be_lazy(struct vma_area *vma);
+extern int lazy_pages_add_iov(struct pstree_item *t, unsigned long addr,
+			      unsigned long len);
+extern int prepare_lazy_pages_socket(void);
+extern int prepare_lazy_pages(struct pstree_item *t, struct task_restore_args *ta);
+extern void lazy_pages_restore_finished(void);
+
+extern int cr_lazy_pages(bool daemon);
+
+#endif /* __CR_UFFD_H__ */
@@ -0,0 +1,79 @@
+#ifndef __CR_URING_H__
+#define __CR_URING_H__
+
+#include "int.h"
+
+/*
+ * The bits of io_uring ABI (see linux/io_uring.h) the restorer
+ * uses to read pages. The system headers may be too old to have
+ * them, the ABI is stable.
+ */
+
+struct io_sqring_offsets {
+	u32	head;
+	u32	tail;
+	u32	ring_mask;
+	u32	ring_entries;
+	u32	flags;
+	u32	dropped;
+	u32	array;
+	u32	resv1;
+	u64	resv2;
+};
+
+struct io_cqring_offsets {
+	u32	head;
+	u32	tail;
+	u32	ring_mask;
+	u32	ring_entries;
+	u32	overflow;
+	u32	cqes;
+	u32	flags;
+	u32	resv1;
+	u64	resv2;
+};
+
+struct io_uring_params {
+	u32	sq_entries;
+	u32	cq_entries;
+	u32	flags;
+	u32	sq_thread_cpu;
+	u32	sq_thread_idle;
+	u32	features;
+	u32	wq_fd;
+	u32	resv[3];
+	struct io_sqring_offsets sq_off;
+	struct io_cqring_offsets cq_off;
+};
+
+struct io_uring_sqe {
+	u8	opcode;
+	u8	flags;
+	u16	ioprio;
+	s32	fd;
+	u64	off;
+	u64	addr;
+	u32	len;
+	u32	rw_flags;
+	u64	user_data;
+	u64	__pad[3];
+};
+
+struct io_uring_cqe {
+	u64	user_data;
+	s32	res;
+	u32	flags;
+};
+
+#define IORING_OFF_SQ_RING	0ULL
+#define IORING_OFF_CQ_RING	0x8000000ULL
+#define IORING_OFF_SQES		0x10000000ULL
+
+#define IORING_OP_READV		1
+#define IORING_ENTER_GETEVENTS	(1U << 0)
+
+#ifndef RWF_NOWAIT
+#define RWF_NOWAIT		0x00000008
+#endif
+
+#endif /* __CR_URING_H__ */
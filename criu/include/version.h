@@ -0,0 +1,8 @@
+/* Autogenerated, do not edit */
+#ifndef __CR_VERSION_H__
+#define __CR_VERSION_H__
+#define CRIU_VERSION "3.2"
+#define CRIU_VERSION_MAJOR  3
+#define CRIU_VERSION_MINOR  2
+#define CRIU_GITID "986db8b"
+#endif /* __CR_VERSION_H__ */
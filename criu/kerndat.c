@@ -1,10 +1,12 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <stdio.h>
+#include <string.h>
 #include <sys/file.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/mman.h>
+#include <sys/wait.h>
 #include <errno.h>
 #include <sys/syscall.h>
 #include <sys/sysmacros.h>
@@ -30,6 +32,9 @@
 #include <compel/plugins/std/syscall-codes.h>
 #include <compel/compel.h>
 #include "netfilter.h"
+#include "uffd.h"
+#include "pagemap-cache.h"
+#include "uring.h"
 
 struct kerndat_s kdat = {
 };
@@ -358,6 +363,28 @@ static int init_zero_page_pfn()
 	return ret;
 }
 
+static void kerndat_thp(void)
+{
+	FILE *f;
+
+	f = fopen("/sys/kernel/mm/transparent_hugepage/hpage_pmd_size", "r");
+	if (!f) {
+		pr_info("No transparent huge pages\n");
+		kdat.thp_size = 0;
+		return;
+	}
+
+	if (fscanf(f, "%lu", &kdat.thp_size) != 1 ||
+			kdat.thp_size & (kdat.thp_size - 1) ||
+			kdat.thp_size <= PAGE_SIZE) {
+		pr_warn("Bad huge page size, THP-backed VMAs are not aligned\n");
+		kdat.thp_size = 0;
+	}
+
+	fclose(f);
+	pr_debug("Found THP size of %lx\n", kdat.thp_size);
+}
+
 static int get_last_cap(void)
 {
 	struct sysctl_req req[] = {
@@ -385,6 +412,78 @@ static bool kerndat_has_memfd_create(void)
 	return 0;
 }
 
+/*
+ * Since 5.12 io_uring workers are threads of the task that uses the
+ * ring and some kernels start one (the io-wq manager) as soon as the
+ * ring is set up. In the restorer such a thread could take a pid of
+ * a thread yet to be restored, so the ring is only used if setting
+ * it up leaves the task single-threaded.
+ */
+static bool io_uring_keeps_single_thread(void)
+{
+	struct io_uring_params p;
+	int status;
+	pid_t pid;
+
+	pid = fork();
+	if (pid < 0) {
+		pr_perror("Can't fork");
+		return false;
+	}
+
+	if (pid == 0) {
+		struct stat st;
+		int fd;
+
+		memset(&p, 0, sizeof(p));
+		fd = syscall(SYS_io_uring_setup, 1, &p);
+		if (fd < 0)
+			_exit(1);
+
+		/* The task dir has a link per thread plus "." and ".." */
+		if (stat("/proc/self/task", &st))
+			_exit(1);
+
+		_exit(st.st_nlink == 3 ? 0 : 1);
+	}
+
+	if (waitpid(pid, &status, 0) != pid) {
+		pr_perror("Can't wait io_uring probe");
+		return false;
+	}
+
+	return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+static int kerndat_io_uring(void)
+{
+	int ret;
+
+	/*
+	 * The restorer reads pages with it, so an io_uring disabled
+	 * by sysctl (EPERM) is the same as absent.
+	 */
+	ret = syscall(SYS_io_uring_setup, 0, NULL);
+
+	if (ret == -1 && (errno == ENOSYS || errno == EPERM))
+		kdat.has_io_uring = false;
+	else if (ret == -1 && (errno == EFAULT || errno == EINVAL))
+		kdat.has_io_uring = true;
+	else {
+		pr_err("Unexpected result from io_uring_setup(0, NULL): %d %m\n", ret);
+		if (ret >= 0)
+			close(ret);
+		return -1;
+	}
+
+	if (kdat.has_io_uring && !io_uring_keeps_single_thread()) {
+		pr_info("io_uring starts threads, reading pages with preadv\n");
+		kdat.has_io_uring = false;
+	}
+
+	return 0;
+}
+
 static int get_task_size(void)
 {
 	kdat.task_size = compel_task_size();
@@ -676,8 +775,15 @@ int kerndat_init(void)
 		ret = kerndat_compat_restore();
 	if (!ret)
 		ret = kerndat_has_memfd_create();
+	if (!ret)
+		ret = kerndat_uffd();
+	if (!ret)
+		ret = kerndat_io_uring();
+	if (!ret)
+		ret = kerndat_pagemap_scan();
 
 	kerndat_lsm();
+	kerndat_thp();
 	kerndat_mmap_min_addr();
 
 	if (!ret)
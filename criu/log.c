@@ -5,6 +5,8 @@
 #include <unistd.h>
 #include <stdbool.h>
 #include <limits.h>
+#include <pthread.h>
+#include <signal.h>
 
 #include <sys/types.h>
 #include <sys/time.h>
@@ -30,6 +32,18 @@ static unsigned int current_loglevel = DEFAULT_LOGLEVEL;
 static char buffer[PAGE_SIZE * 2];
 static char buf_off = 0;
 
+/*
+ * With --log-buffered the lines going to the log file are collected
+ * here and written out by big chunks, rather than with a write() per
+ * line. The buffer is flushed when full, on errors, before the task
+ * forks, execs or jumps to the restorer, at exit and when criu gets
+ * a fatal signal.
+ */
+#define LOG_BUF_SIZE	(128 << 10)
+
+static char log_buf[LOG_BUF_SIZE];
+static int log_buf_len;
+
 static struct timeval start;
 /*
  * Manual buf len as sprintf will _always_ put '\0' at the end,
@@ -66,6 +80,78 @@ int log_get_fd(void)
 	return fd < 0 ? DEFAULT_LOGFD : fd;
 }
 
+static void log_write(int fd, const char *buf, int size)
+{
+	int ret, off = 0;
+
+	while (off < size) {
+		ret = write(fd, buf + off, size - off);
+		if (ret <= 0)
+			break;
+		off += ret;
+	}
+}
+
+void log_flush(void)
+{
+	int __errno = errno;
+
+	if (log_buf_len) {
+		log_write(log_get_fd(), log_buf, log_buf_len);
+		log_buf_len = 0;
+	}
+
+	errno = __errno;
+}
+
+/* The child has it all flushed by the parent in log_flush() */
+static void log_buf_drop(void)
+{
+	log_buf_len = 0;
+}
+
+/* What's in the buffer likely tells why we crash, write it out */
+static void log_fatal_handler(int sig)
+{
+	log_flush();
+	raise(sig);
+}
+
+static int log_fatal_init(void)
+{
+	static const int sigs[] = { SIGSEGV, SIGBUS, SIGILL, SIGFPE, SIGABRT, };
+	struct sigaction sa = {
+		.sa_handler	= log_fatal_handler,
+		/* The default action is back for raise() */
+		.sa_flags	= SA_RESETHAND | SA_NODEFER,
+	};
+	int i;
+
+	sigemptyset(&sa.sa_mask);
+	for (i = 0; i < ARRAY_SIZE(sigs); i++)
+		if (sigaction(sigs[i], &sa, NULL))
+			return -1;
+
+	return 0;
+}
+
+static int log_buffered_init(void)
+{
+	static bool registered;
+
+	if (!opts.log_buffered || registered)
+		return 0;
+
+	if (pthread_atfork(log_flush, NULL, log_buf_drop) ||
+	    atexit(log_flush) || log_fatal_init()) {
+		pr_err("Can't register log flush hooks\n");
+		return -1;
+	}
+
+	registered = true;
+	return 0;
+}
+
 void log_get_logstart(struct timeval *s)
 {
 	if (current_loglevel >= LOG_TIMESTAMP)
@@ -136,6 +222,7 @@ int log_init(const char *output)
 {
 	int new_logfd, fd;
 
+	log_flush();
 	gettimeofday(&start, NULL);
 	reset_buf_off();
 
@@ -164,7 +251,7 @@ int log_init(const char *output)
 	if (fd < 0)
 		goto err;
 
-	return 0;
+	return log_buffered_init();
 
 err:
 	pr_perror("Log engine failure, can't duplicate descriptor");
@@ -196,6 +283,7 @@ int log_init_by_pid(void)
 
 void log_fini(void)
 {
+	log_flush();
 	close_service_fd(LOG_FD_OFF);
 }
 
@@ -211,7 +299,7 @@ unsigned int log_get_loglevel(void)
 
 void vprint_on_level(unsigned int loglevel, const char *format, va_list params)
 {
-	int fd, size, ret, off = 0;
+	int fd, size, off = 0;
 	int __errno = errno;
 
 	if (unlikely(loglevel == LOG_MSG)) {
@@ -227,17 +315,25 @@ void vprint_on_level(unsigned int loglevel, const char *format, va_list params)
 
 	size  = vsnprintf(buffer + buf_off, sizeof buffer - buf_off, format, params);
 	size += buf_off;
-
-	while (off < size) {
-		ret = write(fd, buffer + off, size - off);
-		if (ret <= 0)
-			break;
-		off += ret;
+	/* vsnprintf() reports the size it wanted, not the size it wrote */
+	size = min_t(int, size, sizeof(buffer) - 1);
+
+	if (opts.log_buffered && loglevel != LOG_MSG) {
+		/* Errors go out at once, together with what was before */
+		if (loglevel == LOG_ERROR || log_buf_len + size > LOG_BUF_SIZE)
+			log_flush();
+		if (loglevel != LOG_ERROR) {
+			memcpy(log_buf + log_buf_len, buffer, size);
+			log_buf_len += size;
+			goto out;
+		}
 	}
 
+	log_write(fd, buffer + off, size - off);
+
 	if (loglevel == LOG_ERROR)
 		log_note_err(buffer + buf_off);
-
+out:
 	errno =  __errno;
 }
 
@@ -3,6 +3,7 @@
 #include <sys/mman.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <sys/wait.h>
 
 #include "types.h"
 #include "cr_options.h"
@@ -13,6 +14,7 @@
 #include "page-pipe.h"
 #include "page-xfer.h"
 #include "log.h"
+#include "criu-log.h"
 #include "kerndat.h"
 #include "stats.h"
 #include "vma.h"
@@ -24,7 +26,9 @@
 #include "sk-packet.h"
 #include "files-reg.h"
 #include "pagemap-cache.h"
+#include "pages-prefetch.h"
 #include "fault-injection.h"
+#include "uffd.h"
 #include <compel/compel.h>
 
 #include "protobuf.h"
@@ -134,11 +138,88 @@ bool page_in_parent(bool dirty)
  * the memory contents is present in the pagent image set.
  */
 
+/*
+ * Pages of these VMAs are dumped or not regardless of being present,
+ * see should_dump_page(). For the rest only present and swapped pages
+ * are of interest.
+ */
+static bool vma_pages_by_pme(struct vma_area *vma)
+{
+	return !vma_entry_is(vma->e, VMA_AREA_VDSO) &&
+		!vma_entry_is(vma->e, VMA_AREA_VVAR) &&
+		!vma_entry_is(vma->e, VMA_AREA_AIORING);
+}
+
+/*
+ * Skips the pages that are neither present nor swapped. Four PMEs
+ * are checked at once, the compiler makes vector ops out of it.
+ */
+static unsigned long pme_skip_empty(u64 *at, unsigned long pfn, unsigned long nr)
+{
+	for (; pfn + 4 <= nr; pfn += 4)
+		if ((at[pfn] | at[pfn + 1] | at[pfn + 2] | at[pfn + 3]) &
+				(PME_PRESENT | PME_SWAP))
+			break;
+
+	return pfn;
+}
+
+/*
+ * Pages of THP-backed VMAs are put into the page pipe by whole huge
+ * pages where possible, rather than one by one.
+ */
+static unsigned long vma_huge_pages(struct vma_area *vma)
+{
+	if (!vma_area_is(vma, VMA_AREA_THP) || !kdat.thp_size)
+		return 0;
+
+	return kdat.thp_size / PAGE_SIZE;
+}
+
+/* Checks that all the nr pages are dumped and go the same way */
+static bool pme_huge_run(VmaEntry *vmae, u64 *at, unsigned long nr)
+{
+	u64 dirty = at[0] & PME_SOFT_DIRTY;
+	unsigned long i;
+
+	for (i = 0; i < nr; i++)
+		if (!should_dump_page(vmae, at[i]) ||
+				(at[i] & PME_SOFT_DIRTY) != dirty)
+			return false;
+
+	return true;
+}
+
+/*
+ * Adds a whole huge page at vaddr. Returns 1 when the page pipe
+ * can't take it at once and the pages are to be added one by one.
+ */
+static int add_huge_page(struct page_pipe *pp, unsigned long vaddr,
+		bool in_parent, unsigned long *pages)
+{
+	unsigned long nr = kdat.thp_size / PAGE_SIZE;
+	int ret;
+
+	if (in_parent) {
+		ret = page_pipe_add_hole(pp, vaddr, kdat.thp_size);
+		if (!ret)
+			pages[0] += nr;
+	} else {
+		ret = page_pipe_add_pages(pp, vaddr, nr);
+		if (!ret)
+			pages[1] += nr;
+	}
+
+	return ret;
+}
+
 static int generate_iovs(struct vma_area *vma, struct page_pipe *pp, u64 *map, u64 *off, bool has_parent)
 {
 	u64 *at = &map[PAGE_PFN(*off)];
 	unsigned long pfn, nr_to_scan;
 	unsigned long pages[2] = {};
+	unsigned long huge_nr = vma_huge_pages(vma);
+	bool skip_empty = vma_pages_by_pme(vma);
 
 	nr_to_scan = (vma_area_len(vma) - *off) / PAGE_SIZE;
 
@@ -146,11 +227,33 @@ static int generate_iovs(struct vma_area *vma, struct page_pipe *pp, u64 *map, u
 		unsigned long vaddr;
 		int ret;
 
-		if (!should_dump_page(vma->e, at[pfn]))
-			continue;
+		if (skip_empty) {
+			pfn = pme_skip_empty(at, pfn, nr_to_scan);
+			if (pfn == nr_to_scan)
+				break;
+		}
 
 		vaddr = vma->e->start + *off + pfn * PAGE_SIZE;
 
+		if (huge_nr && !(vaddr & (kdat.thp_size - 1)) &&
+				pfn + huge_nr <= nr_to_scan &&
+				pme_huge_run(vma->e, &at[pfn], huge_nr)) {
+			ret = add_huge_page(pp, vaddr, has_parent &&
+					page_in_parent(at[pfn] & PME_SOFT_DIRTY), pages);
+			if (ret < 0) {
+				*off += pfn * PAGE_SIZE;
+				return ret;
+			}
+
+			if (ret == 0) {
+				pfn += huge_nr - 1;
+				continue;
+			}
+		}
+
+		if (!should_dump_page(vma->e, at[pfn]))
+			continue;
+
 		/*
 		 * If we're doing incremental dump (parent images
 		 * specified) and page is not soft-dirty -- we dump
@@ -159,7 +262,7 @@ static int generate_iovs(struct vma_area *vma, struct page_pipe *pp, u64 *map, u
 		 */
 
 		if (has_parent && page_in_parent(at[pfn] & PME_SOFT_DIRTY)) {
-			ret = page_pipe_add_hole(pp, vaddr);
+			ret = page_pipe_add_hole(pp, vaddr, PAGE_SIZE);
 			pages[0]++;
 		} else {
 			ret = page_pipe_add_page(pp, vaddr);
@@ -182,6 +285,85 @@ static int generate_iovs(struct vma_area *vma, struct page_pipe *pp, u64 *map, u
 	return 0;
 }
 
+/*
+ * Same as generate_iovs(), but gets the pages from the kernel with
+ * pmc_scan(). Unpopulated page tables are skipped by the kernel and
+ * pages with the same flags come in ranges, so for incremental dumps
+ * the cost depends on the number of dirty pages rather than on the
+ * VMA size: clean pages turn into holes a range at a time.
+ */
+static int generate_iovs_scan(struct vma_area *vma, struct page_pipe *pp,
+		pmc_t *pmc, u64 *off, bool has_parent)
+{
+	unsigned long start = vma->e->start + *off, end = vma->e->end;
+	unsigned long scan_start = start;
+	unsigned long pages[2] = {};
+	bool huge = vma_huge_pages(vma) != 0;
+	int ret = 0;
+
+	while (start < end) {
+		unsigned long walk_end;
+		int nr, i;
+
+		nr = pmc_scan(pmc, start, end, &walk_end);
+		if (nr < 0)
+			return -1;
+
+		for (i = 0; i < nr; i++) {
+			struct pmc_region *r = &pmc->regs[i];
+			unsigned long vaddr;
+
+			if (!should_dump_page(vma->e, r->pme))
+				continue;
+
+			if (has_parent && page_in_parent(r->pme & PME_SOFT_DIRTY)) {
+				ret = page_pipe_add_hole(pp, r->start, r->end - r->start);
+				if (ret)
+					return ret;
+
+				pages[0] += (r->end - r->start) / PAGE_SIZE;
+				continue;
+			}
+
+			for (vaddr = r->start; vaddr < r->end; vaddr += PAGE_SIZE) {
+				if (huge && !(vaddr & (kdat.thp_size - 1)) &&
+						vaddr + kdat.thp_size <= r->end) {
+					ret = add_huge_page(pp, vaddr, false, pages);
+					if (ret < 0) {
+						start = vaddr;
+						goto out;
+					}
+
+					if (ret == 0) {
+						vaddr += kdat.thp_size - PAGE_SIZE;
+						continue;
+					}
+				}
+
+				ret = page_pipe_add_page(pp, vaddr);
+				if (ret) {
+					start = vaddr;
+					goto out;
+				}
+
+				pages[1]++;
+			}
+		}
+
+		start = walk_end;
+	}
+
+out:
+	*off = start - vma->e->start;
+
+	cnt_add(CNT_PAGES_SCANNED, (start - scan_start) / PAGE_SIZE);
+	cnt_add(CNT_PAGES_SKIPPED_PARENT, pages[0]);
+	cnt_add(CNT_PAGES_WRITTEN, pages[1]);
+
+	pr_info("Pagemap scanned: %lu pages %lu holes\n", pages[1], pages[0]);
+	return ret;
+}
+
 static struct parasite_dump_pages_args *prep_dump_pages_args(struct parasite_ctl *ctl,
 		struct vm_area_list *vma_area_list, bool skip_non_trackable)
 {
@@ -316,7 +498,8 @@ static int __parasite_dump_pages_seized(struct pstree_item *item,
 		 * right here. For pre-dumps the pp will be taken by the
 		 * caller and handled later.
 		 */
-		ret = open_page_xfer(&xfer, CR_FD_PAGEMAP, vpid(item));
+		ret = open_page_xfer_id(&xfer, CR_FD_PAGEMAP, vpid(item),
+				mdc->pages_id);
 		if (ret < 0)
 			goto out_pp;
 	} else {
@@ -346,15 +529,32 @@ static int __parasite_dump_pages_seized(struct pstree_item *item,
 			has_parent = false;
 		}
 
-		map = pmc_get_map(&pmc, vma_area);
-		if (!map)
-			goto out_xfer;
+		/*
+		 * Shared areas are accounted by the caller, when
+		 * pages are dumped by a worker (see below)
+		 */
+		if (mdc->parallel && vma_area_is(vma_area, VMA_ANON_SHARED))
+			continue;
+
+		if (kdat.has_pagemap_scan && vma_pages_by_pme(vma_area) &&
+				!vma_area_is(vma_area, VMA_ANON_SHARED))
+			map = NULL;
+		else {
+			map = pmc_get_map(&pmc, vma_area);
+			if (!map)
+				goto out_xfer;
+		}
+
 		if (vma_area_is(vma_area, VMA_ANON_SHARED))
 			ret = add_shmem_area(item->pid->real, vma_area->e, map);
 		else {
 again:
-			ret = generate_iovs(vma_area, pp, map, &off,
-				has_parent);
+			if (map)
+				ret = generate_iovs(vma_area, pp, map, &off,
+					has_parent);
+			else
+				ret = generate_iovs_scan(vma_area, pp, &pmc, &off,
+					has_parent);
 			if (ret == -EAGAIN) {
 				BUG_ON(!(pp->flags & PP_CHUNK_MODE));
 
@@ -444,6 +644,125 @@ int parasite_dump_pages_seized(struct pstree_item *item,
 	return ret;
 }
 
+static int collect_shmem_areas(struct pstree_item *item,
+		struct vm_area_list *vma_area_list)
+{
+	pmc_t pmc = PMC_INIT;
+	struct vma_area *vma_area;
+	int ret = 0;
+
+	if (pmc_init(&pmc, item->pid->real, &vma_area_list->h,
+			 vma_area_list->shared_longest * PAGE_SIZE))
+		return -1;
+
+	list_for_each_entry(vma_area, &vma_area_list->h, list) {
+		u64 *map;
+
+		if (!vma_area_is(vma_area, VMA_ANON_SHARED))
+			continue;
+
+		map = pmc_get_map(&pmc, vma_area);
+		if (!map) {
+			ret = -1;
+			break;
+		}
+
+		ret = add_shmem_area(item->pid->real, vma_area->e, map);
+		if (ret)
+			break;
+	}
+
+	pmc_fini(&pmc);
+	return ret;
+}
+
+/*
+ * Dump task pages in a forked worker. The worker talks to the
+ * parasite via the control socket only (no ptrace is required
+ * for this), so several workers can drain and write pages of
+ * different tasks at the same time. The caller must not touch
+ * the parasite until parasite_dump_pages_wait() is called.
+ *
+ * Shared anonymous areas are collected here, since the shmem
+ * pagemaps live in criu memory and are dumped later.
+ */
+int parasite_dump_pages_start(struct pstree_item *item,
+		struct vm_area_list *vma_area_list,
+		struct mem_dump_ctl *mdc,
+		struct parasite_ctl *ctl,
+		struct mem_dump_worker *w)
+{
+	u32 pages_id;
+	int sfd[2];
+	pid_t pid;
+
+	BUG_ON(mdc->pre_dump);
+
+	if (collect_shmem_areas(item, vma_area_list))
+		return -1;
+
+	if (pipe(sfd)) {
+		pr_perror("Can't make pipe for mem dump worker");
+		return -1;
+	}
+
+	/* The worker writes one pages image */
+	pages_id = alloc_page_id();
+
+	pid = fork();
+	if (pid < 0) {
+		pr_perror("Can't fork mem dump worker");
+		close(sfd[0]);
+		close(sfd[1]);
+		return -1;
+	}
+
+	if (pid == 0) {
+		int ret;
+
+		close(sfd[0]);
+		reset_dump_stats();
+
+		mdc->parallel = true;
+		mdc->pages_id = pages_id;
+		ret = parasite_dump_pages_seized(item, vma_area_list, mdc, ctl);
+		if (!ret)
+			ret = send_dump_stats(sfd[1]);
+
+		/* No atexit hooks with _exit() */
+		log_flush();
+		_exit(ret ? 1 : 0);
+	}
+
+	close(sfd[1]);
+	pr_info("Started mem dump worker %d for %d\n", pid, item->pid->real);
+
+	w->pid = pid;
+	w->stats_fd = sfd[0];
+	return 0;
+}
+
+int parasite_dump_pages_wait(struct mem_dump_worker *w)
+{
+	int status, ret = -1;
+
+	if (waitpid(w->pid, &status, 0) != w->pid) {
+		pr_perror("Can't wait mem dump worker %d", w->pid);
+		goto out;
+	}
+
+	if (!WIFEXITED(status) || WEXITSTATUS(status)) {
+		pr_err("Mem dump worker %d failed: %d\n", w->pid, status);
+		goto out;
+	}
+
+	ret = recv_dump_stats(w->stats_fd);
+out:
+	close_safe(&w->stats_fd);
+	w->pid = -1;
+	return ret;
+}
+
 int prepare_mm_pid(struct pstree_item *i)
 {
 	pid_t pid = vpid(i);
@@ -501,6 +820,9 @@ int prepare_mm_pid(struct pstree_item *i)
 			ri->vmas.priv_size += vma_area_len(vma);
 			if (vma->e->flags & MAP_GROWSDOWN)
 				ri->vmas.priv_size += PAGE_SIZE;
+			/* Room to align it, see premap_private_vma() */
+			if (vma_area_is(vma, VMA_AREA_THP) && kdat.thp_size)
+				ri->vmas.priv_size += kdat.thp_size - PAGE_SIZE;
 		}
 
 		pr_info("vma 0x%"PRIx64" 0x%"PRIx64"\n", vma->e->start, vma->e->end);
@@ -637,6 +959,17 @@ static int premap_private_vma(struct pstree_item *t, struct vma_area *vma, void
 	if (vma->e->flags & MAP_GROWSDOWN)
 		vma->e->start -= PAGE_SIZE;
 
+	/*
+	 * Keep THP-backed VMAs at the same offset from the huge page
+	 * boundary as they are in the task. Otherwise mremap() splits
+	 * their huge pages when the restorer moves them into place.
+	 * The padding left in the premapped area is unmapped by the
+	 * restorer.
+	 */
+	if (vma_area_is(vma, VMA_AREA_THP) && kdat.thp_size)
+		*tgt_addr += (vma->e->start - (unsigned long)*tgt_addr) &
+				(kdat.thp_size - 1);
+
 	size = vma_entry_len(vma->e);
 	if (!vma_inherited(vma)) {
 		int flag = 0;
@@ -675,6 +1008,16 @@ static int premap_private_vma(struct pstree_item *t, struct vma_area *vma, void
 			pr_perror("Unable to map ANON_VMA");
 			return -1;
 		}
+
+		/*
+		 * The restorer applies madvise bits after the contents
+		 * is in place, but for this one it's needed to have the
+		 * contents read into huge pages.
+		 */
+		if (vma_area_is(vma, VMA_AREA_THP) &&
+				(vma->e->madv & (1ul << MADV_HUGEPAGE)) &&
+				madvise(addr, size, MADV_HUGEPAGE))
+			pr_perror("Can't madvise huge pages for %p", addr);
 	} else {
 		void *paddr;
 
@@ -761,7 +1104,19 @@ static int premap_priv_vmas(struct pstree_item *t, struct vm_area_list *vmas,
 		if (!vma_area_is_private(vma, kdat.task_size))
 			continue;
 
-		if (vma->pvma == NULL && pr->pieok && !vma_force_premap(vma, &vmas->h)) {
+		if (opts.lazy_pages && vma->pvma == NULL &&
+				!vma_force_premap(vma, &vmas->h) && vma_can_be_lazy(vma)) {
+			/*
+			 * The contents will be put into the VMA by the
+			 * lazy-pages daemon, the restorer only maps it.
+			 */
+			vma->e->status |= VMA_LAZY | VMA_NO_PROT_WRITE;
+			continue;
+		}
+
+		if (vma->pvma == NULL && pr->pieok && !vma_force_premap(vma, &vmas->h) &&
+				pagemap_range_pieok(pr, vma->e->start, vma->e->end,
+					vma_area_is(vma, VMA_ANON_PRIVATE))) {
 			/*
 			 * VMA in question is not shared with anyone. We'll
 			 * restore it with its contents in restorer.
@@ -790,9 +1145,16 @@ static int premap_priv_vmas(struct pstree_item *t, struct vm_area_list *vmas,
 	return ret;
 }
 
+/*
+ * Pages of inherited vmas are read by runs of up to this many
+ * and compared with the parent's ones after that.
+ */
+#define COW_BATCH_PAGES	64
+
 static int restore_priv_vma_content(struct pstree_item *t, struct page_read *pr)
 {
 	struct vma_area *vma;
+	void *cow_buf = NULL;
 	int ret = 0;
 	struct list_head *vmas = &rsti(t)->vmas.h;
 	struct list_head *vma_io = &rsti(t)->vma_io;
@@ -820,7 +1182,6 @@ static int restore_priv_vma_content(struct pstree_item *t, struct page_read *pr)
 		nr_pages = pr->pe->nr_pages;
 
 		for (i = 0; i < nr_pages; i++) {
-			unsigned char buf[PAGE_SIZE];
 			void *p;
 
 			/*
@@ -851,13 +1212,30 @@ static int restore_priv_vma_content(struct pstree_item *t, struct page_read *pr)
 						(nr_pages - i) * PAGE_SIZE,
 						vma->e->end - va);
 
+				if (vma_area_is(vma, VMA_LAZY)) {
+					if (!pagemap_zero(pr->pe) &&
+							lazy_pages_add_iov(t, va, len))
+						return -1;
+
+					pr->skip_pages(pr, len);
+
+					va += len;
+					i += (len >> PAGE_SHIFT) - 1;
+					continue;
+				}
+
 				if (vma->e->status & VMA_NO_PROT_WRITE) {
 					pr_debug("VMA 0x%"PRIx64":0x%"PRIx64" RO %#lx:%lu IO\n",
 							vma->e->start, vma->e->end, va, nr_pages);
 					BUG();
 				}
 
-				if (pagemap_enqueue_iovec(pr, (void *)va, len, vma_io))
+				/*
+				 * Zero pages are only met here in anonymous
+				 * VMAs, see pagemap_range_pieok().
+				 */
+				if (!pagemap_zero(pr->pe) &&
+						pagemap_enqueue_iovec(pr, (void *)va, len, vma_io))
 					return -1;
 
 				pr->skip_pages(pr, len);
@@ -878,24 +1256,51 @@ static int restore_priv_vma_content(struct pstree_item *t, struct page_read *pr)
 			p = decode_pointer((off) * PAGE_SIZE +
 					vma->premmaped_addr);
 
-			set_bit(off, vma->page_bitmap);
 			if (vma_inherited(vma)) {
-				clear_bit(off, vma->pvma->page_bitmap);
+				int nr, j;
+
+				/* Page aligned, as pages may be read with O_DIRECT */
+				if (!cow_buf) {
+					cow_buf = mmap(NULL, COW_BATCH_PAGES * PAGE_SIZE,
+							PROT_READ | PROT_WRITE,
+							MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+					if (cow_buf == MAP_FAILED) {
+						pr_perror("Can't map COW buffer");
+						cow_buf = NULL;
+						ret = -1;
+						goto err_read;
+					}
+				}
 
-				ret = pr->read_pages(pr, va, 1, buf, 0);
+				/*
+				 * Read the run of pages at once, then leave
+				 * the ones equal to the parent's cowed.
+				 */
+				nr = min_t(int, nr_pages - i, (vma->e->end - va) / PAGE_SIZE);
+				nr = min_t(int, nr, COW_BATCH_PAGES);
+
+				ret = pr->read_pages(pr, va, nr, cow_buf, 0);
 				if (ret < 0)
 					goto err_read;
 
-				va += PAGE_SIZE;
-				nr_compared++;
+				bitmap_set(vma->page_bitmap, off, nr);
+				bitmap_clear(vma->pvma->page_bitmap, off, nr);
 
-				if (memcmp(p, buf, PAGE_SIZE) == 0) {
-					nr_shared++; /* the page is cowed */
-					continue;
+				for (j = 0; j < nr; j++) {
+					void *from = cow_buf + j * PAGE_SIZE;
+
+					if (memcmp(p, from, PAGE_SIZE) == 0)
+						nr_shared++; /* the page is cowed */
+					else {
+						nr_restored++;
+						memcpy(p, from, PAGE_SIZE);
+					}
+					p += PAGE_SIZE;
 				}
 
-				nr_restored++;
-				memcpy(p, buf, PAGE_SIZE);
+				va += nr * PAGE_SIZE;
+				nr_compared += nr;
+				i += nr - 1;
 			} else {
 				int nr;
 
@@ -910,21 +1315,28 @@ static int restore_priv_vma_content(struct pstree_item *t, struct page_read *pr)
 
 				nr = min_t(int, nr_pages - i, (vma->e->end - va) / PAGE_SIZE);
 
-				ret = pr->read_pages(pr, va, nr, p, PR_ASYNC);
-				if (ret < 0)
-					goto err_read;
+				if (pagemap_zero(pr->pe) && vma_area_is(vma, VMA_ANON_PRIVATE))
+					/* Freshly mapped memory is zero already */
+					pr->skip_pages(pr, nr * PAGE_SIZE);
+				else {
+					ret = pr->read_pages(pr, va, nr, p, PR_ASYNC);
+					if (ret < 0)
+						goto err_read;
+				}
 
 				va += nr * PAGE_SIZE;
 				nr_restored += nr;
 				i += nr - 1;
 
-				bitmap_set(vma->page_bitmap, off + 1, nr - 1);
+				bitmap_set(vma->page_bitmap, off, nr);
 			}
 
 		}
 	}
 
 err_read:
+	if (cow_buf)
+		munmap(cow_buf, COW_BATCH_PAGES * PAGE_SIZE);
 	if (pr->sync(pr))
 		return -1;
 
@@ -1002,7 +1414,10 @@ int prepare_mappings(struct pstree_item *t)
 	rsti(t)->premmapped_addr = addr;
 	rsti(t)->premmapped_len = vmas->priv_size;
 
-	ret = open_page_read(vpid(t), &pr, PR_TASK);
+	pages_prefetch_progress(t);
+
+	ret = open_page_read(vpid(t), &pr,
+			PR_TASK | (opts.direct_io ? PR_DIRECT : 0));
 	if (ret <= 0)
 		return -1;
 
@@ -1117,6 +1532,17 @@ static int prepare_vma_ios(struct pstree_item *t, struct task_restore_args *ta)
 		return -1;
 
 	ta->vma_ios_fd = img_raw_fd(pages);
+	if (opts.direct_io)
+		pages_image_direct(pages);
+
+	ta->vma_ios_uring = false;
+	if (opts.io_uring) {
+		if (kdat.has_io_uring)
+			ta->vma_ios_uring = true;
+		else
+			pr_warn_once("io_uring is not supported, reading pages with preadv\n");
+	}
+
 	return pagemap_render_iovec(&rsti(t)->vma_io, ta);
 }
 
@@ -1145,6 +1571,9 @@ int prepare_vmas(struct pstree_item *t, struct task_restore_args *ta)
 			vma_premmaped_start(vme) = vma->premmaped_addr;
 	}
 
+	if (prepare_lazy_pages(t, ta))
+		return -1;
+
 	return prepare_vma_ios(t, ta);
 }
 
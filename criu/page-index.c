@@ -0,0 +1,187 @@
+#include <string.h>
+#include <unistd.h>
+
+#include "types.h"
+#include "image.h"
+#include "page.h"
+#include "page-index.h"
+#include "log.h"
+#include "xmalloc.h"
+#include "common/list.h"
+
+bool page_is_zero(void *page)
+{
+	unsigned long *w = page;
+
+	/*
+	 * The page is zero if its first word is zero and every
+	 * word equals to the next one. The latter is what the
+	 * libc's vectorized memcmp is very good at.
+	 */
+	return w[0] == 0 && !memcmp(page, page + sizeof(*w), PAGE_SIZE - sizeof(*w));
+}
+
+#define HASH_MUL	0x9e3779b97f4a7c15ULL
+
+u64 page_hash(void *page)
+{
+	u64 *w = page, h[4] = { 1, 2, 3, 4 };
+	int i;
+
+	/* Four independent lanes to keep the CPU busy */
+	for (i = 0; i < PAGE_SIZE / sizeof(u64); i += 4) {
+		h[0] = (h[0] ^ w[i + 0]) * HASH_MUL;
+		h[1] = (h[1] ^ w[i + 1]) * HASH_MUL;
+		h[2] = (h[2] ^ w[i + 2]) * HASH_MUL;
+		h[3] = (h[3] ^ w[i + 3]) * HASH_MUL;
+	}
+
+	return h[0] ^ (h[1] >> 16 | h[1] << 48) ^
+		(h[2] >> 32 | h[2] << 32) ^ (h[3] >> 48 | h[3] << 16);
+}
+
+#define PAGE_INDEX_HASH_BITS	16
+#define PAGE_INDEX_HASH_SIZE	(1 << PAGE_INDEX_HASH_BITS)
+
+struct page_index_entry {
+	struct hlist_node	hash;
+	u64			page_hash;
+	u64			off;
+	u32			pages_id;
+};
+
+/* Entries are allocated in bunches, there can be lots of them */
+#define PAGE_INDEX_SLAB		1024
+
+struct page_index_slab {
+	struct page_index_slab	*next;
+	int			nr;
+	struct page_index_entry	e[PAGE_INDEX_SLAB];
+};
+
+static struct hlist_head page_index_hash[PAGE_INDEX_HASH_SIZE];
+static struct page_index_slab *page_index_slabs;
+
+/*
+ * Hash match doesn't guarantee the contents match, so the page
+ * found is read back from the image and compared. These are the
+ * images opened for that.
+ */
+struct page_index_img {
+	struct list_head	l;
+	u32			pages_id;
+	struct cr_img		*img;
+};
+
+static LIST_HEAD(page_index_imgs);
+
+static struct cr_img *page_index_img(u32 pages_id)
+{
+	struct page_index_img *pi;
+
+	list_for_each_entry(pi, &page_index_imgs, l)
+		if (pi->pages_id == pages_id)
+			return pi->img;
+
+	pi = xmalloc(sizeof(*pi));
+	if (!pi)
+		return NULL;
+
+	pi->img = open_image(CR_FD_PAGES, O_RSTR, pages_id);
+	if (!pi->img) {
+		xfree(pi);
+		return NULL;
+	}
+
+	pi->pages_id = pages_id;
+	list_add(&pi->l, &page_index_imgs);
+	return pi->img;
+}
+
+static int page_index_same(void *page, u32 pages_id, u64 off)
+{
+	char buf[PAGE_SIZE];
+	struct cr_img *img;
+	ssize_t ret;
+
+	img = page_index_img(pages_id);
+	if (!img)
+		return -1;
+
+	ret = pread(img_raw_fd(img), buf, PAGE_SIZE, img_raw_off(img) + off);
+	if (ret != PAGE_SIZE) {
+		pr_perror("Can't read back page %u/%"PRIx64" (%zd)", pages_id, off, ret);
+		return -1;
+	}
+
+	return !memcmp(page, buf, PAGE_SIZE);
+}
+
+int page_index_lookup(void *page, u64 hash, u32 *pages_id, u64 *off)
+{
+	struct hlist_head *chain;
+	struct page_index_entry *e;
+
+	chain = &page_index_hash[hash & (PAGE_INDEX_HASH_SIZE - 1)];
+	hlist_for_each_entry(e, chain, hash) {
+		int ret;
+
+		if (e->page_hash != hash)
+			continue;
+
+		ret = page_index_same(page, e->pages_id, e->off);
+		if (ret < 0)
+			return -1;
+		if (ret) {
+			*pages_id = e->pages_id;
+			*off = e->off;
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+int page_index_add(u64 hash, u32 pages_id, u64 off)
+{
+	struct page_index_slab *s = page_index_slabs;
+	struct page_index_entry *e;
+
+	if (!s || s->nr == PAGE_INDEX_SLAB) {
+		s = xmalloc(sizeof(*s));
+		if (!s)
+			return -1;
+
+		s->nr = 0;
+		s->next = page_index_slabs;
+		page_index_slabs = s;
+	}
+
+	e = &s->e[s->nr++];
+	e->page_hash = hash;
+	e->pages_id = pages_id;
+	e->off = off;
+	hlist_add_head(&e->hash, &page_index_hash[hash & (PAGE_INDEX_HASH_SIZE - 1)]);
+
+	return 0;
+}
+
+void page_index_fini(void)
+{
+	struct page_index_img *pi, *n;
+
+	while (page_index_slabs) {
+		struct page_index_slab *s = page_index_slabs;
+
+		page_index_slabs = s->next;
+		xfree(s);
+	}
+
+	memzero(page_index_hash, sizeof(page_index_hash));
+
+	list_for_each_entry_safe(pi, n, &page_index_imgs, l) {
+		close_image(pi->img);
+		xfree(pi);
+	}
+	INIT_LIST_HEAD(&page_index_imgs);
+}
@@ -10,21 +10,31 @@
 #include "page-pipe.h"
 #include "fcntl.h"
 
-/* can existing iov accumulate the page? */
-static inline bool iov_grow_page(struct iovec *iov, unsigned long addr)
+/* can existing iov accumulate the pages? */
+static inline bool iov_grow(struct iovec *iov, unsigned long addr, unsigned long len)
 {
 	if ((unsigned long)iov->iov_base + iov->iov_len == addr) {
-		iov->iov_len += PAGE_SIZE;
+		iov->iov_len += len;
 		return true;
 	}
 
 	return false;
 }
 
-static inline void iov_init(struct iovec *iov, unsigned long addr)
+static inline bool iov_grow_page(struct iovec *iov, unsigned long addr)
+{
+	return iov_grow(iov, addr, PAGE_SIZE);
+}
+
+static inline void iov_init_len(struct iovec *iov, unsigned long addr, unsigned long len)
 {
 	iov->iov_base = (void *)addr;
-	iov->iov_len = PAGE_SIZE;
+	iov->iov_len = len;
+}
+
+static inline void iov_init(struct iovec *iov, unsigned long addr)
+{
+	iov_init_len(iov, addr, PAGE_SIZE);
 }
 
 static struct page_pipe_buf *ppb_alloc(struct page_pipe *pp)
@@ -241,9 +251,64 @@ int page_pipe_add_page(struct page_pipe *pp, unsigned long addr)
 	return ret;
 }
 
+static inline int try_add_pages(struct page_pipe *pp, unsigned long addr,
+		unsigned int nr)
+{
+	struct page_pipe_buf *ppb;
+
+	BUG_ON(list_empty(&pp->bufs));
+	ppb = list_entry(pp->bufs.prev, struct page_pipe_buf, l);
+
+	while (ppb->pages_in + nr > ppb->pipe_size) {
+		unsigned long new_size = ppb->pipe_size << 1;
+
+		if (new_size > PIPE_MAX_SIZE)
+			return 1;
+		if (ppb_resize_pipe(ppb, new_size) < 0)
+			return 1;
+	}
+
+	if (ppb->nr_segs) {
+		if (iov_grow(&ppb->iov[ppb->nr_segs - 1], addr, nr * PAGE_SIZE))
+			goto out;
+
+		if (ppb->nr_segs == UIO_MAXIOV)
+			return 1;
+	}
+
+	iov_init_len(&ppb->iov[ppb->nr_segs++], addr, nr * PAGE_SIZE);
+	pp->free_iov++;
+	BUG_ON(pp->free_iov > pp->nr_iovs);
+out:
+	ppb->pages_in += nr;
+	return 0;
+}
+
+/*
+ * Adds nr pages starting at addr in one go, e.g. a whole huge page.
+ * The pages either all get into one buf, or none of them does and 1
+ * is returned, so that the caller adds them one by one.
+ */
+int page_pipe_add_pages(struct page_pipe *pp, unsigned long addr,
+		unsigned int nr)
+{
+	int ret;
+
+	ret = try_add_pages(pp, addr, nr);
+	if (ret <= 0)
+		return ret;
+
+	ret = page_pipe_grow(pp);
+	if (ret < 0)
+		return ret;
+
+	return try_add_pages(pp, addr, nr);
+}
+
 #define PP_HOLES_BATCH	32
 
-int page_pipe_add_hole(struct page_pipe *pp, unsigned long addr)
+int page_pipe_add_hole(struct page_pipe *pp, unsigned long addr,
+		unsigned long len)
 {
 	if (pp->free_hole >= pp->nr_holes) {
 		pp->holes = xrealloc(pp->holes,
@@ -255,10 +320,10 @@ int page_pipe_add_hole(struct page_pipe *pp, unsigned long addr)
 	}
 
 	if (pp->free_hole &&
-			iov_grow_page(&pp->holes[pp->free_hole - 1], addr))
+			iov_grow(&pp->holes[pp->free_hole - 1], addr, len))
 		goto out;
 
-	iov_init(&pp->holes[pp->free_hole++], addr);
+	iov_init_len(&pp->holes[pp->free_hole++], addr, len);
 
 out:
 	return 0;
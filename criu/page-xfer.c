@@ -1,4 +1,5 @@
 #include <sys/socket.h>
+#include <signal.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <linux/falloc.h>
@@ -6,6 +7,7 @@
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 
 #include "types.h"
 #include "cr_options.h"
@@ -14,11 +16,21 @@
 #include "page-xfer.h"
 #include "page-pipe.h"
 #include "util.h"
+#include "compress.h"
+#include "page-index.h"
+#include "stats.h"
+#include "xmalloc.h"
 #include "protobuf.h"
 #include "images/pagemap.pb-c.h"
 #include "fcntl.h"
 
-static int page_server_sk = -1;
+/*
+ * Connections to the page server. Pages of different images can be
+ * striped across several ones (--ps-connections), but all the pages
+ * of one image always go via the same connection to keep the order.
+ */
+static int page_server_sks[PS_MAX_CONNECTIONS];
+static int nr_page_server_sks;
 
 struct page_server_iov {
 	u32	cmd;
@@ -38,10 +50,21 @@ static void psi2iovec(struct page_server_iov *ps, struct iovec *iov)
 #define PS_IOV_OPEN	3
 #define PS_IOV_OPEN2	4
 #define PS_IOV_PARENT	5
+#define PS_IOV_ITER	6
+#define PS_IOV_BATCH	7
+#define PS_IOV_CONNS	8
 
 #define PS_IOV_FLUSH		0x1023
 #define PS_IOV_FLUSH_N_CLOSE	0x1024
 
+/*
+ * PS_IOV_OPEN2 carries the features the client wants in nr_pages and
+ * the server answers with the ones it has next to PS_OPEN_PARENT. Old
+ * servers ignore the former and answer with the parent bit only.
+ */
+#define PS_OPEN_PARENT	(1 << 0)
+#define PS_FEAT_BATCH	(1 << 1)
+
 #define PS_TYPE_BITS	8
 #define PS_TYPE_MASK	((1 << PS_TYPE_BITS) - 1)
 
@@ -60,6 +83,11 @@ static long decode_pm_id(u64 dst_id)
 	return (long)(dst_id >> PS_TYPE_BITS);
 }
 
+static int page_server_sk(u64 dst_id)
+{
+	return page_server_sks[decode_pm_id(dst_id) % nr_page_server_sks];
+}
+
 static inline int send_psi(int sk, u32 cmd, u32 nr_pages, u64 vaddr, u64 dst_id)
 {
 	struct page_server_iov pi = {
@@ -85,49 +113,147 @@ static inline int send_iov(int sk, u32 cmd, u64 dst_id, struct iovec *iov)
 	return send_psi(sk, cmd, nr_pages, vaddr, dst_id);
 }
 
+/*
+ * The page-server xfer sends pagemap entries and holes in batches --
+ * the PS_IOV_BATCH header with the number of entries, the entries
+ * and then the pages of all the entries one after another.
+ */
+#define PS_BATCH_IOVS	256
+
+struct page_server_batch {
+	struct page_server_iov	hdr;
+	struct page_server_iov	iovs[PS_BATCH_IOVS];
+	int			pipes[PS_BATCH_IOVS];
+	int			nr;
+};
+
 /* page-server xfer */
+static int flush_server_batch(struct page_xfer *xfer)
+{
+	struct page_server_batch *b = xfer->batch;
+	size_t len;
+	int i;
+
+	if (!b->nr)
+		return 0;
+
+	b->hdr.cmd = PS_IOV_BATCH;
+	b->hdr.nr_pages = b->nr;
+	b->hdr.vaddr = 0;
+	b->hdr.dst_id = xfer->dst_id;
+
+	len = sizeof(b->hdr) + b->nr * sizeof(b->iovs[0]);
+	if (write(xfer->sk, &b->hdr, len) != len) {
+		pr_perror("Can't write batch of %d iovs to server", b->nr);
+		return -1;
+	}
+
+	for (i = 0; i < b->nr; i++) {
+		len = b->iovs[i].nr_pages * PAGE_SIZE;
+		if (b->iovs[i].cmd != PS_IOV_ADD)
+			continue;
+
+		pr_debug("Splicing %zu bytes / %u pages into socket\n",
+				len, b->iovs[i].nr_pages);
+
+		if (splice(b->pipes[i], NULL, xfer->sk, NULL, len, SPLICE_F_MOVE) != len) {
+			pr_perror("Can't write pages to socket");
+			return -1;
+		}
+	}
+
+	b->nr = 0;
+	return 0;
+}
+
+static int add_server_batch(struct page_xfer *xfer, u32 cmd, struct iovec *iov)
+{
+	struct page_server_batch *b = xfer->batch;
+	struct page_server_iov *pi;
+
+	if (b->nr == PS_BATCH_IOVS && flush_server_batch(xfer))
+		return -1;
+
+	pi = &b->iovs[b->nr];
+	pi->cmd = cmd;
+	pi->nr_pages = iov->iov_len / PAGE_SIZE;
+	pi->vaddr = encode_pointer(iov->iov_base);
+	pi->dst_id = xfer->dst_id;
+	b->pipes[b->nr] = -1;
+	b->nr++;
+
+	return 0;
+}
+
 static int write_pagemap_to_server(struct page_xfer *xfer,
 		struct iovec *iov)
 {
-	return send_iov(xfer->sk, PS_IOV_ADD, xfer->dst_id, iov);
+	if (!xfer->batch)
+		return send_iov(xfer->sk, PS_IOV_ADD, xfer->dst_id, iov);
+
+	return add_server_batch(xfer, PS_IOV_ADD, iov);
 }
 
 static int write_pages_to_server(struct page_xfer *xfer,
 		int p, unsigned long len)
 {
-	pr_debug("Splicing %lu bytes / %lu pages into socket\n", len, len / PAGE_SIZE);
+	struct page_server_batch *b = xfer->batch;
 
-	if (splice(p, NULL, xfer->sk, NULL, len, SPLICE_F_MOVE) != len) {
-		pr_perror("Can't write pages to socket");
-		return -1;
+	if (!b) {
+		pr_debug("Splicing %lu bytes / %lu pages into socket\n", len, len / PAGE_SIZE);
+
+		if (splice(p, NULL, xfer->sk, NULL, len, SPLICE_F_MOVE) != len) {
+			pr_perror("Can't write pages to socket");
+			return -1;
+		}
+
+		return 0;
 	}
 
+	/* The pages stay in the pipe till the batch is flushed */
+	BUG_ON(!b->nr || b->iovs[b->nr - 1].cmd != PS_IOV_ADD ||
+			b->iovs[b->nr - 1].nr_pages * PAGE_SIZE != len);
+	b->pipes[b->nr - 1] = p;
+
 	return 0;
 }
 
 static int write_hole_to_server(struct page_xfer *xfer, struct iovec *iov)
 {
-	return send_iov(xfer->sk, PS_IOV_HOLE, xfer->dst_id, iov);
+	if (!xfer->batch)
+		return send_iov(xfer->sk, PS_IOV_HOLE, xfer->dst_id, iov);
+
+	return add_server_batch(xfer, PS_IOV_HOLE, iov);
 }
 
 static void close_server_xfer(struct page_xfer *xfer)
 {
+	/*
+	 * A batch is left unsent if the transfer failed. The pages
+	 * stay in the page pipe, which is destroyed by the caller.
+	 */
+	if (xfer->batch && xfer->batch->nr)
+		pr_warn("Dropping batch of %d iovs not sent to server\n",
+				xfer->batch->nr);
+	xfree(xfer->batch);
 	xfer->sk = -1;
 }
 
 static int open_page_server_xfer(struct page_xfer *xfer, int fd_type, long id)
 {
-	char has_parent;
+	char answer;
 
-	xfer->sk = page_server_sk;
+	xfer->dst_id = encode_pm_id(fd_type, id);
+	xfer->sk = page_server_sk(xfer->dst_id);
 	xfer->write_pagemap = write_pagemap_to_server;
 	xfer->write_pages = write_pages_to_server;
 	xfer->write_hole = write_hole_to_server;
 	xfer->close = close_server_xfer;
-	xfer->dst_id = encode_pm_id(fd_type, id);
+	xfer->flush = NULL;
+	xfer->batch = NULL;
 	xfer->parent = NULL;
 
-	if (send_psi(xfer->sk, PS_IOV_OPEN2, 0, 0, xfer->dst_id)) {
+	if (send_psi(xfer->sk, PS_IOV_OPEN2, PS_FEAT_BATCH, 0, xfer->dst_id)) {
 		pr_perror("Can't write to page server");
 		return -1;
 	}
@@ -135,35 +261,68 @@ static int open_page_server_xfer(struct page_xfer *xfer, int fd_type, long id)
 	/* Push the command NOW */
 	tcp_nodelay(xfer->sk, true);
 
-	if (read(xfer->sk, &has_parent, 1) != 1) {
+	if (read(xfer->sk, &answer, 1) != 1) {
 		pr_perror("The page server doesn't answer");
 		return -1;
 	}
 
-	if (has_parent)
+	if (answer & PS_OPEN_PARENT)
 		xfer->parent = (void *) 1; /* This is required for generate_iovs() */
 
+	/* Older servers take iovs one by one */
+	if (answer & PS_FEAT_BATCH) {
+		xfer->batch = xzalloc(sizeof(*xfer->batch));
+		if (!xfer->batch)
+			return -1;
+		xfer->flush = flush_server_batch;
+	}
+
 	return 0;
 }
 
 /* local xfer */
-static int write_pagemap_loc(struct page_xfer *xfer,
-		struct iovec *iov)
+static int dedup_parent_pages(struct page_xfer *xfer, PagemapEntry *pe)
 {
 	int ret;
-	PagemapEntry pe = PAGEMAP_ENTRY__INIT;
 
-	pe.vaddr = encode_pointer(iov->iov_base);
-	pe.nr_pages = iov->iov_len / PAGE_SIZE;
 	if (opts.auto_dedup && xfer->parent != NULL) {
-		ret = dedup_one_iovec(xfer->parent, pe.vaddr,
-				pagemap_len(&pe));
+		ret = dedup_one_iovec(xfer->parent, pe->vaddr,
+				pagemap_len(pe));
 		if (ret == -1) {
 			pr_perror("Auto-deduplication failed");
 			return ret;
 		}
 	}
-	return pb_write_one(xfer->pmi, &pe, PB_PAGEMAP);
+
+	return 0;
+}
+
+static int write_pagemap_entry(struct page_xfer *xfer, PagemapEntry *pe)
+{
+	struct pagemap_rec r;
+
+	if (!xfer->compact)
+		return pb_write_one(xfer->pmi, pe, PB_PAGEMAP);
+
+	BUG_ON(pagemap_compressed(pe) || pagemap_zero(pe) || pagemap_same_as(pe));
+
+	r.vaddr = pe->vaddr;
+	r.nr_pages = pe->nr_pages;
+	r.flags = pe->in_parent ? PAGEMAP_REC_IN_PARENT : 0;
+	return write_img_buf(xfer->pmi, &r, sizeof(r));
+}
+
+static int write_pagemap_loc(struct page_xfer *xfer,
+		struct iovec *iov)
+{
+	PagemapEntry pe = PAGEMAP_ENTRY__INIT;
+
+	pe.vaddr = encode_pointer(iov->iov_base);
+	pe.nr_pages = iov->iov_len / PAGE_SIZE;
+	if (dedup_parent_pages(xfer, &pe))
+		return -1;
+
+	return write_pagemap_entry(xfer, &pe);
 }
 
 static int write_pages_loc(struct page_xfer *xfer,
@@ -172,6 +331,9 @@ static int write_pages_loc(struct page_xfer *xfer,
 	ssize_t ret;
 	ssize_t curr = 0;
 
+	if (img_reserve(xfer->pi, len))
+		return -1;
+
 	while (1) {
 		ret = splice(p, NULL, img_raw_fd(xfer->pi), NULL, len, SPLICE_F_MOVE);
 		if (ret == -1) {
@@ -186,6 +348,366 @@ static int write_pages_loc(struct page_xfer *xfer,
 	return 0;
 }
 
+/*
+ * Buffered local xfer. The pages of one pagemap are collected
+ * from the pipe and then
+ *  - zero pages and pages already written into images are put
+ *    as "zero" and "same-as" pagemap entries (--dedup-pages)
+ *  - the rest is compressed in COMPRESS_BLOCK_SIZE blocks and
+ *    each block is written with its own pagemap entry carrying
+ *    the compressed size (--compress). Blocks that don't compress
+ *    are written as is with the plain pagemap entry.
+ */
+struct page_xfer_buf {
+	struct page_codec	*codec;	/* NULL if not compressing */
+	u32			pages_id;
+	u64			pi_off;	/* current pages image size */
+
+	struct iovec		iov;	/* pagemap being written */
+	unsigned long		got;	/* how many bytes of it we have */
+
+	void			*buf;
+	u64			*hashes; /* of pages in buf */
+	void			*out;
+	struct compress_block	*blocks;
+	unsigned long		size;	/* max length buffers can fit */
+};
+
+static int xfer_grow_buffers(struct page_xfer_buf *c, unsigned long len)
+{
+	unsigned long nr_blocks;
+
+	if (len <= c->size)
+		return 0;
+
+	nr_blocks = DIV_ROUND_UP(len, COMPRESS_BLOCK_SIZE);
+
+	xfree(c->buf);
+	xfree(c->hashes);
+	xfree(c->out);
+	xfree(c->blocks);
+	c->size = 0;
+
+	c->buf = xmalloc(len);
+	c->hashes = xmalloc(len / PAGE_SIZE * sizeof(*c->hashes));
+	if (!c->buf || !c->hashes)
+		return -1;
+
+	if (c->codec) {
+		c->out = xmalloc(nr_blocks * c->codec->bound(COMPRESS_BLOCK_SIZE));
+		c->blocks = xmalloc(nr_blocks * sizeof(*c->blocks));
+		if (!c->out || !c->blocks)
+			return -1;
+	}
+
+	c->size = len;
+	return 0;
+}
+
+static int write_pagemap_buf(struct page_xfer *xfer,
+		struct iovec *iov)
+{
+	struct page_xfer_buf *c = xfer->pbuf;
+	PagemapEntry pe = PAGEMAP_ENTRY__INIT;
+
+	BUG_ON(c->got != c->iov.iov_len);
+
+	pe.vaddr = encode_pointer(iov->iov_base);
+	pe.nr_pages = iov->iov_len / PAGE_SIZE;
+	if (dedup_parent_pages(xfer, &pe))
+		return -1;
+
+	if (xfer_grow_buffers(c, iov->iov_len))
+		return -1;
+
+	c->iov = *iov;
+	c->got = 0;
+	return 0;
+}
+
+static int write_pages_direct_data(struct page_xfer *xfer, void *data, unsigned long len);
+
+static int write_buf_entry(struct page_xfer *xfer, PagemapEntry *pe,
+		void *data, unsigned long len)
+{
+	struct page_xfer_buf *c = xfer->pbuf;
+	int ret = 0;
+
+	if (write_pagemap_entry(xfer, pe) < 0)
+		return -1;
+
+	if (len && xfer->direct)
+		ret = write_pages_direct_data(xfer, data, len);
+	else if (len)
+		ret = write_img_buf(xfer->pi, data, len);
+	if (ret)
+		return -1;
+
+	c->pi_off += len;
+	return 0;
+}
+
+static int write_buf_compressed(struct page_xfer *xfer,
+		unsigned long start, unsigned long len)
+{
+	struct page_xfer_buf *c = xfer->pbuf;
+	unsigned long bound, in = 0, out = 0;
+	bool stats = dump_stats_enabled();
+	int i, nr, ret;
+
+	nr = DIV_ROUND_UP(len, COMPRESS_BLOCK_SIZE);
+	bound = c->codec->bound(COMPRESS_BLOCK_SIZE);
+	for (i = 0; i < nr; i++) {
+		struct compress_block *b = &c->blocks[i];
+		unsigned long off = i * COMPRESS_BLOCK_SIZE;
+
+		b->src = c->buf + start + off;
+		b->len = min_t(unsigned long, len - off, COMPRESS_BLOCK_SIZE);
+		b->dst = c->out + i * bound;
+	}
+
+	if (stats)
+		timing_start(TIME_COMPRESS);
+	ret = compress_blocks(c->codec, c->blocks, nr);
+	if (stats)
+		timing_stop(TIME_COMPRESS);
+	if (ret)
+		return -1;
+
+	for (i = 0; i < nr; i++) {
+		struct compress_block *b = &c->blocks[i];
+		PagemapEntry pe = PAGEMAP_ENTRY__INIT;
+		void *data = b->src;
+		size_t len = b->len;
+
+		pe.vaddr = encode_pointer(c->iov.iov_base) + start + i * COMPRESS_BLOCK_SIZE;
+		pe.nr_pages = b->len / PAGE_SIZE;
+		if (b->clen) {
+			pe.has_codec = true;
+			pe.codec = c->codec->type;
+			pe.has_compressed_size = true;
+			pe.compressed_size = b->clen;
+			data = b->dst;
+			len = b->clen;
+		}
+
+		if (write_buf_entry(xfer, &pe, data, len))
+			return -1;
+
+		in += b->len;
+		out += len;
+	}
+
+	pr_debug("\tcompressed %lu -> %lu bytes in %d blocks\n", in, out, nr);
+	if (stats) {
+		cnt_add(CNT_COMPRESS_IN, in);
+		cnt_add(CNT_COMPRESS_OUT, out);
+	}
+
+	return 0;
+}
+
+static int write_buf_pages(struct page_xfer *xfer,
+		unsigned long start, unsigned long len)
+{
+	struct page_xfer_buf *c = xfer->pbuf;
+	PagemapEntry pe = PAGEMAP_ENTRY__INIT;
+	unsigned long off;
+
+	if (c->codec)
+		return write_buf_compressed(xfer, start, len);
+
+	pe.vaddr = encode_pointer(c->iov.iov_base) + start;
+	pe.nr_pages = len / PAGE_SIZE;
+
+	if (opts.dedup_pages) {
+		/* Let the next pages refer to these ones */
+		for (off = 0; off < len; off += PAGE_SIZE)
+			if (page_index_add(c->hashes[(start + off) / PAGE_SIZE],
+					c->pages_id, c->pi_off + off))
+				return -1;
+	}
+
+	return write_buf_entry(xfer, &pe, c->buf + start, len);
+}
+
+enum {
+	XFER_PAGE_DATA,
+	XFER_PAGE_ZERO,
+	XFER_PAGE_SAME,
+};
+
+struct xfer_page_run {
+	int		type;
+	unsigned long	start;	/* offset in buf */
+	unsigned long	len;
+	u32		same_id;
+	u64		same_off;
+};
+
+static int write_buf_run(struct page_xfer *xfer, struct xfer_page_run *r)
+{
+	struct page_xfer_buf *c = xfer->pbuf;
+	PagemapEntry pe = PAGEMAP_ENTRY__INIT;
+
+	if (!r->len)
+		return 0;
+
+	if (r->type == XFER_PAGE_DATA)
+		return write_buf_pages(xfer, r->start, r->len);
+
+	pe.vaddr = encode_pointer(c->iov.iov_base) + r->start;
+	pe.nr_pages = r->len / PAGE_SIZE;
+
+	if (r->type == XFER_PAGE_ZERO) {
+		pe.has_zero = true;
+		pe.zero = true;
+		if (dump_stats_enabled())
+			cnt_add(CNT_PAGES_ZERO, pe.nr_pages);
+	} else {
+		pe.has_same_as_pages_id = true;
+		pe.same_as_pages_id = r->same_id;
+		pe.has_same_as_off = true;
+		pe.same_as_off = r->same_off;
+		if (dump_stats_enabled())
+			cnt_add(CNT_PAGES_SAME, pe.nr_pages);
+	}
+
+	pr_debug("\t%s %"PRIx64" [%u]\n", pe.zero ? "zero" : "same",
+			pe.vaddr, pe.nr_pages);
+
+	return write_buf_entry(xfer, &pe, NULL, 0);
+}
+
+static int classify_page(struct page_xfer_buf *c, unsigned long off,
+		struct xfer_page_run *r)
+{
+	void *page = c->buf + off;
+	int ret;
+
+	if (page_is_zero(page)) {
+		r->type = XFER_PAGE_ZERO;
+		return 0;
+	}
+
+	r->type = XFER_PAGE_DATA;
+
+	/* Compressed pages are not indexed, so only zeroes can be found */
+	if (c->codec)
+		return 0;
+
+	c->hashes[off / PAGE_SIZE] = page_hash(page);
+	ret = page_index_lookup(page, c->hashes[off / PAGE_SIZE],
+			&r->same_id, &r->same_off);
+	if (ret < 0)
+		return -1;
+	if (ret)
+		r->type = XFER_PAGE_SAME;
+
+	return 0;
+}
+
+/*
+ * Split the pagemap into runs of zero, same-as and data pages,
+ * each run is written as its own pagemap entry.
+ */
+static int write_buf_dedup(struct page_xfer *xfer)
+{
+	struct page_xfer_buf *c = xfer->pbuf;
+	struct xfer_page_run run = { }, page;
+	unsigned long off;
+
+	for (off = 0; off < c->iov.iov_len; off += PAGE_SIZE) {
+		if (classify_page(c, off, &page))
+			return -1;
+
+		if (run.len && page.type == run.type &&
+				(run.type != XFER_PAGE_SAME ||
+				 (page.same_id == run.same_id &&
+				  page.same_off == run.same_off + run.len))) {
+			run.len += PAGE_SIZE;
+			continue;
+		}
+
+		if (write_buf_run(xfer, &run))
+			return -1;
+
+		run = page;
+		run.start = off;
+		run.len = PAGE_SIZE;
+	}
+
+	return write_buf_run(xfer, &run);
+}
+
+static int write_pages_buf(struct page_xfer *xfer,
+		int p, unsigned long len)
+{
+	struct page_xfer_buf *c = xfer->pbuf;
+
+	BUG_ON(c->got + len > c->iov.iov_len);
+
+	while (len) {
+		ssize_t ret;
+
+		ret = read(p, c->buf + c->got, len);
+		if (ret <= 0) {
+			pr_perror("Can't read pages from pipe");
+			return -1;
+		}
+
+		c->got += ret;
+		len -= ret;
+	}
+
+	/*
+	 * The page server feeds pages by pieces of pipe size,
+	 * so wait for the whole pagemap before writing.
+	 */
+	if (c->got < c->iov.iov_len)
+		return 0;
+
+	if (opts.dedup_pages)
+		return write_buf_dedup(xfer);
+
+	return write_buf_pages(xfer, 0, c->iov.iov_len);
+}
+
+static int open_page_xfer_buf(struct page_xfer *xfer, u32 pages_id)
+{
+	struct page_xfer_buf *c;
+
+	c = xzalloc(sizeof(*c));
+	if (!c)
+		return -1;
+
+	if (opts.compress) {
+		c->codec = page_codec_lookup(opts.compress);
+		BUG_ON(!c->codec); /* checked when parsing options */
+	}
+
+	c->pages_id = pages_id;
+	xfer->pbuf = c;
+	xfer->write_pagemap = write_pagemap_buf;
+	xfer->write_pages = write_pages_buf;
+	return 0;
+}
+
+static void close_page_xfer_buf(struct page_xfer *xfer)
+{
+	struct page_xfer_buf *c = xfer->pbuf;
+
+	if (!c)
+		return;
+
+	xfree(c->buf);
+	xfree(c->hashes);
+	xfree(c->out);
+	xfree(c->blocks);
+	xfree(c);
+	xfer->pbuf = NULL;
+}
+
 static int check_pagehole_in_parent(struct page_read *p, struct iovec *iov)
 {
 	int ret;
@@ -248,7 +770,7 @@ static int write_pagehole_loc(struct page_xfer *xfer, struct iovec *iov)
 	pe.has_in_parent = true;
 	pe.in_parent = true;
 
-	if (pb_write_one(xfer->pmi, &pe, PB_PAGEMAP) < 0)
+	if (write_pagemap_entry(xfer, &pe) < 0)
 		return -1;
 
 	return 0;
@@ -261,19 +783,20 @@ static void close_page_xfer(struct page_xfer *xfer)
 		xfree(xfer->parent);
 		xfer->parent = NULL;
 	}
+	close_page_xfer_buf(xfer);
 	close_image(xfer->pi);
 	close_image(xfer->pmi);
 }
 
-static int open_page_local_xfer(struct page_xfer *xfer, int fd_type, long id)
+static int open_page_local_xfer(struct page_xfer *xfer, int fd_type, long id,
+		u32 pages_id)
 {
-	u32 pages_id;
-
 	xfer->pmi = open_image(fd_type, O_DUMP, id);
 	if (!xfer->pmi)
 		return -1;
 
-	xfer->pi = open_pages_image(O_DUMP, xfer->pmi, &pages_id);
+	xfer->compact = opts.compact_pagemaps;
+	xfer->pi = open_pages_image(O_DUMP, xfer->pmi, &pages_id, &xfer->compact);
 	if (!xfer->pi) {
 		close_image(xfer->pmi);
 		return -1;
@@ -318,15 +841,239 @@ out:
 	xfer->write_pages = write_pages_loc;
 	xfer->write_hole = write_pagehole_loc;
 	xfer->close = close_page_xfer;
+	xfer->flush = NULL;
+	xfer->pbuf = NULL;
+	xfer->direct = NULL;
+
+	if ((opts.compress || opts.dedup_pages) &&
+			open_page_xfer_buf(xfer, pages_id)) {
+		close_page_xfer(xfer);
+		return -1;
+	}
+
 	return 0;
 }
 
-int open_page_xfer(struct page_xfer *xfer, int fd_type, long id)
+/*
+ * Direct local xfer (--direct-io). Pages are written into the pages
+ * image bypassing the page cache, so that dump doesn't evict the
+ * working set of the rest of the host. Pages images consist of whole
+ * pages only, so plain pages are written with O_DIRECT from a page
+ * aligned buffer. When it's not possible (the filesystem doesn't
+ * support it, or the data is compressed and thus not aligned) the
+ * pages are written as usual, then flushed and dropped from the
+ * page cache, one DIRECT_STAGE_SIZE window behind the writes.
+ */
+#define DIRECT_BUF_SIZE		(1 << 20)
+#define DIRECT_STAGE_SIZE	(8 << 20)
+
+struct page_xfer_direct {
+	void		*buf;
+	unsigned long	fill;		/* bytes in buf */
+	bool		odirect;
+	u64		off;		/* written into the image */
+	u64		dropped;	/* dropped from page cache */
+};
+
+static int drop_written_pages(struct page_xfer *xfer, u64 upto)
+{
+	struct page_xfer_direct *d = xfer->direct;
+	int fd = img_raw_fd(xfer->pi);
+	u64 len = upto - d->dropped;
+
+	if (sync_file_range(fd, d->dropped, len, SYNC_FILE_RANGE_WAIT_BEFORE |
+				SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER)) {
+		pr_perror("Can't flush pages image");
+		return -1;
+	}
+
+	/* Not fatal, the pages just stay cached */
+	posix_fadvise(fd, d->dropped, len, POSIX_FADV_DONTNEED);
+	d->dropped = upto;
+	return 0;
+}
+
+static int write_pages_direct_data(struct page_xfer *xfer, void *data, unsigned long len)
+{
+	struct page_xfer_direct *d = xfer->direct;
+	int fd = img_raw_fd(xfer->pi);
+	unsigned long done = 0;
+
+	while (done < len) {
+		ssize_t ret;
+
+		ret = write(fd, data + done, len - done);
+		if (ret < 0 && errno == EINVAL && d->odirect) {
+			pr_warn("O_DIRECT doesn't work for pages image, "
+					"dropping page cache instead\n");
+			if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_DIRECT)) {
+				pr_perror("Can't turn O_DIRECT off");
+				return -1;
+			}
+			d->odirect = false;
+			d->dropped = d->off;
+			continue;
+		}
+		if (ret <= 0) {
+			pr_perror("Can't write pages image");
+			return -1;
+		}
+
+		done += ret;
+	}
+
+	d->off += len;
+	if (d->odirect)
+		return 0;
+
+	/* Start writeback now, wait for it a window later */
+	if (sync_file_range(fd, d->off - len, len, SYNC_FILE_RANGE_WRITE)) {
+		pr_perror("Can't start pages image writeback");
+		return -1;
+	}
+
+	if (d->off - d->dropped >= 2 * DIRECT_STAGE_SIZE)
+		return drop_written_pages(xfer, d->off - DIRECT_STAGE_SIZE);
+
+	return 0;
+}
+
+/*
+ * Pages are collected in the buffer across the calls, so that small
+ * iovs don't turn into small synchronous writes, and the buffer is
+ * written when full and on flush.
+ */
+static int write_pages_direct(struct page_xfer *xfer,
+		int p, unsigned long len)
+{
+	struct page_xfer_direct *d = xfer->direct;
+
+	while (len) {
+		ssize_t ret;
+
+		ret = read(p, d->buf + d->fill,
+				min_t(unsigned long, len, DIRECT_BUF_SIZE - d->fill));
+		if (ret <= 0) {
+			pr_perror("Can't read pages from pipe");
+			return -1;
+		}
+
+		d->fill += ret;
+		len -= ret;
+		if (d->fill < DIRECT_BUF_SIZE)
+			continue;
+
+		if (write_pages_direct_data(xfer, d->buf, d->fill))
+			return -1;
+		d->fill = 0;
+	}
+
+	return 0;
+}
+
+static int flush_page_direct(struct page_xfer *xfer)
+{
+	struct page_xfer_direct *d = xfer->direct;
+	unsigned long aligned;
+
+	/*
+	 * The page server feeds pages by pieces of any size,
+	 * the partial page waits for the rest of it.
+	 */
+	aligned = d->fill & ~(PAGE_SIZE - 1);
+	if (!aligned)
+		return 0;
+
+	if (write_pages_direct_data(xfer, d->buf, aligned))
+		return -1;
+
+	d->fill -= aligned;
+	memmove(d->buf, d->buf + aligned, d->fill);
+	return 0;
+}
+
+static void close_page_direct_xfer(struct page_xfer *xfer)
+{
+	struct page_xfer_direct *d = xfer->direct;
+
+	/* Flushed unless the transfer has failed */
+	if (d->fill >= PAGE_SIZE)
+		pr_err("Dropping %lu bytes of pages not written\n", d->fill);
+	/* The client went away in the middle of a page */
+	else if (d->fill)
+		pr_err("Dropping %lu bytes of a partial page\n", d->fill);
+	if (!d->odirect && d->off > d->dropped)
+		drop_written_pages(xfer, d->off);
+
+	munmap(d->buf, DIRECT_BUF_SIZE);
+	xfree(d);
+	xfer->direct = NULL;
+
+	close_page_xfer(xfer);
+}
+
+static int open_page_direct_xfer(struct page_xfer *xfer, int fd_type, long id,
+		u32 pages_id)
+{
+	struct page_xfer_direct *d;
+	int fd;
+
+	if (open_page_local_xfer(xfer, fd_type, id, pages_id))
+		return -1;
+
+	d = xzalloc(sizeof(*d));
+	if (!d)
+		goto err;
+
+	d->buf = mmap(NULL, DIRECT_BUF_SIZE, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (d->buf == MAP_FAILED) {
+		pr_perror("Can't allocate direct write buffer");
+		xfree(d);
+		goto err;
+	}
+
+	xfer->direct = d;
+	xfer->close = close_page_direct_xfer;
+
+	/* The buffered xfer writes data of any length from any place */
+	if (xfer->pbuf)
+		return 0;
+
+	xfer->write_pages = write_pages_direct;
+	xfer->flush = flush_page_direct;
+
+	fd = img_raw_fd(xfer->pi);
+	if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_DIRECT) == 0)
+		d->odirect = true;
+	else
+		pr_warn("Can't write pages image with O_DIRECT, "
+				"dropping page cache instead\n");
+
+	return 0;
+
+err:
+	close_page_xfer(xfer);
+	return -1;
+}
+
+/*
+ * A non-zero @pages_id is the id of the pages image allocated in
+ * advance (see alloc_page_id), the page server allocates its own.
+ */
+int open_page_xfer_id(struct page_xfer *xfer, int fd_type, long id, u32 pages_id)
 {
 	if (opts.use_page_server)
 		return open_page_server_xfer(xfer, fd_type, id);
+	else if (opts.direct_io)
+		return open_page_direct_xfer(xfer, fd_type, id, pages_id);
 	else
-		return open_page_local_xfer(xfer, fd_type, id);
+		return open_page_local_xfer(xfer, fd_type, id, pages_id);
+}
+
+int open_page_xfer(struct page_xfer *xfer, int fd_type, long id)
+{
+	return open_page_xfer_id(xfer, fd_type, id, 0);
 }
 
 static int page_xfer_dump_hole(struct page_xfer *xfer,
@@ -395,7 +1142,15 @@ int page_xfer_dump_pages(struct page_xfer *xfer, struct page_pipe *pp,
 		}
 	}
 
-	return dump_holes(xfer, pp, &cur_hole, NULL, off);
+	ret = dump_holes(xfer, pp, &cur_hole, NULL, off);
+	if (ret)
+		return ret;
+
+	/* The pipes are reused by the caller, send what's there */
+	if (xfer->flush)
+		return xfer->flush(xfer);
+
+	return 0;
 }
 
 /*
@@ -450,19 +1205,20 @@ static int page_server_check_parent(int sk, struct page_server_iov *pi)
 static int check_parent_server_xfer(int fd_type, long id)
 {
 	struct page_server_iov pi = {};
-	int has_parent;
+	int has_parent, sk;
 
 	pi.cmd = PS_IOV_PARENT;
 	pi.dst_id = encode_pm_id(fd_type, id);
+	sk = page_server_sk(pi.dst_id);
 
-	if (write(page_server_sk, &pi, sizeof(pi)) != sizeof(pi)) {
+	if (write(sk, &pi, sizeof(pi)) != sizeof(pi)) {
 		pr_perror("Can't write to page server");
 		return -1;
 	}
 
-	tcp_nodelay(page_server_sk, true);
+	tcp_nodelay(sk, true);
 
-	if (read(page_server_sk, &has_parent, sizeof(int)) != sizeof(int)) {
+	if (read(sk, &has_parent, sizeof(int)) != sizeof(int)) {
 		pr_perror("The page server doesn't answer");
 		return -1;
 	}
@@ -489,6 +1245,15 @@ static struct page_xfer_job cxfer = {
 	.dst_id = ~0,
 };
 
+/* Writes what the xfer keeps, before the answer to the client */
+static int page_server_flush(void)
+{
+	if (cxfer.dst_id == ~0 || !cxfer.loc_xfer.flush)
+		return 0;
+
+	return cxfer.loc_xfer.flush(&cxfer.loc_xfer);
+}
+
 static void page_server_close(void)
 {
 	if (cxfer.dst_id != ~0)
@@ -497,24 +1262,34 @@ static void page_server_close(void)
 
 static int page_server_open(int sk, struct page_server_iov *pi)
 {
-	int type;
+	int type, ret;
 	long id;
 
 	type = decode_pm_type(pi->dst_id);
 	id = decode_pm_id(pi->dst_id);
 	pr_info("Opening %d/%ld\n", type, id);
 
+	if (page_server_flush())
+		return -1;
 	page_server_close();
 
-	if (open_page_local_xfer(&cxfer.loc_xfer, type, id))
+	if (opts.direct_io)
+		ret = open_page_direct_xfer(&cxfer.loc_xfer, type, id, 0);
+	else
+		ret = open_page_local_xfer(&cxfer.loc_xfer, type, id, 0);
+	if (ret)
 		return -1;
 
 	cxfer.dst_id = pi->dst_id;
 
 	if (sk >= 0) {
-		char has_parent = !!cxfer.loc_xfer.parent;
+		char answer = cxfer.loc_xfer.parent ? PS_OPEN_PARENT : 0;
 
-		if (write(sk, &has_parent, 1) != 1) {
+		/* Clients not asking for features take any non-zero as parent */
+		if (pi->nr_pages & PS_FEAT_BATCH)
+			answer |= PS_FEAT_BATCH;
+
+		if (write(sk, &answer, 1) != 1) {
 			pr_perror("Unable to send response");
 			close_page_xfer(&cxfer.loc_xfer);
 			return -1;
@@ -602,6 +1377,62 @@ static int page_server_hole(int sk, struct page_server_iov *pi)
 	return 0;
 }
 
+static int page_server_batch(int sk, struct page_server_iov *pi)
+{
+	struct page_server_iov iovs[PS_BATCH_IOVS];
+	size_t len;
+	int i, ret;
+
+	if (pi->nr_pages > PS_BATCH_IOVS) {
+		pr_err("Batch of %u iovs is too long\n", pi->nr_pages);
+		return -1;
+	}
+
+	len = pi->nr_pages * sizeof(iovs[0]);
+	if (recv(sk, iovs, len, MSG_WAITALL) != len) {
+		pr_perror("Can't read batch from socket");
+		return -1;
+	}
+
+	/* The pages of the entries follow the entries in the same order */
+	for (i = 0; i < pi->nr_pages; i++) {
+		iovs[i].dst_id = pi->dst_id;
+
+		switch (iovs[i].cmd) {
+		case PS_IOV_ADD:
+			ret = page_server_add(sk, &iovs[i]);
+			break;
+		case PS_IOV_HOLE:
+			ret = page_server_hole(sk, &iovs[i]);
+			break;
+		default:
+			pr_err("Unexpected command %u in batch\n", iovs[i].cmd);
+			ret = -1;
+		}
+
+		if (ret)
+			return -1;
+	}
+
+	return 0;
+}
+
+static int page_server_iter(struct page_server_iov *pi)
+{
+	pr_info("Switching to iterative dump pass %"PRIu64" (parent %"PRIu64")\n",
+			pi->dst_id, pi->vaddr);
+
+	if (page_server_flush())
+		return -1;
+	page_server_close();
+	cxfer.dst_id = ~0;
+
+	/* Pages found in the index live in the old images dir */
+	page_index_fini();
+
+	return open_iter_image_dir(pi->dst_id, pi->vaddr);
+}
+
 static int page_server_serve(int sk)
 {
 	int ret = -1;
@@ -654,12 +1485,28 @@ static int page_server_serve(int sk)
 		case PS_IOV_HOLE:
 			ret = page_server_hole(sk, &pi);
 			break;
+		case PS_IOV_BATCH:
+			ret = page_server_batch(sk, &pi);
+			break;
+		case PS_IOV_ITER:
+			ret = page_server_iter(&pi);
+			break;
+		case PS_IOV_CONNS:
+			/* page_server_serve_conns() takes it when it's fine */
+			pr_err("Dump uses %u connections, more than --ps-connections %u\n",
+					pi.nr_pages, opts.ps_connections);
+			ret = -1;
+			break;
 		case PS_IOV_FLUSH:
 		case PS_IOV_FLUSH_N_CLOSE:
 		{
 			int32_t status = 0;
 
 			ret = 0;
+			if (page_server_flush()) {
+				status = -1;
+				ret = -1;
+			}
 
 			/*
 			 * An answer must be sent back to inform another side,
@@ -703,16 +1550,121 @@ static int page_server_serve(int sk)
 	}
 
 	page_server_close();
+	page_index_fini();
 	pr_info("Session over\n");
 
 	close(sk);
 	return ret;
 }
 
+/*
+ * The dump using several connections tells how many on the first one,
+ * so that the server doesn't wait for more. Dumps with one connection
+ * (and older ones) start with an image open instead.
+ */
+static int page_server_nr_conns(int ask)
+{
+	struct page_server_iov pi;
+	int ret;
+
+	ret = recv(ask, &pi, sizeof(pi), MSG_WAITALL | MSG_PEEK);
+	if (ret != sizeof(pi)) {
+		if (ret < 0)
+			pr_perror("Can't read from page server connection");
+		else
+			pr_err("Page server connection is closed\n");
+		return -1;
+	}
+
+	if (pi.cmd != PS_IOV_CONNS)
+		return 1;
+
+	if (pi.nr_pages < 1 || pi.nr_pages > opts.ps_connections) {
+		pr_err("Dump uses %u connections, page server accepts 1..%u\n",
+				pi.nr_pages, opts.ps_connections);
+		return -1;
+	}
+
+	if (recv(ask, &pi, sizeof(pi), MSG_WAITALL) != sizeof(pi)) {
+		pr_perror("Can't read from page server connection");
+		return -1;
+	}
+
+	return pi.nr_pages;
+}
+
+/*
+ * With --ps-connections each connection is served by its own process.
+ * All the pages of an image come via one connection, so the processes
+ * share nothing but the images dir and take turns in pages images IDs.
+ */
+static int page_server_serve_conns(int ask, int lsk)
+{
+	pid_t pids[PS_MAX_CONNECTIONS];
+	int i, nr = 1, nr_conns, ret = -1;
+
+	nr_conns = page_server_nr_conns(ask);
+	if (nr_conns < 0)
+		goto err;
+
+	for (i = 1; i < nr_conns; i++) {
+		int sk;
+
+		sk = accept(lsk, NULL, NULL);
+		if (sk < 0) {
+			pr_perror("Can't accept page server connection %d", i);
+			goto err;
+		}
+
+		pids[i] = fork();
+		if (pids[i] < 0) {
+			pr_perror("Can't fork page server");
+			close(sk);
+			goto err;
+		}
+
+		if (pids[i] == 0) {
+			close(lsk);
+			close(ask);
+			split_page_ids(nr_conns, i);
+			exit(page_server_serve(sk) ? 1 : 0);
+		}
+
+		close(sk);
+		nr++;
+	}
+
+	close_safe(&lsk);
+	split_page_ids(nr_conns, 0);
+	ret = page_server_serve(ask);
+	ask = -1;
+err:
+	if (ret) {
+		close_safe(&ask);
+		for (i = 1; i < nr; i++)
+			kill(pids[i], SIGKILL);
+	}
+
+	for (i = 1; i < nr; i++) {
+		int status;
+
+		if (waitpid(pids[i], &status, 0) != pids[i]) {
+			pr_perror("Can't wait page server %d", pids[i]);
+			ret = -1;
+		} else if (!WIFEXITED(status) || WEXITSTATUS(status)) {
+			pr_err("Page server %d failed (status %#x)\n", pids[i], status);
+			ret = -1;
+		}
+	}
+
+	close_safe(&lsk);
+	return ret;
+}
+
 int cr_page_server(bool daemon_mode, int cfd)
 {
 	int ask = -1;
-	int sk = -1;
+	int sk = -1, lsk = -1;
 	int ret;
 
 	up_page_ids_base();
@@ -727,13 +1679,29 @@ int cr_page_server(bool daemon_mode, int cfd)
 	sk = setup_tcp_server("page");
 	if (sk == -1)
 		return -1;
+
+	/* The first connection is accepted by run_tcp_server, the rest by us */
+	if (opts.ps_connections > 1) {
+		lsk = dup(sk);
+		if (lsk < 0) {
+			pr_perror("Can't dup page server socket");
+			close(sk);
+			return -1;
+		}
+	}
 no_server:
 	ret = run_tcp_server(daemon_mode, &ask, cfd, sk);
-	if (ret != 0)
+	if (ret != 0) {
+		close_safe(&lsk);
 		return ret > 0 ? 0 : -1;
+	}
 
-	if (ask >= 0)
-		ret = page_server_serve(ask);
+	if (ask >= 0) {
+		if (lsk >= 0)
+			ret = page_server_serve_conns(ask, lsk);
+		else
+			ret = page_server_serve(ask);
+	}
 
 	if (daemon_mode)
 		exit(ret);
@@ -741,67 +1709,122 @@ no_server:
 	return ret;
 }
 
+/*
+ * The iterative dump pass the connection is used by, -1 when the
+ * dump is not iterative. The connection is established once for
+ * all the passes and each pass tells the server which images dir
+ * to put pages into.
+ */
+static int page_server_pass = -1;
+
+int page_server_start_pass(int pass, int parent)
+{
+	int i;
+
+	page_server_pass = pass;
+
+	if (!opts.use_page_server)
+		return 0;
+
+	for (i = 0; i < nr_page_server_sks; i++)
+		if (send_psi(page_server_sks[i], PS_IOV_ITER, 0, parent, pass))
+			return -1;
+
+	return 0;
+}
+
 int connect_to_page_server(void)
 {
+	int i;
+
 	if (!opts.use_page_server)
 		return 0;
 
+	if (nr_page_server_sks)
+		/* Connected before the iterative dump passes */
+		return 0;
+
 	if (opts.ps_socket != -1) {
-		page_server_sk = opts.ps_socket;
-		pr_info("Re-using ps socket %d\n", page_server_sk);
+		page_server_sks[nr_page_server_sks++] = opts.ps_socket;
+		pr_info("Re-using ps socket %d\n", opts.ps_socket);
 		goto out;
 	}
 
-	page_server_sk = setup_tcp_client(opts.addr);
-	if (page_server_sk == -1)
+	for (i = 0; i < opts.ps_connections; i++) {
+		int sk;
+
+		sk = setup_tcp_client(opts.addr);
+		if (sk == -1) {
+			while (nr_page_server_sks)
+				close(page_server_sks[--nr_page_server_sks]);
+			return -1;
+		}
+
+		page_server_sks[nr_page_server_sks++] = sk;
+	}
+
+	/* See page_server_nr_conns() */
+	if (nr_page_server_sks > 1 &&
+	    send_psi(page_server_sks[0], PS_IOV_CONNS, nr_page_server_sks, 0, 0)) {
+		while (nr_page_server_sks)
+			close(page_server_sks[--nr_page_server_sks]);
 		return -1;
+	}
 out:
 	/*
 	 * CORK the socket at the very beginning. As per ANK
 	 * the corked by default socket with sporadic NODELAY-s
 	 * on urgent data is the smartest mode ever.
 	 */
-	tcp_cork(page_server_sk, true);
+	for (i = 0; i < nr_page_server_sks; i++)
+		tcp_cork(page_server_sks[i], true);
 	return 0;
 }
 
 int disconnect_from_page_server(void)
 {
 	struct page_server_iov pi = { };
-	int32_t status = -1;
-	int ret = -1;
+	int i, ret = 0;
 
 	if (!opts.use_page_server)
 		return 0;
 
-	if (page_server_sk == -1)
+	if (!nr_page_server_sks)
 		return 0;
 
 	pr_info("Disconnect from the page server %s:%u\n",
 			opts.addr, (int)ntohs(opts.port));
 
-	if (opts.ps_socket != -1)
+	if (opts.ps_socket != -1 && page_server_pass <= 0)
 		/*
 		 * The socket might not get closed (held by
 		 * the parent process) so we must order the
-		 * page-server to terminate itself.
+		 * page-server to terminate itself. Unless
+		 * there are more iterative dump passes.
 		 */
 		pi.cmd = PS_IOV_FLUSH_N_CLOSE;
 	else
 		pi.cmd = PS_IOV_FLUSH;
 
-	if (write(page_server_sk, &pi, sizeof(pi)) != sizeof(pi)) {
-		pr_perror("Can't write the fini command to server");
-		goto out;
-	}
+	/* Send the command everywhere first, then collect the answers */
+	for (i = 0; i < nr_page_server_sks; i++)
+		if (write(page_server_sks[i], &pi, sizeof(pi)) != sizeof(pi)) {
+			pr_perror("Can't write the fini command to server");
+			ret = -1;
+		}
 
-	if (read(page_server_sk, &status, sizeof(status)) != sizeof(status)) {
-		pr_perror("The page server doesn't answer");
-		goto out;
+	for (i = 0; i < nr_page_server_sks; i++) {
+		int32_t status = -1;
+
+		if (read(page_server_sks[i], &status, sizeof(status)) != sizeof(status)) {
+			pr_perror("The page server doesn't answer");
+			ret = -1;
+		} else if (status)
+			ret = status;
+
+		close(page_server_sks[i]);
 	}
 
-	ret = 0;
-out:
-	close_safe(&page_server_sk);
-	return ret ? : status;
+	nr_page_server_sks = 0;
+	return ret;
 }
@@ -1,5 +1,7 @@
 #include <unistd.h>
 #include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
 
 #include "page.h"
 #include "pagemap-cache.h"
@@ -22,6 +24,40 @@
 
 #define PAGEMAP_LEN(addr)	(PAGE_PFN(addr) * sizeof(u64))
 
+/*
+ * The PAGEMAP_SCAN ioctl (linux v6.8 for soft-dirty) walks page tables
+ * in the kernel and reports ranges of pages with the same properties,
+ * skipping unpopulated ones. Its ABI is copied here as system headers
+ * may miss it.
+ */
+#ifndef PAGEMAP_SCAN
+#define PAGE_IS_FILE		(1 << 2)
+#define PAGE_IS_PRESENT		(1 << 3)
+#define PAGE_IS_SWAPPED		(1 << 4)
+#define PAGE_IS_PFNZERO		(1 << 5)
+#define PAGE_IS_SOFT_DIRTY	(1 << 7)
+
+struct pm_scan_arg {
+	u64 size;
+	u64 flags;
+	u64 start;
+	u64 end;
+	u64 walk_end;
+	u64 vec;
+	u64 vec_len;
+	u64 max_pages;
+	u64 category_inverted;
+	u64 category_mask;
+	u64 category_anyof_mask;
+	u64 return_mask;
+};
+
+#define PAGEMAP_SCAN		_IOWR('f', 16, struct pm_scan_arg)
+#endif
+
+/* Regions pmc_scan() reports at once */
+#define PMC_SCAN_REGIONS	512
+
 /*
  * It's a workaround for a kernel bug. In the 3.19 kernel when pagemap are read
  * for a few vma-s for one read call, it returns incorrect data.
@@ -55,6 +91,12 @@ int pmc_init(pmc_t *pmc, pid_t pid, const struct list_head *vma_head, size_t siz
 	if (!pmc->map)
 		goto err;
 
+	if (kdat.has_pagemap_scan) {
+		pmc->regs = xmalloc(PMC_SCAN_REGIONS * sizeof(struct pmc_region));
+		if (!pmc->regs)
+			goto err;
+	}
+
 	if (pagemap_cache_disabled)
 		pr_debug("The pagemap cache is disabled\n");
 
@@ -180,10 +222,111 @@ u64 *pmc_get_map(pmc_t *pmc, const struct vma_area *vma)
 	return __pmc_get_map(pmc, vma->e->start);
 }
 
+static int pm_scan(int fd, struct pm_scan_arg *arg, unsigned long start,
+		unsigned long end, struct pmc_region *regs, unsigned int nr)
+{
+	memzero(arg, sizeof(*arg));
+	arg->size = sizeof(*arg);
+	arg->start = start;
+	arg->end = end;
+	arg->vec = (unsigned long)regs;
+	arg->vec_len = nr;
+
+	/* Present or swapped, but not the zero page */
+	arg->category_anyof_mask = PAGE_IS_PRESENT | PAGE_IS_SWAPPED;
+	arg->category_inverted = PAGE_IS_PFNZERO;
+	arg->category_mask = PAGE_IS_PFNZERO;
+	arg->return_mask = PAGE_IS_PRESENT | PAGE_IS_SWAPPED |
+			   PAGE_IS_FILE | PAGE_IS_SOFT_DIRTY;
+
+	return ioctl(fd, PAGEMAP_SCAN, arg);
+}
+
+static u64 pm_scan_pme(u64 categories)
+{
+	u64 pme = 0;
+
+	if (categories & PAGE_IS_PRESENT)
+		pme |= PME_PRESENT;
+	if (categories & PAGE_IS_SWAPPED)
+		pme |= PME_SWAP;
+	if (categories & PAGE_IS_FILE)
+		pme |= PME_FILE;
+	if (categories & PAGE_IS_SOFT_DIRTY)
+		pme |= PME_SOFT_DIRTY;
+
+	return pme;
+}
+
+int pmc_scan(pmc_t *pmc, unsigned long start, unsigned long end,
+		unsigned long *walk_end)
+{
+	struct pm_scan_arg arg;
+	int nr, i;
+
+	BUG_ON(!pmc->regs);
+
+	nr = pm_scan(pmc->fd, &arg, start, end, pmc->regs, PMC_SCAN_REGIONS);
+	if (nr < 0) {
+		pr_perror("Can't scan %d's pagemap %lx-%lx", pmc->pid, start, end);
+		return -1;
+	}
+
+	/*
+	 * The kernel reports page_region-s, their categories are
+	 * converted into PME bits in place.
+	 */
+	for (i = 0; i < nr; i++)
+		pmc->regs[i].pme = pm_scan_pme(pmc->regs[i].pme);
+
+	*walk_end = arg.walk_end;
+	return nr;
+}
+
+int kerndat_pagemap_scan(void)
+{
+	struct pm_scan_arg arg;
+	struct pmc_region reg;
+	int fd, ret;
+	void *addr;
+
+	kdat.has_pagemap_scan = false;
+	if (kdat.pmap == PM_DISABLED)
+		return 0;
+
+	addr = mmap(NULL, PAGE_SIZE, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (addr == MAP_FAILED) {
+		pr_perror("Can't map page for pagemap scan");
+		return -1;
+	}
+	*(int *)addr = 1;
+
+	fd = open("/proc/self/pagemap", O_RDONLY);
+	if (fd < 0) {
+		pr_perror("Can't open self pagemap");
+		munmap(addr, PAGE_SIZE);
+		return -1;
+	}
+
+	/* Older kernels fail with ENOTTY, or EINVAL for the soft-dirty bit */
+	ret = pm_scan(fd, &arg, (unsigned long)addr,
+			(unsigned long)addr + PAGE_SIZE, &reg, 1);
+	if (ret == 1)
+		kdat.has_pagemap_scan = true;
+	else
+		pr_info("Pagemap scan is not supported (%d)\n", ret);
+
+	close(fd);
+	munmap(addr, PAGE_SIZE);
+	return 0;
+}
+
 void pmc_fini(pmc_t *pmc)
 {
 	close_safe(&pmc->fd);
 	xfree(pmc->map);
+	xfree(pmc->regs);
 	pmc_reset(pmc);
 }
 
@@ -3,6 +3,7 @@
 #include <unistd.h>
 #include <linux/falloc.h>
 #include <sys/uio.h>
+#include <sys/file.h>
 #include <limits.h>
 
 #include "types.h"
@@ -14,6 +15,7 @@
 #include "rst-malloc.h"
 #include "fault-injection.h"
 #include "xmalloc.h"
+#include "compress.h"
 #include "protobuf.h"
 #include "images/pagemap.pb-c.h"
 
@@ -59,7 +61,8 @@ static int punch_hole(struct page_read *pr, unsigned long off,
 		if (bunch->iov_len > 0) {
 			pr_debug("Punch!/%p/%zu/\n", bunch->iov_base, bunch->iov_len);
 			ret = fallocate(img_raw_fd(pr->pi), FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
-					(unsigned long)bunch->iov_base, bunch->iov_len);
+					img_raw_off(pr->pi) + (unsigned long)bunch->iov_base,
+					bunch->iov_len);
 			if (ret != 0) {
 				pr_perror("Error punching hole");
 				return -1;
@@ -72,6 +75,19 @@ static int punch_hole(struct page_read *pr, unsigned long off,
 	return 0;
 }
 
+/*
+ * Compressed block can only be punched as a whole, so do it
+ * only if the whole entry is met.
+ */
+static int punch_compressed(struct page_read *pr, unsigned long off,
+			    unsigned long end)
+{
+	if (off != pr->pe->vaddr || end != pr->pe->vaddr + pagemap_len(pr->pe))
+		return 0;
+
+	return punch_hole(pr, pr->pi_off, pr->pe->compressed_size, false);
+}
+
 static int seek_pagemap_page(struct page_read *pr, unsigned long vaddr);
 
 int dedup_one_iovec(struct page_read *pr, unsigned long off, unsigned long len)
@@ -96,7 +112,11 @@ int dedup_one_iovec(struct page_read *pr, unsigned long off, unsigned long len)
 		if (!pr->pe)
 			return -1;
 		piov_end = pr->pe->vaddr + pagemap_len(pr->pe);
-		if (!pr->pe->in_parent) {
+		if (pagemap_compressed(pr->pe)) {
+			ret = punch_compressed(pr, off, min(piov_end, iov_end));
+			if (ret == -1)
+				return ret;
+		} else if (pagemap_raw_pages(pr->pe)) {
 			ret = punch_hole(pr, pr->pi_off, min(piov_end, iov_end) - off, false);
 			if (ret == -1)
 				return ret;
@@ -123,6 +143,14 @@ int dedup_one_iovec(struct page_read *pr, unsigned long off, unsigned long len)
 
 static int advance(struct page_read *pr)
 {
+	/*
+	 * Compressed entry is read as a whole, so the pi_off stays
+	 * at its beginning and jumps over it only when leaving.
+	 */
+	if (pr->pe && pr->curr_pme < pr->nr_pmes &&
+			!pr->pe->in_parent && pagemap_compressed(pr->pe))
+		pr->pi_off += pr->pe->compressed_size;
+
 	pr->curr_pme++;
 	if (pr->curr_pme >= pr->nr_pmes)
 		return 0;
@@ -138,7 +166,7 @@ static void skip_pagemap_pages(struct page_read *pr, unsigned long len)
 	if (!len)
 		return;
 
-	if (!pr->pe->in_parent)
+	if (pagemap_raw_pages(pr->pe))
 		pr->pi_off += len;
 	pr->cvaddr += len;
 }
@@ -189,12 +217,101 @@ static inline void pagemap_bound_check(PagemapEntry *pe, unsigned long vaddr, in
 	}
 }
 
+/*
+ * A run of pages of a pagemap entry, which is not in_parent, as seen
+ * from the top of the parents chain.
+ */
+struct pagemap_extent {
+	unsigned long		vaddr;
+	unsigned long		end;
+	PagemapEntry		*pe;	/* the entry with the pages */
+	struct page_read	*pr;	/* page_read the pe belongs to */
+	off_t			off;	/* pe's offset in the pages image */
+};
+
+static struct pagemap_extent *find_pagemap_extent(struct page_read *pr,
+		unsigned long vaddr)
+{
+	struct pagemap_extent *ext;
+	int lo = 0, hi = pr->nr_exts;
+
+	/* Pages are mostly read in order */
+	if (pr->curr_ext < pr->nr_exts) {
+		ext = &pr->exts[pr->curr_ext];
+		if (ext->vaddr <= vaddr && vaddr < ext->end)
+			return ext;
+		if (ext->end <= vaddr)
+			lo = pr->curr_ext + 1;
+	}
+
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
+
+		if (pr->exts[mid].end <= vaddr)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	if (lo == pr->nr_exts || pr->exts[lo].vaddr > vaddr)
+		return NULL;
+
+	pr->curr_ext = lo;
+	return &pr->exts[lo];
+}
+
+static int maybe_read_page(struct page_read *pr, unsigned long vaddr,
+		int nr, void *buf, unsigned flags);
+
+/*
+ * Read in_parent pages right from the page_read-s that have them,
+ * rather than walking the parents chain level by level.
+ */
+static int read_extent_pages(struct page_read *pr, unsigned long vaddr,
+			     int nr, void *buf, unsigned flags)
+{
+	do {
+		struct pagemap_extent *ext;
+		struct page_read *ppr;
+		int p_nr;
+
+		ext = find_pagemap_extent(pr, vaddr);
+		if (!ext) {
+			pr_err("Missing %lx in parent pagemap\n", vaddr);
+			return -1;
+		}
+
+		p_nr = min_t(unsigned long, nr, (ext->end - vaddr) / PAGE_SIZE);
+
+		ppr = ext->pr;
+		pr_debug("\tpr%u Read %d pages from pr%u\n", pr->id, p_nr, ppr->id);
+
+		ppr->pe = ext->pe;
+		ppr->cvaddr = vaddr;
+		ppr->pi_off = ext->off;
+		if (pagemap_raw_pages(ext->pe))
+			ppr->pi_off += vaddr - ext->pe->vaddr;
+
+		if (maybe_read_page(ppr, vaddr, p_nr, buf, flags) < 0)
+			return -1;
+
+		nr -= p_nr;
+		vaddr += p_nr * PAGE_SIZE;
+		buf += p_nr * PAGE_SIZE;
+	} while (nr);
+
+	return 0;
+}
+
 static int read_parent_page(struct page_read *pr, unsigned long vaddr,
 			    int nr, void *buf, unsigned flags)
 {
 	struct page_read *ppr = pr->parent;
 	int ret;
 
+	if (pr->exts)
+		return read_extent_pages(pr, vaddr, nr, buf, flags);
+
 	if (!ppr) {
 		pr_err("No parent for snapshot pagemap\n");
 		return -1;
@@ -245,23 +362,52 @@ static int read_parent_page(struct page_read *pr, unsigned long vaddr,
 	return 0;
 }
 
-static int read_local_page(struct page_read *pr, unsigned long vaddr,
-			   unsigned long len, void *buf)
+/*
+ * Reading with O_DIRECT (PR_DIRECT) puts the pages right into the
+ * restored memory, without the copy in the page cache. The buffers
+ * and offsets are page aligned, but the filesystem may want more,
+ * then the reads fail with EINVAL and the page cache is used again.
+ */
+void pages_image_direct(struct cr_img *pi)
 {
-	int fd = img_raw_fd(pr->pi);
+	int fd = img_raw_fd(pi);
+
+	if (img_raw_off(pi) & (PAGE_SIZE - 1))
+		return;
+
+	if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_DIRECT))
+		pr_warn_once("Can't read pages images with O_DIRECT\n");
+}
+
+static bool pages_image_undirect(int fd)
+{
+	int flags = fcntl(fd, F_GETFL);
+
+	if (flags < 0 || !(flags & O_DIRECT))
+		return false;
+
+	pr_warn("O_DIRECT doesn't work for pages image, reading via page cache\n");
+	if (fcntl(fd, F_SETFL, flags & ~O_DIRECT)) {
+		pr_perror("Can't turn O_DIRECT off");
+		return false;
+	}
+
+	return true;
+}
+
+static int read_pages_img(struct cr_img *pi, void *buf,
+			  unsigned long len, off_t off)
+{
+	int fd = img_raw_fd(pi);
 	int ret;
 	size_t curr = 0;
 
-	/*
-	 * Flush any pending async requests if any not to break the
-	 * linear reading from the pages.img file.
-	 */
-	if (pr->sync(pr))
-		return -1;
+	off += img_raw_off(pi);
 
-	pr_debug("\tpr%u Read page from self %lx/%"PRIx64"\n", pr->id, pr->cvaddr, pr->pi_off);
 	while (1) {
-		ret = pread(fd, buf + curr, len - curr, pr->pi_off + curr);
+		ret = pread(fd, buf + curr, len - curr, off + curr);
+		if (ret < 0 && errno == EINVAL && pages_image_undirect(fd))
+			continue;
 		if (ret < 1) {
 			pr_perror("Can't read mapping page %d", ret);
 			return -1;
@@ -271,6 +417,25 @@ static int read_local_page(struct page_read *pr, unsigned long vaddr,
 			break;
 	}
 
+	return 0;
+}
+
+static int read_local_page(struct page_read *pr, unsigned long vaddr,
+			   unsigned long len, void *buf)
+{
+	int ret;
+
+	/*
+	 * Flush any pending async requests if any not to break the
+	 * linear reading from the pages.img file.
+	 */
+	if (pr->sync(pr))
+		return -1;
+
+	pr_debug("\tpr%u Read page from self %lx/%"PRIx64"\n", pr->id, pr->cvaddr, pr->pi_off);
+	if (read_pages_img(pr->pi, buf, len, pr->pi_off))
+		return -1;
+
 	if (opts.auto_dedup) {
 		ret = punch_hole(pr, pr->pi_off, len, false);
 		if (ret == -1)
@@ -280,6 +445,105 @@ static int read_local_page(struct page_read *pr, unsigned long vaddr,
 	return 0;
 }
 
+/*
+ * Compressed entry is decompressed as a whole into the pr->cbuf
+ * and the subsequent reads from it are served from there.
+ */
+static int decompress_block(struct page_read *pr)
+{
+	PagemapEntry *pe = pr->pe;
+	unsigned long len = pagemap_len(pe);
+	struct page_codec *codec;
+	void *data;
+	ssize_t ret;
+
+	codec = page_codec_get(pe->codec);
+	if (!codec)
+		return -1;
+
+	if (pr->cbuf_size < len) {
+		xfree(pr->cbuf);
+		pr->cbuf_size = 0;
+		pr->cbuf = xmalloc(len);
+		if (!pr->cbuf)
+			return -1;
+		pr->cbuf_size = len;
+	}
+
+	data = xmalloc(pe->compressed_size);
+	if (!data)
+		return -1;
+
+	pr_debug("\tpr%u Decompress %u bytes block from %"PRIx64"\n",
+			pr->id, pe->compressed_size, pr->pi_off);
+	if (read_pages_img(pr->pi, data, pe->compressed_size, pr->pi_off)) {
+		xfree(data);
+		return -1;
+	}
+
+	ret = codec->decompress(data, pe->compressed_size, pr->cbuf, len);
+	xfree(data);
+	if (ret != len) {
+		pr_err("Can't decompress pages at %"PRIx64" (%zd)\n", pe->vaddr, ret);
+		pr->cbuf_off = -1;
+		return -1;
+	}
+
+	pr->cbuf_off = pr->pi_off;
+
+	/* The block is in memory now */
+	if (opts.auto_dedup)
+		return punch_hole(pr, pr->pi_off, pe->compressed_size, false);
+
+	return 0;
+}
+
+static int read_compressed_page(struct page_read *pr, unsigned long vaddr,
+				unsigned long len, void *buf)
+{
+	if (pr->cbuf_off != pr->pi_off && decompress_block(pr))
+		return -1;
+
+	memcpy(buf, pr->cbuf + (vaddr - pr->pe->vaddr), len);
+	return 0;
+}
+
+struct same_pages_img {
+	struct list_head	l;
+	u32			id;
+	struct cr_img		*pi;
+};
+
+static struct cr_img *same_pages_img(struct page_read *pr, u32 id)
+{
+	struct same_pages_img *spi;
+
+	if (id == pr->pages_img_id)
+		return pr->pi;
+
+	list_for_each_entry(spi, &pr->same_pis, l)
+		if (spi->id == id)
+			return spi->pi;
+
+	pr_err("No pages image %u for same-as pages\n", id);
+	return NULL;
+}
+
+static int read_same_page(struct page_read *pr, unsigned long vaddr,
+			  unsigned long len, void *buf)
+{
+	struct cr_img *pi;
+
+	pi = same_pages_img(pr, pr->pe->same_as_pages_id);
+	if (!pi)
+		return -1;
+
+	pr_debug("\tpr%u Read same page %lx from %u/%"PRIx64"\n", pr->id, vaddr,
+			pr->pe->same_as_pages_id, pr->pe->same_as_off);
+	return read_pages_img(pi, buf, len,
+			pr->pe->same_as_off + (vaddr - pr->pe->vaddr));
+}
+
 static int enqueue_async_iov(struct page_read *pr, void *buf,
 		unsigned long len, struct list_head *to)
 {
@@ -290,8 +554,9 @@ static int enqueue_async_iov(struct page_read *pr, void *buf,
 	if (!pr_iov)
 		return -1;
 
-	pr_iov->from = pr->pi_off;
-	pr_iov->end = pr->pi_off + len;
+	/* Offsets in the fd, async reads don't see the image */
+	pr_iov->from = img_raw_off(pr->pi) + pr->pi_off;
+	pr_iov->end = pr_iov->from + len;
 
 	iov = xzalloc(sizeof(*iov));
 	if (!iov) {
@@ -351,7 +616,7 @@ int pagemap_enqueue_iovec(struct page_read *pr, void *buf,
 	 * the previous one.
 	 * Start the new preadv request here.
 	 */
-	if (!cur_async || pr->pi_off != cur_async->end)
+	if (!cur_async || img_raw_off(pr->pi) + pr->pi_off != cur_async->end)
 		return enqueue_async_iov(pr, buf, len, to);
 
 	/*
@@ -393,6 +658,17 @@ static int maybe_read_page(struct page_read *pr, unsigned long vaddr,
 	int ret;
 	unsigned long len = nr * PAGE_SIZE;
 
+	if (pagemap_zero(pr->pe)) {
+		memzero(buf, len);
+		return 0;
+	}
+
+	if (pagemap_same_as(pr->pe))
+		return read_same_page(pr, vaddr, len, buf);
+
+	if (pagemap_compressed(pr->pe))
+		return read_compressed_page(pr, vaddr, len, buf);
+
 	if (flags & PR_ASYNC)
 		ret = pagemap_enqueue_iovec(pr, buf, len, &pr->async);
 	else
@@ -424,12 +700,10 @@ static int read_pagemap_page(struct page_read *pr, unsigned long vaddr, int nr,
 
 static void free_pagemaps(struct page_read *pr)
 {
-	int i;
-
-	for (i = 0; i < pr->nr_pmes; i++)
-		pagemap_entry__free_unpacked(pr->pmes[i], NULL);
-
+	pb_arena_destroy(pr->pmes_arena);
+	pr->pmes_arena = NULL;
 	xfree(pr->pmes);
+	pr->pmes = NULL;
 }
 
 static void advance_piov(struct page_read_iov *piov, ssize_t len)
@@ -473,6 +747,8 @@ static int process_async_reads(struct page_read *pr)
 				piov->to->iov_base, piov->to->iov_len);
 more:
 		ret = preadv(fd, piov->to, piov->nr, piov->from);
+		if (ret < 0 && errno == EINVAL && pages_image_undirect(fd))
+			goto more;
 		if (fault_injected(FI_PARTIAL_PAGES)) {
 			/*
 			 * We might have read everything, but for debug
@@ -505,7 +781,7 @@ more:
 			goto more;
 		}
 
-		if (opts.auto_dedup && punch_hole(pr, start, ret, false))
+		if (opts.auto_dedup && punch_hole(pr, start - img_raw_off(pr->pi), ret, false))
 			return -1;
 
 		list_del(&piov->l);
@@ -519,6 +795,54 @@ more:
 	return ret;
 }
 
+static int open_same_pages_imgs(int dfd, struct page_read *pr)
+{
+	struct same_pages_img *spi;
+	int i;
+
+	for (i = 0; i < pr->nr_pmes; i++) {
+		PagemapEntry *pe = pr->pmes[i];
+		bool opened = false;
+
+		if (!pagemap_same_as(pe) || pe->same_as_pages_id == pr->pages_img_id)
+			continue;
+
+		list_for_each_entry(spi, &pr->same_pis, l)
+			if (spi->id == pe->same_as_pages_id) {
+				opened = true;
+				break;
+			}
+		if (opened)
+			continue;
+
+		spi = xmalloc(sizeof(*spi));
+		if (!spi)
+			return -1;
+
+		spi->id = pe->same_as_pages_id;
+		spi->pi = open_image_at(dfd, CR_FD_PAGES, O_RSTR, spi->id);
+		if (!spi->pi) {
+			xfree(spi);
+			return -1;
+		}
+
+		list_add_tail(&spi->l, &pr->same_pis);
+	}
+
+	return 0;
+}
+
+static void close_same_pages_imgs(struct page_read *pr)
+{
+	struct same_pages_img *spi, *n;
+
+	list_for_each_entry_safe(spi, n, &pr->same_pis, l) {
+		close_image(spi->pi);
+		xfree(spi);
+	}
+	INIT_LIST_HEAD(&pr->same_pis);
+}
+
 static void close_page_read(struct page_read *pr)
 {
 	int ret;
@@ -543,8 +867,11 @@ static void close_page_read(struct page_read *pr)
 	if (pr->pi)
 		close_image(pr->pi);
 
-	if (pr->pmes)
-		free_pagemaps(pr);
+	free_pagemaps(pr);
+
+	xfree(pr->cbuf);
+	xfree(pr->exts);
+	close_same_pages_imgs(pr);
 }
 
 static void reset_pagemap(struct page_read *pr)
@@ -602,6 +929,68 @@ err_cl:
  */
 #define PAGEMAP_ENTRY_SIZE_ESTIMATE 16
 
+/*
+ * Compact pagemap is read in one go, the entries are made from
+ * the records all at once, with no allocation per entry.
+ */
+static int init_compact_pagemaps(struct page_read *pr, off_t fsize)
+{
+	struct pagemap_rec *recs;
+	PagemapEntry *pes;
+	int i, nr, ret = -1;
+	ssize_t len;
+
+	/* The head is there too, so it's the upper bound */
+	nr = fsize / sizeof(*recs);
+	recs = xmalloc(nr * sizeof(*recs) + 1);
+	if (!recs)
+		return -1;
+
+	len = bread(&pr->pmi->_x, recs, nr * sizeof(*recs));
+	if (len < 0) {
+		pr_perror("Can't read compact pagemap");
+		goto out;
+	}
+	if (len % sizeof(*recs)) {
+		pr_err("Compact pagemap is truncated\n");
+		goto out;
+	}
+	nr = len / sizeof(*recs);
+
+	pr->pmes = xmalloc(nr * sizeof(*pr->pmes) + 1);
+	pr->pmes_arena = pb_arena_create();
+	if (!pr->pmes || !pr->pmes_arena)
+		goto out;
+	pes = pb_arena_alloc(pr->pmes_arena, nr * sizeof(*pes));
+	if (!pes)
+		goto out;
+
+	for (i = 0; i < nr; i++) {
+		struct pagemap_rec *r = &recs[i];
+		PagemapEntry *pe = &pes[i];
+
+		if (r->flags & ~PAGEMAP_REC_IN_PARENT) {
+			pr_err("Unknown compact pagemap flags %#x\n", r->flags);
+			goto out;
+		}
+
+		pagemap_entry__init(pe);
+		pe->vaddr = r->vaddr;
+		pe->nr_pages = r->nr_pages;
+		if (r->flags & PAGEMAP_REC_IN_PARENT) {
+			pe->has_in_parent = true;
+			pe->in_parent = true;
+		}
+		pr->pmes[i] = pe;
+	}
+
+	pr->nr_pmes = nr;
+	ret = 0;
+out:
+	xfree(recs);
+	return ret;
+}
+
 static int init_pagemaps(struct page_read *pr)
 {
 	off_t fsize;
@@ -611,6 +1000,15 @@ static int init_pagemaps(struct page_read *pr)
 	if (fsize < 0)
 		return -1;
 
+	pr->nr_pmes = 0;
+	pr->curr_pme = -1;
+
+	if (pr->compact) {
+		if (init_compact_pagemaps(pr, fsize))
+			goto free_pagemaps;
+		goto done;
+	}
+
 	nr_pmes = fsize / PAGEMAP_ENTRY_SIZE_ESTIMATE + 1;
 	nr_realloc = nr_pmes / 2;
 
@@ -618,12 +1016,14 @@ static int init_pagemaps(struct page_read *pr)
 	if (!pr->pmes)
 		return -1;
 
-	pr->nr_pmes = 0;
-	pr->curr_pme = -1;
+	/* There can be lots of them, so no malloc per entry */
+	pr->pmes_arena = pb_arena_create();
+	if (!pr->pmes_arena)
+		goto free_pagemaps;
 
 	while (1) {
-		int ret = pb_read_one_eof(pr->pmi, &pr->pmes[pr->nr_pmes],
-					  PB_PAGEMAP);
+		int ret = pb_read_one_eof_arena(pr->pmi, &pr->pmes[pr->nr_pmes],
+					  PB_PAGEMAP, pr->pmes_arena);
 		if (ret < 0)
 			goto free_pagemaps;
 		if (ret == 0)
@@ -639,6 +1039,7 @@ static int init_pagemaps(struct page_read *pr)
 		}
 	}
 
+done:
 	close_image(pr->pmi);
 	pr->pmi = NULL;
 
@@ -649,7 +1050,135 @@ free_pagemaps:
 	return -1;
 }
 
-int open_page_read_at(int dfd, int pid, struct page_read *pr, int pr_flags)
+static int add_pagemap_extent(struct page_read *pr, int *size,
+		unsigned long vaddr, unsigned long end,
+		PagemapEntry *pe, struct page_read *owner, off_t off)
+{
+	struct pagemap_extent *ext;
+
+	if (pr->nr_exts == *size) {
+		*size = *size ? *size * 2 : 64;
+		ext = xrealloc(pr->exts, *size * sizeof(*ext));
+		if (!ext)
+			return -1;
+		pr->exts = ext;
+	}
+
+	ext = &pr->exts[pr->nr_exts++];
+	ext->vaddr = vaddr;
+	ext->end = end;
+	ext->pe = pe;
+	ext->pr = owner;
+	ext->off = off;
+
+	return 0;
+}
+
+/*
+ * With a deep chain of pre-dumps an in_parent page can be several
+ * levels up, and finding it with seek_pagemap() on every level costs
+ * a linear scan per level. Instead, merge the extents of the parent
+ * (built the same way when it was opened) into the in_parent entries
+ * of this page_read, so that any page is found with one lookup. The
+ * parent's extents are not needed after that.
+ */
+static int build_pagemap_extents(struct page_read *pr)
+{
+	struct page_read *ppr = pr->parent;
+	int i, j = 0, size = 0;
+	off_t off = 0;
+
+	pr->curr_ext = 0;
+
+	for (i = 0; i < pr->nr_pmes; i++) {
+		PagemapEntry *pe = pr->pmes[i];
+		unsigned long end = pe->vaddr + pagemap_len(pe);
+		int k;
+
+		if (!pe->in_parent) {
+			if (add_pagemap_extent(pr, &size, pe->vaddr, end, pe, pr, off))
+				return -1;
+
+			if (pagemap_compressed(pe))
+				off += pe->compressed_size;
+			else if (pagemap_raw_pages(pe))
+				off += pagemap_len(pe);
+			continue;
+		}
+
+		if (!ppr)
+			continue;
+
+		while (j < ppr->nr_exts && ppr->exts[j].end <= pe->vaddr)
+			j++;
+
+		for (k = j; k < ppr->nr_exts && ppr->exts[k].vaddr < end; k++) {
+			struct pagemap_extent *pext = &ppr->exts[k];
+
+			if (add_pagemap_extent(pr, &size,
+					max_t(unsigned long, pext->vaddr, pe->vaddr),
+					min_t(unsigned long, pext->end, end),
+					pext->pe, pext->pr, pext->off))
+				return -1;
+		}
+	}
+
+	if (ppr) {
+		xfree(ppr->exts);
+		ppr->exts = NULL;
+		ppr->nr_exts = 0;
+	}
+
+	pr_debug("pr%u: %d extents\n", pr->id, pr->nr_exts);
+	return 0;
+}
+
+/*
+ * Check whether the pages in the start:end range can be read by
+ * PIE code. It can only preadv() from the task's pages image, and
+ * zero pages are OK if the memory is known to be zero already.
+ */
+bool pagemap_range_pieok(struct page_read *pr, unsigned long start,
+			 unsigned long end, bool zero_ok)
+{
+	int lo = 0, hi = pr->nr_pmes;
+
+	/* Find the first entry ending after the start */
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
+		PagemapEntry *pe = pr->pmes[mid];
+
+		if (pe->vaddr + pagemap_len(pe) <= start)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	for (; lo < pr->nr_pmes && pr->pmes[lo]->vaddr < end; lo++) {
+		PagemapEntry *pe = pr->pmes[lo];
+
+		if (pagemap_same_as(pe) || pagemap_compressed(pe))
+			return false;
+		if (pagemap_zero(pe) && !zero_ok)
+			return false;
+	}
+
+	return true;
+}
+
+/* Compressed pages can't be read by PIE code */
+static bool has_compressed_pagemaps(struct page_read *pr)
+{
+	int i;
+
+	for (i = 0; i < pr->nr_pmes; i++)
+		if (pagemap_compressed(pr->pmes[i]))
+			return true;
+
+	return false;
+}
+
+static int do_open_page_read_at(int dfd, int pid, struct page_read *pr, int pr_flags)
 {
 	int flags, i_typ;
 	static unsigned ids = 1;
@@ -674,6 +1203,7 @@ int open_page_read_at(int dfd, int pid, struct page_read *pr, int pr_flags)
 	}
 
 	INIT_LIST_HEAD(&pr->async);
+	INIT_LIST_HEAD(&pr->same_pis);
 	pr->pe = NULL;
 	pr->parent = NULL;
 	pr->cvaddr = 0;
@@ -681,7 +1211,15 @@ int open_page_read_at(int dfd, int pid, struct page_read *pr, int pr_flags)
 	pr->bunch.iov_len = 0;
 	pr->bunch.iov_base = NULL;
 	pr->pmes = NULL;
+	pr->pmes_arena = NULL;
+	pr->compact = false;
 	pr->pieok = false;
+	pr->cbuf = NULL;
+	pr->cbuf_size = 0;
+	pr->cbuf_off = -1;
+	pr->exts = NULL;
+	pr->nr_exts = 0;
+	pr->curr_ext = 0;
 
 	pr->pmi = open_image_at(dfd, i_typ, O_RSTR, (long)pid);
 	if (!pr->pmi)
@@ -697,7 +1235,7 @@ int open_page_read_at(int dfd, int pid, struct page_read *pr, int pr_flags)
 		return -1;
 	}
 
-	pr->pi = open_pages_image_at(dfd, flags, pr->pmi, &pr->pages_img_id);
+	pr->pi = open_pages_image_at(dfd, flags, pr->pmi, &pr->pages_img_id, &pr->compact);
 	if (!pr->pi) {
 		close_page_read(pr);
 		return -1;
@@ -708,6 +1246,15 @@ int open_page_read_at(int dfd, int pid, struct page_read *pr, int pr_flags)
 		return -1;
 	}
 
+	/* Compressed blocks are neither aligned, nor read into place */
+	if ((pr_flags & PR_DIRECT) && !has_compressed_pagemaps(pr))
+		pages_image_direct(pr->pi);
+
+	if (open_same_pages_imgs(dfd, pr)) {
+		close_page_read(pr);
+		return -1;
+	}
+
 	pr->read_pages = read_pagemap_page;
 	pr->advance = advance;
 	pr->close = close_page_read;
@@ -716,7 +1263,20 @@ int open_page_read_at(int dfd, int pid, struct page_read *pr, int pr_flags)
 	pr->seek_pagemap = seek_pagemap;
 	pr->reset = reset_pagemap;
 	pr->id = ids++;
-	if (!pr->parent)
+
+	/*
+	 * The parent has its extents built by now, unless it's the
+	 * oldest one, which only has its own pages.
+	 */
+	if (pr->parent) {
+		if ((!pr->parent->exts && build_pagemap_extents(pr->parent)) ||
+				build_pagemap_extents(pr)) {
+			close_page_read(pr);
+			return -1;
+		}
+	}
+	/* Restorer can't punch the pages it has read */
+	if (!pr->parent && !has_compressed_pagemaps(pr) && !opts.auto_dedup)
 		pr->pieok = true;
 
 	pr_debug("Opened page read %u (parent %u)\n",
@@ -725,6 +1285,21 @@ int open_page_read_at(int dfd, int pid, struct page_read *pr, int pr_flags)
 	return 1;
 }
 
+int open_page_read_at(int dfd, int pid, struct page_read *pr, int pr_flags)
+{
+	int lfd, ret;
+
+	/* Don't race with criu merge swapping the images */
+	lfd = lock_image_dir(dfd, LOCK_SH);
+	if (lfd < 0)
+		return -1;
+
+	ret = do_open_page_read_at(dfd, pid, pr, pr_flags);
+	unlock_image_dir(lfd);
+
+	return ret;
+}
+
 int open_page_read(int pid, struct page_read *pr, int pr_flags)
 {
 	return open_page_read_at(get_service_fd(IMG_FD_OFF), pid, pr, pr_flags);
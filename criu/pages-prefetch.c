@@ -0,0 +1,347 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/wait.h>
+
+#include "types.h"
+#include "atomic.h"
+#include "common/lock.h"
+#include "cr_options.h"
+#include "image.h"
+#include "pages-prefetch.h"
+#include "pstree.h"
+#include "rst_info.h"
+#include "servicefd.h"
+#include "log.h"
+#include "xmalloc.h"
+
+/*
+ * Prefetch of the pages images on restore (--prefetch-threads).
+ *
+ * Each task reads its pages itself when it gets to restoring its
+ * memory, so with many tasks the storage sees the reads of one or
+ * few tasks at a time, each with a small readahead. Instead, the
+ * root criu collects the pages images of all the tasks (and of the
+ * parent images) in the order the tasks are restored, and a pool
+ * of threads pulls them into the page cache by chunks ahead of the
+ * tasks, keeping the storage busy. The threads stay within the
+ * PREFETCH_WINDOW bytes past the pages of the last task that has
+ * started restoring its memory (pages_prefetch_progress), so that
+ * the prefetched pages are not evicted before they are read.
+ *
+ * The threads live in a helper process, as criu itself switches
+ * namespaces with setns() while restoring and that can't be done
+ * by multithreaded process. The helper stays till restore is over
+ * (like usernsd does), not to be seen by the sigchld_handler().
+ */
+
+#define PREFETCH_CHUNK	(4 << 20)
+#define PREFETCH_WINDOW	(256 << 20)
+
+struct prefetch_chunk {
+	int	fd;
+	off_t	off;
+	size_t	len;
+	u64	pos;	/* bytes of chunks before it */
+};
+
+static struct {
+	struct prefetch_chunk	*chunks;
+	int			nr, size;
+	u64			total;
+	atomic_t		next;
+	int			*fds;
+	int			nr_fds;
+	pid_t			pid;
+	futex_t			*cur;	/* 1st chunk of the last started task */
+} pf;
+
+static int add_chunks(int fd, off_t off, off_t len)
+{
+	while (len > 0) {
+		struct prefetch_chunk *c;
+
+		if (pf.nr == pf.size) {
+			pf.size = pf.size ? pf.size * 2 : 256;
+			c = xrealloc(pf.chunks, pf.size * sizeof(*c));
+			if (!c)
+				return -1;
+			pf.chunks = c;
+		}
+
+		c = &pf.chunks[pf.nr++];
+		c->fd = fd;
+		c->off = off;
+		c->len = min_t(off_t, len, PREFETCH_CHUNK);
+		c->pos = pf.total;
+
+		pf.total += c->len;
+		off += c->len;
+		len -= c->len;
+	}
+
+	return 0;
+}
+
+static int add_pages_image(struct cr_img *pi)
+{
+	off_t size;
+	int fd, *fds;
+
+	size = img_raw_size(pi);
+	if (size <= 0)
+		return size;
+
+	/*
+	 * Out of fds is not fatal, the tasks will just read
+	 * the rest as usual.
+	 */
+	fd = dup(img_raw_fd(pi));
+	if (fd < 0) {
+		pr_warn("Can't prefetch more pages images: %s\n", strerror(errno));
+		return 1;
+	}
+
+	fds = xrealloc(pf.fds, (pf.nr_fds + 1) * sizeof(*fds));
+	if (!fds) {
+		close(fd);
+		return -1;
+	}
+	pf.fds = fds;
+	pf.fds[pf.nr_fds++] = fd;
+
+	return add_chunks(fd, img_raw_off(pi), size);
+}
+
+/*
+ * Pages images of the task in the images dir and in the
+ * parent ones, as in_parent pages are read from there.
+ */
+static int collect_task_pages(pid_t pid)
+{
+	int dfd, ret = 0;
+
+	dfd = dup(get_service_fd(IMG_FD_OFF));
+	if (dfd < 0) {
+		pr_perror("Can't dup images dir");
+		return -1;
+	}
+
+	while (1) {
+		struct cr_img *pmi, *pi;
+		bool compact;
+		u32 id;
+		int pfd;
+
+		pmi = open_image_at(dfd, CR_FD_PAGEMAP, O_RSTR, (long)pid);
+		if (!pmi) {
+			ret = -1;
+			break;
+		}
+		if (empty_image(pmi)) {
+			close_image(pmi);
+			break;
+		}
+
+		pi = open_pages_image_at(dfd, O_RDONLY, pmi, &id, &compact);
+		close_image(pmi);
+		if (!pi) {
+			ret = -1;
+			break;
+		}
+
+		ret = add_pages_image(pi);
+		close_image(pi);
+		if (ret)
+			break;
+
+		pfd = openat(dfd, CR_PARENT_LINK, O_RDONLY | O_DIRECTORY);
+		if (pfd < 0)
+			break;
+		close(dfd);
+		dfd = pfd;
+	}
+
+	close(dfd);
+	return ret < 0 ? -1 : ret;
+}
+
+static void wait_for_window(struct prefetch_chunk *c)
+{
+	u32 cur;
+
+	while (1) {
+		cur = futex_get(pf.cur);
+		if (cur >= pf.nr || c->pos < pf.chunks[cur].pos + PREFETCH_WINDOW)
+			return;
+		futex_wait_while_eq(pf.cur, cur);
+	}
+}
+
+/*
+ * No logging here, this is called in threads and
+ * the log engine is not ready for that.
+ */
+static void *prefetch_worker(void *arg)
+{
+	int i;
+
+	while ((i = atomic_add_return(1, &pf.next) - 1) < pf.nr) {
+		struct prefetch_chunk *c = &pf.chunks[i];
+
+		wait_for_window(c);
+		/* Errors (e.g. not a regular file) are fine, it's a hint */
+		readahead(c->fd, c->off, c->len);
+	}
+
+	return NULL;
+}
+
+static void prefetch_pages(void)
+{
+	pthread_t *threads;
+	int i;
+
+	if (prctl(PR_SET_PDEATHSIG, SIGKILL))
+		goto out;
+
+	threads = xmalloc(opts.prefetch_threads * sizeof(*threads));
+	if (!threads)
+		goto out;
+
+	atomic_set(&pf.next, 0);
+	for (i = 0; i < opts.prefetch_threads - 1; i++)
+		if (pthread_create(&threads[i], NULL, prefetch_worker, NULL))
+			break;
+
+	/* The main thread is a worker as well */
+	prefetch_worker(NULL);
+
+	while (--i >= 0)
+		pthread_join(threads[i], NULL);
+out:
+	/* Wait for stop_pages_prefetch() */
+	while (1)
+		pause();
+}
+
+static void free_prefetch_chunks(void)
+{
+	int i;
+
+	for (i = 0; i < pf.nr_fds; i++)
+		close(pf.fds[i]);
+
+	xfree(pf.chunks);
+	xfree(pf.fds);
+	pf.chunks = NULL;
+	pf.fds = NULL;
+	pf.nr = pf.size = pf.nr_fds = 0;
+	pf.total = 0;
+}
+
+static void free_prefetch_window(void)
+{
+	if (pf.cur) {
+		munmap(pf.cur, sizeof(*pf.cur));
+		pf.cur = NULL;
+	}
+}
+
+int start_pages_prefetch(void)
+{
+	struct pstree_item *item;
+	int ret;
+
+	/* Streamed pages are in memory already */
+	if (!opts.prefetch_threads || opts.stream_fd >= 0)
+		return 0;
+
+	for_each_pstree_item(item) {
+		rsti(item)->prefetch_chunk = pf.nr + 1;
+		ret = collect_task_pages(vpid(item));
+		if (ret < 0)
+			goto err;
+		if (ret > 0)
+			break;
+	}
+
+	pr_info("Prefetching %d chunks of pages with %d threads\n",
+			pf.nr, opts.prefetch_threads);
+	if (!pf.nr)
+		goto out;
+
+	/* Shared with the helper and the tasks to be forked */
+	pf.cur = mmap(NULL, sizeof(*pf.cur), PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (pf.cur == MAP_FAILED) {
+		pr_perror("Can't allocate prefetch window");
+		pf.cur = NULL;
+		goto err;
+	}
+	futex_init(pf.cur);
+
+	pf.pid = fork();
+	if (pf.pid < 0) {
+		pr_perror("Can't fork prefetch helper");
+		free_prefetch_window();
+		goto err;
+	}
+
+	if (pf.pid == 0)
+		prefetch_pages();
+out:
+	/* The helper has them, we don't need them */
+	free_prefetch_chunks();
+	return 0;
+
+err:
+	free_prefetch_chunks();
+	return -1;
+}
+
+/*
+ * Called by a task when it starts restoring its pages, moves the
+ * prefetch window to them unless a later task has done it already.
+ */
+void pages_prefetch_progress(struct pstree_item *t)
+{
+	u32 first = rsti(t)->prefetch_chunk, cur;
+
+	if (!pf.cur || !first--)
+		return;
+
+	do {
+		cur = futex_get(pf.cur);
+		if (cur >= first)
+			return;
+	} while (atomic_cmpxchg(&pf.cur->raw, cur, first) != cur);
+
+	futex_wake(pf.cur);
+}
+
+/* Called when restore is over, whatever is not prefetched is not needed */
+void stop_pages_prefetch(void)
+{
+	sigset_t blockmask, oldmask;
+
+	if (!pf.pid)
+		return;
+
+	/* Don't let the sigchld_handler() see the helper */
+	sigemptyset(&blockmask);
+	sigaddset(&blockmask, SIGCHLD);
+	sigprocmask(SIG_BLOCK, &blockmask, &oldmask);
+
+	kill(pf.pid, SIGKILL);
+	waitpid(pf.pid, NULL, 0);
+
+	sigprocmask(SIG_SETMASK, &oldmask, NULL);
+	pf.pid = 0;
+	free_prefetch_window();
+}
@@ -82,9 +82,18 @@ unsigned long get_exec_start(struct vm_area_list *vmas)
  */
 static void sigchld_handler(int signal, siginfo_t *siginfo, void *data)
 {
-	int pid, status;
+	struct pstree_item *item;
+	int pid = 0, status;
 
-	pid = waitpid(-1, &status, WNOHANG);
+	/*
+	 * Only the dumped tasks are checked, as criu has other children
+	 * (e.g. --mem-dump-workers) that are waited for by their owners.
+	 */
+	for_each_pstree_item(item) {
+		pid = waitpid(item->pid->real, &status, WNOHANG);
+		if (pid > 0)
+			break;
+	}
 	if (pid <= 0)
 		return;
 
@@ -162,57 +171,71 @@ int parasite_dump_thread_leader_seized(struct parasite_ctl *ctl, int pid, CoreEn
 	return dump_thread_core(pid, core, args);
 }
 
-int parasite_dump_thread_seized(struct parasite_ctl *ctl, int id,
-				struct pid *tid, CoreEntry *core)
+/*
+ * Non-leader threads are dumped by batches, the threads of one
+ * batch run the parasite at the same time.
+ */
+int parasite_dump_threads_seized(struct parasite_ctl *ctl,
+				 const struct pstree_item *item, int *ids, int nr)
 {
-	struct parasite_dump_thread *args;
-	pid_t pid = tid->real;
-	ThreadCoreEntry *tc = core->thread_core;
-	CredsEntry *creds = tc->creds;
-	struct parasite_dump_creds *pc;
-	int ret;
-	struct parasite_thread_ctl *tctl;
+	struct parasite_thread_ctl *tctls[PARASITE_THREADS_BATCH];
+	struct parasite_dump_threads *args;
+	int i, prepared, ret = -1;
 
-	BUG_ON(id == 0); /* Leader is dumped in dump_task_core_all */
+	BUG_ON(nr > PARASITE_THREADS_BATCH);
 
-	args = compel_parasite_args(ctl, struct parasite_dump_thread);
+	args = compel_parasite_args_s(ctl, (nr + 1) * PAGE_SIZE);
+	args->stacks = compel_thread_stacks(ctl, &args->stack_size);
+	args->nr = nr;
 
-	pc = args->creds;
-	pc->cap_last_cap = kdat.last_cap;
+	for (prepared = 0; prepared < nr; prepared++) {
+		struct pid *tid = &item->threads[ids[prepared]];
+		ThreadCoreEntry *tc = item->core[ids[prepared]]->thread_core;
+		struct parasite_thread_ctl *tctl;
 
-	tctl = compel_prepare_thread(ctl, pid);
-	if (!tctl)
-		return -1;
+		BUG_ON(tid->real == item->pid->real); /* Leader is dumped in dump_task_core_all */
 
-	tc->has_blk_sigset = true;
-	memcpy(&tc->blk_sigset, compel_thread_sigmask(tctl), sizeof(k_rtsigset_t));
+		dump_threads_slot(args, prepared)->creds->cap_last_cap = kdat.last_cap;
 
-	ret = compel_run_in_thread(tctl, PARASITE_CMD_DUMP_THREAD);
-	if (ret) {
-		pr_err("Can't init thread in parasite %d\n", pid);
-		goto err_rth;
-	}
+		tctl = compel_prepare_thread(ctl, tid->real);
+		if (!tctl)
+			goto err;
+		tctls[prepared] = tctl;
 
-	ret = alloc_groups_copy_creds(creds, pc);
-	if (ret) {
-		pr_err("Can't copy creds for thread %d\n", pid);
-		goto err_rth;
+		tc->has_blk_sigset = true;
+		memcpy(&tc->blk_sigset, compel_thread_sigmask(tctl), sizeof(k_rtsigset_t));
 	}
 
-	ret = compel_get_thread_regs(tctl, save_task_regs, core);
-	if (ret) {
-		pr_err("Can't obtain regs for thread %d\n", pid);
-		goto err_rth;
+	if (compel_run_in_threads(tctls, nr, PARASITE_CMD_DUMP_THREADS)) {
+		pr_err("Can't dump threads in parasite\n");
+		goto err;
 	}
 
-	compel_release_thread(tctl);
+	for (i = 0; i < nr; i++) {
+		struct parasite_dump_thread *dt = dump_threads_slot(args, i);
+		struct pid *tid = &item->threads[ids[i]];
+		CoreEntry *core = item->core[ids[i]];
 
-	tid->ns[0].virt = args->tid;
-	return dump_thread_core(pid, core, args);
+		if (alloc_groups_copy_creds(core->thread_core->creds, dt->creds)) {
+			pr_err("Can't copy creds for thread %d\n", tid->real);
+			goto err;
+		}
+
+		if (compel_get_thread_regs(tctls[i], save_task_regs, core)) {
+			pr_err("Can't obtain regs for thread %d\n", tid->real);
+			goto err;
+		}
 
-err_rth:
-	compel_release_thread(tctl);
-	return -1;
+		tid->ns[0].virt = dt->tid;
+		if (dump_thread_core(tid->real, core, dt))
+			goto err;
+	}
+
+	ret = 0;
+err:
+	while (--prepared >= 0)
+		compel_release_thread(tctls[prepared]);
+	return ret;
 }
 
 int parasite_dump_sigacts_seized(struct parasite_ctl *ctl, struct pstree_item *item)
@@ -469,7 +492,42 @@ static int make_sigframe(void *arg, struct rt_sigframe *sf, struct rt_sigframe *
 	return construct_sigframe(sf, rtsf, bs, (CoreEntry *)arg);
 }
 
-struct parasite_ctl *parasite_infect_seized(pid_t pid, struct pstree_item *item,
+/*
+ * Parasites started and not yet waited for with parasite_infect_finish().
+ * Only our sigchld_handler() notices one dying while daemonizing, so
+ * curing (or stopping) some other parasite meanwhile must not put the
+ * default handler back, see parasite_cure().
+ */
+static unsigned int nr_infecting;
+
+static void set_cure_handler(struct parasite_ctl *ctl)
+{
+	struct infect_ctx *ictx = compel_infect_ctx(ctl);
+
+	if (nr_infecting)
+		ictx->orig_handler.sa_sigaction = sigchld_handler;
+	else
+		ictx->orig_handler.sa_handler = SIG_DFL;
+}
+
+int parasite_stop_daemon(struct parasite_ctl *ctl)
+{
+	set_cure_handler(ctl);
+	return compel_stop_daemon(ctl);
+}
+
+int parasite_cure(struct parasite_ctl *ctl)
+{
+	set_cure_handler(ctl);
+	return compel_cure(ctl);
+}
+
+/*
+ * Infection is split in two, so that the parasites of several tasks
+ * can be started with parasite_infect_start() and then waited for
+ * with parasite_infect_finish(), see --parallel-infect.
+ */
+struct parasite_ctl *parasite_infect_start(pid_t pid, struct pstree_item *item,
 		struct vm_area_list *vma_area_list)
 {
 	struct parasite_ctl *ctl;
@@ -519,16 +577,46 @@ struct parasite_ctl *parasite_infect_seized(pid_t pid, struct pstree_item *item,
 
 	parasite_ensure_args_size(dump_pages_args_size(vma_area_list));
 	parasite_ensure_args_size(aio_rings_args_size(vma_area_list));
+	if (item->nr_threads > 1)
+		parasite_ensure_args_size(PAGE_SIZE * (1 + min_t(int,
+				item->nr_threads - 1, PARASITE_THREADS_BATCH)));
 
-	if (compel_infect(ctl, item->nr_threads, parasite_args_size) < 0) {
-		compel_cure(ctl);
+	if (compel_infect_start(ctl, item->nr_threads, parasite_args_size) < 0) {
+		parasite_cure(ctl);
 		return NULL;
 	}
 
+	nr_infecting++;
 	parasite_args_size = PARASITE_ARG_SIZE_MIN; /* reset for next task */
+	return ctl;
+}
+
+int parasite_infect_finish(struct pstree_item *item, struct parasite_ctl *ctl)
+{
+	int ret;
+
+	ret = compel_infect_finish(ctl);
+	nr_infecting--;
+	if (ret < 0) {
+		parasite_cure(ctl);
+		return -1;
+	}
+
 	memcpy(&item->core[0]->tc->blk_sigset, compel_task_sigmask(ctl), sizeof(k_rtsigset_t));
 	dmpi(item)->parasite_ctl = ctl;
 
+	return 0;
+}
+
+struct parasite_ctl *parasite_infect_seized(pid_t pid, struct pstree_item *item,
+		struct vm_area_list *vma_area_list)
+{
+	struct parasite_ctl *ctl;
+
+	ctl = parasite_infect_start(pid, item, vma_area_list);
+	if (ctl && parasite_infect_finish(item, ctl))
+		ctl = NULL;
+
 	return ctl;
 }
 
@@ -350,6 +350,19 @@ static int dump_thread(struct parasite_dump_thread *args)
 	return dump_thread_common(args);
 }
 
+static int dump_threads(struct parasite_dump_threads *args)
+{
+	unsigned long sp = (unsigned long)&args;
+	unsigned long i = (sp - args->stacks) / args->stack_size;
+
+	if (sp < args->stacks || i >= args->nr) {
+		pr_err("Thread runs on unknown stack %lx\n", sp);
+		return -1;
+	}
+
+	return dump_thread(dump_threads_slot(args, i));
+}
+
 static char proc_mountpoint[] = "proc.crtools";
 
 static int pie_atoi(char *str)
@@ -682,6 +695,8 @@ int parasite_trap_cmd(int cmd, void *args)
 	switch (cmd) {
 	case PARASITE_CMD_DUMP_THREAD:
 		return dump_thread(args);
+	case PARASITE_CMD_DUMP_THREADS:
+		return dump_threads(args);
 	}
 
 	pr_err("Unknown command to parasite: %d\n", cmd);
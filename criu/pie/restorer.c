@@ -4,6 +4,7 @@
 #include <linux/securebits.h>
 #include <linux/capability.h>
 #include <linux/aio_abi.h>
+#include <linux/userfaultfd.h>
 #include <sys/types.h>
 #include <sys/mman.h>
 #include <sys/file.h>
@@ -36,6 +37,7 @@
 #include "restorer.h"
 #include "aio.h"
 #include "seccomp.h"
+#include "uring.h"
 
 #include "images/creds.pb-c.h"
 #include "images/mm.pb-c.h"
@@ -756,6 +758,289 @@ populate:
 	return 0;
 }
 
+/* Skip r bytes of data in iovs, returns the number of iovs left */
+static int vma_io_advance(struct iovec **piovs, int nr, ssize_t r)
+{
+	struct iovec *iovs = *piovs;
+
+	do {
+		if (iovs->iov_len <= r) {
+			pr_debug("   `- skip pagemap\n");
+			r -= iovs->iov_len;
+			iovs++;
+			nr--;
+			continue;
+		}
+
+		iovs->iov_base += r;
+		iovs->iov_len -= r;
+		break;
+	} while (nr > 0);
+
+	*piovs = iovs;
+	return nr;
+}
+
+/*
+ * The pages image may be opened with O_DIRECT (--direct-io), but the
+ * filesystem may need larger alignment than the page one has.
+ */
+static bool vma_io_undirect(int fd)
+{
+	long flags = sys_fcntl(fd, F_GETFL, 0);
+
+	if (flags < 0 || !(flags & O_DIRECT))
+		return false;
+
+	pr_warn("O_DIRECT doesn't work for pages image, reading via page cache\n");
+	return sys_fcntl(fd, F_SETFL, flags & ~O_DIRECT) == 0;
+}
+
+static int vma_io_preadv(int fd, struct iovec *iovs, int nr, loff_t off)
+{
+	ssize_t r;
+
+	while (nr) {
+		pr_debug("Preadv %lx:%d... (%d iovs)\n",
+				(unsigned long)iovs->iov_base,
+				(int)iovs->iov_len, nr);
+		r = sys_preadv(fd, iovs, nr, off);
+		if (r == -EINVAL && vma_io_undirect(fd))
+			continue;
+		if (r < 0) {
+			pr_err("Can't read pages data (%d)\n", (int)r);
+			return -1;
+		}
+
+		pr_debug("`- returned %ld\n", (long)r);
+		off += r;
+		nr = vma_io_advance(&iovs, nr, r);
+	}
+
+	return 0;
+}
+
+/*
+ * Reading pages with io_uring keeps up to VMA_IO_URING_DEPTH
+ * preadv-s in flight, which is what storage with high latency
+ * or deep queues needs to be fast. Each vma_io is one READV
+ * request, short reads are finished with plain preadv.
+ *
+ * The requests are RWF_NOWAIT, so the kernel never punts them to
+ * io-wq workers, which would be threads of this task and could take
+ * pids of the threads restored later. A read that would block fails
+ * with -EAGAIN and is redone with preadv too. That's why --io-uring
+ * needs --direct-io, buffered reads of cold pages would all block.
+ */
+#define VMA_IO_URING_DEPTH	128
+
+struct vma_io_uring {
+	int			fd;
+	unsigned int		entries;
+
+	void			*sq_ring;
+	unsigned long		sq_ring_len;
+	u32			*sq_tail;
+	u32			*sq_mask;
+	u32			*sq_array;
+	struct io_uring_sqe	*sqes;
+	unsigned long		sqes_len;
+
+	void			*cq_ring;
+	unsigned long		cq_ring_len;
+	u32			*cq_head;
+	u32			*cq_tail;
+	u32			*cq_mask;
+	struct io_uring_cqe	*cqes;
+};
+
+static void vma_io_uring_fini(struct vma_io_uring *u)
+{
+	if (u->cq_ring)
+		sys_munmap(u->cq_ring, u->cq_ring_len);
+	if (u->sqes)
+		sys_munmap(u->sqes, u->sqes_len);
+	if (u->sq_ring)
+		sys_munmap(u->sq_ring, u->sq_ring_len);
+	sys_close(u->fd);
+}
+
+static void *vma_io_uring_map(int fd, unsigned long len, unsigned long off)
+{
+	void *addr;
+
+	addr = (void *)sys_mmap(NULL, len, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, fd, off);
+	if (IS_ERR(addr)) {
+		pr_err("Can't mmap io_uring at %lx: %ld\n", off, PTR_ERR(addr));
+		return NULL;
+	}
+
+	return addr;
+}
+
+static int vma_io_uring_init(struct vma_io_uring *u)
+{
+	struct io_uring_params p;
+
+	memset(u, 0, sizeof(*u));
+	memset(&p, 0, sizeof(p));
+
+	u->fd = sys_io_uring_setup(VMA_IO_URING_DEPTH, &p);
+	if (u->fd < 0) {
+		pr_warn("Can't setup io_uring (%d), reading with preadv\n", u->fd);
+		return -1;
+	}
+
+	u->entries = p.sq_entries;
+
+	u->sq_ring_len = p.sq_off.array + p.sq_entries * sizeof(u32);
+	u->sq_ring = vma_io_uring_map(u->fd, u->sq_ring_len, IORING_OFF_SQ_RING);
+	if (!u->sq_ring)
+		goto err;
+
+	u->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+	u->sqes = vma_io_uring_map(u->fd, u->sqes_len, IORING_OFF_SQES);
+	if (!u->sqes)
+		goto err;
+
+	u->cq_ring_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	u->cq_ring = vma_io_uring_map(u->fd, u->cq_ring_len, IORING_OFF_CQ_RING);
+	if (!u->cq_ring)
+		goto err;
+
+	u->sq_tail = u->sq_ring + p.sq_off.tail;
+	u->sq_mask = u->sq_ring + p.sq_off.ring_mask;
+	u->sq_array = u->sq_ring + p.sq_off.array;
+
+	u->cq_head = u->cq_ring + p.cq_off.head;
+	u->cq_tail = u->cq_ring + p.cq_off.tail;
+	u->cq_mask = u->cq_ring + p.cq_off.ring_mask;
+	u->cqes = u->cq_ring + p.cq_off.cqes;
+
+	return 0;
+
+err:
+	vma_io_uring_fini(u);
+	return -1;
+}
+
+static int vma_io_uring_complete(int fd, struct restore_vma_io *rio, s32 res)
+{
+	struct iovec *iovs = rio->iovs;
+	int nr = rio->nr_iovs;
+
+	/* Re-read synchronously, it turns O_DIRECT off if needed */
+	if (res == -EINVAL || res == -EAGAIN)
+		return vma_io_preadv(fd, iovs, nr, rio->off);
+
+	if (res < 0) {
+		pr_err("Can't read pages data (%d)\n", res);
+		return -1;
+	}
+
+	pr_debug("Read %d iovs at %lx: %d\n", nr, (unsigned long)rio->off, res);
+
+	nr = vma_io_advance(&iovs, nr, res);
+	if (!nr)
+		return 0;
+
+	if (!res) {
+		pr_err("Pages data is truncated at %lx\n", (unsigned long)rio->off);
+		return -1;
+	}
+
+	return vma_io_preadv(fd, iovs, nr, rio->off + res);
+}
+
+static int vma_io_uring_read(struct vma_io_uring *u, int fd,
+		struct restore_vma_io *rio, unsigned int n)
+{
+	unsigned int queued = 0, unsubmitted = 0, inflight = 0;
+	u32 sq_tail = *u->sq_tail, cq_head;
+
+	while (queued < n || inflight) {
+		long ret;
+
+		while (queued < n && inflight < u->entries) {
+			u32 idx = sq_tail & *u->sq_mask;
+			struct io_uring_sqe *sqe = &u->sqes[idx];
+
+			memset(sqe, 0, sizeof(*sqe));
+			sqe->opcode = IORING_OP_READV;
+			sqe->fd = fd;
+			sqe->off = rio->off;
+			sqe->addr = (unsigned long)rio->iovs;
+			sqe->len = rio->nr_iovs;
+			sqe->rw_flags = RWF_NOWAIT;
+			sqe->user_data = (unsigned long)rio;
+			u->sq_array[idx] = idx;
+
+			sq_tail++;
+			unsubmitted++;
+			inflight++;
+			queued++;
+			rio = ((void *)rio) + RIO_SIZE(rio->nr_iovs);
+		}
+
+		/* The kernel must see the sqes before the new tail */
+		__atomic_store_n(u->sq_tail, sq_tail, __ATOMIC_RELEASE);
+
+		ret = sys_io_uring_enter(u->fd, unsubmitted, 1,
+				IORING_ENTER_GETEVENTS, NULL, 0);
+		if (ret < 0) {
+			if (ret == -EINTR)
+				continue;
+			pr_err("Can't submit io_uring reads (%ld)\n", ret);
+			return -1;
+		}
+		unsubmitted -= ret;
+
+		cq_head = *u->cq_head;
+		while (cq_head != __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE)) {
+			struct io_uring_cqe *cqe = &u->cqes[cq_head & *u->cq_mask];
+
+			if (vma_io_uring_complete(fd,
+					(void *)(unsigned long)cqe->user_data, cqe->res))
+				return -1;
+
+			cq_head++;
+			inflight--;
+		}
+		__atomic_store_n(u->cq_head, cq_head, __ATOMIC_RELEASE);
+	}
+
+	return 0;
+}
+
+static int read_vma_ios(struct task_restore_args *args)
+{
+	struct restore_vma_io *rio = args->vma_ios;
+	int i;
+
+	if (args->vma_ios_uring && args->vma_ios_n) {
+		struct vma_io_uring u;
+
+		if (!vma_io_uring_init(&u)) {
+			int ret;
+
+			ret = vma_io_uring_read(&u, args->vma_ios_fd,
+					args->vma_ios, args->vma_ios_n);
+			vma_io_uring_fini(&u);
+			return ret;
+		}
+	}
+
+	for (i = 0; i < args->vma_ios_n; i++) {
+		if (vma_io_preadv(args->vma_ios_fd, rio->iovs, rio->nr_iovs, rio->off))
+			return -1;
+
+		rio = ((void *)rio) + RIO_SIZE(rio->nr_iovs);
+	}
+
+	return 0;
+}
+
 static void rst_tcp_repair_off(struct rst_tcp_sock *rts)
 {
 	int aux, ret;
@@ -1021,6 +1306,42 @@ static int unmap_old_vmas(void *premmapped_addr, unsigned long premmapped_len,
 	return 0;
 }
 
+/*
+ * THP-backed VMAs are premapped at huge page aligned addresses, see
+ * premap_private_vma(). Unmap the padding between them before the
+ * VMAs are moved into place, or it would stay in the task.
+ */
+static int unmap_premap_padding(struct task_restore_args *args)
+{
+	unsigned long prev_end = args->premmapped_addr;
+	int i, ret;
+
+	for (i = 0; i < args->vmas_n; i++) {
+		VmaEntry *vma_entry = args->vmas + i;
+		unsigned long start;
+
+		if (!vma_entry_is(vma_entry, VMA_PREMMAPED))
+			continue;
+
+		start = vma_premmaped_start(vma_entry);
+		if (vma_entry->flags & MAP_GROWSDOWN)
+			start -= PAGE_SIZE;
+
+		if (start > prev_end) {
+			ret = sys_munmap((void *)prev_end, start - prev_end);
+			if (ret) {
+				pr_err("Unable to unmap (%lx-%lx): %d\n",
+						prev_end, start, ret);
+				return -1;
+			}
+		}
+
+		prev_end = vma_premmaped_start(vma_entry) + vma_entry_len(vma_entry);
+	}
+
+	return 0;
+}
+
 static int wait_helpers(struct task_restore_args *task_args)
 {
 	int i;
@@ -1088,7 +1409,6 @@ long __export_restore_task(struct task_restore_args *args)
 	int i;
 	VmaEntry *vma_entry;
 	unsigned long va;
-	struct restore_vma_io *rio;
 	struct rt_sigframe *rt_sigframe;
 	struct prctl_mm_map prctl_map;
 	unsigned long new_sp;
@@ -1139,6 +1459,9 @@ long __export_restore_task(struct task_restore_args *args)
 				bootstrap_start, bootstrap_len, args->task_size))
 		goto core_restore_end;
 
+	if (unmap_premap_padding(args))
+		goto core_restore_end;
+
 	/* Map compatible vdso */
 	if (args->compatible_mode && vdso_map_compat(args->vdso_rt_parked_at))
 		goto core_restore_end;
@@ -1198,49 +1521,52 @@ long __export_restore_task(struct task_restore_args *args)
 			pr_err("Can't restore %"PRIx64" mapping with %lx\n", vma_entry->start, va);
 			goto core_restore_end;
 		}
+
+		/* Read the contents into huge pages, see premap_private_vma() */
+		if (vma_entry_is(vma_entry, VMA_AREA_THP) &&
+				(vma_entry->madv & (1ul << MADV_HUGEPAGE))) {
+			ret = sys_madvise(vma_entry->start,
+					  vma_entry_len(vma_entry), MADV_HUGEPAGE);
+			if (ret)
+				pr_warn("Can't madvise huge pages for %"PRIx64": %ld\n",
+						vma_entry->start, ret);
+		}
 	}
 
 	/*
-	 * Now read the contents (if any)
+	 * Lazy VMAs are populated by the lazy-pages daemon, it
+	 * gets the faults on them via the uffd.
 	 */
+	if (args->uffd >= 0) {
+		for (i = 0; i < args->vmas_n; i++) {
+			struct uffdio_register reg;
 
-	rio = args->vma_ios;
-	for (i = 0; i < args->vma_ios_n; i++) {
-		struct iovec *iovs = rio->iovs;
-		int nr = rio->nr_iovs;
-		ssize_t r;
-
-		while (nr) {
-			pr_debug("Preadv %lx:%d... (%d iovs)\n",
-					(unsigned long)iovs->iov_base,
-					(int)iovs->iov_len, nr);
-			r = sys_preadv(args->vma_ios_fd, iovs, nr, rio->off);
-			if (r < 0) {
-				pr_err("Can't read pages data (%d)\n", (int)r);
-				goto core_restore_end;
-			}
+			vma_entry = args->vmas + i;
+			if (!vma_entry_is(vma_entry, VMA_LAZY))
+				continue;
 
-			pr_debug("`- returned %ld\n", (long)r);
-			rio->off += r;
-			/* Advance the iovecs */
-			do {
-				if (iovs->iov_len <= r) {
-					pr_debug("   `- skip pagemap\n");
-					r -= iovs->iov_len;
-					iovs++;
-					nr--;
-					continue;
-				}
+			reg.range.start = vma_entry->start;
+			reg.range.len = vma_entry_len(vma_entry);
+			reg.mode = UFFDIO_REGISTER_MODE_MISSING;
 
-				iovs->iov_base += r;
-				iovs->iov_len -= r;
-				break;
-			} while (nr > 0);
+			ret = sys_ioctl(args->uffd, UFFDIO_REGISTER, (unsigned long)&reg);
+			if (ret) {
+				pr_err("Can't register %"PRIx64" vma with uffd (%ld)\n",
+						vma_entry->start, ret);
+				goto core_restore_end;
+			}
 		}
 
-		rio = ((void *)rio) + RIO_SIZE(rio->nr_iovs);
+		sys_close(args->uffd);
 	}
 
+	/*
+	 * Now read the contents (if any)
+	 */
+
+	if (read_vma_ios(args))
+		goto core_restore_end;
+
 	sys_close(args->vma_ios_fd);
 
 #ifdef CONFIG_VDSO
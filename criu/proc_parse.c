@@ -16,6 +16,7 @@
 #include "util.h"
 #include "mount.h"
 #include "filesystems.h"
+#include "fs-magic.h"
 #include "mman.h"
 #include "cpu.h"
 #include "file-lock.h"
@@ -330,6 +331,16 @@ static int vma_get_mapfile(const char *fname, struct vma_area *vma, DIR *mfd,
 	char path[32];
 	int flags;
 
+	/*
+	 * Anonymous private mappings (and vdso & co) have no file,
+	 * so don't look for map_files links for them, there can be
+	 * lots of such vmas.
+	 */
+	if (!vfi->dev_maj && !vfi->dev_min && !vfi->ino) {
+		close_safe(vm_file_fd);
+		return 0;
+	}
+
 	/* Figure out if it's file mapping */
 	snprintf(path, sizeof(path), "%"PRIx64"-%"PRIx64, vma->e->start, vma->e->end);
 
@@ -664,8 +675,74 @@ static int vma_list_add(struct vma_area *vma_area,
 	return 0;
 }
 
-int parse_smaps(pid_t pid, struct vm_area_list *vma_area_list,
-					dump_filemap_t dump_filemap)
+/*
+ * With --skip-smaps the vmas are read from maps, which is much cheaper
+ * than smaps (the latter walks page tables of every vma for the Rss
+ * and friends), but has no VmFlags. Locked vmas can't be told from
+ * others then, so tasks with them still go via smaps.
+ */
+static bool task_has_locked_vmas(pid_t pid)
+{
+	bool ret = true;
+	struct bfd f;
+	char *str;
+
+	f.fd = open_proc(pid, "status");
+	if (f.fd < 0)
+		return true;
+
+	if (bfdopenr(&f))
+		return true;
+
+	while (1) {
+		str = breadline(&f);
+		if (IS_ERR_OR_NULL(str))
+			break;
+		if (!strncmp(str, "VmLck:", 6)) {
+			ret = strtoul(str + 6, NULL, 10) != 0;
+			break;
+		}
+	}
+
+	bclose(&f);
+	return ret;
+}
+
+/*
+ * Files of these filesystems can be mapped by the kernel with
+ * VM_IO or VM_PFNMAP (PCI resources in sysfs and proc, drivers'
+ * debugfs files) or are hugetlb ones, which only smaps can tell.
+ * Mappings of devices other than /dev/zero are refused anyway.
+ */
+static bool vma_needs_vmflags(int vm_file_fd)
+{
+	struct statfs sfs;
+
+	if (vm_file_fd < 0)
+		return false;
+
+	if (fstatfs(vm_file_fd, &sfs)) {
+		pr_perror("Can't statfs mapped file");
+		return true;
+	}
+
+	switch (sfs.f_type) {
+	case SYSFS_MAGIC:
+	case PROC_SUPER_MAGIC:
+	case DEBUGFS_MAGIC:
+	case HUGETLBFS_MAGIC:
+		return true;
+	}
+
+	return false;
+}
+
+/*
+ * Returns 1 if the vmas are read from maps and one of them
+ * turns out to need VmFlags from smaps.
+ */
+static int __parse_smaps(pid_t pid, struct vm_area_list *vma_area_list,
+		dump_filemap_t dump_filemap, bool maps)
 {
 	struct vma_area *vma_area = NULL;
 	unsigned long start, end, pgoff, prev_end = 0;
@@ -684,7 +761,7 @@ int parse_smaps(pid_t pid, struct vm_area_list *vma_area_list,
 	vma_area_list->shared_longest = 0;
 	INIT_LIST_HEAD(&vma_area_list->h);
 
-	f.fd = open_proc(pid, "smaps");
+	f.fd = open_proc(pid, "%s", maps ? "maps" : "smaps");
 	if (f.fd < 0)
 		goto err_n;
 
@@ -721,6 +798,12 @@ int parse_smaps(pid_t pid, struct vm_area_list *vma_area_list,
 				if (parse_vmflags(&str[9], vma_area))
 					goto err;
 				continue;
+			} else if (!strncmp(str, "AnonHugePages:", 14)) {
+				BUG_ON(!vma_area);
+				if (vma_area_is(vma_area, VMA_ANON_PRIVATE) &&
+						strtoul(&str[14], NULL, 10))
+					vma_area->e->status |= VMA_AREA_THP;
+				continue;
 			} else
 				continue;
 		}
@@ -765,10 +848,22 @@ int parse_smaps(pid_t pid, struct vm_area_list *vma_area_list,
 			goto err;
 		}
 
+		/* The main stack is the only growsdown vma we can see in maps */
+		if (maps && !strcmp(str + path_off, "[stack]"))
+			vma_area->e->flags |= MAP_GROWSDOWN;
+
 		if (handle_vma(pid, vma_area, str + path_off, map_files_dir,
 				&vfi, &prev_vfi, &vm_file_fd))
 			goto err;
 
+		if (maps && !vma_area->file_borrowed &&
+				vma_needs_vmflags(vm_file_fd)) {
+			pr_info("%d maps %s, reading smaps\n", pid, str + path_off);
+			xfree(vma_area->vmst);
+			ret = 1;
+			goto err;
+		}
+
 		if (vma_entry_is(vma_area->e, VMA_FILE_PRIVATE) ||
 				vma_entry_is(vma_area->e, VMA_FILE_SHARED)) {
 			if (dump_filemap && dump_filemap(vma_area, vm_file_fd))
@@ -792,6 +887,27 @@ err_n:
 
 }
 
+int parse_smaps(pid_t pid, struct vm_area_list *vma_area_list,
+					dump_filemap_t dump_filemap)
+{
+	bool maps = false;
+	int ret;
+
+	if (opts.skip_smaps) {
+		maps = !task_has_locked_vmas(pid);
+		if (!maps)
+			pr_info("%d has locked vmas, reading smaps\n", pid);
+	}
+
+	ret = __parse_smaps(pid, vma_area_list, dump_filemap, maps);
+	if (ret > 0) {
+		free_mappings(vma_area_list);
+		ret = __parse_smaps(pid, vma_area_list, dump_filemap, false);
+	}
+
+	return ret;
+}
+
 int parse_pid_stat(pid_t pid, struct proc_pid_stat *s)
 {
 	char *tok, *p;
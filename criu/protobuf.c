@@ -27,6 +27,124 @@
  */
 #define PB_PKOBJ_LOCAL_SIZE	1024
 
+/*
+ * Arena for unpacked objects that are either kept till the end
+ * (restore collects most of the images this way) or freed all at
+ * once (pagemaps). Objects are bump-allocated from big chunks and
+ * are never freed one by one.
+ */
+#define PB_ARENA_CHUNK		(64 << 10)
+
+struct pb_arena_chunk {
+	struct pb_arena_chunk	*next;
+	char			data[];
+};
+
+struct pb_arena {
+	ProtobufCAllocator	allocator;
+	struct pb_arena_chunk	*chunks;
+	char			*pos;
+	size_t			left;
+};
+
+static void *__pb_arena_alloc(void *data, size_t size)
+{
+	struct pb_arena *a = data;
+	struct pb_arena_chunk *c;
+	size_t csize;
+	void *ret;
+
+	size = round_up(size, sizeof(u64));
+	if (size <= a->left) {
+		ret = a->pos;
+		a->pos += size;
+		a->left -= size;
+		return ret;
+	}
+
+	csize = max_t(size_t, size, PB_ARENA_CHUNK - sizeof(*c));
+	c = xmalloc(sizeof(*c) + csize);
+	if (!c)
+		return NULL;
+
+	/* Big objects get own chunks not to waste the current one */
+	if (size > PB_ARENA_CHUNK / 4 && a->chunks) {
+		c->next = a->chunks->next;
+		a->chunks->next = c;
+		return c->data;
+	}
+
+	c->next = a->chunks;
+	a->chunks = c;
+	a->pos = c->data + size;
+	a->left = csize - size;
+	return c->data;
+}
+
+void *pb_arena_alloc(struct pb_arena *a, size_t size)
+{
+	return __pb_arena_alloc(a, size);
+}
+
+static void pb_arena_free_one(void *data, void *ptr)
+{
+	/* Freed with the whole arena */
+}
+
+struct pb_arena *pb_arena_create(void)
+{
+	struct pb_arena *a;
+
+	a = xzalloc(sizeof(*a));
+	if (!a)
+		return NULL;
+
+	a->allocator.alloc = __pb_arena_alloc;
+	a->allocator.free = pb_arena_free_one;
+	a->allocator.allocator_data = a;
+	return a;
+}
+
+void pb_arena_destroy(struct pb_arena *a)
+{
+	struct pb_arena_chunk *c;
+
+	if (!a)
+		return;
+
+	while (a->chunks) {
+		c = a->chunks;
+		a->chunks = c->next;
+		xfree(c);
+	}
+	xfree(a);
+}
+
+static struct pb_arena *collect_arena;
+
+/*
+ * Arena for objects collected on restore, they live till criu
+ * exits and are inherited by restored tasks with the rest of the
+ * memory.
+ */
+struct pb_arena *pb_collect_arena(void)
+{
+	if (!collect_arena)
+		collect_arena = pb_arena_create();
+	return collect_arena;
+}
+
+static inline ProtobufCAllocator *pb_allocator(struct pb_arena *a)
+{
+	return a ? &a->allocator : NULL;
+}
+
+void pb_free(int type, void *obj, struct pb_arena *a)
+{
+	if (!a)
+		cr_pb_descs[type].free(obj, NULL);
+}
+
 static char *image_name(struct cr_img *img)
 {
 	int fd = img->_x.fd;
@@ -45,10 +163,12 @@ static char *image_name(struct cr_img *img)
  * -1 on error (or EOF met and @eof set to false)
  *  0 on EOF and @eof set to true
  *
- * Don't forget to free memory granted to unpacked object in calling code if needed
+ * Don't forget to free memory granted to unpacked object in calling code if needed,
+ * objects unpacked into @arena are freed with it
  */
 
-int do_pb_read_one(struct cr_img *img, void **pobj, int type, bool eof)
+int do_pb_read_one(struct cr_img *img, void **pobj, int type, bool eof,
+		struct pb_arena *arena)
 {
 	u8 local[PB_PKOBJ_LOCAL_SIZE];
 	void *buf = (void *)&local;
@@ -101,7 +221,7 @@ int do_pb_read_one(struct cr_img *img, void **pobj, int type, bool eof)
 		goto err;
 	}
 
-	*pobj = cr_pb_descs[type].unpack(NULL, size, buf);
+	*pobj = cr_pb_descs[type].unpack(pb_allocator(arena), size, buf);
 	if (!*pobj) {
 		ret = -1;
 		pr_err("Failed unpacking object %p from %s\n",
@@ -178,6 +298,7 @@ int collect_image(struct collect_image_info *cinfo)
 	struct cr_img *img;
 	void *(*o_alloc)(size_t size) = malloc;
 	void (*o_free)(void *ptr) = free;
+	struct pb_arena *arena = NULL;
 
 	pr_info("Collecting %d/%d (flags %x)\n",
 			cinfo->fd_type, cinfo->pb_type, cinfo->flags);
@@ -192,6 +313,14 @@ int collect_image(struct collect_image_info *cinfo)
 		o_free = shfree_last;
 	}
 
+	if (cinfo->flags & COLLECT_ARENA) {
+		arena = pb_collect_arena();
+		if (!arena) {
+			close_image(img);
+			return -1;
+		}
+	}
+
 	while (1) {
 		void *obj;
 		ProtobufCMessage *msg;
@@ -204,7 +333,7 @@ int collect_image(struct collect_image_info *cinfo)
 		} else
 			obj = NULL;
 
-		ret = pb_read_one_eof(img, &msg, cinfo->pb_type);
+		ret = do_pb_read_one(img, (void **)&msg, cinfo->pb_type, true, arena);
 		if (ret <= 0) {
 			o_free(obj);
 			break;
@@ -213,12 +342,12 @@ int collect_image(struct collect_image_info *cinfo)
 		ret = cinfo->collect(obj, msg, img);
 		if (ret < 0) {
 			o_free(obj);
-			cr_pb_descs[cinfo->pb_type].free(msg, NULL);
+			pb_free(cinfo->pb_type, msg, arena);
 			break;
 		}
 
 		if (!cinfo->priv_size && !(cinfo->flags & COLLECT_NOFREE))
-			cr_pb_descs[cinfo->pb_type].free(msg, NULL);
+			pb_free(cinfo->pb_type, msg, arena);
 	}
 
 	close_image(img);
@@ -327,6 +327,40 @@ static int log_unfrozen_stacks(char *root)
 	return 0;
 }
 
+/*
+ * The freezer.state doesn't notify anyone when it changes, so it
+ * has to be polled. Most cgroups get frozen (and exiting tasks go
+ * away) in a few ms, so poll often first and back off to the step
+ * of max_step_us not to spin on the long ones.
+ */
+#define FREEZER_MIN_STEP_US	1000UL
+
+struct freezer_wait {
+	unsigned long long	waited_us;
+	unsigned long long	max_us;
+	unsigned long		step_us;
+	unsigned long		max_step_us;
+	unsigned long		nr_polls;
+};
+
+/* Returns false when it's time to give up */
+static bool freezer_wait_step(struct freezer_wait *fw)
+{
+	struct timespec req;
+
+	if (fw->waited_us >= fw->max_us || alarm_timeouted())
+		return false;
+
+	req.tv_sec = fw->step_us / 1000000;
+	req.tv_nsec = (fw->step_us % 1000000) * 1000;
+	nanosleep(&req, NULL);
+
+	fw->waited_us += fw->step_us;
+	fw->nr_polls++;
+	fw->step_us = min(fw->step_us * 2, fw->max_step_us);
+	return true;
+}
+
 static int freeze_processes(void)
 {
 	int fd, exit_code = -1;
@@ -335,11 +369,9 @@ static int freeze_processes(void)
 
 	static const unsigned long step_ms = 100;
 	unsigned long nr_attempts = (opts.timeout * 1000000) / step_ms;
-	unsigned long i = 0;
-
-	const struct timespec req = {
-		.tv_nsec	= step_ms * 1000000,
-		.tv_sec		= 0,
+	struct freezer_wait fw = {
+		.step_us	= FREEZER_MIN_STEP_US,
+		.max_step_us	= step_ms * 1000,
 	};
 
 	if (unlikely(!nr_attempts)) {
@@ -349,9 +381,10 @@ static int freeze_processes(void)
 		 */
 		nr_attempts = (10 * 1000000) / step_ms;
 	}
+	fw.max_us = (unsigned long long)nr_attempts * step_ms * 1000;
 
-	pr_debug("freezing processes: %lu attempst with %lu ms steps\n",
-		 nr_attempts, step_ms);
+	pr_debug("freezing processes: %llu us at most with %lu ms steps\n",
+		 fw.max_us, step_ms);
 
 	snprintf(path, sizeof(path), "%s/freezer.state", opts.freeze_cgroup);
 	fd = open(path, O_RDWR);
@@ -367,6 +400,7 @@ static int freeze_processes(void)
 	if (state == thawed) {
 		freezer_thawed = true;
 
+		timing_start(TIME_FREEZER_WAIT);
 		lseek(fd, 0, SEEK_SET);
 		if (write(fd, frozen, sizeof(frozen)) != sizeof(frozen)) {
 			pr_perror("Unable to freeze tasks");
@@ -381,7 +415,7 @@ static int freeze_processes(void)
 		 * not read @tasks pids while freezer in
 		 * transition stage.
 		 */
-		for (; i <= nr_attempts; i++) {
+		while (1) {
 			state = get_freezer_state(fd);
 			if (!state) {
 				close(fd);
@@ -390,31 +424,30 @@ static int freeze_processes(void)
 
 			if (state == frozen)
 				break;
-			if (alarm_timeouted())
-				goto err;
-			nanosleep(&req, NULL);
+			if (!freezer_wait_step(&fw))
+				break;
 		}
 
-		if (i > nr_attempts) {
+		if (state != frozen) {
+			if (alarm_timeouted())
+				goto err;
 			pr_err("Unable to freeze cgroup %s\n", opts.freeze_cgroup);
 			if (!pr_quelled(LOG_DEBUG))
 				log_unfrozen_stacks(opts.freeze_cgroup);
 			goto err;
 		}
 
-		pr_debug("freezing processes: %lu attempts done\n", i);
+		timing_stop(TIME_FREEZER_WAIT);
+		pr_debug("freezing processes: frozen in %lu polls\n", fw.nr_polls);
 	}
 
 	/*
-	 * Pay attention on @i variable -- it's continuation.
+	 * Pay attention on @fw -- it's continuation.
 	 */
-	for (; i <= nr_attempts; i++) {
+	timing_start(TIME_SEIZE);
+	while (1) {
 		exit_code = seize_cgroup_tree(opts.freeze_cgroup, state);
-		if (exit_code == -EAGAIN) {
-			if (alarm_timeouted())
-				goto err;
-			nanosleep(&req, NULL);
-		} else
+		if (exit_code != -EAGAIN || !freezer_wait_step(&fw))
 			break;
 	}
 
@@ -846,6 +879,9 @@ int collect_pstree(void)
 	if (opts.freeze_cgroup && freeze_processes())
 		goto err;
 
+	if (!opts.freeze_cgroup)
+		timing_start(TIME_SEIZE);
+
 	if (!opts.freeze_cgroup && compel_interrupt_task(pid)) {
 		set_cr_errno(ESRCH);
 		goto err;
@@ -878,6 +914,7 @@ int collect_pstree(void)
 	}
 
 	ret = 0;
+	timing_stop(TIME_SEIZE);
 	timing_stop(TIME_FREEZING);
 	timing_start(TIME_FROZEN);
 
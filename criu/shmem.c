@@ -711,7 +711,7 @@ again:
 		if (pgstate == PST_ZERO)
 			ret = 0;
 		else if (xfer.parent && page_in_parent(pgstate == PST_DIRTY))
-			ret = page_pipe_add_hole(pp, pgaddr);
+			ret = page_pipe_add_hole(pp, pgaddr, PAGE_SIZE);
 		else
 			ret = page_pipe_add_page(pp, pgaddr);
 
@@ -520,6 +520,7 @@ struct collect_image_info inet_sk_cinfo = {
 	.pb_type = PB_INET_SK,
 	.priv_size = sizeof(struct inet_sk_info),
 	.collect = collect_one_inetsk,
+	.flags = COLLECT_ARENA,
 };
 
 int collect_inet_sockets(void)
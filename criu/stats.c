@@ -10,6 +10,9 @@
 #include "util.h"
 #include "image.h"
 #include "images/stats.pb-c.h"
+#include "images/fdinfo.pb-c.h"
+
+#define NR_FD_TYPES	(FD_TYPES__TIMERFD + 1)
 
 struct timing {
 	struct timeval start;
@@ -24,6 +27,9 @@ struct dump_stats {
 struct restore_stats {
 	struct timing	timings[RESTORE_TIME_NS_STATS];
 	atomic_t	counts[RESTORE_CNT_NR_STATS];
+	/* Per fd type, summed over all the tasks */
+	atomic_t	fds_restored[NR_FD_TYPES];
+	u64		fds_time[NR_FD_TYPES];	/* us, atomic, can be big */
 };
 
 struct dump_stats *dstats;
@@ -41,6 +47,15 @@ void cnt_add(int c, unsigned long val)
 		BUG();
 }
 
+/*
+ * The page server writes pages images too, but doesn't collect
+ * any stats, so the code shared with it should check this.
+ */
+bool dump_stats_enabled(void)
+{
+	return dstats != NULL;
+}
+
 static void timeval_accumulate(const struct timeval *from, const struct timeval *to,
 		struct timeval *res)
 {
@@ -95,6 +110,26 @@ void timing_stop(int t)
 	timeval_accumulate(&tm->start, &now, &tm->total);
 }
 
+/*
+ * Accounts one attempt to restore an fd of the @type, started at
+ * @start, and the fd itself if it got @restored.
+ */
+void fd_timing_add(int type, struct timeval *start, bool restored)
+{
+	struct timeval now, total = { };
+
+	if (rstats == NULL || type < 0 || type >= NR_FD_TYPES)
+		return;
+
+	gettimeofday(&now, NULL);
+	timeval_accumulate(start, &now, &total);
+	__atomic_fetch_add(&rstats->fds_time[type],
+			(u64)total.tv_sec * USEC_PER_SEC + total.tv_usec,
+			__ATOMIC_RELAXED);
+	if (restored)
+		atomic_inc(&rstats->fds_restored[type]);
+}
+
 static void encode_time(int t, u_int32_t *to)
 {
 	struct timing *tm;
@@ -105,9 +140,15 @@ static void encode_time(int t, u_int32_t *to)
 
 static void display_stats(int what, StatsEntry *stats)
 {
+	int i;
+
 	if (what == DUMP_STATS) {
 		pr_msg("Displaying dump stats:\n");
 		pr_msg("Freezing time: %d us\n", stats->dump->freezing_time);
+		if (stats->dump->has_freezer_wait_time)
+			pr_msg("  Freezer wait time: %d us\n", stats->dump->freezer_wait_time);
+		if (stats->dump->has_seize_time)
+			pr_msg("  Seizing time: %d us\n", stats->dump->seize_time);
 		pr_msg("Frozen time: %d us\n", stats->dump->frozen_time);
 		pr_msg("Memory dump time: %d us\n", stats->dump->memdump_time);
 		pr_msg("Memory write time: %d us\n", stats->dump->memwrite_time);
@@ -120,6 +161,21 @@ static void display_stats(int what, StatsEntry *stats)
 				stats->dump->pages_skipped_parent);
 		pr_msg("Memory pages written: %" PRIu64 " (0x%" PRIx64 ")\n", stats->dump->pages_written,
 				stats->dump->pages_written);
+		if (stats->dump->has_pages_zero) {
+			pr_msg("Memory pages zero: %" PRIu64 " (0x%" PRIx64 ")\n",
+					stats->dump->pages_zero, stats->dump->pages_zero);
+			pr_msg("Memory pages same as written: %" PRIu64 " (0x%" PRIx64 ")\n",
+					stats->dump->pages_same, stats->dump->pages_same);
+		}
+		if (stats->dump->has_compress_in) {
+			DumpStatsEntry *ds = stats->dump;
+
+			pr_msg("Memory compression time: %d us\n", ds->compress_time);
+			pr_msg("Memory compressed: %" PRIu64 " -> %" PRIu64 " bytes (ratio %.2f, %.1f MB/s)\n",
+					ds->compress_in, ds->compress_out,
+					ds->compress_out ? (double)ds->compress_in / ds->compress_out : 0.0,
+					ds->compress_time ? (double)ds->compress_in / ds->compress_time : 0.0);
+		}
 	} else if (what == RESTORE_STATS) {
 		pr_msg("Displaying restore stats:\n");
 		pr_msg("Pages compared: %" PRIu64 " (0x%" PRIx64 ")\n", stats->restore->pages_compared,
@@ -129,6 +185,17 @@ static void display_stats(int what, StatsEntry *stats)
 		if (stats->restore->has_pages_restored)
 			pr_msg("Pages restored: %" PRIu64 " (0x%" PRIx64 ")\n", stats->restore->pages_restored,
 					stats->restore->pages_restored);
+		if (stats->restore->has_pages_lazy)
+			pr_msg("Pages left for lazy restore: %" PRIu64 " (0x%" PRIx64 ")\n",
+					stats->restore->pages_lazy, stats->restore->pages_lazy);
+		for (i = 0; i < stats->restore->n_fds; i++) {
+			RestoreFdStatsEntry *fe = stats->restore->fds[i];
+			const ProtobufCEnumValue *v;
+
+			v = protobuf_c_enum_descriptor_get_value(&fd_types__descriptor, fe->type);
+			pr_msg("Fds of type %s restored: %" PRIu64 " in %" PRIu64 " us\n",
+					v ? v->name : "unknown", fe->nr, fe->time);
+		}
 		pr_msg("Restore time: %d us\n", stats->restore->restore_time);
 		pr_msg("Forking time: %d us\n", stats->restore->forking_time);
 	} else
@@ -140,6 +207,8 @@ void write_stats(int what)
 	StatsEntry stats = STATS_ENTRY__INIT;
 	DumpStatsEntry ds_entry = DUMP_STATS_ENTRY__INIT;
 	RestoreStatsEntry rs_entry = RESTORE_STATS_ENTRY__INIT;
+	RestoreFdStatsEntry fd_entries[NR_FD_TYPES], *fd_ptrs[NR_FD_TYPES];
+	int i;
 	char *name;
 	struct cr_img *img;
 
@@ -149,6 +218,12 @@ void write_stats(int what)
 
 		encode_time(TIME_FREEZING, &ds_entry.freezing_time);
 		encode_time(TIME_FROZEN, &ds_entry.frozen_time);
+		if (opts.freeze_cgroup) {
+			ds_entry.has_freezer_wait_time = true;
+			encode_time(TIME_FREEZER_WAIT, &ds_entry.freezer_wait_time);
+		}
+		ds_entry.has_seize_time = true;
+		encode_time(TIME_SEIZE, &ds_entry.seize_time);
 		encode_time(TIME_MEMDUMP, &ds_entry.memdump_time);
 		encode_time(TIME_MEMWRITE, &ds_entry.memwrite_time);
 		ds_entry.has_irmap_resolve = true;
@@ -158,6 +233,22 @@ void write_stats(int what)
 		ds_entry.pages_skipped_parent = dstats->counts[CNT_PAGES_SKIPPED_PARENT];
 		ds_entry.pages_written = dstats->counts[CNT_PAGES_WRITTEN];
 
+		if (opts.dedup_pages) {
+			ds_entry.has_pages_zero = true;
+			ds_entry.pages_zero = dstats->counts[CNT_PAGES_ZERO];
+			ds_entry.has_pages_same = true;
+			ds_entry.pages_same = dstats->counts[CNT_PAGES_SAME];
+		}
+
+		if (dstats->counts[CNT_COMPRESS_IN]) {
+			ds_entry.has_compress_time = true;
+			encode_time(TIME_COMPRESS, &ds_entry.compress_time);
+			ds_entry.has_compress_in = true;
+			ds_entry.compress_in = dstats->counts[CNT_COMPRESS_IN];
+			ds_entry.has_compress_out = true;
+			ds_entry.compress_out = dstats->counts[CNT_COMPRESS_OUT];
+		}
+
 		name = "dump";
 	} else if (what == RESTORE_STATS) {
 		stats.restore = &rs_entry;
@@ -166,6 +257,24 @@ void write_stats(int what)
 		rs_entry.pages_skipped_cow = atomic_read(&rstats->counts[CNT_PAGES_SKIPPED_COW]);
 		rs_entry.has_pages_restored = true;
 		rs_entry.pages_restored = atomic_read(&rstats->counts[CNT_PAGES_RESTORED]);
+		if (opts.lazy_pages) {
+			rs_entry.has_pages_lazy = true;
+			rs_entry.pages_lazy = atomic_read(&rstats->counts[CNT_PAGES_LAZY]);
+		}
+
+		for (i = 0; i < NR_FD_TYPES; i++) {
+			RestoreFdStatsEntry *fe = &fd_entries[rs_entry.n_fds];
+
+			if (!atomic_read(&rstats->fds_restored[i]))
+				continue;
+
+			restore_fd_stats_entry__init(fe);
+			fe->type = i;
+			fe->nr = atomic_read(&rstats->fds_restored[i]);
+			fe->time = __atomic_load_n(&rstats->fds_time[i], __ATOMIC_RELAXED);
+			fd_ptrs[rs_entry.n_fds++] = fe;
+		}
+		rs_entry.fds = fd_ptrs;
 
 		encode_time(TIME_FORK, &rs_entry.forking_time);
 		encode_time(TIME_RESTORE, &rs_entry.restore_time);
@@ -184,6 +293,50 @@ void write_stats(int what)
 		display_stats(what, &stats);
 }
 
+/*
+ * Dump stats of forked memory dump workers. The worker starts with
+ * clean stats, sends them to the parent when done and the parent
+ * accumulates them into its own.
+ */
+void reset_dump_stats(void)
+{
+	BUG_ON(dstats == NULL);
+	memzero(dstats, sizeof(*dstats));
+}
+
+int send_dump_stats(int fd)
+{
+	if (write(fd, dstats, sizeof(*dstats)) != sizeof(*dstats)) {
+		pr_perror("Can't send dump stats");
+		return -1;
+	}
+
+	return 0;
+}
+
+int recv_dump_stats(int fd)
+{
+	struct dump_stats ws;
+	int i;
+
+	if (read(fd, &ws, sizeof(ws)) != sizeof(ws)) {
+		pr_perror("Can't receive dump stats");
+		return -1;
+	}
+
+	for (i = 0; i < DUMP_TIME_NR_STATS; i++) {
+		struct timeval zero = { };
+
+		timeval_accumulate(&zero, &ws.timings[i].total,
+				&dstats->timings[i].total);
+	}
+
+	for (i = 0; i < DUMP_CNT_NR_STATS; i++)
+		dstats->counts[i] += ws.counts[i];
+
+	return 0;
+}
+
 int init_stats(int what)
 {
 	if (what == DUMP_STATS) {
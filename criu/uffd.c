@@ -0,0 +1,965 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <linux/userfaultfd.h>
+
+#include "types.h"
+#include "cr_options.h"
+#include "kerndat.h"
+#include "image.h"
+#include "pagemap.h"
+#include "pstree.h"
+#include "rst_info.h"
+#include "restorer.h"
+#include "servicefd.h"
+#include "stats.h"
+#include "util.h"
+#include "vma.h"
+#include "uffd.h"
+#include "log.h"
+#include "criu-log.h"
+#include "xmalloc.h"
+#include "common/list.h"
+#include "common/scm.h"
+
+#undef	LOG_PREFIX
+#define LOG_PREFIX "uffd: "
+
+/*
+ * Without these events the daemon can't follow the changes tasks do
+ * to their address spaces after resume, and would copy pages into
+ * wrong places or into forked children.
+ */
+#define LAZY_UFFD_FEATURES	(UFFD_FEATURE_EVENT_FORK |	\
+				 UFFD_FEATURE_EVENT_REMAP |	\
+				 UFFD_FEATURE_EVENT_REMOVE |	\
+				 UFFD_FEATURE_EVENT_UNMAP)
+
+int kerndat_uffd(void)
+{
+	struct uffdio_api api = { .api = UFFD_API };
+	int uffd;
+
+	uffd = syscall(SYS_userfaultfd, 0);
+	if (uffd < 0) {
+		if (errno == ENOSYS || errno == EPERM) {
+			kdat.has_uffd = false;
+			return 0;
+		}
+
+		pr_perror("Can't create userfaultfd");
+		return -1;
+	}
+
+	if (ioctl(uffd, UFFDIO_API, &api)) {
+		pr_perror("Can't query userfaultfd features");
+		close(uffd);
+		return -1;
+	}
+
+	kdat.has_uffd = true;
+	kdat.uffd_features = api.features;
+	close(uffd);
+	return 0;
+}
+
+bool uffd_noncoop_supported(void)
+{
+	return kdat.has_uffd &&
+		(kdat.uffd_features & LAZY_UFFD_FEATURES) == LAZY_UFFD_FEATURES;
+}
+
+/*
+ * Ranges of pages, that are not yet in the task. The @start
+ * is where the pages are now, the @img_start is where they
+ * are in images, these differ after the task mremap()-s them.
+ */
+struct lazy_iov {
+	struct list_head	l;
+	unsigned long		start;
+	unsigned long		end;
+	unsigned long		img_start;
+};
+
+/*
+ * Restore sends the ranges to the daemon in a series of messages
+ * over the SOCK_SEQPACKET socket. The last one for a task carries
+ * the userfaultfd, message with zero pid means the restore is over.
+ */
+#define LAZY_MSG_IOVS		256
+
+struct lazy_pages_msg {
+	s32			pid;
+	u32			nr_iovs;
+	struct {
+		u64		start;
+		u64		len;
+	} iovs[LAZY_MSG_IOVS];
+};
+
+#define LAZY_MSG_SIZE(nr)	(offsetof(struct lazy_pages_msg, iovs) + \
+				 (nr) * sizeof(((struct lazy_pages_msg *)0)->iovs[0]))
+
+static int lazy_pages_sock_addr(struct sockaddr_un *addr)
+{
+	addr->sun_family = AF_UNIX;
+	strcpy(addr->sun_path, LAZY_PAGES_SOCK_NAME);
+
+	return offsetof(struct sockaddr_un, sun_path) + strlen(addr->sun_path);
+}
+
+bool vma_can_be_lazy(struct vma_area *vma)
+{
+	/*
+	 * Only anonymous private memory can be populated via the
+	 * userfaultfd. Stacks are always restored eagerly, they are
+	 * the hottest memory the task has. And mlock-ed areas are
+	 * populated by kernel at mmap time.
+	 */
+	return vma_area_is(vma, VMA_AREA_REGULAR) &&
+		vma_area_is(vma, VMA_ANON_PRIVATE) &&
+		!vma_area_is(vma, VMA_AREA_STACK) &&
+		!vma_area_is(vma, VMA_AREA_AIORING) &&
+		!(vma->e->flags & (MAP_GROWSDOWN | MAP_LOCKED));
+}
+
+int lazy_pages_add_iov(struct pstree_item *t, unsigned long addr, unsigned long len)
+{
+	struct list_head *iovs = &rsti(t)->lazy_iovs;
+	struct lazy_iov *iov;
+
+	if (!list_empty(iovs)) {
+		iov = list_entry(iovs->prev, struct lazy_iov, l);
+		if (iov->end == addr) {
+			iov->end += len;
+			return 0;
+		}
+	}
+
+	iov = xmalloc(sizeof(*iov));
+	if (!iov)
+		return -1;
+
+	iov->start = iov->img_start = addr;
+	iov->end = addr + len;
+	list_add_tail(&iov->l, iovs);
+	return 0;
+}
+
+int prepare_lazy_pages_socket(void)
+{
+	struct sockaddr_un addr;
+	int sk, len, ret;
+
+	if (!opts.lazy_pages)
+		return 0;
+
+	if (!uffd_noncoop_supported()) {
+		pr_err("Lazy pages need userfaultfd with non-cooperative events\n");
+		return -1;
+	}
+
+	sk = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+	if (sk < 0) {
+		pr_perror("Can't create lazy-pages socket");
+		return -1;
+	}
+
+	len = lazy_pages_sock_addr(&addr);
+	if (connect(sk, (struct sockaddr *)&addr, len)) {
+		pr_perror("Can't connect to lazy-pages daemon");
+		close(sk);
+		return -1;
+	}
+
+	ret = install_service_fd(LAZY_PAGES_SK_OFF, sk);
+	close(sk);
+
+	return ret < 0 ? -1 : 0;
+}
+
+int prepare_lazy_pages(struct pstree_item *t, struct task_restore_args *ta)
+{
+	struct uffdio_api api = {
+		.api		= UFFD_API,
+		.features	= LAZY_UFFD_FEATURES,
+	};
+	struct lazy_pages_msg msg;
+	struct lazy_iov *iov, *n;
+	unsigned long nr_pages = 0;
+	int sk, uffd;
+
+	ta->uffd = -1;
+	if (list_empty(&rsti(t)->lazy_iovs))
+		return 0;
+
+	sk = get_service_fd(LAZY_PAGES_SK_OFF);
+	if (sk < 0) {
+		pr_err("No connection to lazy-pages daemon\n");
+		return -1;
+	}
+
+	uffd = syscall(SYS_userfaultfd, O_CLOEXEC | O_NONBLOCK);
+	if (uffd < 0) {
+		pr_perror("Can't create userfaultfd");
+		return -1;
+	}
+
+	if (ioctl(uffd, UFFDIO_API, &api)) {
+		pr_perror("Can't negotiate userfaultfd API");
+		goto err;
+	}
+
+	msg.pid = vpid(t);
+	msg.nr_iovs = 0;
+
+	list_for_each_entry_safe(iov, n, &rsti(t)->lazy_iovs, l) {
+		if (msg.nr_iovs == LAZY_MSG_IOVS) {
+			if (send(sk, &msg, LAZY_MSG_SIZE(msg.nr_iovs), 0) < 0) {
+				pr_perror("Can't send lazy pages to daemon");
+				goto err;
+			}
+			msg.nr_iovs = 0;
+		}
+
+		msg.iovs[msg.nr_iovs].start = iov->start;
+		msg.iovs[msg.nr_iovs].len = iov->end - iov->start;
+		msg.nr_iovs++;
+		nr_pages += (iov->end - iov->start) / PAGE_SIZE;
+
+		list_del(&iov->l);
+		xfree(iov);
+	}
+
+	/*
+	 * The restorer will register the lazy VMAs with the uffd,
+	 * so the daemon is ready to handle faults on them since
+	 * it gets the uffd.
+	 */
+	if (send_fds(sk, NULL, 0, &uffd, 1, &msg, LAZY_MSG_SIZE(msg.nr_iovs))) {
+		pr_perror("Can't send userfaultfd to daemon");
+		goto err;
+	}
+
+	pr_info("%lu pages will be restored lazily\n", nr_pages);
+	cnt_add(CNT_PAGES_LAZY, nr_pages);
+	ta->uffd = uffd;
+	return 0;
+
+err:
+	close(uffd);
+	return -1;
+}
+
+void lazy_pages_restore_finished(void)
+{
+	struct lazy_pages_msg msg = { .pid = 0, .nr_iovs = 0, };
+	int sk;
+
+	sk = get_service_fd(LAZY_PAGES_SK_OFF);
+	if (sk < 0)
+		return;
+
+	if (send(sk, &msg, LAZY_MSG_SIZE(0), 0) < 0)
+		pr_perror("Can't notify lazy-pages daemon");
+
+	close_service_fd(LAZY_PAGES_SK_OFF);
+}
+
+/*
+ * The daemon side
+ */
+
+#define LAZY_PREFETCH_PAGES	256
+
+struct lazy_fault {
+	struct list_head	l;
+	unsigned long		addr;
+};
+
+struct lazy_task {
+	struct list_head	l;
+	int			pid;		/* from images */
+	int			uffd;
+	struct page_read	pr;
+	struct list_head	iovs;
+	struct list_head	faults;		/* to be retried */
+
+	unsigned long		nr_faults;
+	unsigned long		nr_prefetched;
+};
+
+static LIST_HEAD(lazy_tasks);
+static bool restore_finished;
+static int lazy_epfd = -1;
+static void *lazy_buf;
+
+static struct lazy_task *lazy_task_alloc(int pid)
+{
+	struct lazy_task *t;
+
+	t = xzalloc(sizeof(*t));
+	if (!t)
+		return NULL;
+
+	if (open_page_read(pid, &t->pr, PR_TASK) <= 0) {
+		pr_err("Can't open pages for %d\n", pid);
+		xfree(t);
+		return NULL;
+	}
+
+	t->pid = pid;
+	t->uffd = -1;
+	INIT_LIST_HEAD(&t->iovs);
+	INIT_LIST_HEAD(&t->faults);
+	list_add_tail(&t->l, &lazy_tasks);
+
+	return t;
+}
+
+static void free_iovs(struct list_head *iovs)
+{
+	struct lazy_iov *iov, *n;
+
+	list_for_each_entry_safe(iov, n, iovs, l) {
+		list_del(&iov->l);
+		xfree(iov);
+	}
+}
+
+static void lazy_task_free(struct lazy_task *t)
+{
+	struct lazy_fault *f, *n;
+
+	pr_info("%d: %lu pages faulted, %lu pages prefetched\n",
+			t->pid, t->nr_faults, t->nr_prefetched);
+
+	list_for_each_entry_safe(f, n, &t->faults, l)
+		xfree(f);
+	free_iovs(&t->iovs);
+	t->pr.close(&t->pr);
+	if (t->uffd >= 0)
+		close(t->uffd);
+	list_del(&t->l);
+	xfree(t);
+}
+
+static int lazy_task_set_uffd(struct lazy_task *t, int uffd)
+{
+	struct epoll_event ev = {
+		.events		= EPOLLIN,
+		.data.ptr	= t,
+	};
+
+	t->uffd = uffd;
+	if (epoll_ctl(lazy_epfd, EPOLL_CTL_ADD, uffd, &ev)) {
+		pr_perror("Can't poll userfaultfd");
+		return -1;
+	}
+
+	return 0;
+}
+
+static struct lazy_iov *split_iov(struct lazy_iov *iov, unsigned long addr)
+{
+	struct lazy_iov *tail;
+
+	tail = xmalloc(sizeof(*tail));
+	if (!tail)
+		return NULL;
+
+	tail->start = addr;
+	tail->end = iov->end;
+	tail->img_start = iov->img_start + (addr - iov->start);
+	iov->end = addr;
+	list_add(&tail->l, &iov->l);
+
+	return tail;
+}
+
+/* Move all the pages from the [start, end) range into @to list */
+static int cut_iovs(struct list_head *from, unsigned long start,
+		    unsigned long end, struct list_head *to)
+{
+	struct list_head *pos, *next;
+
+	for (pos = from->next; pos != from; pos = next) {
+		struct lazy_iov *iov = list_entry(pos, struct lazy_iov, l);
+
+		if (iov->end <= start || iov->start >= end) {
+			next = pos->next;
+			continue;
+		}
+
+		if (iov->start < start) {
+			/* The tail will be handled on the next step */
+			if (!split_iov(iov, start))
+				return -1;
+			next = pos->next;
+			continue;
+		}
+
+		if (iov->end > end && !split_iov(iov, end))
+			return -1;
+
+		next = pos->next;
+		list_move_tail(pos, to);
+	}
+
+	return 0;
+}
+
+static int drop_iovs(struct lazy_task *t, unsigned long start, unsigned long end)
+{
+	LIST_HEAD(gone);
+
+	if (cut_iovs(&t->iovs, start, end, &gone))
+		return -1;
+
+	free_iovs(&gone);
+	return 0;
+}
+
+static struct lazy_iov *find_iov(struct lazy_task *t, unsigned long addr)
+{
+	struct lazy_iov *iov;
+
+	list_for_each_entry(iov, &t->iovs, l)
+		if (addr >= iov->start && addr < iov->end)
+			return iov;
+
+	return NULL;
+}
+
+static int lazy_read_pages(struct page_read *pr, unsigned long vaddr,
+			   unsigned long nr, void *buf)
+{
+	while (nr) {
+		unsigned long n;
+
+		/* The page_read can only move forward */
+		if (vaddr < pr->cvaddr)
+			pr->reset(pr);
+
+		if (pr->seek_pagemap(pr, vaddr) <= 0) {
+			pr_err("Missing %lx in pagemap\n", vaddr);
+			return -1;
+		}
+
+		pr->skip_pages(pr, vaddr - pr->cvaddr);
+
+		n = pr->pe->nr_pages - (vaddr - pr->pe->vaddr) / PAGE_SIZE;
+		if (n > nr)
+			n = nr;
+
+		if (pr->read_pages(pr, vaddr, n, buf, 0) < 0)
+			return -1;
+
+		vaddr += n * PAGE_SIZE;
+		buf += n * PAGE_SIZE;
+		nr -= n;
+	}
+
+	return 0;
+}
+
+/*
+ * Returns the number of pages populated, 0 if it should be
+ * retried later and -1 on error.
+ */
+static int uffd_copy(struct lazy_task *t, struct lazy_iov *iov,
+		     unsigned long addr, unsigned long nr)
+{
+	struct uffdio_copy uc = {
+		.dst	= addr,
+		.src	= (unsigned long)lazy_buf,
+		.len	= nr * PAGE_SIZE,
+	};
+
+	if (lazy_read_pages(&t->pr, iov->img_start + (addr - iov->start), nr, lazy_buf))
+		return -1;
+
+	if (ioctl(t->uffd, UFFDIO_COPY, &uc)) {
+		if (uc.copy > 0)
+			/* Partially copied, the rest will be tried later */
+			nr = uc.copy / PAGE_SIZE;
+		else if (errno == EAGAIN)
+			/* Address space is changing, events are coming */
+			return 0;
+		else if ((errno == EEXIST || errno == ENOENT) && nr > 1)
+			/*
+			 * The range may cross the VMAs boundary, e.g. after
+			 * mprotect() on the part of it, try smaller piece.
+			 */
+			return uffd_copy(t, iov, addr, nr / 2);
+		else if (errno == EEXIST || errno == ENOENT)
+			/*
+			 * The page has already been populated or unmapped
+			 * and we'll get the event, forget about it.
+			 */
+			pr_debug("%d: %lx is gone (%d)\n", t->pid, addr, errno);
+		else if (errno == ESRCH) {
+			/* The task has exited */
+			free_iovs(&t->iovs);
+			return nr;
+		} else {
+			pr_perror("%d: Can't copy %lx:%lu", t->pid, addr, nr);
+			return -1;
+		}
+	}
+
+	if (drop_iovs(t, addr, addr + nr * PAGE_SIZE))
+		return -1;
+
+	return nr;
+}
+
+static int uffd_zero(struct lazy_task *t, unsigned long addr)
+{
+	struct uffdio_zeropage uz = {
+		.range.start	= addr,
+		.range.len	= PAGE_SIZE,
+	};
+
+	if (ioctl(t->uffd, UFFDIO_ZEROPAGE, &uz)) {
+		if (errno == EAGAIN)
+			return 0;
+		if (errno != EEXIST && errno != ENOENT && errno != ESRCH) {
+			pr_perror("%d: Can't zero %lx", t->pid, addr);
+			return -1;
+		}
+	}
+
+	return 1;
+}
+
+static int handle_fault(struct lazy_task *t, unsigned long addr)
+{
+	struct lazy_iov *iov;
+	int ret;
+
+	addr &= ~(PAGE_SIZE - 1);
+
+	/*
+	 * The pages that are not in images are either holes
+	 * or zero pages and are served with zeroes.
+	 */
+	iov = find_iov(t, addr);
+	if (iov) {
+		ret = uffd_copy(t, iov, addr, 1);
+		if (ret > 0)
+			t->nr_faults++;
+	} else
+		ret = uffd_zero(t, addr);
+
+	if (ret == 0) {
+		struct lazy_fault *f;
+
+		f = xmalloc(sizeof(*f));
+		if (!f)
+			return -1;
+
+		f->addr = addr;
+		list_add_tail(&f->l, &t->faults);
+	}
+
+	return ret < 0 ? -1 : 0;
+}
+
+static int retry_faults(struct lazy_task *t)
+{
+	struct lazy_fault *f, *n;
+	LIST_HEAD(faults);
+
+	list_splice_init(&t->faults, &faults);
+	list_for_each_entry_safe(f, n, &faults, l) {
+		int ret;
+
+		ret = handle_fault(t, f->addr);
+		xfree(f);
+		if (ret)
+			return -1;
+	}
+
+	return 0;
+}
+
+static int handle_fork(struct lazy_task *t, int uffd)
+{
+	struct lazy_task *c;
+	struct lazy_iov *iov;
+
+	pr_info("%d: forked, child uffd %d\n", t->pid, uffd);
+
+	/*
+	 * The child has the same pages missing as the parent
+	 * has at the moment, and the same contents for them.
+	 */
+	c = lazy_task_alloc(t->pid);
+	if (!c) {
+		close(uffd);
+		return -1;
+	}
+
+	list_for_each_entry(iov, &t->iovs, l) {
+		struct lazy_iov *ci;
+
+		ci = xmalloc(sizeof(*ci));
+		if (!ci)
+			goto err;
+
+		*ci = *iov;
+		list_add_tail(&ci->l, &c->iovs);
+	}
+
+	if (lazy_task_set_uffd(c, uffd))
+		goto err;
+
+	return 0;
+
+err:
+	close(uffd);
+	lazy_task_free(c);
+	return -1;
+}
+
+static int handle_remap(struct lazy_task *t, unsigned long from,
+			unsigned long to, unsigned long len)
+{
+	struct lazy_iov *iov;
+	LIST_HEAD(moved);
+
+	pr_debug("%d: remap %lx -> %lx:%lx\n", t->pid, from, to, len);
+
+	if (cut_iovs(&t->iovs, from, from + len, &moved))
+		return -1;
+
+	list_for_each_entry(iov, &moved, l) {
+		iov->start = iov->start - from + to;
+		iov->end = iov->end - from + to;
+	}
+
+	list_splice_tail(&moved, &t->iovs);
+	return 0;
+}
+
+static int handle_uffd_events(struct lazy_task *t)
+{
+	struct uffd_msg msg;
+	int ret;
+
+	while (1) {
+		ret = read(t->uffd, &msg, sizeof(msg));
+		if (ret < 0) {
+			if (errno == EAGAIN)
+				return 0;
+			pr_perror("%d: Can't read uffd message", t->pid);
+			return -1;
+		}
+
+		if (ret != sizeof(msg)) {
+			pr_err("%d: Short uffd message %d\n", t->pid, ret);
+			return -1;
+		}
+
+		switch (msg.event) {
+		case UFFD_EVENT_PAGEFAULT:
+			ret = handle_fault(t, msg.arg.pagefault.address);
+			break;
+		case UFFD_EVENT_FORK:
+			ret = handle_fork(t, msg.arg.fork.ufd);
+			break;
+		case UFFD_EVENT_REMAP:
+			ret = handle_remap(t, msg.arg.remap.from,
+					msg.arg.remap.to, msg.arg.remap.len);
+			break;
+		case UFFD_EVENT_REMOVE:
+		case UFFD_EVENT_UNMAP:
+			ret = drop_iovs(t, msg.arg.remove.start, msg.arg.remove.end);
+			break;
+		default:
+			pr_err("%d: Unexpected uffd event %u\n", t->pid, msg.event);
+			ret = -1;
+		}
+
+		if (ret)
+			return -1;
+	}
+}
+
+static int handle_sk_message(int sk)
+{
+	struct lazy_pages_msg msg;
+	struct lazy_task *t;
+	char cbuf[CMSG_SPACE(sizeof(int))];
+	struct iovec iov = {
+		.iov_base	= &msg,
+		.iov_len	= sizeof(msg),
+	};
+	struct msghdr mh = {
+		.msg_iov	= &iov,
+		.msg_iovlen	= 1,
+		.msg_control	= cbuf,
+		.msg_controllen	= sizeof(cbuf),
+	};
+	struct cmsghdr *ch;
+	int ret, i, uffd = -1;
+
+	ret = recvmsg(sk, &mh, MSG_CMSG_CLOEXEC);
+	if (ret < 0) {
+		pr_perror("Can't read lazy pages message");
+		return -1;
+	}
+
+	if (ret == 0 || msg.pid == 0) {
+		pr_info("Restore finished%s\n", ret ? "" : " (connection closed)");
+		restore_finished = true;
+		epoll_ctl(lazy_epfd, EPOLL_CTL_DEL, sk, NULL);
+		return 0;
+	}
+
+	ch = CMSG_FIRSTHDR(&mh);
+	if (ch && ch->cmsg_level == SOL_SOCKET && ch->cmsg_type == SCM_RIGHTS)
+		memcpy(&uffd, CMSG_DATA(ch), sizeof(int));
+
+	if (ret != LAZY_MSG_SIZE(msg.nr_iovs) || msg.nr_iovs > LAZY_MSG_IOVS) {
+		pr_err("Malformed lazy pages message (%d bytes)\n", ret);
+		goto err;
+	}
+
+	t = NULL;
+	list_for_each_entry(t, &lazy_tasks, l)
+		if (t->pid == msg.pid && t->uffd < 0)
+			goto found;
+
+	t = lazy_task_alloc(msg.pid);
+	if (!t)
+		goto err;
+found:
+	for (i = 0; i < msg.nr_iovs; i++) {
+		struct lazy_iov *li;
+
+		li = xmalloc(sizeof(*li));
+		if (!li)
+			goto err;
+
+		li->start = li->img_start = msg.iovs[i].start;
+		li->end = li->start + msg.iovs[i].len;
+		list_add_tail(&li->l, &t->iovs);
+	}
+
+	if (uffd >= 0) {
+		pr_info("%d: got uffd %d\n", t->pid, uffd);
+		return lazy_task_set_uffd(t, uffd);
+	}
+
+	return 0;
+
+err:
+	if (uffd >= 0)
+		close(uffd);
+	return -1;
+}
+
+/* Copy one chunk of pages, returns whether there's more work */
+static int prefetch_pages(void)
+{
+	struct lazy_task *t;
+
+	list_for_each_entry(t, &lazy_tasks, l) {
+		struct lazy_iov *iov;
+		unsigned long nr;
+		int ret;
+
+		if (t->uffd < 0 || list_empty(&t->iovs))
+			continue;
+
+		iov = list_first_entry(&t->iovs, struct lazy_iov, l);
+		nr = min_t(unsigned long, (iov->end - iov->start) / PAGE_SIZE,
+				LAZY_PREFETCH_PAGES);
+
+		ret = uffd_copy(t, iov, iov->start, nr);
+		if (ret < 0)
+			return -1;
+
+		t->nr_prefetched += ret;
+
+		/* Round-robin between the tasks */
+		list_move_tail(&t->l, &lazy_tasks);
+		return 1;
+	}
+
+	return 0;
+}
+
+static void reap_lazy_tasks(void)
+{
+	struct lazy_task *t, *n;
+
+	/*
+	 * Once all the pages are in place the uffd is not needed,
+	 * closing it unregisters the VMAs and the rest of faults
+	 * (on holes) are handled by kernel itself.
+	 */
+	list_for_each_entry_safe(t, n, &lazy_tasks, l) {
+		if (t->uffd < 0) {
+			/* The task has never made it to the restorer */
+			if (restore_finished)
+				lazy_task_free(t);
+			continue;
+		}
+
+		if (list_empty(&t->iovs) && list_empty(&t->faults))
+			lazy_task_free(t);
+	}
+}
+
+static int lazy_pages_serve(int sk)
+{
+	struct epoll_event ev = { .events = EPOLLIN, .data.ptr = NULL, };
+	struct epoll_event evs[16];
+	int ret = -1, more = 0;
+
+	lazy_buf = xmalloc(LAZY_PREFETCH_PAGES * PAGE_SIZE);
+	if (!lazy_buf)
+		return -1;
+
+	lazy_epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (lazy_epfd < 0) {
+		pr_perror("Can't create epoll");
+		goto out;
+	}
+
+	if (epoll_ctl(lazy_epfd, EPOLL_CTL_ADD, sk, &ev)) {
+		pr_perror("Can't poll lazy-pages socket");
+		goto out;
+	}
+
+	while (!restore_finished || !list_empty(&lazy_tasks)) {
+		struct lazy_task *t;
+		bool retry = false;
+		int i, nr;
+
+		list_for_each_entry(t, &lazy_tasks, l)
+			if (!list_empty(&t->faults))
+				retry = true;
+
+		nr = epoll_wait(lazy_epfd, evs, ARRAY_SIZE(evs),
+				(retry || more) ? 0 : -1);
+		if (nr < 0) {
+			if (errno == EINTR)
+				continue;
+			pr_perror("Can't wait for events");
+			goto out;
+		}
+
+		for (i = 0; i < nr; i++) {
+			if (evs[i].data.ptr == NULL) {
+				if (handle_sk_message(sk))
+					goto out;
+			} else if (handle_uffd_events(evs[i].data.ptr))
+				goto out;
+		}
+
+		list_for_each_entry(t, &lazy_tasks, l)
+			if (retry_faults(t))
+				goto out;
+
+		/*
+		 * The rest of memory is copied in the background once
+		 * all the tasks are restored, one chunk at a time not
+		 * to delay the faults handling.
+		 */
+		more = 0;
+		if (restore_finished) {
+			more = prefetch_pages();
+			if (more < 0)
+				goto out;
+		}
+
+		reap_lazy_tasks();
+	}
+
+	ret = 0;
+out:
+	while (!list_empty(&lazy_tasks))
+		lazy_task_free(list_first_entry(&lazy_tasks, struct lazy_task, l));
+	close_safe(&lazy_epfd);
+	xfree(lazy_buf);
+	return ret;
+}
+
+int cr_lazy_pages(bool daemon)
+{
+	struct sockaddr_un addr;
+	int lsk, sk = -1, len, ret;
+
+	lsk = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+	if (lsk < 0) {
+		pr_perror("Can't create lazy-pages socket");
+		return -1;
+	}
+
+	len = lazy_pages_sock_addr(&addr);
+	unlink(addr.sun_path);
+	if (bind(lsk, (struct sockaddr *)&addr, len) || listen(lsk, 1)) {
+		pr_perror("Can't bind lazy-pages socket");
+		close(lsk);
+		return -1;
+	}
+
+	if (daemon) {
+		ret = cr_daemon(1, 0, &lsk, -1);
+		if (ret == -1) {
+			pr_err("Can't run in the background\n");
+			goto out;
+		}
+		if (ret > 0) { /* parent task, daemon started */
+			close(lsk);
+			if (opts.pidfile && write_pidfile(ret) == -1) {
+				pr_perror("Can't write pidfile");
+				kill(ret, SIGKILL);
+				waitpid(ret, NULL, 0);
+				return -1;
+			}
+
+			return 0;
+		}
+	}
+
+	ret = -1;
+	if (close_status_fd())
+		goto out;
+
+	sk = accept(lsk, NULL, NULL);
+	if (sk < 0) {
+		pr_perror("Can't accept lazy-pages connection");
+		goto out;
+	}
+
+	close_safe(&lsk);
+	unlink(addr.sun_path);
+
+	ret = lazy_pages_serve(sk);
+	close(sk);
+out:
+	if (lsk >= 0) {
+		close(lsk);
+		unlink(addr.sun_path);
+	}
+
+	if (daemon)
+		exit(ret ? 1 : 0);
+
+	return ret;
+}
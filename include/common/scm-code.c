@@ -72,50 +72,59 @@ int send_fds(int sock, struct sockaddr_un *saddr, int len,
 	return 0;
 }
 
-int __recv_fds(int sock, int *fds, int nr_fds, void *data, unsigned ch_size, int flags)
+int __recv_fds_msg(int sock, int *fds, int nr_fds, void *data, unsigned ch_size, int flags)
 {
 	/* In musl_libc the msghdr structure has pads which has to be zeroed */
 	struct scm_fdset fdset = {};
 	struct cmsghdr *cmsg;
 	int *cmsg_data;
 	int ret;
-	int i, min_fd;
 
 	cmsg_data = scm_fdset_init(&fdset, NULL, 0);
+	nr_fds = min(CR_SCM_MAX_FD, nr_fds);
+	scm_fdset_init_chunk(&fdset, nr_fds, data, ch_size);
+
+	ret = __sys(recvmsg)(sock, &fdset.hdr, flags);
+	if (ret <= 0)
+		return ret ? __sys_err(ret) : -ENOMSG;
+
+	cmsg = CMSG_FIRSTHDR(&fdset.hdr);
+	if (!cmsg || cmsg->cmsg_type != SCM_RIGHTS)
+		return -EINVAL;
+	if (fdset.hdr.msg_flags & MSG_CTRUNC)
+		return -ENFILE;
+
+	nr_fds = (cmsg->cmsg_len - sizeof(struct cmsghdr)) / sizeof(int);
+	/*
+	 * In case if kernel screwed the recipient, most probably
+	 * the caller stack frame will be overwriten, just scream
+	 * and exit.
+	 *
+	 * FIXME Need to sanitize util.h to be able to include it
+	 * into files which do not have glibc and a couple of
+	 * sys_write_ helpers. Meawhile opencoded BUG_ON here.
+	 */
+	BUG_ON(nr_fds > CR_SCM_MAX_FD);
+
+	if (unlikely(nr_fds <= 0))
+		return -EBADFD;
+
+	memcpy(fds, cmsg_data, sizeof(int) * nr_fds);
+	return nr_fds;
+}
+
+int __recv_fds(int sock, int *fds, int nr_fds, void *data, unsigned ch_size, int flags)
+{
+	int i, min_fd;
+
 	for (i = 0; i < nr_fds; i += min_fd) {
-		min_fd = min(CR_SCM_MAX_FD, nr_fds - i);
-		scm_fdset_init_chunk(&fdset, min_fd, data, ch_size);
+		min_fd = __recv_fds_msg(sock, &fds[i], nr_fds - i, data, ch_size, flags);
+		if (min_fd < 0)
+			return min_fd;
 
-		ret = __sys(recvmsg)(sock, &fdset.hdr, flags);
-		if (ret <= 0)
-			return ret ? __sys_err(ret) : -ENOMSG;
-
-		cmsg = CMSG_FIRSTHDR(&fdset.hdr);
-		if (!cmsg || cmsg->cmsg_type != SCM_RIGHTS)
-			return -EINVAL;
-		if (fdset.hdr.msg_flags & MSG_CTRUNC)
-			return -ENFILE;
-
-		min_fd = (cmsg->cmsg_len - sizeof(struct cmsghdr)) / sizeof(int);
-		/*
-		 * In case if kernel screwed the recipient, most probably
-		 * the caller stack frame will be overwriten, just scream
-		 * and exit.
-		 *
-		 * FIXME Need to sanitize util.h to be able to include it
-		 * into files which do not have glibc and a couple of
-		 * sys_write_ helpers. Meawhile opencoded BUG_ON here.
-		 */
-		BUG_ON(min_fd > CR_SCM_MAX_FD);
-
-		if (unlikely(min_fd <= 0))
-			return -EBADFD;
-
-		memcpy(&fds[i], cmsg_data, sizeof(int) * min_fd);
 		if (data)
 			data += ch_size * min_fd;
 	}
 
 	return 0;
 }
-
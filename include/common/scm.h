@@ -27,6 +27,12 @@ struct scm_fdset {
 
 extern int send_fds(int sock, struct sockaddr_un *saddr, int len,
 		int *fds, int nr_fds, void *data, unsigned ch_size);
+/*
+ * Receives one message with up to nr_fds descriptors,
+ * returns the number of descriptors in it.
+ */
+extern int __recv_fds_msg(int sock, int *fds, int nr_fds,
+		void *data, unsigned ch_size, int flags);
 extern int __recv_fds(int sock, int *fds, int nr_fds,
 		void *data, unsigned ch_size, int flags);
 static inline int recv_fds(int sock, int *fds, int nr_fds,
@@ -179,22 +179,59 @@ class pagemap_handler:
 	"""
 	Special entry handler for pagemap.img, which is unique in a way
 	that it has a header of pagemap_head type followed by entries
-	of pagemap_entry type.
+	of pagemap_entry type. Compact pagemaps have fixed size records
+	(vaddr, nr_pages, flags) after the header instead.
 	"""
-	def load(self, f, pretty = False, no_payload = False):
+	REC_FMT = '<QII'
+	REC_IN_PARENT = 0x1
+
+	def __load_head(self, f):
+		buf = f.read(4)
+		if buf == '':
+			return None
+		size, = struct.unpack('i', buf)
+		pb = pagemap_head()
+		pb.ParseFromString(f.read(size))
+		return pb
+
+	def __load_compact(self, f, pretty):
 		entries = []
+		rsize = struct.calcsize(self.REC_FMT)
+
+		while True:
+			buf = f.read(rsize)
+			if buf == '':
+				break
+			if len(buf) != rsize:
+				raise Exception("Compact pagemap is truncated")
+			vaddr, nr_pages, flags = struct.unpack(self.REC_FMT, buf)
+			pb = pagemap_entry()
+			pb.vaddr = vaddr
+			pb.nr_pages = nr_pages
+			if flags & self.REC_IN_PARENT:
+				pb.in_parent = True
+			entries.append(pb2dict.pb2dict(pb, pretty))
+
+		return entries
+
+	def load(self, f, pretty = False, no_payload = False):
+		pb = self.__load_head(f)
+		if pb is None:
+			return []
+
+		entries = [pb2dict.pb2dict(pb, pretty)]
+		if pb.compact:
+			return entries + self.__load_compact(f, pretty)
 
-		pb = pagemap_head()
 		while True:
 			buf = f.read(4)
 			if buf == '':
 				break
 			size, = struct.unpack('i', buf)
+			pb = pagemap_entry()
 			pb.ParseFromString(f.read(size))
 			entries.append(pb2dict.pb2dict(pb, pretty))
 
-			pb = pagemap_entry()
-
 		return entries
 
 	def loads(self, s, pretty = False):
@@ -203,12 +240,19 @@ class pagemap_handler:
 
 	def dump(self, entries, f):
 		pb = pagemap_head()
+		compact = False
 		for item in entries:
 			pb2dict.dict2pb(item, pb)
-			pb_str = pb.SerializeToString()
-			size = len(pb_str)
-			f.write(struct.pack('i', size))
-			f.write(pb_str)
+			if compact:
+				flags = pb.in_parent and self.REC_IN_PARENT or 0
+				f.write(struct.pack(self.REC_FMT, pb.vaddr, pb.nr_pages, flags))
+			else:
+				pb_str = pb.SerializeToString()
+				size = len(pb_str)
+				f.write(struct.pack('i', size))
+				f.write(pb_str)
+				if isinstance(pb, pagemap_head):
+					compact = pb.compact
 
 			pb = pagemap_entry()
 
@@ -218,7 +262,15 @@ class pagemap_handler:
 		return f.read()
 
 	def count(self, f):
-		return entry_handler(None).count(f) - 1
+		pb = self.__load_head(f)
+		if pb is None:
+			return 0
+		if not pb.compact:
+			return entry_handler(None).count(f)
+
+		start = f.tell()
+		f.seek(0, 2)
+		return (f.tell() - start) / struct.calcsize(self.REC_FMT)
 
 
 # In following extra handlers we use base64 encoding
@@ -35,6 +35,24 @@ int main(void)
 }
 endef
 
+define FEATURE_TEST_LIBLZ4_DEV
+#include <lz4.h>
+
+int main(void)
+{
+	return LZ4_compressBound(0);
+}
+endef
+
+define FEATURE_TEST_LIBZSTD_DEV
+#include <zstd.h>
+
+int main(void)
+{
+	return ZSTD_compressBound(0);
+}
+endef
+
 define FEATURE_TEST_STRLCPY
 
 #include <string.h>
@@ -0,0 +1 @@
+../criu/include/config.h
\ No newline at end of file
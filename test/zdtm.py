@@ -781,8 +781,24 @@ class criu:
 		self.__sat = (opts['sat'] and True or False)
 		self.__dedup = (opts['dedup'] and True or False)
 		self.__mdedup = (opts['noauto_dedup'] and True or False)
+		self.__merge = (opts['merge'] and True or False)
 		self.__user = (opts['user'] and True or False)
 		self.__leave_stopped = (opts['stop'] and True or False)
+		self.__mem_dump_workers = opts['mem_dump_workers']
+		self.__parallel_infect = opts['parallel_infect']
+		self.__compress = opts['compress']
+		self.__dedup_pages = (opts['dedup_pages'] and True or False)
+		self.__lazy_pages = (opts['lazy_pages'] and True or False)
+		self.__iterative = (opts['iterative'] and True or False)
+		self.__ps_connections = opts['ps_connections']
+		self.__direct_io = (opts['direct_io'] and True or False)
+		self.__io_uring = (opts['io_uring'] and True or False)
+		self.__archive = (opts['archive'] and True or False)
+		self.__stream = (opts['stream'] and True or False)
+		self.__compact_pagemaps = (opts['compact_pagemaps'] and True or False)
+		self.__skip_smaps = (opts['skip_smaps'] and True or False)
+		self.__prefetch_threads = opts['prefetch_threads']
+		self.__log_buffered = (opts['log_buffered'] and True or False)
 		self.__criu = (opts['rpc'] and criu_rpc or criu_cli)
 		self.__lazy_pages_p = None
 		self.__page_server_p = None
@@ -889,6 +905,13 @@ class criu:
 			else:
 				raise test_fail_exc("CRIU %s" % action)
 
+	def __criu_act_stream(self, action, opts, flags):
+		fd = os.open(os.path.join(self.__ddir(), "images.stream"), flags, 0600)
+		try:
+			self.__criu_act(action, opts = opts + ["--stream-fd", str(fd)])
+		finally:
+			os.close(fd)
+
 	def dump(self, action, opts = []):
 		self.__iter += 1
 		os.mkdir(self.__ddir())
@@ -905,14 +928,41 @@ class criu:
 			ps_opts = ["--port", "12345"]
 			if self.__dedup:
 				ps_opts += ["--auto-dedup"]
+			if self.__compress:
+				ps_opts += ["--compress", self.__compress]
+			if self.__dedup_pages:
+				ps_opts += ["--dedup-pages"]
+			if self.__ps_connections:
+				ps_opts += ["--ps-connections", self.__ps_connections]
+			if self.__direct_io:
+				ps_opts += ["--direct-io"]
+			if self.__compact_pagemaps:
+				ps_opts += ["--compact-pagemaps"]
 
 			self.__page_server_p = self.__criu_act("page-server", opts = ps_opts, nowait = True)
 			a_opts += ["--page-server", "--address", "127.0.0.1", "--port", "12345"]
+			if self.__ps_connections:
+				a_opts += ["--ps-connections", self.__ps_connections]
+		else:
+			if self.__compress:
+				a_opts += ["--compress", self.__compress]
+			if self.__direct_io:
+				a_opts += ["--direct-io"]
+			if self.__archive:
+				a_opts += ["--archive"]
+			if self.__compact_pagemaps:
+				a_opts += ["--compact-pagemaps"]
 
 		a_opts += self.__test.getdopts()
 
 		if self.__dedup:
 			a_opts += ["--auto-dedup"]
+		if self.__dedup_pages:
+			a_opts += ["--dedup-pages"]
+		if self.__skip_smaps:
+			a_opts += ["--skip-smaps"]
+		if self.__log_buffered:
+			a_opts += ["--log-buffered"]
 
 		a_opts += ["--timeout", "10"]
 
@@ -925,10 +975,21 @@ class criu:
 			a_opts += ['--leave-stopped']
 		if self.__empty_ns:
 			a_opts += ['--empty-ns', 'net']
-
-		self.__criu_act(action, opts = a_opts + opts)
+		if self.__mem_dump_workers and action == "dump":
+			a_opts += ['--mem-dump-workers', self.__mem_dump_workers]
+		if self.__parallel_infect and action == "dump":
+			a_opts += ['--parallel-infect', self.__parallel_infect]
+		if self.__iterative and action == "dump" and self.__iter == 1:
+			a_opts += ['--iterative']
+
+		if self.__stream and action == "dump":
+			self.__criu_act_stream(action, a_opts + opts, os.O_WRONLY | os.O_CREAT)
+		else:
+			self.__criu_act(action, opts = a_opts + opts)
 		if self.__mdedup and self.__iter > 1:
 			self.__criu_act("dedup", opts = [])
+		if self.__merge and self.__iter > 1:
+			self.__criu_act("merge", opts = [])
 
 		if self.__leave_stopped:
 			pstree_check_stopped(self.__test.getpid())
@@ -962,7 +1023,24 @@ class criu:
 		if self.__leave_stopped:
 			r_opts += ['--leave-stopped']
 
-		self.__criu_act("restore", opts = r_opts + ["--restore-detached"])
+		if self.__lazy_pages:
+			print "Starting lazy pages daemon"
+			self.__lazy_pages_p = self.__criu_act("lazy-pages", opts = [], nowait = True)
+			r_opts += ["--lazy-pages"]
+
+		if self.__io_uring:
+			r_opts += ["--io-uring"]
+		if self.__direct_io:
+			r_opts += ["--direct-io"]
+		if self.__prefetch_threads:
+			r_opts += ["--prefetch-threads", self.__prefetch_threads]
+		if self.__log_buffered:
+			r_opts += ["--log-buffered"]
+
+		if self.__stream:
+			self.__criu_act_stream("restore", r_opts + ["--restore-detached"], os.O_RDONLY)
+		else:
+			self.__criu_act("restore", opts = r_opts + ["--restore-detached"])
 
 		if self.__lazy_pages_p:
 			ret = self.__lazy_pages_p.wait()
@@ -1416,7 +1494,11 @@ class launcher:
 
 		nd = ('nocr', 'norst', 'pre', 'iters', 'page_server', 'sibling', 'stop', 'empty_ns',
 				'fault', 'keep_img', 'report', 'snaps', 'sat', 'script', 'rpc',
-				'join_ns', 'dedup', 'sbs', 'freezecg', 'user', 'dry_run', 'noauto_dedup')
+				'join_ns', 'dedup', 'sbs', 'freezecg', 'user', 'dry_run', 'noauto_dedup',
+				'mem_dump_workers', 'compress', 'dedup_pages', 'lazy_pages', 'iterative',
+				'ps_connections', 'direct_io', 'io_uring', 'merge', 'archive', 'stream',
+				'compact_pagemaps', 'skip_smaps', 'prefetch_threads', 'parallel_infect',
+				'log_buffered')
 		arg = repr((name, desc, flavor, {d: self.__opts[d] for d in nd}))
 
 		if self.__use_log:
@@ -1888,6 +1970,7 @@ rp.add_argument("--pre", help = "Do some pre-dumps before dump (n[:pause])")
 rp.add_argument("--snaps", help = "Instead of pre-dumps do full dumps", action = 'store_true')
 rp.add_argument("--dedup", help = "Auto-deduplicate images on iterations", action = 'store_true')
 rp.add_argument("--noauto-dedup", help = "Manual deduplicate images on iterations", action = 'store_true')
+rp.add_argument("--merge", help = "Merge parent images in on iterations", action = 'store_true')
 rp.add_argument("--nocr", help = "Do not CR anything, just check test works", action = 'store_true')
 rp.add_argument("--norst", help = "Don't restore tasks, leave them running after dump", action = 'store_true')
 rp.add_argument("--stop", help = "Check that --leave-stopped option stops ps tree.", action = 'store_true')
@@ -1900,6 +1983,21 @@ rp.add_argument("--user", help = "Run CRIU as regular user", action = 'store_tru
 rp.add_argument("--rpc", help = "Run CRIU via RPC rather than CLI", action = 'store_true')
 
 rp.add_argument("--page-server", help = "Use page server dump", action = 'store_true')
+rp.add_argument("--mem-dump-workers", help = "Dump memory of several tasks at once")
+rp.add_argument("--parallel-infect", help = "Start parasites in several tasks at once")
+rp.add_argument("--log-buffered", help = "Write criu logs in big chunks", action = 'store_true')
+rp.add_argument("--compress", help = "Compress pages images with given codec")
+rp.add_argument("--dedup-pages", help = "Don't write zero and duplicate pages", action = 'store_true')
+rp.add_argument("--lazy-pages", help = "Restore memory lazily via userfaultfd", action = 'store_true')
+rp.add_argument("--iterative", help = "Pre-dump memory in passes within the dump", action = 'store_true')
+rp.add_argument("--ps-connections", help = "Number of connections to page server")
+rp.add_argument("--direct-io", help = "Write and read pages images bypassing page cache", action = 'store_true')
+rp.add_argument("--io-uring", help = "Read pages with io_uring on restore", action = 'store_true')
+rp.add_argument("--archive", help = "Put images into one archive file", action = 'store_true')
+rp.add_argument("--stream", help = "Dump images into and restore them from a stream", action = 'store_true')
+rp.add_argument("--compact-pagemaps", help = "Write pagemaps as fixed size records", action = 'store_true')
+rp.add_argument("--skip-smaps", help = "Read tasks' mappings from maps instead of smaps", action = 'store_true')
+rp.add_argument("--prefetch-threads", help = "Number of threads prefetching pages on restore")
 rp.add_argument("-p", "--parallel", help = "Run test in parallel")
 rp.add_argument("--dry-run", help="Don't run tests, just pretend to", action='store_true')
 rp.add_argument("--script", help="Add script to get notified by criu")
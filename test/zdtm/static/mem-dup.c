@@ -0,0 +1,103 @@
+#include <unistd.h>
+#include <string.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#include "zdtmtst.h"
+
+const char *test_doc	= "Check zero and duplicate pages are restored";
+const char *test_author	= "agent <agent@local>";
+
+#define MEM_PAGES	64
+#define NR_PATTERNS	4
+
+/*
+ * Odd pages are dirty zeroes, even ones are filled with
+ * one of a few patterns, so that there are lots of pages
+ * with the same contents both in one task and in two.
+ */
+static void fill(void *mem)
+{
+	int i;
+
+	for (i = 0; i < MEM_PAGES; i++) {
+		void *page = mem + i * PAGE_SIZE;
+
+		if (i % 2) {
+			memset(page, 0, PAGE_SIZE);
+			continue;
+		}
+
+		memset(page, 'a' + (i / 2) % NR_PATTERNS, PAGE_SIZE);
+	}
+}
+
+static int check(void *mem)
+{
+	char page[PAGE_SIZE];
+	int i;
+
+	for (i = 0; i < MEM_PAGES; i++) {
+		if (i % 2)
+			memset(page, 0, PAGE_SIZE);
+		else
+			memset(page, 'a' + (i / 2) % NR_PATTERNS, PAGE_SIZE);
+
+		if (memcmp(mem + i * PAGE_SIZE, page, PAGE_SIZE)) {
+			test_msg("Page %d differs\n", i);
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	void *mem;
+	int status;
+	pid_t pid;
+
+	test_init(argc, argv);
+
+	mem = mmap(NULL, MEM_PAGES * PAGE_SIZE, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (mem == MAP_FAILED) {
+		pr_perror("Can't allocate memory");
+		return 1;
+	}
+
+	/* Make the zero pages present */
+	memset(mem, 1, MEM_PAGES * PAGE_SIZE);
+	fill(mem);
+
+	pid = test_fork();
+	if (pid < 0) {
+		pr_perror("Unable to fork a new process");
+		return 1;
+	} else if (pid == 0) {
+		/* Break COW, but keep the same contents */
+		fill(mem);
+		test_waitsig();
+		return check(mem);
+	}
+
+	test_daemon();
+	test_waitsig();
+
+	kill(pid, SIGTERM);
+	if (waitpid(pid, &status, 0) != pid) {
+		pr_perror("Unable to wait the child");
+		return 1;
+	}
+
+	if (check(mem))
+		fail("Memory corruption in parent");
+	else if (!WIFEXITED(status) || WEXITSTATUS(status))
+		fail("Memory corruption in child");
+	else
+		pass();
+
+	return 0;
+}
@@ -0,0 +1,108 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <sys/mman.h>
+
+#include "zdtmtst.h"
+
+const char *test_doc	= "Check THP-backed memory is restored";
+const char *test_author	= "agent <agent@local>";
+
+#define HPAGE_SIZE	(2UL << 20)
+#define MEM_SIZE	(4 * HPAGE_SIZE)
+
+/* Sum of AnonHugePages (in kB) of the VMA containing addr */
+static long anon_huge_kb(void *addr)
+{
+	unsigned long start, end;
+	long kb = -1;
+	char buf[1024];
+	int in = 0;
+	FILE *f;
+
+	f = fopen("/proc/self/smaps", "r");
+	if (!f) {
+		pr_perror("Can't open smaps");
+		return -1;
+	}
+
+	while (fgets(buf, sizeof(buf), f)) {
+		if (sscanf(buf, "%lx-%lx", &start, &end) == 2) {
+			in = (start <= (unsigned long)addr &&
+					(unsigned long)addr < end);
+			continue;
+		}
+
+		if (in && sscanf(buf, "AnonHugePages: %ld kB", &kb) == 1)
+			break;
+	}
+
+	fclose(f);
+	return kb;
+}
+
+static void fill(uint32_t *mem)
+{
+	unsigned long i;
+
+	for (i = 0; i < MEM_SIZE / sizeof(*mem); i++)
+		mem[i] = i * 2654435761u;
+}
+
+static int check(uint32_t *mem)
+{
+	unsigned long i;
+
+	for (i = 0; i < MEM_SIZE / sizeof(*mem); i++)
+		if (mem[i] != (uint32_t)(i * 2654435761u)) {
+			test_msg("Word %lu differs\n", i);
+			return 1;
+		}
+
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	void *area, *small;
+	uint32_t *mem;
+	long before, after;
+
+	test_init(argc, argv);
+
+	/* A small VMA makes the premapped area not aligned */
+	small = mmap(NULL, 3 * PAGE_SIZE, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (small == MAP_FAILED) {
+		pr_perror("Can't allocate memory");
+		return 1;
+	}
+	memset(small, 'x', 3 * PAGE_SIZE);
+
+	area = mmap(NULL, MEM_SIZE + HPAGE_SIZE, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (area == MAP_FAILED) {
+		pr_perror("Can't allocate memory");
+		return 1;
+	}
+
+	mem = (void *)(((unsigned long)area + HPAGE_SIZE - 1) & ~(HPAGE_SIZE - 1));
+	if (madvise(mem, MEM_SIZE, MADV_HUGEPAGE))
+		test_msg("No THP support\n");
+
+	fill(mem);
+	before = anon_huge_kb(mem);
+
+	test_daemon();
+	test_waitsig();
+
+	after = anon_huge_kb(mem);
+	test_msg("AnonHugePages: %ld kB -> %ld kB\n", before, after);
+
+	if (check(mem))
+		fail("Memory corruption");
+	else
+		pass();
+
+	return 0;
+}